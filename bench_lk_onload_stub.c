@@ -0,0 +1,1178 @@
+/*
+ * Copyright 2023 Google LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/* Microbenchmarks for intercepted calls.
+ *
+ * Run both with and without LD_PRELOAD of lk_onload_stub, to measure
+ * the overhead that the library adds: see make target bench.
+ */
+
+#define _GNU_SOURCE
+
+#include <error.h>
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netpacket/packet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/sysinfo.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>		/* after time.h, for timespec */
+#include <linux/if_ether.h>
+#include <linux/net_tstamp.h>
+
+#include "lk_onload_stub_ext.h"
+
+#define BENCH_MSGS	(1 << 18)
+#define BENCH_PAYLOAD	64
+#define BENCH_TCP_BYTES	(1LL << 30)
+#define BENCH_TCP_CHUNK	(1 << 18)
+#define BENCH_SENDS	10000
+#define BENCH_MC_GROUP	0xef010203
+#define BENCH_MC_READERS 8
+#define BENCH_CL_MEMBERS 4
+#define BENCH_CL_PORT	9124
+#define BENCH_CL_CONNS	4096
+
+static bool has_preload;
+
+/* library support functions */
+
+static int __fail_errno(const char *fn, int line)
+{
+	fprintf(stderr, "%s.%d: %d (%s)\n", fn, line, errno, strerror(errno));
+	return 1;
+}
+#define fail_errno() __fail_errno(__func__, __LINE__)
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL * 1000 * 1000 + ts.tv_nsec;
+}
+
+static int udp_pair_open(int *fdt_p, int *fdr_p)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t alen = sizeof(addr);
+	int fdt, fdr, val;
+
+	fdt = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdt == -1)
+		return fail_errno();
+	fdr = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdr == -1)
+		return fail_errno();
+
+	/* room for the largest batch; fall back if not privileged */
+	val = 4 << 20;
+	if (setsockopt(fdr, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) &&
+	    setsockopt(fdr, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)))
+		return fail_errno();
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fdr, (void *)&addr, alen))
+		return fail_errno();
+	if (getsockname(fdr, (void *)&addr, &alen))
+		return fail_errno();
+	if (connect(fdt, (void *)&addr, alen))
+		return fail_errno();
+
+	*fdt_p = fdt;
+	*fdr_p = fdr;
+	return 0;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	const long long *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* A TCP connection over loopback with a payload of whole pages per
+ * segment, as with header split on a NIC, so that TCP_ZEROCOPY_RECEIVE
+ * can map it.
+ */
+static int tcp_pair_open(int *fdt_p, int *fdr_p)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t alen = sizeof(addr);
+	int fdl, fdt, fdr, mss;
+
+	fdl = socket(PF_INET, SOCK_STREAM, 0);
+	if (fdl == -1)
+		return fail_errno();
+	fdt = socket(PF_INET, SOCK_STREAM, 0);
+	if (fdt == -1)
+		return fail_errno();
+
+	/* 7 pages, plus the timestamp option: at most 32767 */
+	mss = 7 * 4096 + 12;
+	if (setsockopt(fdl, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)) ||
+	    setsockopt(fdt, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss)))
+		return fail_errno();
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fdl, (void *)&addr, alen))
+		return fail_errno();
+	if (getsockname(fdl, (void *)&addr, &alen))
+		return fail_errno();
+	if (listen(fdl, 1))
+		return fail_errno();
+	if (connect(fdt, (void *)&addr, alen))
+		return fail_errno();
+	fdr = accept(fdl, NULL, NULL);
+	if (fdr == -1)
+		return fail_errno();
+	if (close(fdl))
+		return fail_errno();
+
+	*fdt_p = fdt;
+	*fdr_p = fdr;
+	return 0;
+}
+
+/* benchmark functions */
+
+/* Per message cost of receiving with a control buffer
+ *
+ * Receive with IP_PKTINFO and SO_RXQ_OVFL, optionally with raw hardware
+ * timestamps requested. Only the recv call is timed.
+ */
+static int bench_recvmmsg(unsigned int vlen, bool tstamp)
+{
+	const int ts_flags = SOF_TIMESTAMPING_RX_HARDWARE |
+			     SOF_TIMESTAMPING_RAW_HARDWARE;
+	static char ctrl[1024][CMSG_SPACE(sizeof(struct scm_timestamping)) +
+			CMSG_SPACE(sizeof(struct in_pktinfo)) +
+			CMSG_SPACE(sizeof(uint32_t))];
+	static struct mmsghdr msgs[1024];
+	static char data[1024][BENCH_PAYLOAD];
+	static struct iovec iov[1024];
+	long long cost = 0, start;
+	int fdt, fdr, one = 1, ret;
+	unsigned int i, total = 0;
+
+	if (udp_pair_open(&fdt, &fdr))
+		return 1;
+
+	if (setsockopt(fdr, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)))
+		return fail_errno();
+	if (setsockopt(fdr, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)))
+		return fail_errno();
+	if (tstamp &&
+	    setsockopt(fdr, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)))
+		return fail_errno();
+
+	for (i = 0; i < vlen; i++) {
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = sizeof(data[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (total < BENCH_MSGS) {
+		ret = sendmmsg(fdt, msgs, vlen, 0);
+		if (ret != vlen)
+			return fail_errno();
+
+		for (i = 0; i < vlen; i++) {
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+
+		start = now_ns();
+		if (vlen == 1)
+			ret = recvmsg(fdr, &msgs[0].msg_hdr, 0) >= 0 ? 1 : -1;
+		else
+			ret = recvmmsg(fdr, msgs, vlen, MSG_DONTWAIT, NULL);
+		cost += now_ns() - start;
+		if (ret <= 0)
+			return fail_errno();
+
+		total += ret;
+
+		/* drain anything left, untimed */
+		while (ret < vlen) {
+			int more = recvmmsg(fdr, msgs, vlen - ret, MSG_DONTWAIT, NULL);
+
+			if (more <= 0)
+				break;
+			ret += more;
+		}
+
+		for (i = 0; i < vlen; i++) {
+			msgs[i].msg_hdr.msg_control = NULL;
+			msgs[i].msg_hdr.msg_controllen = 0;
+		}
+	}
+
+	printf("%-8s vlen=%-4u tstamp=%d preload=%d: %6.1f ns/msg\n",
+	       vlen == 1 ? "recvmsg" : "recvmmsg", vlen, tstamp, has_preload,
+	       (double)cost / total);
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Send BENCH_TCP_BYTES from page aligned memory with MSG_ZEROCOPY: on
+ * loopback the kernel then copies into whole pages for the receiver
+ */
+static void *bench_tcp_rx_send(void *arg)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) +
+			     sizeof(struct sockaddr_in6))];
+	struct msghdr msg = { .msg_control = ctrl };
+	int fd = *(int *)arg, one = 1;
+	long long sent = 0;
+	struct pollfd pfd;
+	ssize_t ret;
+	char *buf;
+
+	buf = mmap(NULL, BENCH_TCP_CHUNK, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		fail_errno();
+		return NULL;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		fail_errno();
+
+	while (sent < BENCH_TCP_BYTES) {
+		ret = send(fd, buf, BENCH_TCP_CHUNK, MSG_ZEROCOPY);
+		if (ret == -1 && errno != ENOBUFS) {
+			fail_errno();
+			break;
+		}
+		if (ret > 0)
+			sent += ret;
+
+		/* reap notifications: unread, they exhaust optmem */
+		pfd.fd = fd;
+		pfd.events = 0;
+		while (poll(&pfd, 1, ret == -1 ? 10 : 0) == 1) {
+			msg.msg_controllen = sizeof(ctrl);
+			if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+				break;
+		}
+	}
+
+	shutdown(fd, SHUT_WR);
+	munmap(buf, BENCH_TCP_CHUNK);
+	return NULL;
+}
+
+/* Throughput of TCP receive over loopback, copying with recv or mapped
+ * with onload_zc_hlrx_recv_zc. The data is not read in either case.
+ */
+static int bench_tcp_rx(bool zc)
+{
+	struct onload_zc_iovec zc_iov[64];
+	struct onload_zc_msg msg;
+	struct onload_zc_hlrx *hlrx;
+	long long total = 0, mapped = 0, start, cost;
+	pthread_t thread;
+	int fdt = -1, fdr = -1, i;
+	ssize_t ret;
+	char *buf;
+
+	if (zc && !has_preload)
+		return 0;
+
+	if (tcp_pair_open(&fdt, &fdr))
+		return 1;
+
+	buf = malloc(BENCH_TCP_CHUNK);
+	if (!buf)
+		return fail_errno();
+	if (zc && onload_zc_hlrx_alloc(fdr, 0, &hlrx))
+		return fail_errno();
+
+	start = now_ns();
+	errno = pthread_create(&thread, NULL, bench_tcp_rx_send, &fdt);
+	if (errno)
+		return fail_errno();
+
+	do {
+		if (!zc) {
+			ret = recv(fdr, buf, BENCH_TCP_CHUNK, 0);
+		} else {
+			msg.iov = zc_iov;
+			msg.msghdr.msg_iovlen = 64;
+			ret = onload_zc_hlrx_recv_zc(hlrx, &msg, 1 << 20, 0);
+			for (i = 0; ret > 0 && i < msg.msghdr.msg_iovlen; i++) {
+				if (zc_iov[i].iov_len >= 4096 &&
+				    !((unsigned long)zc_iov[i].iov_base & 4095))
+					mapped += zc_iov[i].iov_len;
+				onload_zc_hlrx_buffer_release(fdr, zc_iov[i].buf);
+			}
+			if (ret < 0) {
+				errno = -ret;
+				ret = -1;
+			}
+		}
+		if (ret > 0)
+			total += ret;
+	} while (ret > 0);
+	if (ret)
+		return fail_errno();
+	cost = now_ns() - start;
+
+	pthread_join(thread, NULL);
+
+	printf("tcp_rx   %-8s preload=%d: %6.2f Gbit/s, %3lld%% mapped\n",
+	       zc ? "hlrx_zc" : "recv", has_preload,
+	       total * 8.0 / cost, total ? mapped * 100 / total : 0);
+
+	if (zc && onload_zc_hlrx_free(hlrx))
+		return fail_errno();
+	free(buf);
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Wait for the TX software timestamp of the last send on fd */
+static long long tx_timestamp_ns(int fd)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct msghdr msg = { .msg_control = ctrl };
+	struct scm_timestamping *tss;
+	struct cmsghdr *cmsg;
+	struct pollfd pfd = { .fd = fd };
+
+	do {
+		if (poll(&pfd, 1, 1000) != 1)
+			return -1;
+		msg.msg_controllen = sizeof(ctrl);
+	} while (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_TIMESTAMPING) {
+			tss = (void *)CMSG_DATA(cmsg);
+			return tss->ts[0].tv_sec * 1000LL * 1000 * 1000 +
+			       tss->ts[0].tv_nsec;
+		}
+	}
+
+	return -1;
+}
+
+/* Latency from patching a message to its TX software timestamp, with
+ * memcpy and send or with onload_msg_template_update and SEND_NOW.
+ * Only the template alloc is left out: it is done ahead of time.
+ */
+static int bench_send_latency(bool tmpl)
+{
+	const int ts_flags = SOF_TIMESTAMPING_TX_SOFTWARE |
+			     SOF_TIMESTAMPING_SOFTWARE |
+			     SOF_TIMESTAMPING_OPT_TSONLY;
+	static long long lat[BENCH_SENDS];
+	char msg[256] = {0}, rxbuf[256];
+	struct onload_template_msg_update_iovec upd;
+	struct iovec iov = { msg, sizeof(msg) };
+	onload_template_handle handle;
+	long long seq, start, ts;
+	struct timespec now;
+	int fdt = -1, fdr = -1, one = 1, i, len, ret;
+
+	if (tmpl && !has_preload)
+		return 0;
+
+	if (tcp_pair_open(&fdt, &fdr))
+		return 1;
+	if (setsockopt(fdt, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		return fail_errno();
+	if (setsockopt(fdt, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)))
+		return fail_errno();
+
+	upd.otmu_base = &seq;
+	upd.otmu_len = sizeof(seq);
+	upd.otmu_offset = 16;
+	upd.otmu_flags = 0;
+
+	for (i = 0; i < BENCH_SENDS; i++) {
+		if (tmpl && onload_msg_template_alloc(fdt, &iov, 1, &handle, 0))
+			return fail_errno();
+
+		seq = i;
+		clock_gettime(CLOCK_REALTIME, &now);
+		start = now.tv_sec * 1000LL * 1000 * 1000 + now.tv_nsec;
+
+		if (tmpl) {
+			ret = onload_msg_template_update(fdt, handle, &upd, 1,
+							 ONLOAD_TEMPLATE_FLAGS_SEND_NOW);
+			if (ret) {
+				errno = -ret;
+				return fail_errno();
+			}
+		} else {
+			memcpy(msg + upd.otmu_offset, &seq, sizeof(seq));
+			if (send(fdt, msg, sizeof(msg), 0) != sizeof(msg))
+				return fail_errno();
+		}
+
+		ts = tx_timestamp_ns(fdt);
+		if (ts == -1)
+			return fail_errno();
+		lat[i] = ts - start;
+
+		for (len = 0; len < sizeof(rxbuf); len += ret) {
+			ret = recv(fdr, rxbuf, sizeof(rxbuf) - len, 0);
+			if (ret <= 0)
+				return fail_errno();
+		}
+	}
+
+	qsort(lat, BENCH_SENDS, sizeof(lat[0]), cmp_ll);
+	printf("send_lat %-8s preload=%d: %6lld ns median, %6lld ns p99\n",
+	       tmpl ? "template" : "send", has_preload,
+	       lat[BENCH_SENDS / 2], lat[BENCH_SENDS * 99 / 100]);
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Per message cost of sending through the delegated send API, with
+ * prepare, header update and complete, against send
+ */
+static int bench_delegated_send(bool delegated)
+{
+	struct onload_delegated_send ds = {0};
+	char msg[BENCH_PAYLOAD] = {0}, rxbuf[BENCH_PAYLOAD], hdr[128];
+	struct iovec iov = { msg, sizeof(msg) };
+	int fdt = -1, fdr = -1, one = 1, i, len, ret;
+	long long cost = 0, start;
+
+	if (delegated && !has_preload)
+		return 0;
+
+	if (tcp_pair_open(&fdt, &fdr))
+		return 1;
+	if (setsockopt(fdt, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		return fail_errno();
+
+	ds.headers = hdr;
+	for (i = 0; i < BENCH_SENDS; i++) {
+		start = now_ns();
+		if (delegated) {
+			ds.headers_len = sizeof(hdr);
+			if (onload_delegated_send_prepare(fdt, sizeof(msg), 0, &ds))
+				return fail_errno();
+			onload_delegated_send_tcp_update(&ds, sizeof(msg), 1);
+			onload_delegated_send_tcp_advance(&ds, sizeof(msg));
+			ret = onload_delegated_send_complete(fdt, &iov, 1, 0);
+		} else {
+			ret = send(fdt, msg, sizeof(msg), 0);
+		}
+		cost += now_ns() - start;
+		if (ret != sizeof(msg))
+			return fail_errno();
+
+		for (len = 0; len < sizeof(rxbuf); len += ret) {
+			ret = recv(fdr, rxbuf, sizeof(rxbuf) - len, 0);
+			if (ret <= 0)
+				return fail_errno();
+		}
+	}
+
+	printf("%-9s preload=%d: %6.1f ns/msg\n",
+	       delegated ? "delegated" : "send", has_preload,
+	       (double)cost / BENCH_SENDS);
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Send an IPv4 UDP frame to 10.99.0.2:port on the AF_PACKET socket fdp */
+static int xdp_inject(int fdp, const struct sockaddr_ll *sll, uint16_t port,
+		      const void *payload, int len)
+{
+	char frame[ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr) +
+		   BENCH_PAYLOAD];
+	struct ethhdr *eth = (void *)frame;
+	struct iphdr *iph = (void *)(eth + 1);
+	struct udphdr *uh = (void *)(iph + 1);
+	uint16_t *p16 = (void *)iph;
+	uint32_t sum = 0;
+	int i;
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(eth->h_dest, sll->sll_addr, ETH_ALEN);
+	eth->h_source[0] = 0x2;
+	eth->h_proto = htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(sizeof(*iph) + sizeof(*uh) + len);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htonl(0x0a630001);
+	iph->daddr = htonl(0x0a630002);
+	for (i = 0; i < sizeof(*iph) / 2; i++)
+		sum += p16[i];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	iph->check = ~sum;
+
+	uh->source = htons(1234);
+	uh->dest = port;
+	uh->len = htons(sizeof(*uh) + len);
+	memcpy(uh + 1, payload, len);
+
+	if (sendto(fdp, frame, (char *)(uh + 1) + len - frame, 0,
+		   (void *)sll, sizeof(*sll)) == -1)
+		return fail_errno();
+
+	return 0;
+}
+
+static int bench_xdp_netns(bool xdp)
+{
+	static long long lat[BENCH_SENDS];
+	char msg[BENCH_PAYLOAD] = {0}, rxbuf[BENCH_PAYLOAD];
+	struct sockaddr_in addr = {0};
+	socklen_t alen = sizeof(addr);
+	struct sockaddr_ll sll = {0};
+	struct ifreq ifr = {0};
+	long long cost = 0, start, rx_start, total;
+	int fdp, fdr, i, j;
+
+	if (unshare(CLONE_NEWNET) ||
+	    system("ip link add lkos_xdp0 type veth peer name lkos_xdp1 && "
+		   "ip link set lkos_xdp0 up && ip link set lkos_xdp1 up && "
+		   "ip addr add 10.99.0.2/24 dev lkos_xdp1 2>/dev/null"))
+		return 0;
+
+	fdp = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fdp == -1)
+		return fail_errno();
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "lkos_xdp1");
+	if (ioctl(fdp, SIOCGIFHWADDR, &ifr))
+		return fail_errno();
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = if_nametoindex("lkos_xdp0");
+	sll.sll_halen = ETH_ALEN;
+	memcpy(sll.sll_addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	if (onload_set_stackname(ONLOAD_THIS_THREAD, ONLOAD_SCOPE_THREAD,
+				 xdp ? "lkos_xdp" : ""))
+		return fail_errno();
+	fdr = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdr == -1)
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	if (bind(fdr, (void *)&addr, alen))
+		return fail_errno();
+	if (getsockname(fdr, (void *)&addr, &alen))
+		return fail_errno();
+
+	/* throughput: bursts of 64, only the receive calls timed */
+	start = now_ns();
+	for (i = 0; i < BENCH_MSGS / 64; i++) {
+		for (j = 0; j < 64; j++) {
+			if (xdp_inject(fdp, &sll, addr.sin_port, msg, sizeof(msg)))
+				return 1;
+		}
+
+		rx_start = now_ns();
+		for (j = 0; j < 64; j++) {
+			if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != sizeof(rxbuf))
+				return fail_errno();
+		}
+		cost += now_ns() - rx_start;
+	}
+	total = now_ns() - start;
+
+	/* latency: from before the send to after the receive */
+	for (i = 0; i < BENCH_SENDS; i++) {
+		start = now_ns();
+		if (xdp_inject(fdp, &sll, addr.sin_port, msg, sizeof(msg)))
+			return 1;
+		if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != sizeof(rxbuf))
+			return fail_errno();
+		lat[i] = now_ns() - start;
+	}
+	qsort(lat, BENCH_SENDS, sizeof(lat[0]), cmp_ll);
+
+	printf("xdp_rx   %-6s: %6.1f ns/msg recv, %6.2f Mpps, "
+	       "%6lld ns median, %6lld ns p99\n",
+	       xdp ? "xdp" : "kernel", (double)cost / BENCH_MSGS,
+	       BENCH_MSGS * 1000.0 / total, lat[BENCH_SENDS / 2],
+	       lat[BENCH_SENDS * 99 / 100]);
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdp))
+		return fail_errno();
+
+	return 0;
+}
+
+/* UDP receive through AF_XDP against the kernel path, on a veth pair in
+ * a network namespace, in a child. Frames are injected with AF_PACKET.
+ * Needs root, and a stack lkos_xdp on lkos_xdp1 in LKOS_STACKS.
+ */
+static int bench_xdp(bool xdp)
+{
+	const char *stacks = getenv("LKOS_STACKS");
+	int status;
+	pid_t pid;
+
+	if (!has_preload || !stacks || !strstr(stacks, "lkos_xdp:") || geteuid())
+		return 0;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid)
+		exit(bench_xdp_netns(xdp));
+
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/* The client of bench_tcp_loopback: echo BENCH_SENDS messages, then
+ * read until the end of stream
+ */
+static int bench_tcp_loopback_client(const struct sockaddr_in *addr)
+{
+	char buf[BENCH_TCP_CHUNK];
+	int fd, one = 1, i, len;
+	ssize_t ret;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return fail_errno();
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		return fail_errno();
+	if (connect(fd, (void *)addr, sizeof(*addr)))
+		return fail_errno();
+
+	for (i = 0; i < BENCH_SENDS; i++) {
+		for (len = 0; len < BENCH_PAYLOAD; len += ret) {
+			ret = recv(fd, buf + len, BENCH_PAYLOAD - len, 0);
+			if (ret <= 0)
+				return fail_errno();
+		}
+		if (send(fd, buf, BENCH_PAYLOAD, 0) != BENCH_PAYLOAD)
+			return fail_errno();
+	}
+
+	do {
+		ret = recv(fd, buf, sizeof(buf), 0);
+	} while (ret > 0);
+	if (ret)
+		return fail_errno();
+
+	if (close(fd))
+		return fail_errno();
+
+	return 0;
+}
+
+/* TCP between processes over loopback, through shared memory rings or
+ * the kernel: round trip latency of small messages, and bulk throughput
+ * to the end of stream.
+ */
+static int bench_tcp_loopback(bool ring)
+{
+	static long long lat[BENCH_SENDS];
+	char msg[BENCH_PAYLOAD] = {0}, rxbuf[BENCH_PAYLOAD], *buf;
+	struct sockaddr_in addr = {0};
+	socklen_t alen = sizeof(addr);
+	long long sent = 0, start, cost;
+	int fdl, fd, one = 1, status, i, len;
+	struct lkos_fd_stat lstat;
+	ssize_t ret;
+	pid_t pid;
+
+	if (ring && !has_preload)
+		return 0;
+
+	if (ring && (onload_stack_opt_set_int("EF_TCP_CLIENT_LOOPBACK", 1) ||
+		     onload_stack_opt_set_int("EF_TCP_SERVER_LOOPBACK", 1)))
+		return fail_errno();
+
+	fdl = socket(PF_INET, SOCK_STREAM, 0);
+	if (fdl == -1)
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fdl, (void *)&addr, alen))
+		return fail_errno();
+	if (getsockname(fdl, (void *)&addr, &alen))
+		return fail_errno();
+	if (listen(fdl, 1))
+		return fail_errno();
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid) {
+		close(fdl);
+		exit(bench_tcp_loopback_client(&addr));
+	}
+
+	fd = accept(fdl, NULL, NULL);
+	if (fd == -1)
+		return fail_errno();
+	if (close(fdl))
+		return fail_errno();
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		return fail_errno();
+	if (ring && (lkos_fd_stat(fd, &lstat) != 1 ||
+		     !(lstat.features & LKOS_FD_FEATURE_LOOPBACK))) {
+		fprintf(stderr, "tcp_loopback: not over rings\n");
+		return 1;
+	}
+
+	for (i = 0; i < BENCH_SENDS; i++) {
+		start = now_ns();
+		if (send(fd, msg, sizeof(msg), 0) != sizeof(msg))
+			return fail_errno();
+		for (len = 0; len < sizeof(rxbuf); len += ret) {
+			ret = recv(fd, rxbuf, sizeof(rxbuf) - len, 0);
+			if (ret <= 0)
+				return fail_errno();
+		}
+		lat[i] = now_ns() - start;
+	}
+	qsort(lat, BENCH_SENDS, sizeof(lat[0]), cmp_ll);
+
+	buf = calloc(1, BENCH_TCP_CHUNK);
+	if (!buf)
+		return fail_errno();
+	start = now_ns();
+	while (sent < BENCH_TCP_BYTES) {
+		ret = send(fd, buf, BENCH_TCP_CHUNK, 0);
+		if (ret <= 0)
+			return fail_errno();
+		sent += ret;
+	}
+	if (shutdown(fd, SHUT_WR))
+		return fail_errno();
+	if (recv(fd, rxbuf, sizeof(rxbuf), 0) != 0)
+		return fail_errno();
+	cost = now_ns() - start;
+	free(buf);
+
+	printf("tcp_lo   %-6s: %6lld ns median rtt, %6lld ns p99, "
+	       "%6.2f Gbit/s\n", ring ? "ring" : "kernel",
+	       lat[BENCH_SENDS / 2], lat[BENCH_SENDS * 99 / 100],
+	       sent * 8.0 / cost);
+
+	if (close(fd))
+		return fail_errno();
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+	if (ring && onload_stack_opt_reset())
+		return fail_errno();
+
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/* A subscriber of bench_mcast: join, report on ready, then count the
+ * datagrams up to the end marker
+ */
+static int bench_mcast_reader(uint16_t port, int ready)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct sockaddr_in addr = {0};
+	char rxbuf[BENCH_PAYLOAD];
+	struct ip_mreqn mreq = {0};
+	int fd, one = 1, n = 0;
+
+	fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	addr.sin_port = port;
+	mreq.imr_multiaddr.s_addr = htonl(BENCH_MC_GROUP);
+	mreq.imr_ifindex = if_nametoindex("lo");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    bind(fd, (void *)&addr, sizeof(addr)) ||
+	    setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+		return fail_errno();
+	if (write(ready, &one, 1) != 1)
+		return fail_errno();
+
+	while (recv(fd, rxbuf, sizeof(rxbuf), 0) == sizeof(rxbuf) && !rxbuf[0])
+		n++;
+
+	/* the count is only reported, so that losses do not fail the run */
+	if (write(ready, &n, sizeof(n)) != sizeof(n))
+		return fail_errno();
+	if (close(fd))
+		return fail_errno();
+
+	return 0;
+}
+
+static int bench_mcast_netns(void)
+{
+	char msg[BENCH_PAYLOAD] = {0};
+	struct sockaddr_in addr = {0};
+	struct ip_mreqn mreq = {0};
+	long long got = 0, cost;
+	int fdt, ready[2], status, ret = 0, i, n;
+	struct rusage ru;
+	bool ring;
+	pid_t pid;
+
+	if (unshare(CLONE_NEWNET) ||
+	    system("ip link set lo up && ip link set lo multicast on && "
+		   "ip route add 224.0.0.0/4 dev lo"))
+		return 0;
+	ring = has_preload && getenv("LKOS_MCAST_RING");
+
+	if (pipe(ready))
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(9999);
+	for (i = 0; i < BENCH_MC_READERS; i++) {
+		pid = fork();
+		if (pid == -1)
+			return fail_errno();
+		if (!pid)
+			exit(bench_mcast_reader(addr.sin_port, ready[1]));
+		if (read(ready[0], &n, 1) != 1)
+			return fail_errno();
+	}
+
+	fdt = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdt == -1)
+		return fail_errno();
+	addr.sin_addr.s_addr = htonl(BENCH_MC_GROUP);
+	mreq.imr_ifindex = if_nametoindex("lo");
+	if (setsockopt(fdt, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) ||
+	    connect(fdt, (void *)&addr, sizeof(addr)))
+		return fail_errno();
+
+	/* bursts of 64, paced so that one cpu can keep up; the subscribers
+	 * are measured in cpu time, not in time to deliver
+	 */
+	for (i = 0; i < BENCH_MSGS / 4; i++) {
+		if (send(fdt, msg, sizeof(msg), 0) != sizeof(msg))
+			return fail_errno();
+		if (i % 64 == 63)
+			usleep(200);
+	}
+	msg[0] = 1;
+	for (i = 0; i < 4; i++) {
+		if (send(fdt, msg, sizeof(msg), 0) != sizeof(msg))
+			return fail_errno();
+	}
+
+	for (i = 0; i < BENCH_MC_READERS; i++) {
+		if (read(ready[0], &n, sizeof(n)) != sizeof(n))
+			return fail_errno();
+		got += n;
+	}
+	for (i = 0; i < BENCH_MC_READERS; i++) {
+		if (wait(&status) == -1)
+			return fail_errno();
+		ret |= !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+	if (getrusage(RUSAGE_CHILDREN, &ru))
+		return fail_errno();
+	cost = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+
+	printf("mcast    %-6s: %6.1f ns cpu/msg over %d readers, "
+	       "%6.2f%% delivered\n", ring ? "ring" : "kernel",
+	       (double)cost / (BENCH_MSGS / 4), BENCH_MC_READERS,
+	       got * 100.0 / ((long long)BENCH_MSGS / 4 * BENCH_MC_READERS));
+
+	if (close(fdt))
+		return fail_errno();
+
+	return ret;
+}
+
+/* One multicast group read by BENCH_MC_READERS processes, through the
+ * shared ring with LKOS_MCAST_RING or else the kernel: the cpu time of
+ * the readers per datagram sent. In a child, in a network namespace.
+ * Needs root.
+ */
+static int bench_mcast(void)
+{
+	int status;
+	pid_t pid;
+
+	if (geteuid())
+		return 0;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid)
+		exit(bench_mcast_netns());
+
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+struct bench_cl_report {
+	int n;
+	long long last;			/* time of the last receive or accept */
+};
+
+static void bench_cl_pin(int cpu)
+{
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu % get_nprocs(), &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+/* A member of bench_cluster on cpu: bind, report on ready, then count
+ * datagrams or connections until idle for 200 ms
+ */
+static int bench_cluster_member(int type, int cpu, bool steer, int ready)
+{
+	struct timeval tv = { .tv_usec = 200 * 1000 };
+	struct bench_cl_report rep = {0};
+	struct sockaddr_in addr = {0};
+	char rxbuf[BENCH_PAYLOAD];
+	int fd, afd, one = 1, val = 4 << 20;
+
+	bench_cl_pin(cpu);
+	if (steer && onload_stack_opt_set_str("EF_CLUSTER_NAME", "bench"))
+		return fail_errno();
+	if (steer && onload_stack_opt_set_int("EF_CLUSTER_SIZE",
+					      BENCH_CL_MEMBERS))
+		return fail_errno();
+
+	fd = socket(PF_INET, type, 0);
+	if (fd == -1)
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_CL_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((!steer && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one,
+				  sizeof(one))) ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &val, sizeof(val)) &&
+	     setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val))) ||
+	    bind(fd, (void *)&addr, sizeof(addr)) ||
+	    (type == SOCK_STREAM && listen(fd, BENCH_CL_CONNS)))
+		return fail_errno();
+	if (write(ready, &one, 1) != 1)
+		return fail_errno();
+
+	for (;;) {
+		if (type == SOCK_STREAM) {
+			afd = accept(fd, NULL, NULL);
+			if (afd == -1)
+				break;
+			close(afd);
+		} else if (recv(fd, rxbuf, sizeof(rxbuf), 0) != sizeof(rxbuf)) {
+			break;
+		}
+		rep.n++;
+		rep.last = now_ns();
+	}
+
+	if (write(ready, &rep, sizeof(rep)) != sizeof(rep))
+		return fail_errno();
+	if (close(fd))
+		return fail_errno();
+
+	return 0;
+}
+
+static int bench_cluster_netns(int type, bool steer)
+{
+	const int total = type == SOCK_STREAM ? BENCH_CL_CONNS : BENCH_MSGS / 4;
+	struct bench_cl_report rep[BENCH_CL_MEMBERS];
+	char msg[BENCH_PAYLOAD] = {0}, shares[128];
+	struct sockaddr_in addr = {0};
+	int fd, ready[2], status, ret = 0, len = 0, i, j, n = 0;
+	long long start, last = 0;
+	pid_t pid;
+
+	if (unshare(CLONE_NEWNET) || system("ip link set lo up"))
+		return 0;
+
+	if (pipe(ready))
+		return fail_errno();
+	for (i = 0; i < BENCH_CL_MEMBERS; i++) {
+		pid = fork();
+		if (pid == -1)
+			return fail_errno();
+		if (!pid)
+			exit(bench_cluster_member(type, i, steer, ready[1]));
+		if (read(ready[0], &j, 1) != 1)
+			return fail_errno();
+	}
+
+	/* flows of 64 datagrams, or connections, from each CPU in turn */
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_CL_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	start = now_ns();
+	for (i = 0; i < total; i += type == SOCK_STREAM ? 1 : 64) {
+		bench_cl_pin(i / (type == SOCK_STREAM ? 1 : 64));
+		fd = socket(PF_INET, type, 0);
+		if (fd == -1)
+			return fail_errno();
+		if (connect(fd, (void *)&addr, sizeof(addr)))
+			return fail_errno();
+		for (j = 0; type == SOCK_DGRAM && j < 64; j++) {
+			if (send(fd, msg, sizeof(msg), 0) != sizeof(msg))
+				return fail_errno();
+		}
+		if (close(fd))
+			return fail_errno();
+	}
+
+	for (i = 0; i < BENCH_CL_MEMBERS; i++) {
+		if (read(ready[0], &rep[i], sizeof(rep[i])) != sizeof(rep[i]))
+			return fail_errno();
+		n += rep[i].n;
+		if (rep[i].last > last)
+			last = rep[i].last;
+	}
+	for (i = 0; i < BENCH_CL_MEMBERS; i++) {
+		if (wait(&status) == -1)
+			return fail_errno();
+		ret |= !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+
+	/* the shares are in the order of the reports, not of the members */
+	for (i = 0; i < BENCH_CL_MEMBERS; i++)
+		len += snprintf(shares + len, sizeof(shares) - len, " %3d%%",
+				n ? rep[i].n * 100 / n : 0);
+	printf("cluster  %s %-5s: %6.2f %s, %6.2f%% delivered, "
+	       "members%s\n", type == SOCK_STREAM ? "tcp" : "udp",
+	       steer ? "steer" : "hash",
+	       n * (type == SOCK_STREAM ? 1000000.0 : 1000.0) /
+	       (last > start ? last - start : 1),
+	       type == SOCK_STREAM ? "K conn/s" : "Mpps", n * 100.0 / total,
+	       shares);
+
+	return ret;
+}
+
+/* BENCH_CL_MEMBERS processes on one port, each pinned to a CPU: with
+ * SO_REUSEPORT and the kernel hash, or in a cluster that steers by CPU.
+ * Flows come from each CPU in turn. Per-member shares and throughput.
+ * In a child, in a network namespace. Needs root.
+ */
+static int bench_cluster(int type, bool steer)
+{
+	int status;
+	pid_t pid;
+
+	if ((steer && !has_preload) || geteuid())
+		return 0;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid)
+		exit(bench_cluster_netns(type, steer));
+
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned int vlens[] = { 1, 64, 1024, 0 }, *p_vlen;
+	int ret = 0;
+
+	has_preload = getenv("LD_PRELOAD");
+
+	for (p_vlen = vlens; *p_vlen; p_vlen++) {
+		ret |= bench_recvmmsg(*p_vlen, false);
+		ret |= bench_recvmmsg(*p_vlen, true);
+	}
+
+	ret |= bench_tcp_rx(false);
+	ret |= bench_tcp_rx(true);
+
+	ret |= bench_send_latency(false);
+	ret |= bench_send_latency(true);
+
+	ret |= bench_delegated_send(false);
+	ret |= bench_delegated_send(true);
+
+	ret |= bench_xdp(false);
+	ret |= bench_xdp(true);
+
+	ret |= bench_tcp_loopback(false);
+	ret |= bench_tcp_loopback(true);
+
+	ret |= bench_mcast();
+
+	ret |= bench_cluster(SOCK_DGRAM, false);
+	ret |= bench_cluster(SOCK_DGRAM, true);
+	ret |= bench_cluster(SOCK_STREAM, false);
+	ret |= bench_cluster(SOCK_STREAM, true);
+
+	return !!ret;
+}
@@ -17,277 +17,11871 @@
 #include <dlfcn.h>
 #include <error.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <net/ethernet.h>
+#include <net/if.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <linux/bpf.h>
+#include <linux/futex.h>
 #include <linux/errqueue.h>		/* after time.h, for timespec */
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/io_uring.h>
 #include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 
 #include "lk_onload_stub_ext.h"
 
 /* file scope definitions */
 
 static int lkos_log_fd;		/* 0 (STDIN_FILENO) means disabled */
+static int lkos_log_level;	/* 0 if disabled */
 
+/* spin types enabled in the environment, see lkos_init_spin.
+ * Bits as returned by onload_thread_get_spin.
+ */
+#define LKOS_SPIN_UDP_RECV	(1U << ONLOAD_SPIN_UDP_RECV)
+#define LKOS_SPIN_UDP_SEND	(1U << ONLOAD_SPIN_UDP_SEND)
+#define LKOS_SPIN_TCP_RECV	(1U << ONLOAD_SPIN_TCP_RECV)
+#define LKOS_SPIN_TCP_SEND	(1U << ONLOAD_SPIN_TCP_SEND)
+#define LKOS_SPIN_TCP_ACCEPT	(1U << ONLOAD_SPIN_TCP_ACCEPT)
+#define LKOS_SPIN_SELECT	(1U << ONLOAD_SPIN_SELECT)
+#define LKOS_SPIN_POLL		(1U << ONLOAD_SPIN_POLL)
+#define LKOS_SPIN_EPOLL		(1U << ONLOAD_SPIN_EPOLL_WAIT)
+#define LKOS_SPIN_TCP_CONNECT	(1U << ONLOAD_SPIN_TCP_CONNECT)
+#define LKOS_SPIN_ALL		(((1U << ONLOAD_SPIN_MAX) - 1) & \
+				 ~(1U << ONLOAD_SPIN_ALL))
+
+static unsigned int lkos_spin_types;
+static int lkos_spin_usec;
+static int lkos_busy_poll_budget;	/* 0: kernel default */
+static bool lkos_prefer_busy_poll;
+
+static int (*accept_fn)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+static int (*accept4_fn)(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+			 int flags);
+static int (*bind_fn)(int sockfd, const struct sockaddr *addr,
+		       socklen_t addrlen);
+static int (*close_fn)(int fd);
+static int (*close_range_fn)(unsigned int first, unsigned int last, int flags);
+static int (*connect_fn)(int sockfd, const struct sockaddr *addr,
+			  socklen_t addrlen);
+static int (*dup_fn)(int oldfd);
+static int (*dup2_fn)(int oldfd, int newfd);
+static int (*dup3_fn)(int oldfd, int newfd, int flags);
+static int (*epoll_create_fn)(int size);
+static int (*epoll_create1_fn)(int flags);
+static int (*epoll_ctl_fn)(int epfd, int op, int fd, struct epoll_event *event);
+static int (*epoll_wait_fn)(int epfd, struct epoll_event *events,
+			    int maxevents, int timeout);
+static int (*fcntl_fn)(int fd, int cmd, ...);
+static int (*fcntl64_fn)(int fd, int cmd, ...);
 static int (*getsockopt_fn)(int sockfd, int level, int optname,
 			    void *optval, socklen_t *optlen);
+static int (*ioctl_fn)(int fd, unsigned long request, ...);
+static int (*listen_fn)(int sockfd, int backlog);
+static int (*poll_fn)(struct pollfd *fds, nfds_t nfds, int timeout);
+static ssize_t (*read_fn)(int fd, void *buf, size_t count);
+static ssize_t (*readv_fn)(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t (*recv_fn)(int sockfd, void *buf, size_t len, int flags);
+static ssize_t (*recvfrom_fn)(int sockfd, void *buf, size_t len, int flags,
+			      struct sockaddr *src_addr, socklen_t *addrlen);
 static int (*recvmmsg_fn)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
 			  int flags, struct timespec *timeout);
 static ssize_t (*recvmsg_fn)(int sockfd, struct msghdr *msg, int flags);
+static int (*select_fn)(int nfds, fd_set *readfds, fd_set *writefds,
+			fd_set *exceptfds, struct timeval *timeout);
+static ssize_t (*send_fn)(int sockfd, const void *buf, size_t len, int flags);
+static int (*sendmmsg_fn)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+			  int flags);
+static ssize_t (*sendmsg_fn)(int sockfd, const struct msghdr *msg, int flags);
+static ssize_t (*sendto_fn)(int sockfd, const void *buf, size_t len, int flags,
+			    const struct sockaddr *dest_addr, socklen_t addrlen);
 static int (*setsockopt_fn)(int sockfd, int level, int optname,
 			    const void *optval, socklen_t optlen);
+static int (*shutdown_fn)(int sockfd, int how);
+static int (*socket_fn)(int domain, int type, int protocol);
+static int (*socketpair_fn)(int domain, int type, int protocol, int sv[2]);
+static ssize_t (*write_fn)(int fd, const void *buf, size_t count);
+static ssize_t (*writev_fn)(int fd, const struct iovec *iov, int iovcnt);
+
+/* library support functions */
+
+/* log levels, LKOS_LOG_LEVEL */
+#define LKOS_LOG_ERR		1	/* written at once, see logging */
+#define LKOS_LOG_WARN		2
+#define LKOS_LOG_INFO		3	/* the default */
+#define LKOS_LOG_DEBUG		4
+
+#define LKOS_LOG_ARGS		8	/* arguments per record */
+
+/* a call site of lkos_log */
+struct lkos_log_site {
+	const char *fmt;
+	int level;
+	int nargs;			/* once parsed: -1 to write at once */
+	bool parsed;
+	uint8_t kind[LKOS_LOG_ARGS];
+	uint64_t window;		/* tsc at the start of the rate window */
+	uint32_t count;			/* records in the window */
+	uint32_t suppressed;		/* since the last record */
+};
+
+static void __lkos_log(struct lkos_log_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define lkos_log_at(lvl, f, ...)					\
+	do {								\
+		static struct lkos_log_site __site = {			\
+			.fmt = f,					\
+			.level = lvl,					\
+		};							\
+									\
+		if ((lvl) <= lkos_log_level)				\
+			__lkos_log(&__site, f, ##__VA_ARGS__);		\
+	} while (0)
+
+#define lkos_log(fmt, ...)	lkos_log_at(LKOS_LOG_INFO, fmt, ##__VA_ARGS__)
+#define lkos_warn(fmt, ...)	lkos_log_at(LKOS_LOG_WARN, fmt, ##__VA_ARGS__)
+#define lkos_debug(fmt, ...)	lkos_log_at(LKOS_LOG_DEBUG, fmt, ##__VA_ARGS__)
+
+static int __attribute__((unused)) __lkos_error(int err, const char *msg, const char *fn, int lineno)
+{
+	if (msg)
+		lkos_warn("%s.%d: %s\n", fn, lineno, msg);
+
+	errno = err;
+	return 1;
+}
+#define lkos_error(err, msg) __lkos_error(err, msg, __func__, __LINE__)
+
+static void * __attribute__((used)) lkos_dlsym(const char *symbol_str)
+{
+	void *fn;
+
+	fn = dlsym(RTLD_NEXT, symbol_str);
+	if (!fn) {
+		lkos_log_at(LKOS_LOG_ERR, "%s: %s: %s\n", __func__, symbol_str,
+			    dlerror());
+		exit(1);
+	}
+
+	return fn;
+};
+
+/* per-fd state
+ *
+ * A table indexed by fd, so that intercepted calls can look up state
+ * without a syscall. It is mapped lazily: only pages that cover fds in
+ * use are populated. Fields are read and written with atomics, without
+ * locks. The state word publishes the other fields: set LKOS_FD_*_VALID
+ * with release semantics after writing them.
+ *
+ * Entries are reset when the fd is created or closed. A dup'ed fd, or
+ * any fd open across fork, in the parent as in the child, refers to a
+ * socket that another fd can modify behind our back. Those entries are
+ * verified against the kernel before use: see LKOS_FD_SHARED and
+ * lkos_fd_gen.
+ */
+
+#define LKOS_FD_TS_VALID	0x1	/* ts and ts_kernel are set */
+#define LKOS_FD_SHARED		0x2	/* socket also open as another fd */
+#define LKOS_FD_SOCKET		0x4	/* created through this library */
+#define LKOS_FD_TS_CONVERT	0x8	/* app reads raw hardware timestamps */
+#define LKOS_FD_BUSY_POLL	0x10	/* SO_BUSY_POLL is set */
+#define LKOS_FD_NONBLOCK	0x20	/* O_NONBLOCK is set */
+#define LKOS_FD_UDP_GRO		0x40	/* UDP_GRO is set */
+#define LKOS_FD_ZEROCOPY	0x80	/* SO_ZEROCOPY is set */
+#define LKOS_FD_ONEPKT		0x100	/* rx timestamps set for ONLOAD_MSG_ONEPKT */
+#define LKOS_FD_ONEPKT_TS	0x200	/* ... by this library: hide SO_TIMESTAMPNS */
+#define LKOS_FD_GRO_SPLIT	0x400	/* UDP_GRO set by this library: split */
+#define LKOS_FD_GSO		0x800	/* batch sends with UDP_SEGMENT */
+#define LKOS_FD_URING		0x1000	/* I/O through io_uring */
+
+#define LKOS_STACK_DEFAULT	0	/* the unnamed stack */
+#define LKOS_STACK_NONACCEL	-1	/* ONLOAD_DONT_ACCELERATE */
+
+struct lkos_fd {
+	unsigned int state;		/* LKOS_FD_* */
+	unsigned int gen;		/* lkos_fd_gen at last update */
+	uint64_t ts;			/* struct so_timestamping as requested */
+	int ts_kernel;			/* flags as passed to the kernel */
+	short domain;			/* if LKOS_FD_SOCKET */
+	short type;			/* if LKOS_FD_SOCKET, without flags */
+	int stack;			/* if LKOS_FD_SOCKET, LKOS_STACK_* or id */
+	struct lkos_epoll *ep;		/* epoll registry, if an epoll fd */
+	struct lkos_zc_stash *zc;	/* zero-copy receive stash */
+	struct lkos_zc_txq *zc_tx;	/* zero-copy sends in flight */
+	struct onload_zc_hlrx *hlrx;	/* high-level zero-copy receive */
+	struct lkos_ds *ds;		/* delegated send state */
+	struct lkos_gro *gro;		/* UDP GRO receive stash */
+	struct lkos_gso *gso;		/* UDP GSO send batch */
+	struct lkos_xdp_sock *xdp;	/* AF_XDP receive queue */
+	struct lkos_lo *lo;		/* TCP loopback over shared memory */
+	struct lkos_mc_sock *mc;	/* multicast ring reader */
+	struct lkos_cl *cl;		/* cluster membership */
+};
+
+static struct lkos_fd *lkos_fds;
+static int lkos_fd_max;
+static unsigned int lkos_fd_gen;	/* incremented on fork */
+
+static struct lkos_fd *lkos_fd_get(int fd)
+{
+	if (fd < 0 || fd >= lkos_fd_max)
+		return NULL;
+
+	return &lkos_fds[fd];
+}
+
+static bool lkos_fd_shared(const struct lkos_fd *lfd, unsigned int state)
+{
+	return (state & LKOS_FD_SHARED) ||
+	       __atomic_load_n(&lfd->gen, __ATOMIC_RELAXED) !=
+	       __atomic_load_n(&lkos_fd_gen, __ATOMIC_RELAXED);
+}
+
+/* defined with statistics */
+static void lkos_stats_fd_init(int fd, int domain, int type, int stack);
+static void lkos_stats_fd_stack(int fd, int stack);
+
+/* Called when fd is created or closed. The epoll registry and the
+ * zero-copy stash and send queue are kept for reuse by a future fd with
+ * the same number.
+ */
+static void lkos_fd_reset(int fd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (!lfd)
+		return;
+
+	__atomic_store_n(&lfd->state, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&lfd->gen, __atomic_load_n(&lkos_fd_gen, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->ts, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->ts_kernel, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->domain, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->type, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->stack, LKOS_STACK_DEFAULT, __ATOMIC_RELAXED);
+	lkos_stats_fd_init(fd, 0, 0, 0);
+}
+
+/* fd is a new socket. type may include SOCK_NONBLOCK */
+static void lkos_fd_socket(int fd, int domain, int type)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	unsigned int state = LKOS_FD_SOCKET;
+
+	if (!lfd)
+		return;
+
+	lkos_fd_reset(fd);
+
+	if (type & SOCK_NONBLOCK)
+		state |= LKOS_FD_NONBLOCK;
+
+	__atomic_store_n(&lfd->domain, domain, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->type, type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->state, state, __ATOMIC_RELEASE);
+	lkos_stats_fd_init(fd, domain, type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC),
+			   LKOS_STACK_DEFAULT);
+}
+
+static void lkos_fd_set_stack(int fd, int stack)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (lfd)
+		__atomic_store_n(&lfd->stack, stack, __ATOMIC_RELAXED);
+	lkos_stats_fd_stack(fd, stack);
+}
+
+/* fd was accepted on listenfd, and joins its stack.
+ * flags as passed to accept4
+ */
+static void lkos_fd_accept(int listenfd, int fd, int flags)
+{
+	const struct lkos_fd *llfd = lkos_fd_get(listenfd);
+	int domain = 0, type = SOCK_STREAM, stack = LKOS_STACK_DEFAULT;
+
+	if (llfd && __atomic_load_n(&llfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET) {
+		domain = __atomic_load_n(&llfd->domain, __ATOMIC_RELAXED);
+		type = __atomic_load_n(&llfd->type, __ATOMIC_RELAXED);
+		stack = __atomic_load_n(&llfd->stack, __ATOMIC_RELAXED);
+	}
+
+	lkos_fd_socket(fd, domain, type | (flags & SOCK_NONBLOCK));
+	lkos_fd_set_stack(fd, stack);
+}
+
+/* Set or clear a flag that mirrors a socket option, such as O_NONBLOCK */
+static void lkos_fd_set_flag(int fd, unsigned int flag, bool on)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (!lfd)
+		return;
+
+	if (on)
+		__atomic_or_fetch(&lfd->state, flag, __ATOMIC_RELEASE);
+	else
+		__atomic_and_fetch(&lfd->state, ~flag, __ATOMIC_RELEASE);
+}
+
+/* newfd now refers to the same socket as oldfd */
+static void lkos_fd_dup(int oldfd, int newfd)
+{
+	struct lkos_fd *old = lkos_fd_get(oldfd);
+	struct lkos_fd *new = lkos_fd_get(newfd);
+	unsigned int state;
+
+	if (!new)
+		return;
+
+	lkos_fd_reset(newfd);
+	if (!old)
+		return;
+
+	state = __atomic_or_fetch(&old->state, LKOS_FD_SHARED, __ATOMIC_ACQ_REL);
+
+	__atomic_store_n(&new->domain, __atomic_load_n(&old->domain, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&new->type, __atomic_load_n(&old->type, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&new->stack, __atomic_load_n(&old->stack, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+
+	__atomic_store_n(&new->ts, __atomic_load_n(&old->ts, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&new->ts_kernel,
+			 __atomic_load_n(&old->ts_kernel, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&new->state, state, __ATOMIC_RELEASE);
+}
+
+static void lkos_fd_set_timestamping(int fd, const void *optval, socklen_t optlen,
+				     int kernel_flags)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct so_timestamping ts;
+	uint64_t val;
+
+	if (!lfd)
+		return;
+
+	/* Like the kernel, only update bind_phc along with its flag */
+	val = __atomic_load_n(&lfd->ts, __ATOMIC_RELAXED);
+	memcpy(&ts, &val, sizeof(ts));
+	memcpy(&ts.flags, optval, sizeof(ts.flags));
+	if (ts.flags & SOF_TIMESTAMPING_BIND_PHC)
+		ts.bind_phc = optlen == sizeof(ts) ?
+			      ((const struct so_timestamping *)optval)->bind_phc : 0;
+	memcpy(&val, &ts, sizeof(val));
+
+	__atomic_store_n(&lfd->ts, val, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->ts_kernel, kernel_flags, __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->gen, __atomic_load_n(&lkos_fd_gen, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	if (ts.flags & SOF_TIMESTAMPING_RAW_HARDWARE)
+		__atomic_or_fetch(&lfd->state, LKOS_FD_TS_VALID | LKOS_FD_TS_CONVERT,
+				  __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&lfd->state,
+				 (__atomic_load_n(&lfd->state, __ATOMIC_RELAXED) &
+				  ~LKOS_FD_TS_CONVERT) | LKOS_FD_TS_VALID,
+				 __ATOMIC_RELEASE);
+}
+
+/* Whether received timestamps need conversion: if the application
+ * requested raw hardware timestamps, or if unknown.
+ */
+static bool lkos_fd_ts_convert(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	unsigned int state;
+
+	if (!lfd)
+		return true;
+
+	state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+	if (!(state & LKOS_FD_SOCKET) || (state & LKOS_FD_TS_CONVERT))
+		return true;
+
+	/* another fd may have enabled timestamping on the socket */
+	return lkos_fd_shared(lfd, state);
+}
+
+/* Whether this library enabled SO_TIMESTAMPNS, see lkos_onepkt_enable */
+static bool lkos_fd_onepkt_ts(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd &&
+	       (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_ONEPKT_TS);
+}
+
+/* Whether this library enabled UDP_GRO, see lkos_gro_socket */
+static bool lkos_fd_gro_split(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd &&
+	       (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_GRO_SPLIT);
+}
+
+/* after fork, parent and child share all sockets */
+static void lkos_fd_atfork(void)
+{
+	__atomic_add_fetch(&lkos_fd_gen, 1, __ATOMIC_RELAXED);
+}
+
+static void lkos_init_fds(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_max > 1 << 20)
+		rlim.rlim_max = 1 << 20;
+
+	lkos_fds = mmap(NULL, rlim.rlim_max * sizeof(*lkos_fds),
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (lkos_fds == MAP_FAILED) {
+		lkos_warn("%s: mmap: %s\n", __func__, strerror(errno));
+		lkos_fds = NULL;
+		return;
+	}
+
+	lkos_fd_max = rlim.rlim_max;
+
+	pthread_atfork(NULL, lkos_fd_atfork, lkos_fd_atfork);
+}
+
+/* epoll registry
+ *
+ * epoll_wait returns the epoll_data passed to epoll_ctl, which need not
+ * hold the fd. Record the data for each registered fd, so that the fd
+ * of a returned event can be looked up, e.g., for wire order delivery.
+ */
+
+struct lkos_epoll_key {
+	uint64_t data;
+	int fd;				/* -1: empty slot */
+};
+
+struct lkos_epoll {
+	pthread_mutex_t lock;
+	struct lkos_epoll_key *keys;	/* open addressing on data */
+	unsigned int keys_mask;
+	unsigned int keys_used;
+	uint64_t *fd_data;		/* indexed by fd */
+	uint32_t *fd_events;		/* indexed by fd */
+	int fd_data_len;
+};
+
+static unsigned int lkos_epoll_hash(const struct lkos_epoll *ep, uint64_t data)
+{
+	return (unsigned int)((data * 0x9e3779b97f4a7c15ULL) >> 32) & ep->keys_mask;
+}
+
+static bool lkos_epoll_key_add(struct lkos_epoll *ep, uint64_t data, int fd)
+{
+	unsigned int i;
+
+	if ((ep->keys_used + 1) * 2 > ep->keys_mask + 1) {
+		struct lkos_epoll old = *ep;
+		unsigned int j;
+
+		ep->keys_mask = ep->keys_mask * 2 + 1;
+		ep->keys = malloc((ep->keys_mask + 1) * sizeof(*ep->keys));
+		if (!ep->keys) {
+			*ep = old;
+			return false;
+		}
+		for (i = 0; i <= ep->keys_mask; i++)
+			ep->keys[i].fd = -1;
+
+		ep->keys_used = 0;
+		for (j = 0; j <= old.keys_mask; j++)
+			if (old.keys[j].fd >= 0)
+				lkos_epoll_key_add(ep, old.keys[j].data, old.keys[j].fd);
+		free(old.keys);
+	}
+
+	for (i = lkos_epoll_hash(ep, data);
+	     ep->keys[i].fd >= 0;
+	     i = (i + 1) & ep->keys_mask)
+		;
+
+	ep->keys[i].data = data;
+	ep->keys[i].fd = fd;
+	ep->keys_used++;
+
+	return true;
+}
+
+static void lkos_epoll_key_del(struct lkos_epoll *ep, uint64_t data, int fd)
+{
+	unsigned int i, j, k;
+
+	for (i = lkos_epoll_hash(ep, data);
+	     ep->keys[i].fd >= 0;
+	     i = (i + 1) & ep->keys_mask) {
+		if (ep->keys[i].data == data && ep->keys[i].fd == fd)
+			break;
+	}
+	if (ep->keys[i].fd < 0)
+		return;
+
+	/* backward shift deletion: no tombstones in the probe chains */
+	for (j = (i + 1) & ep->keys_mask;
+	     ep->keys[j].fd >= 0;
+	     j = (j + 1) & ep->keys_mask) {
+		k = lkos_epoll_hash(ep, ep->keys[j].data);
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			ep->keys[i] = ep->keys[j];
+			i = j;
+		}
+	}
+
+	ep->keys[i].fd = -1;
+	ep->keys_used--;
+}
+
+/* Returns the fd registered with data, or -1 if none or ambiguous */
+static int lkos_epoll_key_lookup(const struct lkos_epoll *ep, uint64_t data)
+{
+	unsigned int i;
+	int fd = -1;
+
+	for (i = lkos_epoll_hash(ep, data);
+	     ep->keys[i].fd >= 0;
+	     i = (i + 1) & ep->keys_mask) {
+		if (ep->keys[i].data == data) {
+			if (fd >= 0)
+				return -1;
+			fd = ep->keys[i].fd;
+		}
+	}
+
+	return fd;
+}
+
+static struct lkos_epoll *lkos_epoll_get(int epfd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(epfd);
+
+	if (!lfd)
+		return NULL;
+
+	return __atomic_load_n(&lfd->ep, __ATOMIC_ACQUIRE);
+}
+
+static void lkos_epoll_create(int epfd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(epfd);
+	struct lkos_epoll *ep;
+	unsigned int i;
+
+	if (!lfd)
+		return;
+
+	/* A previous epoll set with this fd was closed: reuse its state */
+	ep = lkos_epoll_get(epfd);
+	if (ep) {
+		pthread_mutex_lock(&ep->lock);
+		for (i = 0; i <= ep->keys_mask; i++)
+			ep->keys[i].fd = -1;
+		ep->keys_used = 0;
+		pthread_mutex_unlock(&ep->lock);
+		return;
+	}
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return;
+
+	ep->keys_mask = 63;
+	ep->keys = malloc((ep->keys_mask + 1) * sizeof(*ep->keys));
+	if (!ep->keys) {
+		free(ep);
+		return;
+	}
+	for (i = 0; i <= ep->keys_mask; i++)
+		ep->keys[i].fd = -1;
+
+	pthread_mutex_init(&ep->lock, NULL);
+
+	__atomic_store_n(&lfd->ep, ep, __ATOMIC_RELEASE);
+}
+
+static void lkos_epoll_ctl(int epfd, int op, int fd, const struct epoll_event *event)
+{
+	struct lkos_epoll *ep;
+
+	ep = lkos_epoll_get(epfd);
+	if (!ep || fd < 0)
+		return;
+
+	pthread_mutex_lock(&ep->lock);
+
+	if (fd < ep->fd_data_len)
+		lkos_epoll_key_del(ep, ep->fd_data[fd], fd);
+
+	if (op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) {
+		if (fd >= ep->fd_data_len) {
+			int len = fd < 64 ? 128 : fd * 2;
+			uint32_t *fd_events;
+			uint64_t *fd_data;
+
+			fd_data = realloc(ep->fd_data, len * sizeof(*fd_data));
+			if (!fd_data)
+				goto out;
+			memset(fd_data + ep->fd_data_len, 0,
+			       (len - ep->fd_data_len) * sizeof(*fd_data));
+			ep->fd_data = fd_data;
+
+			fd_events = realloc(ep->fd_events, len * sizeof(*fd_events));
+			if (!fd_events)
+				goto out;
+			memset(fd_events + ep->fd_data_len, 0,
+			       (len - ep->fd_data_len) * sizeof(*fd_events));
+			ep->fd_events = fd_events;
+			ep->fd_data_len = len;
+		}
+
+		if (lkos_epoll_key_add(ep, event->data.u64, fd)) {
+			ep->fd_data[fd] = event->data.u64;
+			ep->fd_events[fd] = event->events;
+		}
+	}
+
+out:
+	pthread_mutex_unlock(&ep->lock);
+}
+
+/* per-thread spin state, see onload_thread_set_spin */
+static __thread unsigned int lkos_thread_spin;
+static __thread bool lkos_thread_spin_valid;
+
+/* stack options
+ *
+ * A fixed table of the known EF_* options, seeded from the environment
+ * at init. onload_stack_opt_set_int and _set_str override options for
+ * the calling thread, onload_stack_opt_reset restores the environment.
+ *
+ * Options apply to sockets and epoll sets that the thread creates
+ * after the set, where a kernel knob exists:
+ *
+ * - EF_POLL_USEC, EF_SPIN_USEC, EF_*_SPIN: busy polling
+ * - EF_UDP_RCVBUF, EF_TCP_RCVBUF, else EF_RXQ_SIZE packets: SO_RCVBUF
+ * - EF_UDP_SNDBUF, EF_TCP_SNDBUF, else EF_TXQ_SIZE packets: SO_SNDBUF
+ *
+ * The loopback and cluster options apply at connect, bind and listen.
+ *
+ * Buffer sizes only apply if set explicitly, not by default.
+ */
+
+#define LKOS_OPT_STR_LEN	64
+#define LKOS_PKT_BUF_SIZE	2048	/* Onload packet buffer size */
+
+enum lkos_opt_id {
+	LKOS_OPT_POLL_USEC,
+	LKOS_OPT_SPIN_USEC,
+	LKOS_OPT_UDP_RECV_SPIN,
+	LKOS_OPT_UDP_SEND_SPIN,
+	LKOS_OPT_TCP_RECV_SPIN,
+	LKOS_OPT_TCP_SEND_SPIN,
+	LKOS_OPT_TCP_ACCEPT_SPIN,
+	LKOS_OPT_TCP_CONNECT_SPIN,
+	LKOS_OPT_EPOLL_SPIN,
+	LKOS_OPT_POLL_SPIN,
+	LKOS_OPT_SELECT_SPIN,
+	LKOS_OPT_RXQ_SIZE,
+	LKOS_OPT_TXQ_SIZE,
+	LKOS_OPT_UDP_RCVBUF,
+	LKOS_OPT_UDP_SNDBUF,
+	LKOS_OPT_TCP_RCVBUF,
+	LKOS_OPT_TCP_SNDBUF,
+	LKOS_OPT_TCP_CLIENT_LOOPBACK,
+	LKOS_OPT_TCP_SERVER_LOOPBACK,
+	LKOS_OPT_CLUSTER_NAME,
+	LKOS_OPT_CLUSTER_SIZE,
+	LKOS_OPT_CLUSTER_RESTART,
+	LKOS_OPT_NAME,
+	LKOS_OPT_SCALABLE_FILTERS,
+	LKOS_OPT_MAX
+};
+
+struct lkos_opt_def {
+	const char *name;
+	bool is_str;
+	int64_t def;
+	unsigned int spin;		/* spin type enabled by the option */
+};
+
+static const struct lkos_opt_def lkos_opt_defs[LKOS_OPT_MAX] = {
+	[LKOS_OPT_POLL_USEC]	= { "EF_POLL_USEC" },
+	[LKOS_OPT_SPIN_USEC]	= { "EF_SPIN_USEC" },
+	[LKOS_OPT_UDP_RECV_SPIN] = { "EF_UDP_RECV_SPIN", .spin = LKOS_SPIN_UDP_RECV },
+	[LKOS_OPT_UDP_SEND_SPIN] = { "EF_UDP_SEND_SPIN", .spin = LKOS_SPIN_UDP_SEND },
+	[LKOS_OPT_TCP_RECV_SPIN] = { "EF_TCP_RECV_SPIN", .spin = LKOS_SPIN_TCP_RECV },
+	[LKOS_OPT_TCP_SEND_SPIN] = { "EF_TCP_SEND_SPIN", .spin = LKOS_SPIN_TCP_SEND },
+	[LKOS_OPT_TCP_ACCEPT_SPIN] = { "EF_TCP_ACCEPT_SPIN", .spin = LKOS_SPIN_TCP_ACCEPT },
+	[LKOS_OPT_TCP_CONNECT_SPIN] = { "EF_TCP_CONNECT_SPIN", .spin = LKOS_SPIN_TCP_CONNECT },
+	[LKOS_OPT_EPOLL_SPIN]	= { "EF_EPOLL_SPIN", .spin = LKOS_SPIN_EPOLL },
+	[LKOS_OPT_POLL_SPIN]	= { "EF_POLL_SPIN", .spin = LKOS_SPIN_POLL },
+	[LKOS_OPT_SELECT_SPIN]	= { "EF_SELECT_SPIN", .spin = LKOS_SPIN_SELECT },
+	[LKOS_OPT_RXQ_SIZE]	= { "EF_RXQ_SIZE", .def = 512 },
+	[LKOS_OPT_TXQ_SIZE]	= { "EF_TXQ_SIZE", .def = 512 },
+	[LKOS_OPT_UDP_RCVBUF]	= { "EF_UDP_RCVBUF" },
+	[LKOS_OPT_UDP_SNDBUF]	= { "EF_UDP_SNDBUF" },
+	[LKOS_OPT_TCP_RCVBUF]	= { "EF_TCP_RCVBUF" },
+	[LKOS_OPT_TCP_SNDBUF]	= { "EF_TCP_SNDBUF" },
+	[LKOS_OPT_TCP_CLIENT_LOOPBACK] = { "EF_TCP_CLIENT_LOOPBACK" },
+	[LKOS_OPT_TCP_SERVER_LOOPBACK] = { "EF_TCP_SERVER_LOOPBACK" },
+	[LKOS_OPT_CLUSTER_NAME]	= { "EF_CLUSTER_NAME", .is_str = true },
+	[LKOS_OPT_CLUSTER_SIZE]	= { "EF_CLUSTER_SIZE", .def = 2 },
+	[LKOS_OPT_CLUSTER_RESTART] = { "EF_CLUSTER_RESTART" },
+	[LKOS_OPT_NAME]		= { "EF_NAME", .is_str = true },
+	[LKOS_OPT_SCALABLE_FILTERS] = { "EF_SCALABLE_FILTERS", .is_str = true },
+};
+
+struct lkos_opt_val {
+	bool set;			/* set explicitly, not default */
+	union {
+		int64_t i;
+		char s[LKOS_OPT_STR_LEN];
+	};
+};
+
+struct lkos_opts {
+	struct lkos_opt_val val[LKOS_OPT_MAX];
+
+	/* derived from val, see lkos_opts_update */
+	int spin_usec;
+	unsigned int spin_types;
+};
+
+static struct lkos_opts lkos_opts_env;
+static __thread struct lkos_opts lkos_opts_thread;
+static __thread bool lkos_opts_thread_valid;
+
+static long lkos_getenv_long(const char *name, long def)
+{
+	const char *str;
+
+	str = getenv(name);
+	if (!str || !*str)
+		return def;
+
+	return strtol(str, NULL, 0);
+}
+
+/* Warns on the first failure only. Returns as setsockopt */
+static int lkos_setsockopt_once(int fd, int optname, const char *optstr,
+				int val, bool *warned)
+{
+	if (!setsockopt_fn(fd, SOL_SOCKET, optname, &val, sizeof(val)))
+		return 0;
+
+	if (!__atomic_exchange_n(warned, true, __ATOMIC_RELAXED))
+		lkos_warn("%s: %s: %s\n", __func__, optstr, strerror(errno));
+	return -1;
+}
+
+static int lkos_opt_find(const char *name)
+{
+	int i;
+
+	if (!name)
+		return -1;
+
+	for (i = 0; i < LKOS_OPT_MAX; i++) {
+		if (!strcmp(lkos_opt_defs[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/* EF_POLL_USEC enables all spin types, unless disabled individually */
+static void lkos_opts_update(struct lkos_opts *opts)
+{
+	const struct lkos_opt_val *val = opts->val;
+	int64_t poll_usec, usec;
+	int i;
+
+	poll_usec = val[LKOS_OPT_POLL_USEC].i;
+	if (val[LKOS_OPT_SPIN_USEC].set)
+		usec = val[LKOS_OPT_SPIN_USEC].i;
+	else
+		usec = poll_usec;
+
+	opts->spin_usec = usec < 0 ? 0 : usec > INT_MAX ? INT_MAX : usec;
+	opts->spin_types = poll_usec > 0 ? LKOS_SPIN_ALL : 0;
+
+	for (i = 0; i < LKOS_OPT_MAX; i++) {
+		if (!lkos_opt_defs[i].spin || !val[i].set)
+			continue;
+
+		if (val[i].i)
+			opts->spin_types |= lkos_opt_defs[i].spin;
+		else
+			opts->spin_types &= ~lkos_opt_defs[i].spin;
+	}
+}
+
+static const struct lkos_opts *lkos_opts_get(void)
+{
+	return lkos_opts_thread_valid ? &lkos_opts_thread : &lkos_opts_env;
+}
+
+/* Returns the thread's options for writing, copied on first write */
+static struct lkos_opts *lkos_opts_get_thread(void)
+{
+	if (!lkos_opts_thread_valid) {
+		lkos_opts_thread = lkos_opts_env;
+		lkos_opts_thread_valid = true;
+	}
+
+	return &lkos_opts_thread;
+}
+
+/* Returns the explicit size of a socket buffer in bytes, or 0 */
+static int lkos_opts_bufsize(const struct lkos_opts *opts, int opt, int opt_q)
+{
+	int64_t val;
+
+	if (opts->val[opt].set)
+		val = opts->val[opt].i;
+	else if (opts->val[opt_q].set)
+		val = opts->val[opt_q].i * LKOS_PKT_BUF_SIZE;
+	else
+		return 0;
+
+	/* the kernel doubles the value */
+	return val <= 0 ? 0 : val > INT_MAX / 2 ? INT_MAX / 2 : val;
+}
+
+static void lkos_opts_socket(int fd, int domain, int type,
+			     const struct lkos_opts *opts)
+{
+	static bool warned_rcvbuf, warned_sndbuf;
+	int rcvbuf, sndbuf;
+
+	if (domain != AF_INET && domain != AF_INET6)
+		return;
+
+	type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (type == SOCK_DGRAM) {
+		rcvbuf = lkos_opts_bufsize(opts, LKOS_OPT_UDP_RCVBUF,
+					   LKOS_OPT_RXQ_SIZE);
+		sndbuf = lkos_opts_bufsize(opts, LKOS_OPT_UDP_SNDBUF,
+					   LKOS_OPT_TXQ_SIZE);
+	} else if (type == SOCK_STREAM) {
+		rcvbuf = lkos_opts_bufsize(opts, LKOS_OPT_TCP_RCVBUF,
+					   LKOS_OPT_RXQ_SIZE);
+		sndbuf = lkos_opts_bufsize(opts, LKOS_OPT_TCP_SNDBUF,
+					   LKOS_OPT_TXQ_SIZE);
+	} else {
+		return;
+	}
+
+	if (rcvbuf)
+		lkos_setsockopt_once(fd, SO_RCVBUF, "SO_RCVBUF", rcvbuf,
+				     &warned_rcvbuf);
+	if (sndbuf)
+		lkos_setsockopt_once(fd, SO_SNDBUF, "SO_SNDBUF", sndbuf,
+				     &warned_sndbuf);
+}
+
+static void lkos_init_opts(void)
+{
+	struct lkos_opt_val *val;
+	const char *str;
+	int i;
+
+	for (i = 0; i < LKOS_OPT_MAX; i++) {
+		val = &lkos_opts_env.val[i];
+		str = getenv(lkos_opt_defs[i].name);
+
+		if (lkos_opt_defs[i].is_str) {
+			if (!str)
+				continue;
+			if (strlen(str) >= sizeof(val->s)) {
+				lkos_warn("%s: %s: too long\n", __func__,
+					  lkos_opt_defs[i].name);
+				continue;
+			}
+			strcpy(val->s, str);
+			val->set = true;
+		} else {
+			val->i = lkos_opt_defs[i].def;
+			if (!str || !*str)
+				continue;
+			val->i = strtoll(str, NULL, 0);
+			val->set = true;
+		}
+	}
+
+	lkos_opts_update(&lkos_opts_env);
+}
+
+static unsigned int lkos_spin_types_thread(void)
+{
+	return lkos_thread_spin_valid ? lkos_thread_spin :
+					lkos_opts_get()->spin_types;
+}
+
+/* statistics
+ *
+ * With LKOS_STATS set, the intercepted calls keep counters in a segment
+ * /dev/shm/lkos_stats.<pid>, laid out as struct lkos_stats, that
+ * lkos_stackdump reads while the process runs. Each thread takes a row
+ * of counters per stack, each in a cache line of its own, and updates it
+ * with plain stores: no atomics, locks or syscalls. Threads past
+ * LKOS_STATS_THREADS share the last rows, with atomic adds. Per-fd
+ * counters are updated in place, and may miss counts while threads use
+ * one fd at the same time.
+ *
+ * A call counts in the stack of its fd. Timestamp conversions and spins
+ * count in the stack of the call in progress in the thread, and waits in
+ * the default stack. Other fds, and sockets of ONLOAD_DONT_ACCELERATE
+ * stacks, are not counted.
+ *
+ * The segment is created at the first counted call, in the child after
+ * fork too, and removed at exit. Processes that make no calls, such as a
+ * shell, have none. A process that ends in _exit, or in exec after its
+ * first call, leaves its segment behind.
+ */
+
+static bool lkos_stats_on;			/* LKOS_STATS */
+static struct lkos_stats *lkos_stats;		/* once created */
+static int lkos_stats_creating;
+static char lkos_stats_names[LKOS_STATS_STACKS][LKOS_STATS_NAME_LEN];
+static __thread struct lkos_stats_thread *lkos_stats_self;
+static __thread struct lkos_stats_row *lkos_stats_call;	/* in progress */
+
+static struct lkos_stats_thread *lkos_stats_thread(void)
+{
+	uint32_t i;
+
+	if (lkos_stats_self)
+		return lkos_stats_self;
+
+	i = __atomic_fetch_add(&lkos_stats->threads, 1, __ATOMIC_RELAXED);
+	if (i >= LKOS_STATS_THREADS)
+		i = LKOS_STATS_THREADS - 1;
+	lkos_stats_self = &lkos_stats->thread[i];
+	return lkos_stats_self;
+}
+
+static inline void lkos_stat_add(struct lkos_stats_row *row, int stat,
+				 uint64_t val)
+{
+	if (lkos_stats_self == &lkos_stats->thread[LKOS_STATS_THREADS - 1])
+		__atomic_add_fetch(&row->val[stat], val, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&row->val[stat], row->val[stat] + val,
+				 __ATOMIC_RELAXED);
+}
+
+/* Count in the stack of the call in progress, if any */
+static inline void lkos_stat_call(int stat)
+{
+	if (lkos_stats_call)
+		lkos_stat_add(lkos_stats_call, stat, 1);
+}
+
+static struct lkos_stats_fd *lkos_stats_fd(int fd)
+{
+	return lkos_stats && fd >= 0 && fd < LKOS_STATS_FDS ?
+	       &lkos_stats->fd[fd] : NULL;
+}
+
+/* fd is closed, or is a new socket of domain, type and stack */
+static void lkos_stats_fd_init(int fd, int domain, int type, int stack)
+{
+	struct lkos_stats_fd *sfd = lkos_stats_fd(fd);
+	uint32_t fds;
+
+	if (!sfd)
+		return;
+
+	memset(sfd, 0, sizeof(*sfd));
+	if (!domain || stack < 0)
+		return;
+
+	sfd->domain = domain;
+	sfd->type = type;
+	sfd->stack = stack;
+
+	fds = __atomic_load_n(&lkos_stats->fds, __ATOMIC_RELAXED);
+	while (fds <= fd &&
+	       !__atomic_compare_exchange_n(&lkos_stats->fds, &fds, fd + 1,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* fd moved to stack */
+static void lkos_stats_fd_stack(int fd, int stack)
+{
+	struct lkos_stats_fd *sfd = lkos_stats_fd(fd);
+
+	if (!sfd || !sfd->domain)
+		return;
+
+	if (stack < 0)
+		memset(sfd, 0, sizeof(*sfd));
+	else
+		__atomic_store_n(&sfd->stack, stack, __ATOMIC_RELAXED);
+}
+
+/* A named stack was created with id */
+static void lkos_stats_stack(int id, const char *name)
+{
+	if (!lkos_stats_on || id >= LKOS_STATS_STACKS)
+		return;
+
+	snprintf(lkos_stats_names[id], LKOS_STATS_NAME_LEN, "%s", name);
+	if (lkos_stats)
+		memcpy(lkos_stats->stack_name[id], lkos_stats_names[id],
+		       LKOS_STATS_NAME_LEN);
+}
+
+static struct lkos_stats *lkos_stats_open(void)
+{
+	char name[LKOS_STATS_NAME_LEN];
+	struct lkos_stats *stats;
+	int fd;
+
+	snprintf(name, sizeof(name), "/lkos_stats.%d", getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		goto fail;
+
+	if (ftruncate(fd, sizeof(*stats))) {
+		close_fn(fd);
+		shm_unlink(name);
+		goto fail;
+	}
+
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	close_fn(fd);
+	if (stats == MAP_FAILED) {
+		shm_unlink(name);
+		goto fail;
+	}
+
+	stats->version = LKOS_STATS_VERSION;
+	stats->pid = getpid();
+	memcpy(stats->stack_name, lkos_stats_names, sizeof(lkos_stats_names));
+	__atomic_store_n(&stats->magic, LKOS_STATS_MAGIC, __ATOMIC_RELEASE);
+	return stats;
+
+fail:
+	lkos_warn("stats: %s: %s\n", name, strerror(errno));
+	return NULL;
+}
+
+/* Calls in other threads meanwhile are not counted. Not retried if it
+ * fails.
+ */
+static struct lkos_stats *lkos_stats_create(void)
+{
+	struct lkos_stats *stats;
+	int creating = 0;
+
+	/* set for the life of the process: a load keeps the line shared */
+	if (__atomic_load_n(&lkos_stats_creating, __ATOMIC_RELAXED) ||
+	    !__atomic_compare_exchange_n(&lkos_stats_creating, &creating, 1,
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED))
+		return NULL;
+
+	stats = lkos_stats_open();
+	if (stats)
+		__atomic_store_n(&lkos_stats, stats, __ATOMIC_RELEASE);
+	return stats;
+}
+
+/* A call on fd starts: returns the row to count it in, or NULL */
+static inline struct lkos_stats_row *lkos_stats_begin(int fd)
+{
+	const struct lkos_fd *lfd;
+	int stack;
+
+	if (!__atomic_load_n(&lkos_stats, __ATOMIC_ACQUIRE) &&
+	    (!lkos_stats_on || !lkos_stats_create()))
+		return NULL;
+
+	lfd = lkos_fd_get(fd);
+	if (!lfd || !(__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET))
+		return NULL;
+
+	stack = __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED);
+	if (stack < 0 || stack >= LKOS_STATS_STACKS)
+		return NULL;
+
+	lkos_stats_call = &lkos_stats_thread()->stack[stack];
+	return lkos_stats_call;
+}
+
+static inline void lkos_stats_wait(void)
+{
+	if (!__atomic_load_n(&lkos_stats, __ATOMIC_ACQUIRE) &&
+	    (!lkos_stats_on || !lkos_stats_create()))
+		return;
+
+	lkos_stats_call = &lkos_stats_thread()->stack[LKOS_STACK_DEFAULT];
+	lkos_stat_add(lkos_stats_call, LKOS_STAT_WAIT_CALLS, 1);
+}
+
+/* The call that lkos_stats_begin counts in row returned ret, of bytes
+ * received or sent, or messages if mmsg. Returns ret.
+ */
+static ssize_t lkos_stats_end(struct lkos_stats_row *row, int fd, bool tx,
+			      ssize_t ret, const struct mmsghdr *mmsg)
+{
+	struct lkos_stats_fd *sfd;
+	uint64_t bytes = 0;
+	int bucket;
+	ssize_t i;
+
+	lkos_stats_call = NULL;
+	if (!row)
+		return ret;
+
+	sfd = lkos_stats_fd(fd);
+	if (sfd && !sfd->domain)
+		lkos_stats_fd_init(fd, lkos_fd_get(fd)->domain,
+				   lkos_fd_get(fd)->type, row - lkos_stats_self->stack);
+
+	if (ret < 0) {
+		if (errno == EAGAIN) {
+			lkos_stat_add(row, LKOS_STAT_EAGAIN, 1);
+			if (sfd)
+				__atomic_store_n(&sfd->eagain, sfd->eagain + 1,
+						 __ATOMIC_RELAXED);
+		} else {
+			lkos_stat_add(row, LKOS_STAT_ERRORS, 1);
+		}
+	}
+
+	if (mmsg && !tx) {
+		for (bucket = 0, i = ret; i > 0 && bucket < LKOS_STATS_BATCHES - 1;
+		     i >>= 1)
+			bucket++;
+		lkos_stat_add(row, LKOS_STAT_MMSG_CALLS, 1);
+		lkos_stat_add(row, LKOS_STAT_MMSG_BATCH + bucket, 1);
+		if (ret > 0)
+			lkos_stat_add(row, LKOS_STAT_MMSG_MSGS, ret);
+	}
+
+	if (mmsg) {
+		for (i = 0; i < ret; i++)
+			bytes += mmsg[i].msg_len;
+	} else if (ret > 0) {
+		bytes = ret;
+	}
+
+	lkos_stat_add(row, tx ? LKOS_STAT_TX_CALLS : LKOS_STAT_RX_CALLS, 1);
+	lkos_stat_add(row, tx ? LKOS_STAT_TX_BYTES : LKOS_STAT_RX_BYTES, bytes);
+	if (sfd && tx) {
+		__atomic_store_n(&sfd->tx_calls, sfd->tx_calls + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&sfd->tx_bytes, sfd->tx_bytes + bytes, __ATOMIC_RELAXED);
+	} else if (sfd) {
+		__atomic_store_n(&sfd->rx_calls, sfd->rx_calls + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&sfd->rx_bytes, sfd->rx_bytes + bytes, __ATOMIC_RELAXED);
+	}
+
+	return ret;
+}
+
+/* Count the increment of SO_RXQ_OVFL in the control messages of msg */
+static void lkos_stats_drops(struct lkos_stats_row *row, int fd,
+			     const struct msghdr *msg)
+{
+	struct lkos_stats_fd *sfd = lkos_stats_fd(fd);
+	struct cmsghdr *cm;
+	uint32_t drops;
+
+	if (!row || !sfd || !msg->msg_control || !msg->msg_controllen)
+		return;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR((struct msghdr *)msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL)
+			continue;
+
+		memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+		lkos_stat_add(row, LKOS_STAT_RXQ_DROPS,
+			      (uint32_t)(drops - (uint32_t)sfd->drops));
+		__atomic_store_n(&sfd->drops, drops, __ATOMIC_RELAXED);
+	}
+}
+
+/* The child counts in a segment of its own */
+static void lkos_stats_atfork_child(void)
+{
+	if (lkos_stats)
+		munmap(lkos_stats, sizeof(*lkos_stats));
+	lkos_stats = NULL;
+	lkos_stats_creating = 0;
+	lkos_stats_self = NULL;
+	lkos_stats_call = NULL;
+}
+
+static void __attribute__((destructor)) lkos_fini_stats(void)
+{
+	char name[LKOS_STATS_NAME_LEN];
+
+	if (!lkos_stats)
+		return;
+
+	snprintf(name, sizeof(name), "/lkos_stats.%d", lkos_stats->pid);
+	shm_unlink(name);
+}
+
+static void lkos_init_stats(void)
+{
+	lkos_stats_on = lkos_getenv_long("LKOS_STATS", 0) > 0;
+	if (!lkos_stats_on)
+		return;
+
+	snprintf(lkos_stats_names[LKOS_STACK_DEFAULT], LKOS_STATS_NAME_LEN,
+		 "default");
+	pthread_atfork(NULL, NULL, lkos_stats_atfork_child);
+}
+
+/* busy polling
+ *
+ * Onload spins in userspace. Map its spin settings onto kernel busy
+ * polling, which polls the device queue from the syscall context:
+ *
+ * - EF_POLL_USEC: spin duration, and enables all spin types
+ * - EF_SPIN_USEC: spin duration
+ * - EF_UDP_RECV_SPIN, EF_TCP_RECV_SPIN, EF_EPOLL_SPIN: enable a type
+ *
+ * Busy polling is configured on sockets when they are created, and on
+ * epoll sets, where supported (Linux 6.9+). Both apply to the spin
+ * types enabled on the creating thread. Raising these limits requires
+ * CAP_NET_ADMIN. Without, calls fail and are logged once.
+ *
+ * LKOS_BUSY_POLL_BUDGET and LKOS_PREFER_BUSY_POLL (default 1) tune
+ * the number of packets per poll and whether to defer softirq
+ * processing to the busy polling thread.
+ */
+
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+
+#define EPIOCSPARAMS	_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+struct lkos_busy_poll {
+	int usec;
+	unsigned int types;		/* LKOS_SPIN_* */
+	int budget;
+	bool prefer;
+};
+
+/* The configuration for the calling thread, outside named stacks */
+static void lkos_busy_poll_default(struct lkos_busy_poll *bp)
+{
+	bp->usec = lkos_opts_get()->spin_usec;
+	bp->types = lkos_spin_types_thread();
+	bp->budget = lkos_busy_poll_budget;
+	bp->prefer = lkos_prefer_busy_poll;
+}
+
+static void lkos_busy_poll_socket(int fd, int domain, int type,
+				  const struct lkos_busy_poll *bp)
+{
+	static bool warned_usec, warned_prefer, warned_budget;
+	unsigned int spin;
+	int ret;
+
+	if (domain != AF_INET && domain != AF_INET6)
+		return;
+
+	type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (type == SOCK_DGRAM)
+		spin = LKOS_SPIN_UDP_RECV;
+	else if (type == SOCK_STREAM)
+		spin = LKOS_SPIN_TCP_RECV;
+	else
+		return;
+
+	if (!bp->usec || !(bp->types & spin))
+		return;
+
+	ret = lkos_setsockopt_once(fd, SO_BUSY_POLL, "SO_BUSY_POLL", bp->usec,
+				   &warned_usec);
+	if (bp->prefer)
+		lkos_setsockopt_once(fd, SO_PREFER_BUSY_POLL,
+				     "SO_PREFER_BUSY_POLL", 1, &warned_prefer);
+	if (bp->budget)
+		lkos_setsockopt_once(fd, SO_BUSY_POLL_BUDGET,
+				     "SO_BUSY_POLL_BUDGET", bp->budget,
+				     &warned_budget);
+
+	if (!ret)
+		lkos_fd_set_flag(fd, LKOS_FD_BUSY_POLL, true);
+}
+
+/* accepted sockets inherit the listener's busy poll settings */
+static void lkos_busy_poll_accept(int listenfd, int fd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(listenfd);
+
+	if (lfd && __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_BUSY_POLL) {
+		lfd = lkos_fd_get(fd);
+		if (lfd)
+			__atomic_or_fetch(&lfd->state, LKOS_FD_BUSY_POLL,
+					  __ATOMIC_RELEASE);
+	}
+}
+
+static void lkos_busy_poll_epoll(int epfd, const struct lkos_busy_poll *bp)
+{
+	static bool warned;
+	struct epoll_params params = {0};
+
+	if (!bp->usec || !(bp->types & LKOS_SPIN_EPOLL))
+		return;
+
+	params.busy_poll_usecs = bp->usec;
+	params.busy_poll_budget = bp->budget;
+	params.prefer_busy_poll = bp->prefer;
+
+	if (ioctl_fn(epfd, EPIOCSPARAMS, &params) &&
+	    !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+		lkos_warn("%s: EPIOCSPARAMS: %s\n", __func__, strerror(errno));
+}
+
+/* named stacks
+ *
+ * Onload stacks isolate sockets. Here all sockets share the kernel
+ * stack, but a named stack groups sockets onto a CPU set and a busy
+ * poll configuration:
+ *
+ * - SO_INCOMING_CPU: round robin over the stack's CPU set
+ * - busy polling: from the stack options of the thread that creates
+ *   the stack's first socket, as Onload applies options on creation
+ * - SO_INCOMING_NAPI_ID: learned from the first socket with a NAPI id.
+ *   Sockets that arrive on another queue are logged once.
+ *
+ * Sockets created under a stack name, fds passed to onload_move_fd and
+ * connections accepted on a listener in the stack join the stack.
+ * Epoll sets created under a stack name get its busy poll settings.
+ *
+ * LKOS_STACKS configures stacks by name, overriding the stack options:
+ *   LKOS_STACKS="feed:cpus=0xc,poll_usec=50,budget=16;bulk:cpus=0x3"
+ * with cpus a hex mask and keys poll_usec, budget and prefer. Keys xdp,
+ * xdp_queue and xdp_mode receive UDP through AF_XDP: see AF_XDP receive.
+ *
+ * ONLOAD_SCOPE_THREAD names are private to the thread that sets them.
+ * Other scopes share the name across the process: there is only one
+ * process here to share with. ONLOAD_DONT_ACCELERATE stacks get no
+ * settings.
+ *
+ * The selected stack is packed with a sequence number, so that the
+ * most recent of a thread's and an ONLOAD_ALL_THREADS selection wins.
+ */
+
+#define LKOS_STACK_MAX		64
+#define LKOS_STACK_NAME_LEN	32
+#define LKOS_STACK_SAVE_MAX	16
+
+struct lkos_stack {
+	char name[LKOS_STACK_NAME_LEN];
+	pid_t tid;			/* owner if ONLOAD_SCOPE_THREAD, else 0 */
+	bool ready;			/* opts and bp are set */
+	cpu_set_t cpus;
+	int ncpus;
+	unsigned int next_cpu;		/* round robin over cpus */
+	unsigned int napi_id;		/* learned, 0 if unknown */
+	bool napi_warned;
+
+	/* from LKOS_STACKS, -1 if not set */
+	int conf_usec;
+	int conf_budget;
+	int conf_prefer;
+	char xdp_if[IFNAMSIZ];		/* empty if not set */
+	int xdp_queue;
+	bool xdp_native;
+
+	struct lkos_busy_poll bp;
+	struct lkos_opts opts;
+};
+
+static struct lkos_stack *lkos_stacks[LKOS_STACK_MAX];	/* id - 1 */
+static int lkos_stack_count;
+static pthread_mutex_t lkos_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* selection: sequence number << 8 | (uint8_t)stack. 0 is the default */
+static uint64_t lkos_stack_seq;
+static uint64_t lkos_stack_all;
+static __thread uint64_t lkos_stack_thread;
+static __thread uint64_t lkos_stack_saved[LKOS_STACK_SAVE_MAX];
+static __thread int lkos_stack_nsaved;
+
+static uint64_t lkos_stack_sel(int stack)
+{
+	uint64_t seq = __atomic_add_fetch(&lkos_stack_seq, 1, __ATOMIC_RELAXED);
+
+	return seq << 8 | (uint8_t)stack;
+}
+
+static uint64_t lkos_stack_sel_cur(void)
+{
+	uint64_t all = __atomic_load_n(&lkos_stack_all, __ATOMIC_RELAXED);
+
+	return lkos_stack_thread > all ? lkos_stack_thread : all;
+}
+
+/* Returns the stack selected for the calling thread */
+static int lkos_stack_cur(void)
+{
+	return (int8_t)lkos_stack_sel_cur();
+}
+
+static struct lkos_stack *lkos_stack_get(int stack)
+{
+	if (stack <= 0 || stack > LKOS_STACK_MAX)
+		return NULL;
+
+	return __atomic_load_n(&lkos_stacks[stack - 1], __ATOMIC_ACQUIRE);
+}
+
+/* Parse the LKOS_STACKS entry for st, if any */
+static void lkos_stack_conf(struct lkos_stack *st)
+{
+	char *spec, *entry, *key, *val, *save_entry, *save_key;
+	unsigned long long mask;
+	const char *env;
+	int cpu;
+
+	st->conf_usec = -1;
+	st->conf_budget = -1;
+	st->conf_prefer = -1;
+
+	env = getenv("LKOS_STACKS");
+	if (!env)
+		return;
+
+	spec = strdup(env);
+	if (!spec)
+		return;
+
+	for (entry = strtok_r(spec, ";", &save_entry); entry;
+	     entry = strtok_r(NULL, ";", &save_entry)) {
+		val = strchr(entry, ':');
+		if (!val)
+			continue;
+		*val++ = '\0';
+		if (strcmp(entry, st->name))
+			continue;
+
+		for (key = strtok_r(val, ",", &save_key); key;
+		     key = strtok_r(NULL, ",", &save_key)) {
+			val = strchr(key, '=');
+			if (!val)
+				continue;
+			*val++ = '\0';
+
+			if (!strcmp(key, "cpus")) {
+				mask = strtoull(val, NULL, 16);
+				for (cpu = 0; cpu < 64; cpu++) {
+					if (mask & (1ULL << cpu))
+						CPU_SET(cpu, &st->cpus);
+				}
+				st->ncpus = CPU_COUNT(&st->cpus);
+			} else if (!strcmp(key, "poll_usec")) {
+				st->conf_usec = strtol(val, NULL, 0);
+			} else if (!strcmp(key, "budget")) {
+				st->conf_budget = strtol(val, NULL, 0);
+			} else if (!strcmp(key, "prefer")) {
+				st->conf_prefer = strtol(val, NULL, 0);
+			} else if (!strcmp(key, "xdp")) {
+				snprintf(st->xdp_if, sizeof(st->xdp_if), "%s", val);
+			} else if (!strcmp(key, "xdp_queue")) {
+				st->xdp_queue = strtol(val, NULL, 0);
+			} else if (!strcmp(key, "xdp_mode")) {
+				st->xdp_native = !strcmp(val, "native");
+			} else {
+				lkos_warn("%s: %s: unknown key %s\n", __func__,
+					  st->name, key);
+			}
+		}
+	}
+
+	free(spec);
+}
+
+/* Returns the id of the stack name for tid, creating it if needed.
+ * Negative errno on failure.
+ */
+static int lkos_stack_find(const char *name, pid_t tid)
+{
+	struct lkos_stack *st;
+	int i, ret;
+
+	pthread_mutex_lock(&lkos_stack_lock);
+
+	for (i = 0; i < lkos_stack_count; i++) {
+		st = lkos_stacks[i];
+		if (st->tid == tid && !strcmp(st->name, name)) {
+			ret = i + 1;
+			goto out;
+		}
+	}
+
+	if (lkos_stack_count == LKOS_STACK_MAX) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	strcpy(st->name, name);
+	st->tid = tid;
+	lkos_stack_conf(st);
+
+	__atomic_store_n(&lkos_stacks[lkos_stack_count], st, __ATOMIC_RELEASE);
+	ret = ++lkos_stack_count;
+	lkos_stats_stack(ret, name);
+
+out:
+	pthread_mutex_unlock(&lkos_stack_lock);
+	return ret;
+}
+
+/* Snapshot the stack options on first use, as Onload on creation */
+static void lkos_stack_init(struct lkos_stack *st)
+{
+	if (__atomic_load_n(&st->ready, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&lkos_stack_lock);
+	if (!st->ready) {
+		st->opts = *lkos_opts_get();
+		lkos_busy_poll_default(&st->bp);
+
+		if (st->conf_usec >= 0) {
+			st->bp.usec = st->conf_usec;
+			if (!st->bp.types)
+				st->bp.types = LKOS_SPIN_ALL;
+		}
+		if (st->conf_budget >= 0 && st->conf_budget <= UINT16_MAX)
+			st->bp.budget = st->conf_budget;
+		if (st->conf_prefer >= 0)
+			st->bp.prefer = st->conf_prefer;
+
+		lkos_log("stack %s: %d cpus, busy poll %d usec, types 0x%x\n",
+			 st->name, st->ncpus, st->bp.usec, st->bp.types);
+		__atomic_store_n(&st->ready, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lkos_stack_lock);
+}
+
+/* Record the queue of fd in its stack, or warn once if it differs */
+static void lkos_stack_napi(struct lkos_stack *st, int fd)
+{
+	unsigned int napi_id, expected = 0;
+	socklen_t slen = sizeof(napi_id);
+
+	if (getsockopt_fn(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &slen) ||
+	    !napi_id)
+		return;
+
+	if (__atomic_compare_exchange_n(&st->napi_id, &expected, napi_id, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+	    expected == napi_id)
+		return;
+
+	if (!__atomic_exchange_n(&st->napi_warned, true, __ATOMIC_RELAXED))
+		lkos_warn("stack %s: fd %d on napi %u, stack on napi %u\n",
+			  st->name, fd, napi_id, expected);
+}
+
+/* Apply the settings of stack to socket fd */
+static void lkos_stack_apply(int fd, int domain, int type, int stack)
+{
+	static bool warned_cpu;
+	struct lkos_busy_poll bp;
+	struct lkos_stack *st;
+	unsigned int i, n;
+	int cpu;
+
+	lkos_fd_set_stack(fd, stack);
+
+	if (stack == LKOS_STACK_NONACCEL)
+		return;
+
+	st = lkos_stack_get(stack);
+	if (!st) {
+		lkos_busy_poll_default(&bp);
+		lkos_busy_poll_socket(fd, domain, type, &bp);
+		lkos_opts_socket(fd, domain, type, lkos_opts_get());
+		return;
+	}
+
+	lkos_stack_init(st);
+	lkos_busy_poll_socket(fd, domain, type, &st->bp);
+	lkos_opts_socket(fd, domain, type, &st->opts);
+
+	if (st->ncpus && (domain == AF_INET || domain == AF_INET6)) {
+		n = __atomic_fetch_add(&st->next_cpu, 1, __ATOMIC_RELAXED) %
+		    st->ncpus;
+		for (cpu = 0, i = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &st->cpus) && i++ == n)
+				break;
+		}
+		lkos_setsockopt_once(fd, SO_INCOMING_CPU, "SO_INCOMING_CPU",
+				     cpu, &warned_cpu);
+	}
+}
+
+static void lkos_stack_socket(int fd, int domain, int type)
+{
+	lkos_stack_apply(fd, domain, type, lkos_stack_cur());
+}
+
+static void lkos_stack_epoll(int epfd)
+{
+	struct lkos_stack *st;
+	struct lkos_busy_poll bp;
+	int stack;
+
+	stack = lkos_stack_cur();
+	if (stack == LKOS_STACK_NONACCEL)
+		return;
+
+	st = lkos_stack_get(stack);
+	if (st) {
+		lkos_stack_init(st);
+		lkos_busy_poll_epoll(epfd, &st->bp);
+	} else {
+		lkos_busy_poll_default(&bp);
+		lkos_busy_poll_epoll(epfd, &bp);
+	}
+}
+
+/* Learn the queue of a socket in a named stack, once it is in use */
+static void lkos_stack_fd_napi(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_stack *st;
+
+	if (!lfd || !(__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET))
+		return;
+
+	st = lkos_stack_get(__atomic_load_n(&lfd->stack, __ATOMIC_RELAXED));
+	if (st)
+		lkos_stack_napi(st, fd);
+}
+
+/* userspace spinning
+ *
+ * Kernel busy polling only helps if the socket's NAPI id is known, and
+ * still costs a syscall per iteration. With LKOS_USER_SPIN=1, blocking
+ * receive, accept and epoll calls instead first poll without blocking
+ * for the spin duration, then fall back to the blocking call.
+ *
+ * Threads that select spin types with onload_thread_set_spin spin in
+ * userspace for those types, also without LKOS_USER_SPIN. Other
+ * threads spin for the types enabled in the environment.
+ *
+ * The deadline is checked against the TSC, calibrated on first use.
+ * Sockets not created through this library, or with O_NONBLOCK, do
+ * not spin.
+ */
+
+#define LKOS_SPIN_USEC_DEFAULT	50
+
+static bool lkos_user_spin;
+static pthread_once_t lkos_tsc_once = PTHREAD_ONCE_INIT;
+static uint64_t lkos_tsc_per_usec;
+static uint64_t lkos_spin_cycles;
+static uint64_t lkos_spin_hits;
+static uint64_t lkos_spin_misses;
+
+static inline uint64_t lkos_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL * 1000 * 1000 + ts.tv_nsec;
+#endif
+}
+
+static inline void lkos_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+static uint64_t lkos_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000ULL * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void lkos_init_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t ns0, ns1, tsc0, tsc1;
+
+	ns0 = lkos_clock_ns(CLOCK_MONOTONIC_RAW);
+	tsc0 = lkos_tsc();
+	do {
+		ns1 = lkos_clock_ns(CLOCK_MONOTONIC_RAW);
+	} while (ns1 - ns0 < 2 * 1000 * 1000);
+	tsc1 = lkos_tsc();
+
+	lkos_tsc_per_usec = (tsc1 - tsc0) * 1000 / (ns1 - ns0);
+	if (!lkos_tsc_per_usec)
+		lkos_tsc_per_usec = 1;
+#else
+	lkos_tsc_per_usec = 1000;
+#endif
+
+	lkos_spin_cycles = (lkos_spin_usec ? : LKOS_SPIN_USEC_DEFAULT) *
+			   lkos_tsc_per_usec;
+}
+
+/* Returns the deadline for a call of spin type, or 0 to not spin */
+static uint64_t lkos_spin_deadline(unsigned int spin)
+{
+	unsigned int types;
+
+	if (lkos_thread_spin_valid)
+		types = lkos_thread_spin;
+	else if (lkos_user_spin)
+		types = lkos_spin_types;
+	else
+		return 0;
+
+	if (!(types & spin))
+		return 0;
+
+	return lkos_tsc() + lkos_spin_cycles;
+}
+
+/* As lkos_spin_deadline, for a blocking call on fd: spin type
+ * spin_dgram on datagram sockets, spin_stream on stream sockets.
+ * MSG_WAITALL receives do not spin, as they would return partial data.
+ */
+static uint64_t lkos_spin_deadline_fd(int fd, unsigned int spin_dgram,
+				      unsigned int spin_stream, int flags)
+{
+	const struct lkos_fd *lfd;
+	unsigned int state;
+
+	if ((!lkos_user_spin && !lkos_thread_spin_valid) ||
+	    (flags & (MSG_DONTWAIT | MSG_WAITALL)))
+		return 0;
+
+	lfd = lkos_fd_get(fd);
+	if (!lfd)
+		return 0;
+
+	state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+	if ((state & (LKOS_FD_SOCKET | LKOS_FD_NONBLOCK)) != LKOS_FD_SOCKET)
+		return 0;
+
+	switch (__atomic_load_n(&lfd->type, __ATOMIC_RELAXED)) {
+	case SOCK_DGRAM:
+		return lkos_spin_deadline(spin_dgram);
+	case SOCK_STREAM:
+		return lkos_spin_deadline(spin_stream);
+	default:
+		return 0;
+	}
+}
+
+/* Returns the timeout remaining from timeout ms after spinning from start */
+static int lkos_spin_timeout(uint64_t start, int timeout)
+{
+	uint64_t elapsed_ms;
+
+	if (timeout <= 0)
+		return timeout;
+
+	elapsed_ms = (lkos_tsc() - start) / lkos_tsc_per_usec / 1000;
+	return elapsed_ms >= timeout ? 0 : timeout - elapsed_ms;
+}
+
+/* Returns whether to spin again. Counts a miss when the deadline passed */
+static inline bool lkos_spin_continue(uint64_t deadline)
+{
+	lkos_cpu_relax();
+
+	if (lkos_tsc() < deadline)
+		return true;
+
+	__atomic_add_fetch(&lkos_spin_misses, 1, __ATOMIC_RELAXED);
+	lkos_stat_call(LKOS_STAT_SPIN_MISSES);
+	return false;
+}
+
+static inline void lkos_spin_hit(void)
+{
+	__atomic_add_fetch(&lkos_spin_hits, 1, __ATOMIC_RELAXED);
+	lkos_stat_call(LKOS_STAT_SPIN_HITS);
+}
+
+/* A non-blocking attempt completed the call, or failed for real. Counts
+ * a hit if it succeeded after an attempt that would have blocked: spun
+ * is set on EAGAIN.
+ */
+static inline bool lkos_spin_done(ssize_t ret, bool *spun)
+{
+	if (ret < 0 && errno == EAGAIN) {
+		*spun = true;
+		return false;
+	}
+
+	if (ret >= 0 && *spun)
+		lkos_spin_hit();
+	return true;
+}
+
+int lkos_get_spin_stats(struct lkos_spin_stats *stats)
+{
+	if (!stats)
+		return -EINVAL;
+
+	stats->hits = __atomic_load_n(&lkos_spin_hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&lkos_spin_misses, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int onload_thread_set_spin(enum onload_spin_type type, int spin)
+{
+	unsigned int bits;
+
+	if ((unsigned int)type >= ONLOAD_SPIN_MAX)
+		return -EINVAL;
+
+	if (type == ONLOAD_SPIN_ALL || type == ONLOAD_SPIN_MIMIC_EF_POLL)
+		bits = LKOS_SPIN_ALL;
+	else
+		bits = 1U << type;
+
+	pthread_once(&lkos_tsc_once, lkos_init_tsc);
+
+	if (!lkos_thread_spin_valid) {
+		lkos_thread_spin = lkos_user_spin ? lkos_spin_types : 0;
+		lkos_thread_spin_valid = true;
+	}
+
+	if (spin)
+		lkos_thread_spin |= bits;
+	else
+		lkos_thread_spin &= ~bits;
+
+	return 0;
+}
+
+int onload_thread_get_spin(unsigned *state)
+{
+	if (!state)
+		return -EINVAL;
+
+	if (lkos_thread_spin_valid)
+		*state = lkos_thread_spin;
+	else
+		*state = lkos_user_spin ? lkos_spin_types : 0;
+
+	return 0;
+}
+
+static void __attribute__((destructor)) lkos_fini_spin(void)
+{
+	if (lkos_user_spin)
+		lkos_log("user spin: %lu hits, %lu misses\n",
+			 (unsigned long)lkos_spin_hits,
+			 (unsigned long)lkos_spin_misses);
+}
+
+static void lkos_init_spin(void)
+{
+	long val;
+
+	/* spin settings from the environment, see lkos_opts_update */
+	lkos_spin_usec = lkos_opts_env.spin_usec;
+	lkos_spin_types = lkos_opts_env.spin_types;
+
+	val = lkos_getenv_long("LKOS_BUSY_POLL_BUDGET", 0);
+	if (val > 0 && val <= UINT16_MAX)
+		lkos_busy_poll_budget = val;
+
+	lkos_prefer_busy_poll = lkos_getenv_long("LKOS_PREFER_BUSY_POLL", 1);
+
+	if (lkos_spin_usec && lkos_spin_types)
+		lkos_log("busy poll: %d usec, types 0x%x\n",
+			 lkos_spin_usec, lkos_spin_types);
+
+	if (lkos_spin_usec && lkos_getenv_long("LKOS_USER_SPIN", 0)) {
+		pthread_once(&lkos_tsc_once, lkos_init_tsc);
+		lkos_user_spin = true;
+		lkos_log("user spin: %d usec, %lu tsc/usec\n",
+			 lkos_spin_usec, (unsigned long)lkos_tsc_per_usec);
+	}
+}
+
+/* logging
+ *
+ * lkos_log and its levels store a binary record, with the call site, the
+ * arguments and the tsc, in a ring of the calling thread: no locks or
+ * syscalls. A background thread formats the records of all rings in tsc
+ * order and writes them in batches every LKOS_LOG_FLUSH_MS, as do
+ * lkos_log_flush and exit. A thread whose ring is full drops records,
+ * and the next batch reports how many.
+ *
+ * Each call site writes at most LKOS_LOG_RATE records per second, and
+ * reports how many it suppressed with its next record.
+ *
+ * Records hold integer, double and pointer arguments, and copies of
+ * strings, up to LKOS_LOG_STR bytes in all. Formats that take other
+ * arguments, records of LKOS_LOG_ERR, and all records with LKOS_LOG_SYNC
+ * set or after exit starts, are written at once, as before.
+ */
+
+#define LKOS_LOG_STR		168	/* bytes of strings per record */
+#define LKOS_LOG_LINE		1024
+#define LKOS_LOG_BATCH		(64 * 1024)
+
+enum lkos_log_kind {
+	LKOS_LOG_KIND_INT,
+	LKOS_LOG_KIND_LONG,
+	LKOS_LOG_KIND_DOUBLE,
+	LKOS_LOG_KIND_STR,
+	LKOS_LOG_KIND_PTR,
+};
+
+struct lkos_log_rec {
+	const struct lkos_log_site *site;
+	uint64_t tsc;
+	uint32_t suppressed;
+	uint64_t arg[LKOS_LOG_ARGS];	/* strings: offset in str */
+	char str[LKOS_LOG_STR];
+};
+
+/* single producer, the owner thread, and single consumer, the drain */
+struct lkos_log_ring {
+	struct lkos_log_ring *next;	/* all rings, never freed */
+	int dead;			/* owner exited: free for another */
+	uint64_t drops;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t end;			/* of the drain in progress */
+	uint64_t drops_seen;
+	struct lkos_log_rec rec[];
+};
+
+enum {
+	LKOS_LOG_INIT,			/* no background thread until init */
+	LKOS_LOG_STOPPED,		/* start at the next record */
+	LKOS_LOG_STARTING,
+	LKOS_LOG_RUNNING,
+};
+
+static bool lkos_log_sync;
+static uint32_t lkos_log_ring_size;	/* records per ring, a power of 2 */
+static long lkos_log_rate;		/* records per second per site */
+static uint64_t lkos_log_rate_tsc;
+static long lkos_log_flush_ms;
+static int lkos_log_state;
+static struct lkos_log_ring *lkos_log_rings;
+static pthread_key_t lkos_log_key;
+static __thread struct lkos_log_ring *lkos_log_self;
+
+/* the drain */
+static pthread_mutex_t lkos_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static char lkos_log_buf[LKOS_LOG_BATCH];
+static uint64_t lkos_log_tsc0;
+static uint64_t lkos_log_real0;		/* usec at lkos_log_tsc0 */
+static uint64_t lkos_log_written;
+static uint64_t lkos_log_suppressed;
+
+/* The kinds of the arguments of fmt, or -1 if a record cannot hold them */
+static int lkos_log_parse(const char *fmt, uint8_t *kind)
+{
+	bool is_long;
+	int n = 0;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%')
+			continue;
+		if (*++fmt == '%')
+			continue;
+
+		fmt += strspn(fmt, "-+ #0123456789.");
+		for (is_long = false; *fmt && strchr("hljzt", *fmt); fmt++)
+			is_long |= *fmt != 'h';
+		if (n == LKOS_LOG_ARGS || !*fmt)
+			return -1;
+
+		switch (*fmt) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+		case 'c':
+			kind[n++] = is_long ? LKOS_LOG_KIND_LONG : LKOS_LOG_KIND_INT;
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			kind[n++] = LKOS_LOG_KIND_DOUBLE;
+			break;
+		case 's':
+			kind[n++] = LKOS_LOG_KIND_STR;
+			break;
+		case 'p':
+			kind[n++] = LKOS_LOG_KIND_PTR;
+			break;
+		default:			/* '*', %n, %L and others */
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+static int lkos_log_nargs(struct lkos_log_site *site)
+{
+	uint8_t kind[LKOS_LOG_ARGS];
+	int nargs;
+
+	if (__atomic_load_n(&site->parsed, __ATOMIC_ACQUIRE))
+		return site->nargs;
+
+	/* racing threads parse alike */
+	nargs = lkos_log_parse(site->fmt, kind);
+	memcpy(site->kind, kind, sizeof(kind));
+	site->nargs = site->level == LKOS_LOG_ERR ? -1 : nargs;
+	__atomic_store_n(&site->parsed, true, __ATOMIC_RELEASE);
+	return site->nargs;
+}
+
+/* Returns true if site is past its rate */
+static bool lkos_log_limited(struct lkos_log_site *site)
+{
+	uint64_t now, window;
+
+	if (!lkos_log_rate)
+		return false;
+
+	now = lkos_tsc();
+	window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	if (now - window >= lkos_log_rate_tsc &&
+	    __atomic_compare_exchange_n(&site->window, &window, now, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < lkos_log_rate)
+		return false;
+
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&lkos_log_suppressed, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static void lkos_log_ring_exit(void *arg)
+{
+	struct lkos_log_ring *ring = arg;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+/* The ring of this thread: that of an exited thread, or a new one */
+static struct lkos_log_ring *lkos_log_ring(void)
+{
+	struct lkos_log_ring *ring;
+	int dead;
+
+	if (lkos_log_self)
+		return lkos_log_self;
+
+	for (ring = __atomic_load_n(&lkos_log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next) {
+		dead = 1;
+		if (__atomic_compare_exchange_n(&ring->dead, &dead, 0, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring) +
+				 lkos_log_ring_size * sizeof(ring->rec[0]));
+		if (!ring)
+			return NULL;
+
+		ring->next = __atomic_load_n(&lkos_log_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&lkos_log_rings, &ring->next,
+						    ring, true, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_setspecific(lkos_log_key, ring);
+	lkos_log_self = ring;
+	return ring;
+}
+
+static void lkos_log_start(void);
+
+static void __lkos_log(struct lkos_log_site *site, const char *fmt, ...)
+{
+	struct lkos_log_ring *ring = NULL;
+	struct lkos_log_rec *rec;
+	uint32_t head, len = 0;
+	int nargs, saved_errno;
+	const char *str;
+	va_list args;
+	size_t n;
+	double d;
+	int i;
+
+	saved_errno = errno;
+	if (lkos_log_limited(site))
+		goto out;
+
+	nargs = lkos_log_nargs(site);
+	if (nargs >= 0 && !__atomic_load_n(&lkos_log_sync, __ATOMIC_RELAXED))
+		ring = lkos_log_ring();
+	if (!ring) {
+		va_start(args, fmt);
+		vdprintf(lkos_log_fd, fmt, args);
+		va_end(args);
+		goto out;
+	}
+
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	    lkos_log_ring_size) {
+		__atomic_store_n(&ring->drops, ring->drops + 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+
+	rec = &ring->rec[head & (lkos_log_ring_size - 1)];
+	rec->site = site;
+	rec->tsc = lkos_tsc();
+	rec->suppressed = 0;
+	if (__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED))
+		rec->suppressed = __atomic_exchange_n(&site->suppressed, 0,
+						      __ATOMIC_RELAXED);
+
+	va_start(args, fmt);
+	for (i = 0; i < nargs; i++) {
+		switch (site->kind[i]) {
+		case LKOS_LOG_KIND_INT:
+			rec->arg[i] = va_arg(args, unsigned int);
+			break;
+		case LKOS_LOG_KIND_LONG:
+			rec->arg[i] = va_arg(args, unsigned long);
+			break;
+		case LKOS_LOG_KIND_DOUBLE:
+			d = va_arg(args, double);
+			memcpy(&rec->arg[i], &d, sizeof(d));
+			break;
+		case LKOS_LOG_KIND_PTR:
+			rec->arg[i] = (uintptr_t)va_arg(args, void *);
+			break;
+		case LKOS_LOG_KIND_STR:
+			/* truncated, the last byte stays '\0' */
+			str = va_arg(args, const char *) ? : "(null)";
+			if (len > LKOS_LOG_STR - 1)
+				len = LKOS_LOG_STR - 1;
+			n = strnlen(str, LKOS_LOG_STR - 1 - len);
+			memcpy(rec->str + len, str, n);
+			rec->str[len + n] = '\0';
+			rec->arg[i] = len;
+			len += n + 1;
+			break;
+		}
+	}
+	va_end(args);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&lkos_log_state, __ATOMIC_RELAXED) == LKOS_LOG_STOPPED)
+		lkos_log_start();
+out:
+	errno = saved_errno;
+}
+
+/* Format rec into buf of size at least LKOS_LOG_LINE. Returns the length */
+static size_t lkos_log_format(char *buf, const struct lkos_log_rec *rec)
+{
+	const char *fmt = rec->site->fmt, *spec;
+	char conv[32];
+	size_t len = 0;
+	int64_t usec;
+	double d;
+	int i = 0;
+
+	usec = lkos_log_real0 + (int64_t)(rec->tsc - lkos_log_tsc0) /
+				(int64_t)(lkos_tsc_per_usec ? : 1);
+	if (rec->suppressed)
+		len += snprintf(buf, LKOS_LOG_LINE,
+				"%ld.%06ld log: %u records suppressed\n",
+				(long)(usec / 1000000), (long)(usec % 1000000),
+				rec->suppressed);
+	len += snprintf(buf + len, LKOS_LOG_LINE - len, "%ld.%06ld ",
+			(long)(usec / 1000000), (long)(usec % 1000000));
+
+	while (*fmt && len < LKOS_LOG_LINE - 1) {
+		if (*fmt != '%' || fmt[1] == '%') {
+			buf[len++] = *fmt;
+			fmt += *fmt == '%' ? 2 : 1;
+			continue;
+		}
+
+		/* the conversion, parsed by lkos_log_parse */
+		spec = fmt++;
+		fmt += strspn(fmt, "-+ #0123456789.hljzt") + 1;
+		snprintf(conv, sizeof(conv), "%.*s", (int)(fmt - spec), spec);
+
+		switch (rec->site->kind[i]) {
+		case LKOS_LOG_KIND_INT:
+			len += snprintf(buf + len, LKOS_LOG_LINE - len, conv,
+					(unsigned int)rec->arg[i]);
+			break;
+		case LKOS_LOG_KIND_LONG:
+			len += snprintf(buf + len, LKOS_LOG_LINE - len, conv,
+					(unsigned long)rec->arg[i]);
+			break;
+		case LKOS_LOG_KIND_DOUBLE:
+			memcpy(&d, &rec->arg[i], sizeof(d));
+			len += snprintf(buf + len, LKOS_LOG_LINE - len, conv, d);
+			break;
+		case LKOS_LOG_KIND_PTR:
+			len += snprintf(buf + len, LKOS_LOG_LINE - len, conv,
+					(void *)(uintptr_t)rec->arg[i]);
+			break;
+		case LKOS_LOG_KIND_STR:
+			len += snprintf(buf + len, LKOS_LOG_LINE - len, conv,
+					rec->str + rec->arg[i]);
+			break;
+		}
+		i++;
+	}
+
+	if (len > LKOS_LOG_LINE - 1)
+		len = LKOS_LOG_LINE - 1;
+	return len;
+}
+
+static void lkos_log_write(const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write_fn(lkos_log_fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Write the records in the rings, oldest first, and the drops. Records
+ * added meanwhile wait for the next drain. Returns the number written.
+ */
+static int lkos_log_drain(void)
+{
+	struct lkos_log_ring *ring, *min;
+	const struct lkos_log_rec *rec;
+	size_t len = 0;
+	uint64_t drops;
+	int n = 0;
+
+	if (!write_fn)
+		return 0;
+
+	pthread_mutex_lock(&lkos_log_lock);
+
+	for (ring = __atomic_load_n(&lkos_log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next)
+		ring->end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		min = NULL;
+		for (ring = __atomic_load_n(&lkos_log_rings, __ATOMIC_ACQUIRE);
+		     ring; ring = ring->next) {
+			if (ring->tail == ring->end)
+				continue;
+			if (!min ||
+			    (int64_t)(ring->rec[ring->tail & (lkos_log_ring_size - 1)].tsc -
+				      min->rec[min->tail & (lkos_log_ring_size - 1)].tsc) < 0)
+				min = ring;
+		}
+		if (!min)
+			break;
+
+		if (len > LKOS_LOG_BATCH - 2 * LKOS_LOG_LINE) {
+			lkos_log_write(lkos_log_buf, len);
+			len = 0;
+		}
+		rec = &min->rec[min->tail & (lkos_log_ring_size - 1)];
+		len += lkos_log_format(lkos_log_buf + len, rec);
+		__atomic_store_n(&min->tail, min->tail + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	for (ring = __atomic_load_n(&lkos_log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next) {
+		drops = __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+		if (drops == ring->drops_seen)
+			continue;
+
+		if (len > LKOS_LOG_BATCH - LKOS_LOG_LINE) {
+			lkos_log_write(lkos_log_buf, len);
+			len = 0;
+		}
+		len += snprintf(lkos_log_buf + len, LKOS_LOG_LINE,
+				"log: %lu records dropped\n",
+				(unsigned long)(drops - ring->drops_seen));
+		ring->drops_seen = drops;
+	}
+
+	lkos_log_write(lkos_log_buf, len);
+	lkos_log_written += n;
+	pthread_mutex_unlock(&lkos_log_lock);
+
+	return n;
+}
+
+static void *lkos_log_thread(void *arg)
+{
+	struct timespec ts = {
+		.tv_sec = lkos_log_flush_ms / 1000,
+		.tv_nsec = lkos_log_flush_ms % 1000 * 1000 * 1000,
+	};
+
+	for (;;) {
+		nanosleep(&ts, NULL);
+		lkos_log_drain();
+	}
+
+	return NULL;
+}
+
+/* Start the background thread, with signals blocked. If it fails,
+ * write at once.
+ */
+static void lkos_log_start(void)
+{
+	int state = LKOS_LOG_STOPPED;
+	sigset_t all, old;
+	pthread_t thread;
+
+	if (!__atomic_compare_exchange_n(&lkos_log_state, &state,
+					 LKOS_LOG_STARTING, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&thread, NULL, lkos_log_thread, NULL)) {
+		__atomic_store_n(&lkos_log_sync, true, __ATOMIC_RELAXED);
+		lkos_log_drain();
+	} else {
+		pthread_setname_np(thread, "lkos_log");
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	__atomic_store_n(&lkos_log_state, LKOS_LOG_RUNNING, __ATOMIC_RELAXED);
+}
+
+static void lkos_log_atfork_prepare(void)
+{
+	pthread_mutex_lock(&lkos_log_lock);
+}
+
+static void lkos_log_atfork_parent(void)
+{
+	pthread_mutex_unlock(&lkos_log_lock);
+}
+
+/* The parent writes the records pending at fork. The rings of the other
+ * threads are free, and the child starts its own background thread.
+ */
+static void lkos_log_atfork_child(void)
+{
+	struct lkos_log_ring *ring;
+
+	for (ring = lkos_log_rings; ring; ring = ring->next) {
+		ring->tail = ring->head;
+		ring->drops_seen = ring->drops;
+		if (ring != lkos_log_self)
+			ring->dead = 1;
+	}
+
+	if (lkos_log_state != LKOS_LOG_INIT)
+		lkos_log_state = LKOS_LOG_STOPPED;
+	pthread_mutex_unlock(&lkos_log_lock);
+}
+
+int lkos_log_flush(void)
+{
+	if (!lkos_log_level)
+		return 0;
+
+	return lkos_log_drain();
+}
+
+int lkos_get_log_stats(struct lkos_log_stats *stats)
+{
+	struct lkos_log_ring *ring;
+
+	if (!stats)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->written = __atomic_load_n(&lkos_log_written, __ATOMIC_RELAXED);
+	stats->suppressed = __atomic_load_n(&lkos_log_suppressed,
+					    __ATOMIC_RELAXED);
+	for (ring = __atomic_load_n(&lkos_log_rings, __ATOMIC_ACQUIRE); ring;
+	     ring = ring->next)
+		stats->dropped += __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* After the other destructors, which log. Records logged later are
+ * written at once.
+ */
+static void __attribute__((destructor(101))) lkos_fini_log(void)
+{
+	if (!lkos_log_level)
+		return;
+
+	__atomic_store_n(&lkos_log_sync, true, __ATOMIC_RELAXED);
+	lkos_log_drain();
+}
+
+static int lkos_log_level_parse(const char *str)
+{
+	static const char * const names[] = {
+		[LKOS_LOG_ERR] = "err",
+		[LKOS_LOG_WARN] = "warn",
+		[LKOS_LOG_INFO] = "info",
+		[LKOS_LOG_DEBUG] = "debug",
+	};
+	char *end;
+	long val;
+	int i;
+
+	for (i = LKOS_LOG_ERR; i <= LKOS_LOG_DEBUG; i++) {
+		if (!strcmp(str, names[i]))
+			return i;
+	}
+
+	val = strtol(str, &end, 0);
+	if (*end || val < LKOS_LOG_ERR || val > LKOS_LOG_DEBUG)
+		return LKOS_LOG_INFO;
+	return val;
+}
+
+/* Records are kept from here, and written once lkos_init_log_thread runs */
+static void lkos_init_log(void)
+{
+	unsigned long fd_val;
+	const char *str;
+	long ring_size;
+
+	str = getenv("LKOS_LOG_FD");
+	if (!str)
+		return;
+
+	fd_val = strtoul(str, NULL, 0);
+	if (fd_val > INT_MAX)
+		return;
+
+	lkos_log_fd = (int) fd_val;
+
+	str = getenv("LKOS_LOG_LEVEL");
+	lkos_log_level = str ? lkos_log_level_parse(str) : LKOS_LOG_INFO;
+
+	lkos_log_sync = lkos_getenv_long("LKOS_LOG_SYNC", 0) > 0;
+	lkos_log_rate = lkos_getenv_long("LKOS_LOG_RATE", 100);
+	if (lkos_log_rate < 0)
+		lkos_log_rate = 0;
+	lkos_log_flush_ms = lkos_getenv_long("LKOS_LOG_FLUSH_MS", 100);
+	if (lkos_log_flush_ms <= 0)
+		lkos_log_flush_ms = 100;
+
+	ring_size = lkos_getenv_long("LKOS_LOG_RING", 256);
+	for (lkos_log_ring_size = 16;
+	     lkos_log_ring_size < ring_size && lkos_log_ring_size < (1U << 20);
+	     lkos_log_ring_size <<= 1)
+		;
+
+	if (pthread_key_create(&lkos_log_key, lkos_log_ring_exit))
+		lkos_log_sync = true;
+	pthread_atfork(lkos_log_atfork_prepare, lkos_log_atfork_parent,
+		       lkos_log_atfork_child);
+
+	lkos_log("lk_onload_stub loaded\n");
+}
+
+/* After the calls to the libc are resolved: start the background thread */
+static void lkos_init_log_thread(void)
+{
+	if (!lkos_log_level)
+		return;
+
+	pthread_once(&lkos_tsc_once, lkos_init_tsc);
+	lkos_log_rate_tsc = lkos_tsc_per_usec * 1000 * 1000;
+	lkos_log_tsc0 = lkos_tsc();
+	lkos_log_real0 = lkos_clock_ns(CLOCK_REALTIME) / 1000;
+
+	lkos_log_state = LKOS_LOG_STOPPED;
+	lkos_log_start();
+}
+
+/* zero-copy receive
+ *
+ * onload_zc_recv hands the application buffers from a preallocated
+ * pool, filled with one recvmmsg per batch. Buffers are descriptors in
+ * a static array, on a lock-free freelist: the head packs a tag with
+ * the index, against ABA. No malloc or memcpy per packet.
+ *
+ * Messages of a batch that the callback did not consume, because it
+ * returned ONLOAD_ZC_TERMINATE, stay in a per-fd stash for the next
+ * call. The kernel no longer reports them as readable, so epoll_wait,
+ * poll and select report stashed fds readable (EPOLLIN, level
+ * triggered). recv and friends do not see the stash: do not mix them
+ * with onload_zc_recv on one fd.
+ *
+ * LKOS_ZC_BUFS (default 4096) buffers of LKOS_ZC_BUF_SIZE (default
+ * 2048) bytes, on huge pages with LKOS_ZC_HUGEPAGES=1. Longer messages
+ * are truncated, with MSG_TRUNC.
+ */
+
+#define LKOS_ZC_BATCH		64
+#define LKOS_ZC_CTRL_LEN	256
+
+struct oo_zc_buf {
+	uint32_t next;			/* freelist or send chain: index + 1, or 0 */
+	uint32_t idx;
+};
+
+struct lkos_zc_pool {
+	pthread_once_t once;
+	char *mem;
+	struct oo_zc_buf *bufs;
+	uint32_t nbufs;
+	size_t buf_size;
+	uint64_t free;			/* tag << 32 | (index + 1) */
+};
+
+struct lkos_zc_stash {
+	pthread_mutex_t lock;
+	unsigned int head;		/* first message not yet delivered */
+	unsigned int count;		/* messages not yet delivered */
+	struct mmsghdr mmsg[LKOS_ZC_BATCH];
+	struct iovec iov[LKOS_ZC_BATCH];
+	struct oo_zc_buf *bufs[LKOS_ZC_BATCH];
+	struct sockaddr_storage names[LKOS_ZC_BATCH];
+	char ctrl[LKOS_ZC_BATCH][LKOS_ZC_CTRL_LEN];
+	struct onload_zc_iovec zc_iov;	/* passed to the callback */
+};
+
+static struct lkos_zc_pool lkos_zc_rx = { .once = PTHREAD_ONCE_INIT };
+static struct lkos_zc_pool lkos_zc_tx = { .once = PTHREAD_ONCE_INIT };
+static int lkos_zc_stashed;		/* number of fds with a stash */
+
+/* defined with the intercepted functions */
+static ssize_t lkos_recvmsg(int sockfd, struct msghdr *msg, int flags);
+static int lkos_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+			 int flags, struct timespec *timeout);
+static void __recvmsg_timestamping(struct msghdr *msg);
+static size_t lkos_iov_len(const struct msghdr *msg);
+static int lkos_getsockopt_int(int fd, int level, int optname);
+static int lkos_fd_type(int fd);
+static int lkos_zc_recv(int fd, struct onload_zc_recv_args *args, int flags);
+static ssize_t lkos_sendmsg_rest(int sockfd, const struct msghdr *msg,
+				 int flags, size_t sent);
+
+/* defined with UDP GRO receive */
+static bool lkos_gro_pending(int fd);
+
+/* defined with AF_XDP receive */
+static bool lkos_xdp_pending(int fd);
+
+/* defined with TCP loopback */
+static bool lkos_lo_pending(int fd);
+
+/* defined with multicast fan-out */
+static bool lkos_mc_pending(int fd);
+
+static void lkos_zc_buf_put(struct lkos_zc_pool *pool, struct oo_zc_buf *buf)
+{
+	uint64_t head, next;
+
+	head = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&buf->next, (uint32_t)head, __ATOMIC_RELAXED);
+		next = ((head >> 32) + 1) << 32 | (buf->idx + 1);
+	} while (!__atomic_compare_exchange_n(&pool->free, &head, next, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct oo_zc_buf *lkos_zc_buf_get(struct lkos_zc_pool *pool)
+{
+	struct oo_zc_buf *buf;
+	uint64_t head, next;
+
+	head = __atomic_load_n(&pool->free, __ATOMIC_ACQUIRE);
+	do {
+		if (!(uint32_t)head)
+			return NULL;
+
+		buf = &pool->bufs[(uint32_t)head - 1];
+		next = ((head >> 32) + 1) << 32 |
+		       __atomic_load_n(&buf->next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pool->free, &head, next, true,
+					      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return buf;
+}
+
+static void *lkos_zc_buf_data(const struct lkos_zc_pool *pool,
+			      const struct oo_zc_buf *buf)
+{
+	return pool->mem + (size_t)buf->idx * pool->buf_size;
+}
+
+/* Allocate nbufs buffers of buf_size bytes, on huge pages if huge */
+static void lkos_zc_pool_init(struct lkos_zc_pool *pool, const char *name,
+			      long nbufs, long buf_size, bool huge)
+{
+	size_t len;
+	uint32_t i;
+
+	pool->nbufs = nbufs;
+	pool->buf_size = buf_size;
+
+	pool->bufs = calloc(pool->nbufs, sizeof(*pool->bufs));
+	if (!pool->bufs)
+		return;
+
+	len = (size_t)pool->nbufs * pool->buf_size;
+	pool->mem = MAP_FAILED;
+	if (huge) {
+		pool->mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+				 MAP_POPULATE, -1, 0);
+		if (pool->mem == MAP_FAILED)
+			lkos_warn("%s: huge pages: %s\n", name, strerror(errno));
+	}
+	if (pool->mem == MAP_FAILED)
+		pool->mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+				 -1, 0);
+	if (pool->mem == MAP_FAILED) {
+		lkos_warn("%s: mmap: %s\n", name, strerror(errno));
+		free(pool->bufs);
+		pool->bufs = NULL;
+		return;
+	}
+
+	for (i = 0; i < pool->nbufs; i++) {
+		pool->bufs[i].idx = i;
+		pool->bufs[i].next = i + 2 <= pool->nbufs ? i + 2 : 0;
+	}
+	__atomic_store_n(&pool->free, 1, __ATOMIC_RELEASE);
+
+	lkos_log("%s: %u buffers of %zu bytes\n", name, pool->nbufs,
+		 pool->buf_size);
+}
+
+static void lkos_zc_init_rx(void)
+{
+	long nbufs, buf_size;
+
+	nbufs = lkos_getenv_long("LKOS_ZC_BUFS", 4096);
+	if (nbufs <= 0 || nbufs >= UINT32_MAX)
+		nbufs = 4096;
+	buf_size = lkos_getenv_long("LKOS_ZC_BUF_SIZE", 2048);
+	if (buf_size <= 0 || buf_size > 65536)
+		buf_size = 2048;
+
+	lkos_zc_pool_init(&lkos_zc_rx, "zc rx", nbufs, buf_size,
+			  lkos_getenv_long("LKOS_ZC_HUGEPAGES", 0));
+}
+
+/* The pool a handle from onload_zc_recv or onload_zc_alloc_buffers
+ * belongs to, or NULL
+ */
+static struct lkos_zc_pool *lkos_zc_handle_pool(onload_zc_handle handle)
+{
+	struct lkos_zc_pool *pools[] = { &lkos_zc_rx, &lkos_zc_tx };
+	struct lkos_zc_pool *pool;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+		pool = pools[i];
+		if (pool->bufs && handle >= pool->bufs &&
+		    handle < pool->bufs + pool->nbufs)
+			return pool;
+	}
+
+	return NULL;
+}
+
+static struct lkos_zc_stash *lkos_zc_stash_get(int fd, bool create)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_zc_stash *st, *old = NULL;
+
+	if (!lfd)
+		return NULL;
+
+	st = __atomic_load_n(&lfd->zc, __ATOMIC_ACQUIRE);
+	if (st || !create)
+		return st;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+	pthread_mutex_init(&st->lock, NULL);
+
+	if (!__atomic_compare_exchange_n(&lfd->zc, &old, st, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(st);
+		st = old;
+	}
+
+	return st;
+}
+
+/* Update the count of stashed fds after delivering from st */
+static void lkos_zc_stash_update(struct lkos_zc_stash *st, bool was_stashed)
+{
+	if (!was_stashed && st->count)
+		__atomic_add_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+	else if (was_stashed && !st->count)
+		__atomic_sub_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+}
+
+/* fd is closed: return its stashed buffers */
+static void lkos_zc_close(int fd)
+{
+	struct lkos_zc_stash *st;
+
+	if (!__atomic_load_n(&lkos_zc_stashed, __ATOMIC_RELAXED))
+		return;
+
+	st = lkos_zc_stash_get(fd, false);
+	if (!st)
+		return;
+
+	pthread_mutex_lock(&st->lock);
+	if (st->count) {
+		for (; st->count; st->count--, st->head++)
+			lkos_zc_buf_put(&lkos_zc_rx, st->bufs[st->head]);
+		lkos_zc_stash_update(st, true);
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* Whether fd has data stashed by onload_zc_recv, by UDP GRO receive or
+ * by AF_XDP receive, or in its TCP loopback or multicast ring
+ */
+static bool lkos_zc_pending(int fd)
+{
+	const struct lkos_zc_stash *st = lkos_zc_stash_get(fd, false);
+
+	return (st && __atomic_load_n(&st->count, __ATOMIC_RELAXED)) ||
+	       lkos_gro_pending(fd) || lkos_xdp_pending(fd) ||
+	       lkos_lo_pending(fd) || lkos_mc_pending(fd);
+}
+
+/* Stashed fds in epoll set epfd as EPOLLIN events. Returns the count */
+static int lkos_zc_epoll(int epfd, struct epoll_event *events, int maxevents)
+{
+	struct lkos_epoll *ep;
+	unsigned int i;
+	int fd, n = 0;
+
+	ep = lkos_epoll_get(epfd);
+	if (!ep)
+		return 0;
+
+	pthread_mutex_lock(&ep->lock);
+	for (i = 0; i <= ep->keys_mask && n < maxevents; i++) {
+		fd = ep->keys[i].fd;
+		if (fd < 0 || !(ep->fd_events[fd] & EPOLLIN) ||
+		    !lkos_zc_pending(fd))
+			continue;
+
+		events[n].events = EPOLLIN;
+		events[n].data.u64 = ep->keys[i].data;
+		n++;
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	return n;
+}
+
+/* Merge kernel events after n stashed events. Returns the total */
+static int lkos_zc_epoll_merge(struct epoll_event *events, int n, int ret)
+{
+	int i, j, total = n;
+
+	for (i = n; i < n + ret; i++) {
+		for (j = 0; j < n; j++) {
+			if (events[j].data.u64 == events[i].data.u64) {
+				events[j].events |= events[i].events;
+				break;
+			}
+		}
+		if (j == n)
+			events[total++] = events[i];
+	}
+
+	return total;
+}
+
+static bool lkos_zc_poll_pending(const struct pollfd *fds, nfds_t nfds)
+{
+	nfds_t i;
+
+	for (i = 0; i < nfds; i++) {
+		if ((fds[i].events & POLLIN) && lkos_zc_pending(fds[i].fd))
+			return true;
+	}
+
+	return false;
+}
+
+/* Add stashed fds to the result ret of poll */
+static int lkos_zc_poll_merge(struct pollfd *fds, nfds_t nfds, int ret)
+{
+	nfds_t i;
+
+	for (i = 0; i < nfds; i++) {
+		if (!(fds[i].events & POLLIN) || !lkos_zc_pending(fds[i].fd))
+			continue;
+
+		if (!fds[i].revents)
+			ret++;
+		fds[i].revents |= POLLIN;
+	}
+
+	return ret;
+}
+
+/* Stashed fds in readfds, into pending. Returns whether any */
+static bool lkos_zc_select_pending(int nfds, const fd_set *readfds,
+				   fd_set *pending)
+{
+	bool any = false;
+	int fd;
+
+	FD_ZERO(pending);
+	for (fd = 0; readfds && fd < nfds; fd++) {
+		if (FD_ISSET(fd, readfds) && lkos_zc_pending(fd)) {
+			FD_SET(fd, pending);
+			any = true;
+		}
+	}
+
+	return any;
+}
+
+/* Add pending fds to the result ret of select */
+static int lkos_zc_select_merge(int nfds, fd_set *readfds,
+				const fd_set *pending, int ret)
+{
+	int fd;
+
+	for (fd = 0; fd < nfds; fd++) {
+		if (FD_ISSET(fd, pending) && !FD_ISSET(fd, readfds)) {
+			FD_SET(fd, readfds);
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+/* Receive a batch into st. Returns the number of messages or -errno */
+static int lkos_zc_fill(int fd, struct lkos_zc_stash *st, int flags,
+			bool want_ctrl)
+{
+	struct msghdr *mh;
+	unsigned int n, i;
+	int ret;
+
+	for (n = 0; n < LKOS_ZC_BATCH; n++) {
+		st->bufs[n] = lkos_zc_buf_get(&lkos_zc_rx);
+		if (!st->bufs[n])
+			break;
+
+		st->iov[n].iov_base = lkos_zc_buf_data(&lkos_zc_rx, st->bufs[n]);
+		st->iov[n].iov_len = lkos_zc_rx.buf_size;
+
+		mh = &st->mmsg[n].msg_hdr;
+		mh->msg_name = &st->names[n];
+		mh->msg_namelen = sizeof(st->names[n]);
+		mh->msg_iov = &st->iov[n];
+		mh->msg_iovlen = 1;
+		mh->msg_control = want_ctrl ? st->ctrl[n] : NULL;
+		mh->msg_controllen = want_ctrl ? sizeof(st->ctrl[n]) : 0;
+		mh->msg_flags = 0;
+	}
+	if (!n)
+		return -ENOMEM;
+
+	ret = lkos_recvmmsg(fd, st->mmsg, n, flags, NULL);
+	if (ret < 0)
+		ret = -errno;
+
+	/* a stream at EOF returns empty messages: keep one. Datagrams
+	 * may be empty.
+	 */
+	if (ret > 0 && lkos_fd_type(fd) == SOCK_STREAM) {
+		for (i = 0; i < ret; i++) {
+			if (!st->mmsg[i].msg_len) {
+				ret = i + 1;
+				break;
+			}
+		}
+	}
+
+	for (i = ret > 0 ? ret : 0; i < n; i++)
+		lkos_zc_buf_put(&lkos_zc_rx, st->bufs[i]);
+
+	if (ret > 0 && want_ctrl && lkos_fd_ts_convert(fd)) {
+		for (i = 0; i < ret; i++) {
+			mh = &st->mmsg[i].msg_hdr;
+			if (mh->msg_controllen)
+				__recvmsg_timestamping(mh);
+		}
+	}
+
+	st->head = 0;
+	st->count = ret > 0 ? ret : 0;
+	return ret;
+}
+
+/* Pass the message at the head of st to the callback */
+static enum onload_zc_callback_rc
+lkos_zc_deliver(struct lkos_zc_stash *st, struct onload_zc_recv_args *args,
+		socklen_t namelen, size_t controllen)
+{
+	const struct mmsghdr *m = &st->mmsg[st->head];
+	struct msghdr *mh = &args->msg.msghdr;
+	enum onload_zc_callback_rc rc;
+	int flags = 0;
+
+	st->zc_iov.iov_base = st->iov[st->head].iov_base;
+	st->zc_iov.iov_len = m->msg_len;
+	st->zc_iov.buf = st->bufs[st->head];
+	st->zc_iov.iov_flags = 0;
+
+	args->msg.iov = &st->zc_iov;
+	mh->msg_iov = NULL;
+	mh->msg_iovlen = 1;
+	mh->msg_flags = m->msg_hdr.msg_flags;
+
+	if (mh->msg_name && namelen) {
+		memcpy(mh->msg_name, m->msg_hdr.msg_name,
+		       namelen < m->msg_hdr.msg_namelen ?
+		       namelen : m->msg_hdr.msg_namelen);
+		mh->msg_namelen = m->msg_hdr.msg_namelen;
+	}
+
+	if (mh->msg_control) {
+		if (m->msg_hdr.msg_controllen <= controllen) {
+			memcpy(mh->msg_control, m->msg_hdr.msg_control,
+			       m->msg_hdr.msg_controllen);
+			mh->msg_controllen = m->msg_hdr.msg_controllen;
+		} else {
+			mh->msg_controllen = 0;
+			mh->msg_flags |= MSG_CTRUNC;
+		}
+	}
+
+	if (st->count == 1)
+		flags |= ONLOAD_ZC_END_OF_BURST;
+
+	rc = args->cb(args, flags);
+
+	if (!(rc & ONLOAD_ZC_KEEP))
+		lkos_zc_buf_put(&lkos_zc_rx, st->bufs[st->head]);
+	st->head++;
+	st->count--;
+
+	return rc;
+}
+
+/* Remove control messages of level and type from msg */
+static void lkos_cmsg_remove(struct msghdr *msg, int level, int type)
+{
+	char *out = msg->msg_control;
+	char *end = out + msg->msg_controllen;
+	struct cmsghdr *cm, *next;
+	size_t len;
+
+	if (!out)
+		return;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = next) {
+		next = CMSG_NXTHDR(msg, cm);
+		len = (next ? (char *)next : end) - (char *)cm;
+		if (cm->cmsg_level == level && cm->cmsg_type == type)
+			continue;
+		memmove(out, cm, len);
+		out += len;
+	}
+
+	msg->msg_controllen = out - (char *)msg->msg_control;
+}
+
+/* UDP GRO receive
+ *
+ * With LKOS_UDP_GRO=1, UDP sockets are created with UDP_GRO: the kernel
+ * queues a run of datagrams of one flow as one, with the segment size
+ * in a control message. One pass through the stack and one syscall per
+ * run. The receive calls read a run into a per-fd stash and return its
+ * segments one by one, as the datagrams that were sent: recvmmsg fills
+ * its vector from the stash before it reads the next run. Each segment
+ * has the source address and control messages of the run. That
+ * includes the rx timestamp, which GRO records once per run.
+ *
+ * Stashed fds are readable, as for onload_zc_recv. Applications that
+ * set UDP_GRO themselves receive runs as is. So does onload_zc_recv.
+ * A dup'ed socket turns UDP_GRO off: the stash is per fd. A read from
+ * the kernel runs without the stash lock, so close on another thread
+ * does not wait for it; that read returns one segment, and no stash.
+ */
+
+#define LKOS_GRO_BUF_LEN	(64 << 10)
+#define LKOS_GRO_CTRL_LEN	512
+
+struct lkos_gro {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* signalled when a fill ends */
+	bool filling;			/* a thread reads into buf, unlocked */
+	unsigned int gen;		/* bumped by close */
+	int count;			/* segments not yet returned */
+	int off;			/* offset of the next segment */
+	int len;			/* bytes in buf */
+	int seg;			/* segment size */
+	int flags;			/* msg_flags of the read */
+	socklen_t namelen;
+	size_t controllen;
+	struct sockaddr_storage name;
+	char ctrl[LKOS_GRO_CTRL_LEN] __attribute__((aligned(8)));
+	char buf[LKOS_GRO_BUF_LEN];
+};
+
+static bool lkos_udp_gro;
+
+static struct lkos_gro *lkos_gro_get(int fd, bool create)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_gro *gro, *old = NULL;
+
+	if (!lfd)
+		return NULL;
+
+	gro = __atomic_load_n(&lfd->gro, __ATOMIC_ACQUIRE);
+	if (gro || !create)
+		return gro;
+
+	gro = calloc(1, sizeof(*gro));
+	if (!gro)
+		return NULL;
+	pthread_mutex_init(&gro->lock, NULL);
+	pthread_cond_init(&gro->cond, NULL);
+
+	if (!__atomic_compare_exchange_n(&lfd->gro, &old, gro, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_cond_destroy(&gro->cond);
+		pthread_mutex_destroy(&gro->lock);
+		free(gro);
+		gro = old;
+	}
+
+	return gro;
+}
+
+static bool lkos_gro_pending(int fd)
+{
+	const struct lkos_gro *gro = lkos_gro_get(fd, false);
+
+	return gro && __atomic_load_n(&gro->count, __ATOMIC_RELAXED);
+}
+
+/* Whether receive calls on fd go through the stash */
+static bool lkos_gro_active(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd &&
+	       ((__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_GRO_SPLIT) ||
+		lkos_gro_pending(fd));
+}
+
+static void lkos_gro_set_count(struct lkos_gro *gro, int count)
+{
+	if (!gro->count && count)
+		__atomic_add_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+	else if (gro->count && !count)
+		__atomic_sub_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&gro->count, count, __ATOMIC_RELAXED);
+}
+
+/* fd is a new socket: enable UDP_GRO, to be split */
+static void lkos_gro_socket(int fd, int domain, int type)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	int one = 1;
+
+	if (!lkos_udp_gro || !lfd ||
+	    (domain != AF_INET && domain != AF_INET6) ||
+	    (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_DGRAM ||
+	    __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) == LKOS_STACK_NONACCEL)
+		return;
+
+	if (setsockopt_fn(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)))
+		return;
+
+	lkos_fd_set_flag(fd, LKOS_FD_GRO_SPLIT | LKOS_FD_UDP_GRO, true);
+}
+
+/* fd is closed: drop its stash, and what a read in progress returns
+ * beyond its first segment
+ */
+static void lkos_gro_close(int fd)
+{
+	struct lkos_gro *gro;
+
+	gro = lkos_gro_get(fd, false);
+	if (!gro)
+		return;
+
+	pthread_mutex_lock(&gro->lock);
+	gro->gen++;
+	lkos_gro_set_count(gro, 0);
+	pthread_mutex_unlock(&gro->lock);
+}
+
+/* oldfd is about to be duplicated. The stash is per fd: stop splitting,
+ * so that no fd reads runs. What oldfd stashed, it still returns.
+ */
+static void lkos_gro_dup(int oldfd)
+{
+	int zero = 0;
+
+	if (!lkos_fd_gro_split(oldfd))
+		return;
+
+	setsockopt_fn(oldfd, SOL_UDP, UDP_GRO, &zero, sizeof(zero));
+	lkos_fd_set_flag(oldfd, LKOS_FD_GRO_SPLIT | LKOS_FD_UDP_GRO, false);
+}
+
+/* Read the next run into the stash, without gro->lock: the caller set
+ * gro->filling. Returns its length, or -1. The caller sets the count.
+ */
+static ssize_t lkos_gro_fill(int fd, struct lkos_gro *gro, int flags)
+{
+	struct iovec iov = { gro->buf, sizeof(gro->buf) };
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	ssize_t ret;
+	int seg = 0;
+
+	msg.msg_name = &gro->name;
+	msg.msg_namelen = sizeof(gro->name);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = gro->ctrl;
+	msg.msg_controllen = sizeof(gro->ctrl);
+
+	ret = lkos_recvmsg(fd, &msg, flags & (MSG_DONTWAIT | MSG_CMSG_CLOEXEC));
+	if (ret < 0)
+		return ret;
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+			memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+	}
+	if (seg)
+		lkos_cmsg_remove(&msg, SOL_UDP, UDP_GRO);
+
+	gro->len = ret;
+	gro->off = 0;
+	gro->seg = seg > 0 && seg < ret ? seg : ret;
+	gro->flags = msg.msg_flags;
+	gro->namelen = msg.msg_namelen;
+	gro->controllen = msg.msg_controllen;
+
+	return ret;
+}
+
+/* Copy the next segment to msg, and consume it unless MSG_PEEK.
+ * Returns its length, as recvmsg.
+ */
+static ssize_t lkos_gro_copy(struct lkos_gro *gro, struct msghdr *msg, int flags)
+{
+	int seg, len, n;
+	size_t i;
+
+	seg = gro->len - gro->off < gro->seg ? gro->len - gro->off : gro->seg;
+
+	for (i = 0, len = 0; i < msg->msg_iovlen && len < seg; i++) {
+		n = seg - len;
+		if (msg->msg_iov[i].iov_len < n)
+			n = msg->msg_iov[i].iov_len;
+		memcpy(msg->msg_iov[i].iov_base, gro->buf + gro->off + len, n);
+		len += n;
+	}
+
+	msg->msg_flags = gro->flags & ~MSG_TRUNC;
+	if (len < seg)
+		msg->msg_flags |= MSG_TRUNC;
+
+	if (msg->msg_name) {
+		memcpy(msg->msg_name, &gro->name,
+		       msg->msg_namelen < gro->namelen ?
+		       msg->msg_namelen : gro->namelen);
+		msg->msg_namelen = gro->namelen;
+	}
+
+	if (msg->msg_control) {
+		if (gro->controllen <= msg->msg_controllen) {
+			memcpy(msg->msg_control, gro->ctrl, gro->controllen);
+			msg->msg_controllen = gro->controllen;
+		} else {
+			msg->msg_controllen = 0;
+			msg->msg_flags |= MSG_CTRUNC;
+		}
+	}
+
+	if (!(flags & MSG_PEEK)) {
+		gro->off += seg;
+		lkos_gro_set_count(gro, gro->count - 1);
+	}
+
+	return flags & MSG_TRUNC ? seg : len;
+}
+
+/* recvmsg from the stash, read from the kernel when empty */
+static ssize_t lkos_gro_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_gro *gro;
+	unsigned int gen;
+	ssize_t ret = 0;
+
+	gro = lkos_gro_get(fd, true);
+	if (!gro)
+		return lkos_recvmsg(fd, msg, flags);
+
+	pthread_mutex_lock(&gro->lock);
+
+	/* Do not wait behind a blocking read by another thread */
+	while (!gro->count && gro->filling) {
+		if ((flags & MSG_DONTWAIT) ||
+		    (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_NONBLOCK)) {
+			pthread_mutex_unlock(&gro->lock);
+			errno = EAGAIN;
+			return -1;
+		}
+		pthread_cond_wait(&gro->cond, &gro->lock);
+	}
+	gen = gro->gen;
+
+	/* The read may block: not under the lock, which close takes */
+	if (!gro->count) {
+		gro->filling = true;
+		pthread_mutex_unlock(&gro->lock);
+
+		ret = lkos_gro_fill(fd, gro, flags);
+
+		pthread_mutex_lock(&gro->lock);
+		gro->filling = false;
+		pthread_cond_broadcast(&gro->cond);
+		if (ret >= 0)
+			lkos_gro_set_count(gro, ret ? (ret + gro->seg - 1) / gro->seg : 1);
+	}
+	if (ret >= 0) {
+		ret = lkos_gro_copy(gro, msg, flags);
+		if (gro->gen != gen)
+			lkos_gro_set_count(gro, 0);
+	}
+
+	pthread_mutex_unlock(&gro->lock);
+
+	return ret;
+}
+
+static ssize_t lkos_gro_recvfrom(int fd, void *buf, size_t len, int flags,
+				 struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {0};
+	ssize_t ret;
+
+	msg.msg_name = src_addr;
+	msg.msg_namelen = src_addr && addrlen ? *addrlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ret = lkos_gro_recvmsg(fd, &msg, flags);
+	if (ret >= 0 && src_addr && addrlen)
+		*addrlen = msg.msg_namelen;
+
+	return ret;
+}
+
+/* recvmmsg from the stash. As in Linux, timeout is only checked
+ * after each message.
+ */
+static int lkos_gro_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+			     int flags, struct timespec *timeout)
+{
+	uint64_t end = 0;
+	unsigned int i;
+	ssize_t ret;
+
+	if (timeout)
+		end = lkos_clock_ns(CLOCK_MONOTONIC) +
+		      timeout->tv_sec * 1000ULL * 1000 * 1000 + timeout->tv_nsec;
+
+	for (i = 0; i < vlen; i++) {
+		ret = lkos_gro_recvmsg(fd, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		msgvec[i].msg_len = ret;
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+		if (timeout && lkos_clock_ns(CLOCK_MONOTONIC) >= end)
+			return i + 1;
+	}
+
+	return i;
+}
+
+/* UDP GSO send batching
+ *
+ * With LKOS_UDP_GSO=<usec>, sends on UDP sockets are batched: a run of
+ * datagrams of the same size to the same destination is copied into a
+ * per-fd buffer and sent with one sendmsg with UDP_SEGMENT. One syscall
+ * and one pass through the stack per run, segmented by the device or
+ * late in the stack. The last datagram of a run may be shorter.
+ *
+ * Sends return as soon as the datagram is queued. A run is sent when it
+ * reaches LKOS_GSO_SEGS datagrams or the buffer size, before a send that
+ * does not extend it, before any other intercepted call on the fd
+ * (receive, socket options, connect, close), at exit, and at the
+ * latest usec after its first datagram, by a background thread. Errors
+ * of a send by the thread are returned by the next send on the fd. If
+ * the kernel rejects UDP_SEGMENT, the run is sent one datagram at a
+ * time, and the fd no longer batches. Nor does a dup'ed socket: the
+ * batch is per fd.
+ *
+ * Only plain sends batch: without control messages and with no flags
+ * other than MSG_DONTWAIT and MSG_NOSIGNAL. write and read flush.
+ */
+
+#define LKOS_GSO_BUF_LEN	65000
+#define LKOS_GSO_SEGS		64
+
+struct lkos_gso {
+	pthread_mutex_t lock;
+	struct lkos_gso *next;		/* list of all batches */
+	int fd;
+	int count;			/* datagrams in buf */
+	int seg;			/* length of the first datagram */
+	int len;			/* bytes in buf */
+	int err;			/* error of a send by the thread */
+	uint64_t deadline;		/* send by, CLOCK_MONOTONIC ns */
+	socklen_t namelen;		/* 0 if connected */
+	struct sockaddr_storage name;
+	char buf[LKOS_GSO_BUF_LEN];
+};
+
+static long lkos_gso_usec;
+static struct lkos_gso *lkos_gso_list;
+static int lkos_gso_pending;		/* number of batches not empty */
+static bool lkos_gso_thread_running;
+static pthread_mutex_t lkos_gso_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lkos_gso_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t lkos_gso_dgrams, lkos_gso_sends;
+
+static void *lkos_gso_thread(void *arg);
+
+static struct lkos_gso *lkos_gso_get(int fd, bool create)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_gso *gso, *old = NULL;
+
+	if (!lfd)
+		return NULL;
+
+	gso = __atomic_load_n(&lfd->gso, __ATOMIC_ACQUIRE);
+	if (gso || !create)
+		return gso;
+
+	gso = calloc(1, sizeof(*gso));
+	if (!gso)
+		return NULL;
+	pthread_mutex_init(&gso->lock, NULL);
+	gso->fd = fd;
+
+	if (!__atomic_compare_exchange_n(&lfd->gso, &old, gso, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(gso);
+		return old;
+	}
+
+	pthread_mutex_lock(&lkos_gso_lock);
+	gso->next = lkos_gso_list;
+	__atomic_store_n(&lkos_gso_list, gso, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lkos_gso_lock);
+
+	return gso;
+}
+
+static bool lkos_gso_enabled(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd && (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_GSO);
+}
+
+/* fd is a new socket: batch its sends */
+static void lkos_gso_socket(int fd, int domain, int type)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (lkos_gso_usec <= 0 || !lfd ||
+	    (domain != AF_INET && domain != AF_INET6) ||
+	    (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_DGRAM ||
+	    __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) == LKOS_STACK_NONACCEL)
+		return;
+
+	lkos_fd_set_flag(fd, LKOS_FD_GSO, true);
+}
+
+/* Start the flush thread with the first datagram queued */
+static void lkos_gso_set_count(struct lkos_gso *gso, int count)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (!gso->count && count) {
+		if (__atomic_add_fetch(&lkos_gso_pending, 1, __ATOMIC_RELAXED) == 1) {
+			pthread_mutex_lock(&lkos_gso_lock);
+			if (!lkos_gso_thread_running) {
+				pthread_attr_init(&attr);
+				pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+				lkos_gso_thread_running =
+					!pthread_create(&thread, &attr, lkos_gso_thread, NULL);
+				pthread_attr_destroy(&attr);
+			}
+			pthread_cond_signal(&lkos_gso_cond);
+			pthread_mutex_unlock(&lkos_gso_lock);
+		}
+	} else if (gso->count && !count) {
+		__atomic_sub_fetch(&lkos_gso_pending, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&gso->count, count, __ATOMIC_RELAXED);
+}
+
+/* Send the batch, with gso->lock held. On EAGAIN the batch is kept.
+ * Returns 0 or -1 with errno.
+ */
+static int lkos_gso_flush(struct lkos_gso *gso, int flags)
+{
+	char ctrl[CMSG_SPACE(sizeof(uint16_t))] = {0};
+	struct iovec iov = { gso->buf, gso->len };
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	ssize_t ret;
+	int off;
+
+	if (!gso->count)
+		return 0;
+
+	msg.msg_name = gso->namelen ? &gso->name : NULL;
+	msg.msg_namelen = gso->namelen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (gso->count > 1) {
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cm) = gso->seg;
+	}
+
+	ret = sendmsg_fn(gso->fd, &msg, flags);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return -1;
+
+	if (ret < 0 && gso->count > 1 &&
+	    (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT)) {
+		lkos_warn("udp gso: fd %d: %s, sending datagrams\n", gso->fd,
+			  strerror(errno));
+		lkos_fd_set_flag(gso->fd, LKOS_FD_GSO, false);
+
+		for (off = 0, ret = 0; off < gso->len && ret >= 0; off += gso->seg) {
+			iov.iov_base = gso->buf + off;
+			iov.iov_len = gso->len - off < gso->seg ? gso->len - off : gso->seg;
+			msg.msg_control = NULL;
+			msg.msg_controllen = 0;
+			ret = sendmsg_fn(gso->fd, &msg, flags);
+		}
+	}
+
+	__atomic_add_fetch(&lkos_gso_dgrams, gso->count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&lkos_gso_sends, 1, __ATOMIC_RELAXED);
+	gso->len = 0;
+	lkos_gso_set_count(gso, 0);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Send any batch of fd before another operation on it */
+static void lkos_gso_flush_fd(int fd)
+{
+	struct lkos_gso *gso;
+
+	if (!__atomic_load_n(&lkos_gso_pending, __ATOMIC_RELAXED))
+		return;
+
+	gso = lkos_gso_get(fd, false);
+	if (!gso)
+		return;
+
+	pthread_mutex_lock(&gso->lock);
+	if (lkos_gso_flush(gso, 0) && errno != EAGAIN && errno != EINTR)
+		gso->err = errno;
+	pthread_mutex_unlock(&gso->lock);
+}
+
+/* oldfd is about to be duplicated. The batch is per fd: send it, and
+ * stop batching, so that sends on either fd keep their order.
+ */
+static void lkos_gso_dup(int oldfd)
+{
+	if (!lkos_gso_enabled(oldfd))
+		return;
+
+	lkos_gso_flush_fd(oldfd);
+	lkos_fd_set_flag(oldfd, LKOS_FD_GSO, false);
+}
+
+/* fd is closed: send its batch, forget errors */
+static void lkos_gso_close(int fd)
+{
+	struct lkos_gso *gso = lkos_gso_get(fd, false);
+
+	if (!gso)
+		return;
+
+	pthread_mutex_lock(&gso->lock);
+	lkos_gso_flush(gso, 0);
+	gso->len = 0;
+	lkos_gso_set_count(gso, 0);
+	gso->err = 0;
+	pthread_mutex_unlock(&gso->lock);
+}
+
+/* Queue msg on the batch of fd. Returns whether handled, with the
+ * result of the send in ret. Else the caller sends msg itself.
+ */
+static bool lkos_gso_send(int fd, const struct msghdr *msg, int flags,
+			  ssize_t *ret)
+{
+	struct lkos_gso *gso;
+	size_t len = 0, i;
+
+	for (i = 0; i < msg->msg_iovlen; i++)
+		len += msg->msg_iov[i].iov_len;
+
+	if ((flags & ~(MSG_DONTWAIT | MSG_NOSIGNAL)) || msg->msg_controllen ||
+	    !len || len > LKOS_GSO_BUF_LEN / 2 ||
+	    msg->msg_namelen > sizeof(gso->name)) {
+		lkos_gso_flush_fd(fd);
+		return false;
+	}
+
+	gso = lkos_gso_get(fd, true);
+	if (!gso)
+		return false;
+
+	pthread_mutex_lock(&gso->lock);
+
+	if (gso->err) {
+		errno = gso->err;
+		gso->err = 0;
+		*ret = -1;
+		pthread_mutex_unlock(&gso->lock);
+		return true;
+	}
+
+	/* Does not extend the run: different destination or length, full,
+	 * or after a shorter datagram that ended the run.
+	 */
+	if (gso->count &&
+	    (len > gso->seg || gso->len + len > sizeof(gso->buf) ||
+	     gso->len != gso->count * gso->seg ||
+	     gso->namelen != (msg->msg_name ? msg->msg_namelen : 0) ||
+	     (gso->namelen && memcmp(&gso->name, msg->msg_name, gso->namelen)))) {
+		if (lkos_gso_flush(gso, flags)) {
+			*ret = -1;
+			pthread_mutex_unlock(&gso->lock);
+			return true;
+		}
+	}
+
+	if (!gso->count) {
+		gso->seg = len;
+		gso->namelen = msg->msg_name ? msg->msg_namelen : 0;
+		memcpy(&gso->name, msg->msg_name, gso->namelen);
+		gso->deadline = lkos_clock_ns(CLOCK_MONOTONIC) + lkos_gso_usec * 1000;
+	}
+
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		memcpy(gso->buf + gso->len, msg->msg_iov[i].iov_base,
+		       msg->msg_iov[i].iov_len);
+		gso->len += msg->msg_iov[i].iov_len;
+	}
+	lkos_gso_set_count(gso, gso->count + 1);
+
+	*ret = len;
+	if (gso->count == LKOS_GSO_SEGS && lkos_gso_flush(gso, flags))
+		gso->err = errno;
+
+	pthread_mutex_unlock(&gso->lock);
+	return true;
+}
+
+static bool lkos_gso_sendto(int fd, const void *buf, size_t len, int flags,
+			    const struct sockaddr *dest_addr, socklen_t addrlen,
+			    ssize_t *ret)
+{
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr msg = {0};
+
+	msg.msg_name = (void *)dest_addr;
+	msg.msg_namelen = dest_addr ? addrlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	return lkos_gso_send(fd, &msg, flags, ret);
+}
+
+/* Send batches past their deadline. Sleeps while none are pending */
+static void *lkos_gso_thread(void *arg)
+{
+	struct timespec ts;
+	struct lkos_gso *gso;
+	uint64_t now, next;
+
+	for (;;) {
+		pthread_mutex_lock(&lkos_gso_lock);
+		while (!__atomic_load_n(&lkos_gso_pending, __ATOMIC_RELAXED))
+			pthread_cond_wait(&lkos_gso_cond, &lkos_gso_lock);
+		pthread_mutex_unlock(&lkos_gso_lock);
+
+		now = lkos_clock_ns(CLOCK_MONOTONIC);
+		next = now + lkos_gso_usec * 1000;
+
+		for (gso = __atomic_load_n(&lkos_gso_list, __ATOMIC_ACQUIRE);
+		     gso; gso = gso->next) {
+			if (!__atomic_load_n(&gso->count, __ATOMIC_RELAXED))
+				continue;
+
+			pthread_mutex_lock(&gso->lock);
+			if (gso->count && gso->deadline <= now &&
+			    lkos_gso_flush(gso, MSG_DONTWAIT)) {
+				if (errno == EAGAIN || errno == EINTR)
+					gso->deadline = now + lkos_gso_usec * 1000;
+				else
+					gso->err = errno;
+			}
+			if (gso->count && gso->deadline < next)
+				next = gso->deadline;
+			pthread_mutex_unlock(&gso->lock);
+		}
+
+		ts.tv_sec = next / (1000 * 1000 * 1000);
+		ts.tv_nsec = next % (1000 * 1000 * 1000);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	return NULL;
+}
+
+int lkos_get_gso_stats(struct lkos_gso_stats *stats)
+{
+	if (!stats)
+		return -EINVAL;
+
+	stats->datagrams = __atomic_load_n(&lkos_gso_dgrams, __ATOMIC_RELAXED);
+	stats->sends = __atomic_load_n(&lkos_gso_sends, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* The child has no flush thread. Batches are sent by the parent */
+static void lkos_gso_atfork_child(void)
+{
+	struct lkos_gso *gso;
+
+	pthread_mutex_init(&lkos_gso_lock, NULL);
+	pthread_cond_init(&lkos_gso_cond, NULL);
+	lkos_gso_thread_running = false;
+	for (gso = lkos_gso_list; gso; gso = gso->next) {
+		pthread_mutex_init(&gso->lock, NULL);
+		gso->len = 0;
+		lkos_gso_set_count(gso, 0);
+	}
+}
+
+static void lkos_init_gso(void)
+{
+	lkos_gso_usec = lkos_getenv_long("LKOS_UDP_GSO", 0);
+	if (lkos_gso_usec <= 0)
+		return;
+
+	pthread_atfork(NULL, NULL, lkos_gso_atfork_child);
+	lkos_log("udp gso: flush after %ld usec\n", lkos_gso_usec);
+}
+
+static void __attribute__((destructor)) lkos_fini_gso(void)
+{
+	struct lkos_gso *gso;
+	uint64_t dgrams;
+
+	if (lkos_gso_usec <= 0)
+		return;
+
+	for (gso = __atomic_load_n(&lkos_gso_list, __ATOMIC_ACQUIRE);
+	     gso; gso = gso->next) {
+		pthread_mutex_lock(&gso->lock);
+		lkos_gso_flush(gso, 0);
+		pthread_mutex_unlock(&gso->lock);
+	}
+
+	dgrams = __atomic_load_n(&lkos_gso_dgrams, __ATOMIC_RELAXED);
+	if (dgrams)
+		lkos_log("udp gso: %lu datagrams in %lu sends\n",
+			 (unsigned long)dgrams,
+			 (unsigned long)__atomic_load_n(&lkos_gso_sends,
+							__ATOMIC_RELAXED));
+}
+
+/* io_uring
+ *
+ * With LKOS_IO_URING=1, recv, recvfrom, recvmsg, send, sendto and
+ * sendmsg on TCP and UDP sockets created through the library go through
+ * a per-thread io_uring with a kernel submission thread (SQPOLL). The
+ * call queues a request and polls the completion queue: while the
+ * submission thread is awake, it completes without a syscall. The rings
+ * of all threads share one submission thread (IORING_SETUP_ATTACH_WQ),
+ * which sleeps after LKOS_IO_URING_IDLE (default 100) ms without work.
+ * LKOS_IO_URING_CPU pins it. The caller polls for
+ * LKOS_IO_URING_SPIN (default 20, or 0 on a single cpu) usec before it
+ * sleeps in io_uring_enter.
+ *
+ * Sockets are registered files, at the index of their fd, on first use
+ * by a thread. A registered file holds a reference to the socket: close,
+ * close_range, dup2 and dup3 remove it from all rings. After a close
+ * that bypasses the library, such as a raw syscall, the socket stays
+ * open until socket or accept reuses its fd.
+ *
+ * Requests are non-blocking. A blocking call that would block, and a
+ * send that fails with EPIPE without MSG_NOSIGNAL, fall back to the
+ * syscall: so timeouts, waiting and SIGPIPE are the kernel's. Results,
+ * errno, msg_flags and control messages are as returned by the syscall.
+ * MSG_WAITALL, MSG_ERRQUEUE and the mmsg calls always use the syscall,
+ * as does a call from a signal handler that interrupts another.
+ *
+ * If io_uring is unavailable, the library logs it once and uses the
+ * syscalls.
+ */
+
+#define LKOS_URING_ENTRIES	8
+#define LKOS_URING_FILES	1024
+
+struct lkos_uring {
+	struct lkos_uring *next;	/* list of all rings */
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+	int nfiles;
+	unsigned char *files;		/* fd is registered at index fd */
+};
+
+static bool lkos_uring_on;
+static long lkos_uring_idle_ms;
+static long lkos_uring_cpu;
+static uint64_t lkos_uring_spin_ns;
+static struct lkos_uring *lkos_uring_list;
+static pthread_mutex_t lkos_uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t lkos_uring_key;
+static __thread struct lkos_uring *lkos_uring_thread;
+static __thread bool lkos_uring_busy;	/* in a call on the ring */
+static __thread bool lkos_uring_failed;	/* ring setup failed */
+
+static bool lkos_uring_enabled(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd &&
+	       (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_URING);
+}
+
+/* Set index fd of the registered files of r to file, or -1 to clear */
+static int lkos_uring_files_update(struct lkos_uring *r, int fd, int file)
+{
+	struct io_uring_files_update up = {0};
+
+	up.offset = fd;
+	up.fds = (uintptr_t)&file;
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE,
+		       &up, 1);
+}
+
+static void lkos_uring_free(struct lkos_uring *r)
+{
+	if (r->sq_map)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->cq_map && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->fd >= 0)
+		close_fn(r->fd);
+	free(r->files);
+	free(r);
+}
+
+static void *lkos_uring_mmap(int fd, size_t len, off_t off)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		 fd, off);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* Create a ring, attached to the submission thread of an existing one */
+static struct lkos_uring *lkos_uring_create(void)
+{
+	struct io_uring_params p = {0};
+	struct lkos_uring *r;
+	int i, *files;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	p.flags = IORING_SETUP_SQPOLL;
+	p.sq_thread_idle = lkos_uring_idle_ms;
+	if (lkos_uring_cpu >= 0) {
+		p.flags |= IORING_SETUP_SQ_AFF;
+		p.sq_thread_cpu = lkos_uring_cpu;
+	}
+
+	pthread_mutex_lock(&lkos_uring_lock);
+	if (lkos_uring_list) {
+		p.flags |= IORING_SETUP_ATTACH_WQ;
+		p.wq_fd = lkos_uring_list->fd;
+	}
+	r->fd = syscall(__NR_io_uring_setup, LKOS_URING_ENTRIES, &p);
+	pthread_mutex_unlock(&lkos_uring_lock);
+	if (r->fd < 0) {
+		lkos_warn("io_uring: setup: %s\n", strerror(errno));
+		goto err;
+	}
+
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = r->sq_map_len;
+	}
+	r->sq_map = lkos_uring_mmap(r->fd, r->sq_map_len, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else
+		r->cq_map = lkos_uring_mmap(r->fd, r->cq_map_len,
+					    IORING_OFF_CQ_RING);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = lkos_uring_mmap(r->fd, r->sqes_len, IORING_OFF_SQES);
+	if (!r->sq_map || !r->cq_map || !r->sqes) {
+		lkos_warn("io_uring: mmap: %s\n", strerror(errno));
+		goto err;
+	}
+
+	r->sq_head = r->sq_map + p.sq_off.head;
+	r->sq_tail = r->sq_map + p.sq_off.tail;
+	r->sq_mask = r->sq_map + p.sq_off.ring_mask;
+	r->sq_flags = r->sq_map + p.sq_off.flags;
+	r->sq_array = r->sq_map + p.sq_off.array;
+	r->cq_head = r->cq_map + p.cq_off.head;
+	r->cq_tail = r->cq_map + p.cq_off.tail;
+	r->cq_mask = r->cq_map + p.cq_off.ring_mask;
+	r->cqes = r->cq_map + p.cq_off.cqes;
+
+	/* A sparse table: without it, requests use the fd */
+	r->nfiles = lkos_fd_max < LKOS_URING_FILES ? lkos_fd_max : LKOS_URING_FILES;
+	r->files = calloc(r->nfiles, 1);
+	files = malloc(r->nfiles * sizeof(*files));
+	if (!r->files || !files) {
+		free(files);
+		goto err;
+	}
+	for (i = 0; i < r->nfiles; i++)
+		files[i] = -1;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+		    files, r->nfiles)) {
+		lkos_warn("io_uring: register files: %s\n", strerror(errno));
+		r->nfiles = 0;
+	}
+	free(files);
+
+	pthread_mutex_lock(&lkos_uring_lock);
+	r->next = lkos_uring_list;
+	__atomic_store_n(&lkos_uring_list, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lkos_uring_lock);
+
+	return r;
+
+err:
+	lkos_uring_free(r);
+	return NULL;
+}
+
+/* Returns the ring of this thread, created on first use, or NULL */
+static struct lkos_uring *lkos_uring_get(void)
+{
+	if (lkos_uring_thread || lkos_uring_failed)
+		return lkos_uring_thread;
+
+	lkos_uring_thread = lkos_uring_create();
+	if (!lkos_uring_thread) {
+		lkos_uring_failed = true;
+		/* not a per-thread limit: stop trying in all threads */
+		if (!__atomic_load_n(&lkos_uring_list, __ATOMIC_ACQUIRE)) {
+			lkos_warn("io_uring: unavailable, using syscalls\n");
+			__atomic_store_n(&lkos_uring_on, false, __ATOMIC_RELAXED);
+		}
+		return NULL;
+	}
+
+	pthread_setspecific(lkos_uring_key, lkos_uring_thread);
+	return lkos_uring_thread;
+}
+
+/* Returns the index of fd in the registered files, or -1 */
+static int lkos_uring_file(struct lkos_uring *r, int fd)
+{
+	int ret = -1;
+
+	if (fd >= r->nfiles)
+		return -1;
+	if (__atomic_load_n(&r->files[fd], __ATOMIC_ACQUIRE))
+		return fd;
+
+	pthread_mutex_lock(&lkos_uring_lock);
+	if (lkos_uring_files_update(r, fd, fd) == 1) {
+		__atomic_store_n(&r->files[fd], 1, __ATOMIC_RELEASE);
+		ret = fd;
+	}
+	pthread_mutex_unlock(&lkos_uring_lock);
+
+	return ret;
+}
+
+/* Queue a request and wait for its completion. Returns its result */
+static int lkos_uring_submit(struct lkos_uring *r, const struct io_uring_sqe *req)
+{
+	unsigned int tail, head, idx, flags;
+	uint64_t now, deadline = 0;
+	int ret;
+
+	tail = *r->sq_tail;
+	idx = tail & *r->sq_mask;
+	r->sqes[idx] = *req;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	/* order the tail store before the flags load, as the kernel does */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+		syscall(__NR_io_uring_enter, r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP,
+			NULL, 0);
+
+	head = *r->cq_head;
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		now = lkos_clock_ns(CLOCK_MONOTONIC);
+		if (!deadline)
+			deadline = now + lkos_uring_spin_ns;
+		if (now < deadline) {
+			lkos_cpu_relax();
+			continue;
+		}
+
+		flags = IORING_ENTER_GETEVENTS;
+		if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		syscall(__NR_io_uring_enter, r->fd, 0, 1, flags, NULL, 0);
+	}
+
+	ret = r->cqes[head & *r->cq_mask].res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* A call is blocking unless MSG_DONTWAIT or O_NONBLOCK. O_NONBLOCK is
+ * shared with other fds of the socket: for a shared socket, assume
+ * blocking. A wrong guess costs a syscall, not a different result.
+ */
+static bool lkos_uring_blocking(int fd, int flags)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	unsigned int state;
+
+	if (flags & MSG_DONTWAIT)
+		return false;
+
+	state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+	return !(state & LKOS_FD_NONBLOCK) || lkos_fd_shared(lfd, state);
+}
+
+/* Run op (IORING_OP_RECV or _SEND on buf and len, _RECVMSG or _SENDMSG
+ * on msg) on fd. Returns whether handled, with the result of the call
+ * in ret. Else the caller makes the syscall.
+ */
+static bool lkos_uring_io(int fd, int op, void *buf, size_t len,
+			  struct msghdr *msg, int flags, ssize_t *ret)
+{
+	struct io_uring_sqe sqe = {0};
+	struct lkos_uring *r;
+	bool send = op == IORING_OP_SEND || op == IORING_OP_SENDMSG;
+	int idx, res;
+
+	if (!__atomic_load_n(&lkos_uring_on, __ATOMIC_RELAXED) ||
+	    (flags & (MSG_WAITALL | MSG_ERRQUEUE)) || len > INT_MAX ||
+	    lkos_uring_busy)
+		return false;
+
+	lkos_uring_busy = true;
+
+	r = lkos_uring_get();
+	if (!r) {
+		lkos_uring_busy = false;
+		return false;
+	}
+
+	idx = lkos_uring_file(r, fd);
+	sqe.opcode = op;
+	if (idx >= 0) {
+		sqe.fd = idx;
+		sqe.flags = IOSQE_FIXED_FILE;
+	} else {
+		sqe.fd = fd;
+	}
+	if (msg) {
+		sqe.addr = (uintptr_t)msg;
+		sqe.len = 1;
+	} else {
+		sqe.addr = (uintptr_t)buf;
+		sqe.len = len;
+	}
+	sqe.msg_flags = flags | MSG_DONTWAIT | (send ? MSG_NOSIGNAL : 0);
+
+	res = lkos_uring_submit(r, &sqe);
+	lkos_uring_busy = false;
+
+	if (res == -EAGAIN && lkos_uring_blocking(fd, flags))
+		return false;
+	if (res == -EPIPE && send && !(flags & MSG_NOSIGNAL))
+		return false;
+
+	if (res < 0) {
+		errno = -res;
+		*ret = -1;
+	} else {
+		*ret = res;
+	}
+	return true;
+}
+
+/* The calls on the ring, else the syscalls */
+
+static ssize_t lkos_uring_recv(int fd, void *buf, size_t len, int flags)
+{
+	ssize_t ret;
+
+	if (lkos_uring_enabled(fd) &&
+	    lkos_uring_io(fd, IORING_OP_RECV, buf, len, NULL, flags, &ret))
+		return ret;
+
+	return recv_fn(fd, buf, len, flags);
+}
+
+static ssize_t lkos_uring_recvfrom(int fd, void *buf, size_t len, int flags,
+				   struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {0};
+	ssize_t ret;
+
+	if (!lkos_uring_enabled(fd) || (src_addr && !addrlen))
+		return recvfrom_fn(fd, buf, len, flags, src_addr, addrlen);
+	if (!src_addr)
+		return lkos_uring_recv(fd, buf, len, flags);
+
+	msg.msg_name = src_addr;
+	msg.msg_namelen = *addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (!lkos_uring_io(fd, IORING_OP_RECVMSG, NULL, 0, &msg, flags, &ret))
+		return recvfrom_fn(fd, buf, len, flags, src_addr, addrlen);
+
+	if (ret >= 0)
+		*addrlen = msg.msg_namelen;
+	return ret;
+}
+
+static ssize_t lkos_uring_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	ssize_t ret;
+
+	if (lkos_uring_enabled(fd) &&
+	    lkos_uring_io(fd, IORING_OP_RECVMSG, NULL, 0, msg, flags, &ret))
+		return ret;
+
+	return recvmsg_fn(fd, msg, flags);
+}
+
+/* A blocking send returns when all is sent: send the rest with the syscall */
+static ssize_t lkos_uring_send(int fd, const void *buf, size_t len, int flags)
+{
+	ssize_t ret, more;
+
+	if (!lkos_uring_enabled(fd) ||
+	    !lkos_uring_io(fd, IORING_OP_SEND, (void *)buf, len, NULL, flags,
+			   &ret))
+		return send_fn(fd, buf, len, flags);
+
+	if (ret <= 0 || ret == len || !lkos_uring_blocking(fd, flags))
+		return ret;
+
+	more = send_fn(fd, buf + ret, len - ret, flags);
+	return more > 0 ? ret + more : ret;
+}
+
+static ssize_t lkos_uring_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	ssize_t ret, more;
+
+	if (!lkos_uring_enabled(fd) ||
+	    !lkos_uring_io(fd, IORING_OP_SENDMSG, NULL, 0, (struct msghdr *)msg,
+			   flags, &ret))
+		return sendmsg_fn(fd, msg, flags);
+
+	if (ret <= 0 || ret == lkos_iov_len(msg) ||
+	    !lkos_uring_blocking(fd, flags))
+		return ret;
+
+	more = lkos_sendmsg_rest(fd, msg, flags, ret);
+	return more > 0 ? ret + more : ret;
+}
+
+static ssize_t lkos_uring_sendto(int fd, const void *buf, size_t len, int flags,
+				 const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr msg = {0};
+
+	if (!lkos_uring_enabled(fd))
+		return sendto_fn(fd, buf, len, flags, dest_addr, addrlen);
+	if (!dest_addr)
+		return lkos_uring_send(fd, buf, len, flags);
+
+	msg.msg_name = (void *)dest_addr;
+	msg.msg_namelen = addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	return lkos_uring_sendmsg(fd, &msg, flags);
+}
+
+/* fd is closed, or replaced by dup2: drop the reference of each ring */
+static void lkos_uring_close(int fd)
+{
+	struct lkos_uring *r;
+
+	if (fd < 0 || fd >= LKOS_URING_FILES ||
+	    !__atomic_load_n(&lkos_uring_list, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&lkos_uring_lock);
+	for (r = lkos_uring_list; r; r = r->next) {
+		if (fd < r->nfiles && r->files[fd]) {
+			lkos_uring_files_update(r, fd, -1);
+			__atomic_store_n(&r->files[fd], 0, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&lkos_uring_lock);
+}
+
+/* fd is a new socket, its old registration dropped by socket() */
+static void lkos_uring_socket(int fd, int domain, int type)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (!__atomic_load_n(&lkos_uring_on, __ATOMIC_RELAXED) || !lfd ||
+	    (domain != AF_INET && domain != AF_INET6) ||
+	    ((type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_DGRAM &&
+	     (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) != SOCK_STREAM) ||
+	    __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) == LKOS_STACK_NONACCEL)
+		return;
+
+	lkos_fd_set_flag(fd, LKOS_FD_URING, true);
+}
+
+/* fd was accepted on listenfd */
+static void lkos_uring_accept(int listenfd, int fd)
+{
+	lkos_uring_close(fd);
+
+	if (lkos_uring_enabled(listenfd))
+		lkos_fd_set_flag(fd, LKOS_FD_URING, true);
+}
+
+static void lkos_uring_thread_exit(void *arg)
+{
+	struct lkos_uring *r = arg, **p;
+
+	pthread_mutex_lock(&lkos_uring_lock);
+	for (p = &lkos_uring_list; *p; p = &(*p)->next) {
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lkos_uring_lock);
+
+	lkos_uring_free(r);
+}
+
+/* The rings belong to the parent and its submission thread */
+static void lkos_uring_atfork_child(void)
+{
+	struct lkos_uring *r, *next;
+
+	pthread_mutex_init(&lkos_uring_lock, NULL);
+	for (r = lkos_uring_list; r; r = next) {
+		next = r->next;
+		lkos_uring_free(r);
+	}
+	lkos_uring_list = NULL;
+	lkos_uring_thread = NULL;
+	lkos_uring_failed = false;
+	pthread_setspecific(lkos_uring_key, NULL);
+}
+
+static void lkos_init_uring(void)
+{
+	long spin = 20;
+	cpu_set_t cpus;
+
+	if (lkos_getenv_long("LKOS_IO_URING", 0) <= 0)
+		return;
+
+	lkos_uring_idle_ms = lkos_getenv_long("LKOS_IO_URING_IDLE", 100);
+	lkos_uring_cpu = lkos_getenv_long("LKOS_IO_URING_CPU", -1);
+
+	/* on a single cpu, polling only delays the submission thread */
+	if (!sched_getaffinity(0, sizeof(cpus), &cpus) && CPU_COUNT(&cpus) == 1)
+		spin = 0;
+	lkos_uring_spin_ns = lkos_getenv_long("LKOS_IO_URING_SPIN", spin) * 1000;
+
+	if (pthread_key_create(&lkos_uring_key, lkos_uring_thread_exit))
+		return;
+
+	pthread_atfork(NULL, NULL, lkos_uring_atfork_child);
+	lkos_uring_on = true;
+	lkos_log("io_uring: sqpoll idle %ld ms\n", lkos_uring_idle_ms);
+}
+
+/* AF_XDP receive
+ *
+ * A stack with key xdp in LKOS_STACKS receives UDP on that interface
+ * through AF_XDP, bypassing the kernel stack:
+ *   LKOS_STACKS="feed:xdp=eth1,xdp_queue=0,xdp_mode=generic"
+ * When an IPv4 UDP socket of the stack binds, its port and address are
+ * added to the map of an XDP program on the interface. The program
+ * redirects unfragmented IPv4 UDP packets without options to a
+ * registered port and address, that fit a UMEM frame, into an AF_XDP
+ * socket on queue xdp_queue (default 0), and passes all other traffic
+ * to the kernel. The program, its maps and the AF_XDP
+ * socket are set up on the first bind, once per interface queue, and
+ * stay until exit. xdp_mode generic (the default) works on any device,
+ * veth included; native attaches in the driver and tries zero-copy.
+ *
+ * Frames land in a UMEM of LKOS_XDP_FRAMES buffers, shared by the
+ * sockets of the interface queue. Receive calls move frames from the
+ * rx ring to per-socket queues, and copy out the payload and the source
+ * address. onload_zc_recv passes the payload in place: the handle is
+ * the frame, returned to the fill ring when the callback does not keep
+ * it, or by onload_zc_release_buffers. Frames for a full socket queue
+ * are dropped, as by a full receive buffer, and so are frames with a
+ * wrong UDP checksum, as by the kernel.
+ *
+ * The kernel socket stays bound, and receives traffic from other
+ * interfaces: receive calls read from both. Blocking calls spin on the
+ * rx ring as for LKOS_SPIN_UDP_RECV, then wait in poll on both sockets,
+ * with SO_RCVTIMEO. epoll_wait, poll and select report sockets with
+ * queued frames readable: the AF_XDP socket joins the epoll sets that
+ * the UDP socket is added to, after bind.
+ *
+ * Not supported: control messages (so no rx timestamps), IPv6,
+ * filtering on the connected peer, implicit binds on
+ * connect or send, and dup'ed fds, which read the kernel socket only.
+ * Sockets of one interface queue share its rx ring: a thread may take
+ * the wakeup for another's frames, so serve them from one thread. After
+ * fork the child no longer receives XDP traffic on inherited sockets.
+ * Setup needs CAP_NET_ADMIN and CAP_BPF. On failure the library logs it
+ * once and sockets stay on the kernel path.
+ */
+
+#define LKOS_XDP_FRAMES		4096
+#define LKOS_XDP_FRAME_SIZE	2048
+#define LKOS_XDP_RX_SIZE	2048
+#define LKOS_XDP_COMP_SIZE	64	/* required, unused: no transmit */
+#define LKOS_XDP_SOCK_QLEN	256
+#define LKOS_XDP_PORTS		65536
+#define LKOS_XDP_HDR_LEN	(sizeof(struct ether_header) + \
+				 sizeof(struct iphdr) + sizeof(struct udphdr))
+/* the largest frame that fits a UMEM frame, after the kernel headroom */
+#define LKOS_XDP_FRAME_MAX	(LKOS_XDP_FRAME_SIZE - XDP_PACKET_HEADROOM)
+
+/* A value of the ports map */
+struct lkos_xdp_port {
+	uint32_t on;
+	uint32_t addr;			/* bound address, 0 for any */
+};
+
+struct lkos_xdp_ring {
+	uint32_t *producer, *consumer, *flags;
+	void *desc;
+	uint32_t mask;
+	void *map;
+	size_t map_len;
+};
+
+struct lkos_xdp {
+	struct lkos_xdp *next;		/* list of all interface queues */
+	pthread_mutex_t lock;		/* rings and socket queues */
+	char ifname[IFNAMSIZ];
+	unsigned int ifindex;
+	int queue;
+	bool native;
+	bool failed;			/* setup failed: use the kernel */
+	bool forked;			/* belongs to the parent process */
+	int xsk_fd, ports_fd, xsks_fd, prog_fd, link_fd;
+	char *umem;
+	struct lkos_xdp_ring fill, rx;
+	struct lkos_xdp_sock **socks;	/* by port, in network byte order */
+};
+
+struct lkos_xdp_sock {
+	struct lkos_xdp *x;		/* NULL if not receiving through XDP */
+	uint16_t port;			/* network byte order */
+	unsigned int head;		/* first frame not yet received */
+	unsigned int count;
+	uint64_t addr[LKOS_XDP_SOCK_QLEN];	/* frame offset in the UMEM */
+	uint16_t len[LKOS_XDP_SOCK_QLEN];	/* payload length */
+	struct onload_zc_iovec zc_iov;	/* passed to the callback */
+};
+
+static struct lkos_xdp *lkos_xdp_list;
+static pthread_mutex_t lkos_xdp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int lkos_xdp_sockets;		/* fds receiving through XDP */
+
+static struct lkos_xdp_sock *lkos_xdp_sock_get(int fd, bool create)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_xdp_sock *s, *old = NULL;
+
+	if (!lfd)
+		return NULL;
+
+	s = __atomic_load_n(&lfd->xdp, __ATOMIC_ACQUIRE);
+	if (s || !create)
+		return s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&lfd->xdp, &old, s, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(s);
+		s = old;
+	}
+
+	return s;
+}
+
+/* Returns the queue of fd if it receives through XDP, else NULL */
+static struct lkos_xdp_sock *lkos_xdp_get(int fd)
+{
+	struct lkos_xdp_sock *s;
+	struct lkos_xdp *x;
+
+	if (!__atomic_load_n(&lkos_xdp_sockets, __ATOMIC_RELAXED))
+		return NULL;
+
+	s = lkos_xdp_sock_get(fd, false);
+	if (!s)
+		return NULL;
+
+	x = __atomic_load_n(&s->x, __ATOMIC_ACQUIRE);
+	return x && !x->forked ? s : NULL;
+}
+
+static bool lkos_xdp_pending(int fd)
+{
+	const struct lkos_xdp_sock *s = lkos_xdp_get(fd);
+
+	return s && __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+}
+
+static int lkos_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Create a map with 4 byte keys and values of value_size bytes */
+static int lkos_bpf_map_create_size(enum bpf_map_type type, const char *name,
+				    uint32_t value_size, uint32_t max_entries)
+{
+	union bpf_attr attr = {0};
+
+	attr.map_type = type;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+	snprintf(attr.map_name, sizeof(attr.map_name), "%s", name);
+	return lkos_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/* Create a map with 4 byte keys and values */
+static int lkos_bpf_map_create(enum bpf_map_type type, const char *name,
+			       uint32_t max_entries)
+{
+	return lkos_bpf_map_create_size(type, name, sizeof(uint32_t),
+					max_entries);
+}
+
+static int lkos_bpf_map_set(int map_fd, uint32_t key, const void *value)
+{
+	union bpf_attr attr = {0};
+
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)value;
+	attr.flags = BPF_ANY;
+	return lkos_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int lkos_bpf_map_update(int map_fd, uint32_t key, uint32_t value)
+{
+	return lkos_bpf_map_set(map_fd, key, &value);
+}
+
+#define LKOS_BPF_INSN(_code, _dst, _src, _off, _imm)			\
+	((struct bpf_insn){ .code = (_code), .dst_reg = (_dst),		\
+			    .src_reg = (_src), .off = (_off), .imm = (_imm) })
+
+/* load the map fd into dst: two instructions */
+#define LKOS_BPF_LD_MAP(_dst, _fd)					\
+	LKOS_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, _dst, BPF_PSEUDO_MAP_FD, 0, _fd), \
+	LKOS_BPF_INSN(0, 0, 0, 0, 0)
+
+/* jump offset placeholder: to the final return XDP_PASS */
+#define LKOS_BPF_PASS		0x7fff
+
+/* Load the XDP program. Without libbpf, it is assembled here:
+ *
+ *	if (data + 42 > data_end || data + LKOS_XDP_FRAME_MAX < data_end ||
+ *	    eth->h_proto != htons(ETH_P_IP) ||
+ *	    ip->version_ihl != 0x45 || ip->protocol != IPPROTO_UDP ||
+ *	    ip->frag_off & htons(IP_MF | IP_OFFMASK))
+ *		return XDP_PASS;
+ *	key = udp->dest;
+ *	port = bpf_map_lookup_elem(&ports, &key);
+ *	if (!port || !port->on || (port->addr && port->addr != ip->daddr))
+ *		return XDP_PASS;
+ *	return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ */
+static int lkos_xdp_prog_load(const struct lkos_xdp *x)
+{
+	const int ip = sizeof(struct ether_header);
+	const int udp = ip + sizeof(struct iphdr);
+	struct bpf_insn insns[] = {
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+			      offsetof(struct xdp_md, data), 0),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6,
+			      offsetof(struct xdp_md, data_end), 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+			      LKOS_XDP_HDR_LEN),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3,
+			      LKOS_BPF_PASS, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+			      LKOS_XDP_FRAME_MAX),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_3, BPF_REG_4,
+			      LKOS_BPF_PASS, 0),
+
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			      offsetof(struct ether_header, ether_type), 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0,
+			      LKOS_BPF_PASS, htons(ETHERTYPE_IP)),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, ip, 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0,
+			      LKOS_BPF_PASS, 0x45),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2,
+			      ip + offsetof(struct iphdr, protocol), 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0,
+			      LKOS_BPF_PASS, IPPROTO_UDP),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			      ip + offsetof(struct iphdr, frag_off), 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0,
+			      htons(IP_MF | IP_OFFMASK)),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0,
+			      LKOS_BPF_PASS, 0),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2,
+			      ip + offsetof(struct iphdr, daddr), 0),
+
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_4, BPF_REG_2,
+			      udp + offsetof(struct udphdr, dest), 0),
+		LKOS_BPF_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_4, -4, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+		LKOS_BPF_LD_MAP(BPF_REG_1, x->ports_fd),
+		LKOS_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0,
+			      LKOS_BPF_PASS, 0),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_0,
+			      offsetof(struct lkos_xdp_port, on), 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0,
+			      LKOS_BPF_PASS, 0),
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_0,
+			      offsetof(struct lkos_xdp_port, addr), 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, 1, 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_7,
+			      LKOS_BPF_PASS, 0),
+
+		LKOS_BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+			      offsetof(struct xdp_md, rx_queue_index), 0),
+		LKOS_BPF_LD_MAP(BPF_REG_1, x->xsks_fd),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+		LKOS_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		LKOS_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		LKOS_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	const int n = sizeof(insns) / sizeof(insns[0]);
+	union bpf_attr attr = {0};
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (BPF_CLASS(insns[i].code) == BPF_JMP &&
+		    insns[i].off == LKOS_BPF_PASS)
+			insns[i].off = n - 2 - (i + 1);
+	}
+
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = n;
+	attr.license = (uintptr_t)"GPL";
+	snprintf(attr.prog_name, sizeof(attr.prog_name), "lkos_xdp");
+	return lkos_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int lkos_xdp_ring_mmap(struct lkos_xdp_ring *ring, int fd,
+			      const struct xdp_ring_offset *off,
+			      uint32_t size, size_t desc_size, off_t pgoff)
+{
+	char *map;
+
+	ring->map_len = off->desc + size * desc_size;
+	map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ring->map = map;
+	ring->producer = (uint32_t *)(map + off->producer);
+	ring->consumer = (uint32_t *)(map + off->consumer);
+	ring->flags = (uint32_t *)(map + off->flags);
+	ring->desc = map + off->desc;
+	ring->mask = size - 1;
+	return 0;
+}
+
+/* Create the AF_XDP socket with its UMEM, all frames on the fill ring */
+static int lkos_xdp_xsk(struct lkos_xdp *x)
+{
+	struct sockaddr_xdp sxdp = {0};
+	struct xdp_mmap_offsets off;
+	struct xdp_umem_reg reg = {0};
+	socklen_t optlen = sizeof(off);
+	uint64_t *fill;
+	int size, i;
+
+	x->xsk_fd = socket_fn(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (x->xsk_fd == -1)
+		return -1;
+
+	x->umem = mmap(NULL, LKOS_XDP_FRAMES * LKOS_XDP_FRAME_SIZE,
+		       PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (x->umem == MAP_FAILED) {
+		x->umem = NULL;
+		return -1;
+	}
+
+	reg.addr = (uintptr_t)x->umem;
+	reg.len = LKOS_XDP_FRAMES * LKOS_XDP_FRAME_SIZE;
+	reg.chunk_size = LKOS_XDP_FRAME_SIZE;
+	if (setsockopt_fn(x->xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)))
+		return -1;
+
+	size = LKOS_XDP_FRAMES;
+	if (setsockopt_fn(x->xsk_fd, SOL_XDP, XDP_UMEM_FILL_RING, &size,
+			  sizeof(size)))
+		return -1;
+	size = LKOS_XDP_COMP_SIZE;
+	if (setsockopt_fn(x->xsk_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size,
+			  sizeof(size)))
+		return -1;
+	size = LKOS_XDP_RX_SIZE;
+	if (setsockopt_fn(x->xsk_fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)))
+		return -1;
+
+	if (getsockopt_fn(x->xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+		return -1;
+	if (lkos_xdp_ring_mmap(&x->fill, x->xsk_fd, &off.fr, LKOS_XDP_FRAMES,
+			       sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING))
+		return -1;
+	if (lkos_xdp_ring_mmap(&x->rx, x->xsk_fd, &off.rx, LKOS_XDP_RX_SIZE,
+			       sizeof(struct xdp_desc), XDP_PGOFF_RX_RING))
+		return -1;
+
+	fill = x->fill.desc;
+	for (i = 0; i < LKOS_XDP_FRAMES; i++)
+		fill[i] = (uint64_t)i * LKOS_XDP_FRAME_SIZE;
+	__atomic_store_n(x->fill.producer, LKOS_XDP_FRAMES, __ATOMIC_RELEASE);
+
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = x->ifindex;
+	sxdp.sxdp_queue_id = x->queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+	if (x->native &&
+	    !bind_fn(x->xsk_fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+		return 0;
+
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+	return bind_fn(x->xsk_fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+}
+
+/* Set up the interface queue. Returns the step that failed, or NULL */
+static const char *lkos_xdp_setup(struct lkos_xdp *x)
+{
+	union bpf_attr attr = {0};
+
+	x->ifindex = if_nametoindex(x->ifname);
+	if (!x->ifindex)
+		return "if_nametoindex";
+
+	x->ports_fd = lkos_bpf_map_create_size(BPF_MAP_TYPE_ARRAY, "lkos_ports",
+					       sizeof(struct lkos_xdp_port),
+					       LKOS_XDP_PORTS);
+	if (x->ports_fd == -1)
+		return "ports map";
+	x->xsks_fd = lkos_bpf_map_create(BPF_MAP_TYPE_XSKMAP, "lkos_xsks",
+					 x->queue + 1);
+	if (x->xsks_fd == -1)
+		return "xsks map";
+
+	if (lkos_xdp_xsk(x))
+		return "AF_XDP socket";
+	if (lkos_bpf_map_update(x->xsks_fd, x->queue, x->xsk_fd))
+		return "xsks map update";
+
+	x->prog_fd = lkos_xdp_prog_load(x);
+	if (x->prog_fd == -1)
+		return "program load";
+
+	attr.link_create.prog_fd = x->prog_fd;
+	attr.link_create.target_ifindex = x->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = x->native ? XDP_FLAGS_DRV_MODE :
+					     XDP_FLAGS_SKB_MODE;
+	x->link_fd = lkos_bpf(BPF_LINK_CREATE, &attr);
+	if (x->link_fd == -1)
+		return "attach";
+
+	x->socks = calloc(LKOS_XDP_PORTS, sizeof(*x->socks));
+	if (!x->socks)
+		return "calloc";
+
+	return NULL;
+}
+
+static void lkos_xdp_free(struct lkos_xdp *x)
+{
+	int *fds[] = { &x->link_fd, &x->prog_fd, &x->xsk_fd, &x->xsks_fd,
+		       &x->ports_fd };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] >= 0)
+			close_fn(*fds[i]);
+		*fds[i] = -1;
+	}
+	if (x->rx.map)
+		munmap(x->rx.map, x->rx.map_len);
+	if (x->fill.map)
+		munmap(x->fill.map, x->fill.map_len);
+	if (x->umem)
+		munmap(x->umem, LKOS_XDP_FRAMES * LKOS_XDP_FRAME_SIZE);
+	free(x->socks);
+	x->rx.map = x->fill.map = x->umem = NULL;
+	x->socks = NULL;
+}
+
+/* Returns the interface queue of stack st, set up on first use */
+static struct lkos_xdp *lkos_xdp_ctx(const struct lkos_stack *st)
+{
+	const char *step;
+	struct lkos_xdp *x;
+
+	pthread_mutex_lock(&lkos_xdp_lock);
+
+	for (x = lkos_xdp_list; x; x = x->next) {
+		if (!strcmp(x->ifname, st->xdp_if) && x->queue == st->xdp_queue)
+			goto out;
+	}
+
+	x = calloc(1, sizeof(*x));
+	if (!x)
+		goto out;
+
+	pthread_mutex_init(&x->lock, NULL);
+	strcpy(x->ifname, st->xdp_if);
+	x->queue = st->xdp_queue;
+	x->native = st->xdp_native;
+	x->xsk_fd = x->ports_fd = x->xsks_fd = x->prog_fd = x->link_fd = -1;
+
+	step = lkos_xdp_setup(x);
+	if (step) {
+		lkos_warn("xdp: %s queue %d: %s: %s\n", x->ifname, x->queue,
+			  step, strerror(errno));
+		lkos_xdp_free(x);
+		x->failed = true;
+	} else {
+		lkos_log("xdp: %s queue %d: %s mode\n", x->ifname, x->queue,
+			 x->native ? "native" : "generic");
+	}
+
+	x->next = lkos_xdp_list;
+	__atomic_store_n(&lkos_xdp_list, x, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&lkos_xdp_lock);
+	return x && !x->failed ? x : NULL;
+}
+
+/* Return the frame at addr to the fill ring, which has room for all.
+ * Called with x->lock held.
+ */
+static void lkos_xdp_recycle(struct lkos_xdp *x, uint64_t addr)
+{
+	uint32_t prod = *x->fill.producer;
+	uint64_t *fill = x->fill.desc;
+
+	fill[prod & x->fill.mask] = addr & ~(uint64_t)(LKOS_XDP_FRAME_SIZE - 1);
+	__atomic_store_n(x->fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+/* The driver waits for a syscall to refill its queue */
+static void lkos_xdp_kick(const struct lkos_xdp *x)
+{
+	if (__atomic_load_n(x->fill.flags, __ATOMIC_RELAXED) &
+	    XDP_RING_NEED_WAKEUP)
+		recvfrom_fn(x->xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* Remove the frame at the head of the queue of s. Returns its offset */
+static uint64_t lkos_xdp_pop(struct lkos_xdp_sock *s)
+{
+	uint64_t addr = s->addr[s->head];
+
+	s->head = (s->head + 1) % LKOS_XDP_SOCK_QLEN;
+	__atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELAXED);
+	if (!s->count)
+		__atomic_sub_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+
+	return addr;
+}
+
+/* Whether the UDP checksum of the datagram of len bytes at uh, in iph,
+ * is right or absent
+ */
+static bool lkos_xdp_csum_ok(const struct iphdr *iph, const struct udphdr *uh,
+			     unsigned int len)
+{
+	const uint16_t *p = (const void *)uh;
+	uint16_t last = 0;
+	uint64_t sum;
+	unsigned int i;
+
+	if (!uh->check)
+		return true;
+
+	/* in network order: the sum is the same for either byte order */
+	sum = (iph->saddr & 0xffff) + (iph->saddr >> 16) +
+	      (iph->daddr & 0xffff) + (iph->daddr >> 16) +
+	      htons(IPPROTO_UDP) + htons(len);
+	for (i = 0; i < len / 2; i++)
+		sum += p[i];
+	if (len & 1) {
+		memcpy(&last, (const char *)uh + len - 1, 1);
+		sum += last;
+	}
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum == 0xffff;
+}
+
+/* Move frames from the rx ring to the socket queues. Called with
+ * x->lock held.
+ */
+static void lkos_xdp_drain(struct lkos_xdp *x)
+{
+	const struct xdp_desc *descs = x->rx.desc, *d;
+	const struct iphdr *iph;
+	const struct udphdr *uh;
+	struct lkos_xdp_sock *s;
+	uint32_t cons, prod;
+	unsigned int len;
+	bool recycled = false;
+
+	cons = *x->rx.consumer;
+	prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+	if (cons == prod)
+		return;
+
+	for (; cons != prod; cons++) {
+		d = &descs[cons & x->rx.mask];
+		iph = (void *)(x->umem + d->addr + sizeof(struct ether_header));
+		uh = (void *)(iph + 1);
+		s = x->socks[uh->dest];
+		len = ntohs(uh->len);
+
+		if (!s || s->count == LKOS_XDP_SOCK_QLEN ||
+		    len < sizeof(*uh) ||
+		    len > d->len - LKOS_XDP_HDR_LEN + sizeof(*uh) ||
+		    !lkos_xdp_csum_ok(iph, uh, len)) {
+			lkos_xdp_recycle(x, d->addr);
+			recycled = true;
+			continue;
+		}
+
+		s->addr[(s->head + s->count) % LKOS_XDP_SOCK_QLEN] = d->addr;
+		s->len[(s->head + s->count) % LKOS_XDP_SOCK_QLEN] = len - sizeof(*uh);
+		if (!s->count)
+			__atomic_add_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(x->rx.consumer, cons, __ATOMIC_RELEASE);
+	if (recycled)
+		lkos_xdp_kick(x);
+}
+
+static void lkos_xdp_drain_locked(struct lkos_xdp *x)
+{
+	pthread_mutex_lock(&x->lock);
+	lkos_xdp_drain(x);
+	pthread_mutex_unlock(&x->lock);
+}
+
+/* The source address of the frame at addr */
+static void lkos_xdp_name(const struct lkos_xdp *x, uint64_t addr,
+			  struct sockaddr_in *sin)
+{
+	const char *pkt = x->umem + addr;
+	const struct iphdr *iph = (void *)(pkt + sizeof(struct ether_header));
+	const struct udphdr *uh = (void *)(iph + 1);
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = uh->source;
+	sin->sin_addr.s_addr = iph->saddr;
+}
+
+/* Copy the frame at the head of the queue of s to msg, and consume it
+ * unless MSG_PEEK. Returns its length, as recvmsg. Called with x->lock
+ * held.
+ */
+static ssize_t lkos_xdp_copy(struct lkos_xdp *x, struct lkos_xdp_sock *s,
+			     struct msghdr *msg, int flags)
+{
+	const char *payload = x->umem + s->addr[s->head] + LKOS_XDP_HDR_LEN;
+	int plen = s->len[s->head], len, n;
+	struct sockaddr_in sin;
+	size_t i;
+
+	for (i = 0, len = 0; i < msg->msg_iovlen && len < plen; i++) {
+		n = plen - len;
+		if (msg->msg_iov[i].iov_len < n)
+			n = msg->msg_iov[i].iov_len;
+		memcpy(msg->msg_iov[i].iov_base, payload + len, n);
+		len += n;
+	}
+
+	msg->msg_flags = len < plen ? MSG_TRUNC : 0;
+	msg->msg_controllen = 0;
+
+	if (msg->msg_name) {
+		lkos_xdp_name(x, s->addr[s->head], &sin);
+		memcpy(msg->msg_name, &sin, msg->msg_namelen < sizeof(sin) ?
+		       msg->msg_namelen : sizeof(sin));
+		msg->msg_namelen = sizeof(sin);
+	}
+
+	if (!(flags & MSG_PEEK)) {
+		lkos_xdp_recycle(x, lkos_xdp_pop(s));
+		lkos_xdp_kick(x);
+	}
+
+	return flags & MSG_TRUNC ? plen : len;
+}
+
+static bool lkos_xdp_nonblock(int fd, int flags)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return (flags & MSG_DONTWAIT) ||
+	       (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_NONBLOCK);
+}
+
+/* Wait for traffic on fd or on wake_fd, its AF_XDP socket or another
+ * source of data, until *end: 0 on the first call, then set from
+ * SO_RCVTIMEO. Returns -1 with EAGAIN after *end, or with EINTR.
+ */
+static int lkos_xdp_wait(int fd, int wake_fd, uint64_t *end)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = wake_fd, .events = POLLIN },
+		{ .fd = fd, .events = POLLIN },
+	};
+	uint64_t now = lkos_clock_ns(CLOCK_MONOTONIC);
+	struct timeval tv = {0};
+	socklen_t slen = sizeof(tv);
+	int timeout = -1;
+
+	if (!*end) {
+		*end = UINT64_MAX;
+		if (!getsockopt_fn(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &slen) &&
+		    (tv.tv_sec || tv.tv_usec))
+			*end = now + tv.tv_sec * 1000ULL * 1000 * 1000 +
+			       tv.tv_usec * 1000ULL;
+	}
+
+	if (*end != UINT64_MAX) {
+		if (now >= *end) {
+			errno = EAGAIN;
+			return -1;
+		}
+		timeout = (*end - now + 999999) / 1000000;
+	}
+
+	return poll_fn(pfd, 2, timeout) == -1 ? -1 : 0;
+}
+
+/* recvmsg from the queue of s, else from the kernel socket */
+static ssize_t lkos_xdp_recvmsg(int fd, struct lkos_xdp_sock *s,
+				struct msghdr *msg, int flags)
+{
+	struct lkos_xdp *x = s->x;
+	uint64_t deadline, end = 0;
+	ssize_t ret;
+
+	deadline = lkos_spin_deadline_fd(fd, LKOS_SPIN_UDP_RECV, 0, flags);
+
+	for (;;) {
+		pthread_mutex_lock(&x->lock);
+		lkos_xdp_drain(x);
+		ret = s->count ? lkos_xdp_copy(x, s, msg, flags) : -1;
+		pthread_mutex_unlock(&x->lock);
+		if (ret >= 0)
+			break;
+
+		ret = recvmsg_fn(fd, msg, flags | MSG_DONTWAIT);
+		if (ret >= 0 || errno != EAGAIN || lkos_xdp_nonblock(fd, flags))
+			break;
+
+		if (deadline) {
+			if (lkos_spin_continue(deadline))
+				continue;
+			deadline = 0;
+		}
+
+		ret = lkos_xdp_wait(fd, x->xsk_fd, &end);
+		if (ret)
+			break;
+	}
+
+	if (deadline && ret >= 0)
+		lkos_spin_hit();
+
+	return ret;
+}
+
+static ssize_t lkos_xdp_recvfrom(int fd, struct lkos_xdp_sock *s, void *buf,
+				 size_t len, int flags,
+				 struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {0};
+	ssize_t ret;
+
+	msg.msg_name = src_addr;
+	msg.msg_namelen = src_addr && addrlen ? *addrlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ret = lkos_xdp_recvmsg(fd, s, &msg, flags);
+	if (ret >= 0 && src_addr && addrlen)
+		*addrlen = msg.msg_namelen;
+
+	return ret;
+}
+
+/* As lkos_gro_recvmmsg */
+static int lkos_xdp_recvmmsg(int fd, struct lkos_xdp_sock *s,
+			     struct mmsghdr *msgvec, unsigned int vlen,
+			     int flags, struct timespec *timeout)
+{
+	uint64_t end = 0;
+	unsigned int i;
+	ssize_t ret;
+
+	if (timeout)
+		end = lkos_clock_ns(CLOCK_MONOTONIC) +
+		      timeout->tv_sec * 1000ULL * 1000 * 1000 + timeout->tv_nsec;
+
+	for (i = 0; i < vlen; i++) {
+		ret = lkos_xdp_recvmsg(fd, s, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		msgvec[i].msg_len = ret;
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+		if (timeout && lkos_clock_ns(CLOCK_MONOTONIC) >= end)
+			return i + 1;
+	}
+
+	return i;
+}
+
+/* onload_zc_recv: pass frames in place, then kernel traffic through the
+ * zero-copy receive pool. Waits only if neither has data.
+ */
+static int lkos_xdp_zc_recv(int fd, struct lkos_xdp_sock *s,
+			    struct onload_zc_recv_args *args)
+{
+	struct msghdr *mh = &args->msg.msghdr;
+	enum onload_zc_callback_rc rc;
+	struct lkos_xdp *x = s->x;
+	bool delivered = false;
+	uint64_t addr = 0, end = 0;
+	struct sockaddr_in sin;
+	int cb_flags, len, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&x->lock);
+		lkos_xdp_drain(x);
+		len = -1;
+		if (s->count) {
+			len = s->len[s->head];
+			addr = lkos_xdp_pop(s);
+		}
+		cb_flags = s->count ? 0 : ONLOAD_ZC_END_OF_BURST;
+		pthread_mutex_unlock(&x->lock);
+
+		if (len < 0) {
+			if (delivered)
+				return 0;
+
+			ret = lkos_zc_recv(fd, args, MSG_DONTWAIT);
+			if (ret != -EAGAIN || lkos_xdp_nonblock(fd, args->flags))
+				return ret;
+			if (lkos_xdp_wait(fd, x->xsk_fd, &end))
+				return -errno;
+			continue;
+		}
+
+		s->zc_iov.iov_base = x->umem + addr + LKOS_XDP_HDR_LEN;
+		s->zc_iov.iov_len = len;
+		s->zc_iov.buf = (onload_zc_handle)(x->umem + (addr &
+			~(uint64_t)(LKOS_XDP_FRAME_SIZE - 1)));
+		s->zc_iov.iov_flags = 0;
+
+		args->msg.iov = &s->zc_iov;
+		mh->msg_iov = NULL;
+		mh->msg_iovlen = 1;
+		mh->msg_flags = 0;
+		if (mh->msg_name && mh->msg_namelen) {
+			lkos_xdp_name(x, addr, &sin);
+			memcpy(mh->msg_name, &sin, mh->msg_namelen < sizeof(sin) ?
+			       mh->msg_namelen : sizeof(sin));
+			mh->msg_namelen = sizeof(sin);
+		}
+		if (mh->msg_control)
+			mh->msg_controllen = 0;
+
+		rc = args->cb(args, cb_flags);
+		delivered = true;
+
+		if (!(rc & ONLOAD_ZC_KEEP)) {
+			pthread_mutex_lock(&x->lock);
+			lkos_xdp_recycle(x, addr);
+			lkos_xdp_kick(x);
+			pthread_mutex_unlock(&x->lock);
+		}
+		if (rc & ONLOAD_ZC_TERMINATE)
+			return 0;
+	}
+}
+
+/* Returns the interface queue whose UMEM holds handle, else NULL */
+static struct lkos_xdp *lkos_xdp_handle(onload_zc_handle handle)
+{
+	struct lkos_xdp *x;
+	char *p = (char *)handle;
+
+	for (x = __atomic_load_n(&lkos_xdp_list, __ATOMIC_ACQUIRE); x;
+	     x = x->next) {
+		if (x->umem && p >= x->umem &&
+		    p < x->umem + LKOS_XDP_FRAMES * LKOS_XDP_FRAME_SIZE)
+			return x;
+	}
+
+	return NULL;
+}
+
+/* A frame kept by the onload_zc_recv callback is released */
+static void lkos_xdp_release(struct lkos_xdp *x, onload_zc_handle handle)
+{
+	pthread_mutex_lock(&x->lock);
+	lkos_xdp_recycle(x, (char *)handle - x->umem);
+	lkos_xdp_kick(x);
+	pthread_mutex_unlock(&x->lock);
+}
+
+/* fd is bound: receive through AF_XDP if its stack has an interface */
+static void lkos_xdp_bind(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	const struct lkos_stack *st;
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	struct lkos_xdp_port port = { .on = 1 };
+	struct lkos_xdp_sock *s;
+	struct lkos_xdp *x;
+	unsigned int state;
+	int zero = 0;
+
+	if (!lfd)
+		return;
+
+	state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+	if (!(state & LKOS_FD_SOCKET) ||
+	    __atomic_load_n(&lfd->domain, __ATOMIC_RELAXED) != AF_INET ||
+	    __atomic_load_n(&lfd->type, __ATOMIC_RELAXED) != SOCK_DGRAM)
+		return;
+
+	st = lkos_stack_get(__atomic_load_n(&lfd->stack, __ATOMIC_RELAXED));
+	if (!st || !st->xdp_if[0])
+		return;
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &alen) ||
+	    addr.sin_family != AF_INET)
+		return;
+	port.addr = addr.sin_addr.s_addr;
+
+	x = lkos_xdp_ctx(st);
+	if (!x)
+		return;
+	s = lkos_xdp_sock_get(fd, true);
+	if (!s)
+		return;
+
+	pthread_mutex_lock(&x->lock);
+	if (x->socks[addr.sin_port]) {
+		lkos_warn("xdp: %s: port %u in use by another socket\n",
+			  x->ifname, ntohs(addr.sin_port));
+		pthread_mutex_unlock(&x->lock);
+		return;
+	}
+	if (lkos_bpf_map_set(x->ports_fd, addr.sin_port, &port)) {
+		lkos_warn("xdp: %s: ports map update: %s\n", x->ifname,
+			  strerror(errno));
+		pthread_mutex_unlock(&x->lock);
+		return;
+	}
+	s->port = addr.sin_port;
+	s->head = 0;
+	s->count = 0;
+	x->socks[s->port] = s;
+	__atomic_store_n(&s->x, x, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&x->lock);
+
+	__atomic_add_fetch(&lkos_xdp_sockets, 1, __ATOMIC_RELAXED);
+
+	/* receive calls bypass the GRO stash: have the kernel split runs */
+	if (state & LKOS_FD_GRO_SPLIT) {
+		setsockopt_fn(fd, SOL_UDP, UDP_GRO, &zero, sizeof(zero));
+		lkos_fd_set_flag(fd, LKOS_FD_GRO_SPLIT | LKOS_FD_UDP_GRO, false);
+	}
+}
+
+/* fd is closed, or replaced by dup2: remove its port, drop its frames */
+static void lkos_xdp_close(int fd)
+{
+	struct lkos_xdp_sock *s;
+	struct lkos_xdp *x;
+
+	if (!__atomic_load_n(&lkos_xdp_sockets, __ATOMIC_RELAXED))
+		return;
+
+	s = lkos_xdp_sock_get(fd, false);
+	if (!s)
+		return;
+	x = __atomic_load_n(&s->x, __ATOMIC_ACQUIRE);
+	if (!x || x->forked)
+		return;
+
+	pthread_mutex_lock(&x->lock);
+	if (s->x) {
+		lkos_bpf_map_set(x->ports_fd, s->port,
+				 &(struct lkos_xdp_port){ 0 });
+		x->socks[s->port] = NULL;
+		while (s->count)
+			lkos_xdp_recycle(x, lkos_xdp_pop(s));
+		lkos_xdp_kick(x);
+		__atomic_store_n(&s->x, NULL, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&lkos_xdp_sockets, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&x->lock);
+}
+
+/* fd joins epoll set epfd: so does its AF_XDP socket, to wake the wait.
+ * Its events carry the interface queue, see lkos_xdp_epoll_filter.
+ */
+static void lkos_xdp_epoll_add(int epfd, int fd)
+{
+	const struct lkos_xdp_sock *s = lkos_xdp_get(fd);
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	if (!s)
+		return;
+
+	ev.data.ptr = s->x;
+	epoll_ctl_fn(epfd, EPOLL_CTL_ADD, s->x->xsk_fd, &ev);
+}
+
+static struct lkos_xdp *lkos_xdp_epoll_ctx(const struct epoll_event *ev)
+{
+	struct lkos_xdp *x;
+
+	for (x = __atomic_load_n(&lkos_xdp_list, __ATOMIC_ACQUIRE); x;
+	     x = x->next) {
+		if (ev->data.ptr == x)
+			return x;
+	}
+
+	return NULL;
+}
+
+/* The interface queues belong to the parent: it receives their frames */
+static void lkos_xdp_atfork_child(void)
+{
+	struct lkos_xdp *x;
+
+	pthread_mutex_init(&lkos_xdp_lock, NULL);
+	for (x = lkos_xdp_list; x; x = x->next)
+		x->forked = true;
+	lkos_xdp_list = NULL;
+	lkos_xdp_sockets = 0;
+}
+
+static void lkos_init_xdp(void)
+{
+	pthread_atfork(NULL, NULL, lkos_xdp_atfork_child);
+}
+
+/* TCP loopback over shared memory
+ *
+ * With EF_TCP_CLIENT_LOOPBACK on the client and EF_TCP_SERVER_LOOPBACK
+ * on the server, as in Onload, TCP connections over 127.0.0.0/8 between
+ * processes that both run with the library move their data through a
+ * pair of single producer, single consumer rings in shared memory
+ * instead of the kernel TCP stack. Any non-zero value enables the mode:
+ * there is no stack to choose.
+ *
+ * A listener in the mode holds a shared lock on a marker in /dev/shm,
+ * named by its address, port and network namespace. A client in the
+ * mode that connects to an address and port with a live marker, or to
+ * a port with a live marker on INADDR_ANY, creates a segment named by
+ * the server address and both ports, before the connect: it binds to an
+ * ephemeral port first if needed. The segment is offered to the accept
+ * of the connection, which opens it by the same name, takes the offer,
+ * unlinks it and rings a doorbell. The client uses the rings only once
+ * it has seen the offer taken. Its first send waits up to
+ * LKOS_LO_WAIT_MS for the doorbell, its first receive as long as it
+ * would for data; then it withdraws the offer and uses the kernel, so
+ * that a process without the mode may accept the connection.
+ * Connections to other ports or from processes without the mode use
+ * the kernel.
+ *
+ * The kernel connection stays open. It carries no data, but:
+ * - the end of stream: a reader that finds its ring empty reads the
+ *   kernel socket, so shutdown, close and a peer that exits are seen
+ *   as with TCP. The library also marks the ring on shutdown, so that
+ *   the peer sees it without a syscall. It does not on close: the
+ *   socket may be open in another process.
+ * - doorbells: epoll_wait, poll and select wait on the kernel socket. A
+ *   reader that found its ring empty before waiting arms a doorbell,
+ *   and the next write sends one byte on the kernel connection, which
+ *   the reader discards.
+ * Blocking calls spin on the ring as for the TCP spin types, then sleep
+ * on a futex in the segment, with SO_RCVTIMEO or SO_SNDTIMEO.
+ *
+ * Not supported: IPv6, MSG_OOB, control messages and timestamps, and
+ * calls not intercepted, such as sendfile and splice. Writability is
+ * the kernel socket's: EPOLLOUT does not wait for room in the ring.
+ * After fork, only one process may use a connection.
+ */
+
+#define LKOS_LO_MAGIC		0x6c6b6f6c
+#define LKOS_LO_RING_SIZE	(1 << 20)	/* per direction, a power of 2 */
+#define LKOS_LO_HDR_SIZE	4096		/* the rings follow */
+#define LKOS_LO_MAP_LEN		(LKOS_LO_HDR_SIZE + 2 * LKOS_LO_RING_SIZE)
+#define LKOS_LO_WAIT_MS		100	/* futex sleeps look at the kernel socket */
+#define LKOS_LO_CHECK_NS	(1000 * 1000)	/* and so do readers, at least */
+#define LKOS_LO_NAME_LEN	64
+
+#define LKOS_LO_OFFERED		1
+#define LKOS_LO_ACCEPTED	2
+#define LKOS_LO_WITHDRAWN	3
+
+#define LKOS_LO_WAIT_FUTEX	0x1	/* sleeps on the futex */
+#define LKOS_LO_WAIT_POLL	0x2	/* waits on the kernel socket */
+
+/* One direction. The writer writes the first cache line, the reader the
+ * second, but for the wait flags, which the other side clears.
+ */
+struct lkos_lo_ring {
+	uint64_t head;			/* bytes written */
+	uint32_t bells;			/* doorbells sent */
+	uint32_t rd_seq;		/* futex: the reader was woken */
+	uint32_t wr_wait;		/* LKOS_LO_WAIT_FUTEX if the writer sleeps */
+	uint32_t shut;			/* the writer shut down or closed */
+
+	uint64_t tail __attribute__((aligned(64)));	/* bytes read */
+	uint32_t bells_read;		/* doorbells discarded */
+	uint32_t wr_seq;		/* futex: the writer was woken */
+	uint32_t rd_wait;		/* LKOS_LO_WAIT_* if the reader waits */
+	uint32_t closed;		/* the reader closed */
+} __attribute__((aligned(64)));
+
+struct lkos_lo_shm {
+	uint32_t magic;
+	uint32_t state;			/* LKOS_LO_OFFERED, _ACCEPTED or _WITHDRAWN */
+	pid_t pid;			/* of the client, to detect stale offers */
+	uint32_t size;			/* of each ring */
+	struct lkos_lo_ring ring[2];	/* from the client, from the server */
+};
+
+struct lkos_lo {
+	int refs;			/* fds that refer to it, see lkos_lo_dup */
+	unsigned int gen;		/* lkos_fd_gen at setup */
+	int marker_fd;			/* a listener: the marker, else -1 */
+	struct lkos_lo_shm *shm;	/* a connection: the segment, else NULL */
+	struct lkos_lo_ring *rx, *tx;
+	char *rx_data, *tx_data;
+	bool server;
+	bool connected;			/* the connect completed */
+	bool accepted;			/* the server took the offer */
+	bool kernel;			/* the offer was withdrawn */
+	bool rd_shut;			/* shutdown(SHUT_RD) */
+	uint64_t check_ns;		/* last read of the kernel socket */
+	pthread_mutex_t rx_lock, tx_lock;
+	char name[LKOS_LO_NAME_LEN];	/* of the segment or the marker */
+};
+
+static int lkos_lo_conns;		/* connections over rings */
+
+/* Returns the connection of fd if over rings, else NULL */
+static struct lkos_lo *lkos_lo_get(int fd)
+{
+	const struct lkos_fd *lfd;
+	struct lkos_lo *lo;
+
+	if (!__atomic_load_n(&lkos_lo_conns, __ATOMIC_RELAXED))
+		return NULL;
+
+	lfd = lkos_fd_get(fd);
+	if (!lfd)
+		return NULL;
+
+	lo = __atomic_load_n(&lfd->lo, __ATOMIC_ACQUIRE);
+	return lo && lo->shm && !__atomic_load_n(&lo->kernel, __ATOMIC_ACQUIRE) ?
+	       lo : NULL;
+}
+
+static bool lkos_lo_readable(const struct lkos_lo_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) !=
+	       __atomic_load_n(&r->tail, __ATOMIC_RELAXED) ||
+	       __atomic_load_n(&r->shut, __ATOMIC_ACQUIRE);
+}
+
+/* Discard the doorbells queued on the kernel socket. Reads no more than
+ * queued, so that errors stay for lkos_lo_kernel.
+ */
+static void lkos_lo_drain(int fd, struct lkos_lo *lo)
+{
+	uint32_t bells = __atomic_load_n(&lo->rx->bells, __ATOMIC_ACQUIRE);
+	char buf[64];
+	ssize_t ret;
+	int len = 0;
+
+	if (!ioctl_fn(fd, SIOCINQ, &len)) {
+		while (len > 0) {
+			ret = recv_fn(fd, buf, len < sizeof(buf) ? len : sizeof(buf),
+				      MSG_DONTWAIT);
+			if (ret <= 0)
+				break;
+			len -= ret;
+		}
+	}
+
+	__atomic_store_n(&lo->rx->bells_read, bells, __ATOMIC_RELAXED);
+}
+
+/* Whether a read on fd would not block. Otherwise arm the doorbell: the
+ * caller is about to wait on the kernel socket.
+ */
+static bool lkos_lo_pending(int fd)
+{
+	struct lkos_lo *lo = lkos_lo_get(fd);
+
+	if (!lo)
+		return false;
+	if (lkos_lo_readable(lo->rx))
+		return true;
+
+	/* a doorbell left would wake the caller for nothing */
+	if (__atomic_load_n(&lo->rx->bells, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&lo->rx->bells_read, __ATOMIC_RELAXED) &&
+	    !pthread_mutex_trylock(&lo->rx_lock)) {
+		lkos_lo_drain(fd, lo);
+		pthread_mutex_unlock(&lo->rx_lock);
+	}
+
+	__atomic_or_fetch(&lo->rx->rd_wait, LKOS_LO_WAIT_POLL, __ATOMIC_SEQ_CST);
+	return lkos_lo_readable(lo->rx);
+}
+
+/* Bytes not yet read in the receive ring of fd, or if tx in the send
+ * ring: SIOCINQ and SIOCOUTQ. Returns -1 if fd is not over rings.
+ */
+static int lkos_lo_queued(int fd, bool tx)
+{
+	const struct lkos_lo *lo = lkos_lo_get(fd);
+	const struct lkos_lo_ring *r;
+
+	if (!lo || __atomic_load_n(&lo->shm->state, __ATOMIC_ACQUIRE) !=
+		   LKOS_LO_ACCEPTED)
+		return -1;
+
+	r = tx ? lo->tx : lo->rx;
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static int lkos_lo_futex(uint32_t *addr, int op, uint32_t val, int timeout_ms)
+{
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+
+	return syscall(SYS_futex, addr, op, val, timeout_ms >= 0 ? &ts : NULL,
+		       NULL, 0);
+}
+
+/* The writer moved head, or shut down: wake the reader if it waits. A
+ * reader in poll gets a doorbell on fd.
+ */
+static void lkos_lo_wake_rx(int fd, struct lkos_lo_ring *r)
+{
+	uint32_t wait;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&r->rd_wait, __ATOMIC_RELAXED))
+		return;
+
+	wait = __atomic_exchange_n(&r->rd_wait, 0, __ATOMIC_ACQ_REL);
+	if (wait & LKOS_LO_WAIT_FUTEX) {
+		__atomic_add_fetch(&r->rd_seq, 1, __ATOMIC_RELEASE);
+		lkos_lo_futex(&r->rd_seq, FUTEX_WAKE, INT_MAX, -1);
+	}
+	if (wait & LKOS_LO_WAIT_POLL) {
+		/* loopback queues the byte before send returns: count after */
+		send_fn(fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		__atomic_add_fetch(&r->bells, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* The reader moved tail, or closed: wake the writer if it sleeps */
+static void lkos_lo_wake_tx(struct lkos_lo_ring *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&r->wr_wait, __ATOMIC_RELAXED) ||
+	    !__atomic_exchange_n(&r->wr_wait, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	__atomic_add_fetch(&r->wr_seq, 1, __ATOMIC_RELEASE);
+	lkos_lo_futex(&r->wr_seq, FUTEX_WAKE, INT_MAX, -1);
+}
+
+/* Sleep on seq while it is val, until *end: 0 on the first call, then
+ * set from socket option optname. Returns -1 with EAGAIN after *end, or
+ * with EINTR. Wakes after LKOS_LO_WAIT_MS to look at the kernel socket.
+ */
+static int lkos_lo_sleep(int fd, int optname, uint32_t *seq, uint32_t val,
+			 uint64_t *end)
+{
+	uint64_t now = lkos_clock_ns(CLOCK_MONOTONIC);
+	struct timeval tv = {0};
+	socklen_t slen = sizeof(tv);
+	int timeout = LKOS_LO_WAIT_MS;
+
+	if (!*end) {
+		*end = UINT64_MAX;
+		if (!getsockopt_fn(fd, SOL_SOCKET, optname, &tv, &slen) &&
+		    (tv.tv_sec || tv.tv_usec))
+			*end = now + tv.tv_sec * 1000ULL * 1000 * 1000 +
+			       tv.tv_usec * 1000ULL;
+	}
+
+	if (*end != UINT64_MAX) {
+		if (now >= *end) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if ((*end - now + 999999) / 1000000 < timeout)
+			timeout = (*end - now + 999999) / 1000000;
+	}
+
+	if (lkos_lo_futex(seq, FUTEX_WAIT, val, timeout) && errno == EINTR)
+		return -1;
+
+	return 0;
+}
+
+static bool lkos_lo_nonblock(int fd, int flags)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return (flags & MSG_DONTWAIT) ||
+	       (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_NONBLOCK);
+}
+
+/* After a non-blocking connect: whether the connection is up. Waits for
+ * it unless non-blocking, else fails as the kernel would.
+ */
+static bool lkos_lo_connected(int fd, struct lkos_lo *lo, int flags)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	socklen_t slen = sizeof(int);
+	int err = 0;
+
+	if (__atomic_load_n(&lo->connected, __ATOMIC_ACQUIRE))
+		return true;
+
+	if (!getpeername(fd, (struct sockaddr *)&addr, &alen)) {
+		__atomic_store_n(&lo->connected, true, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	if (poll_fn(&pfd, 1, lkos_lo_nonblock(fd, flags) ? 0 : -1) == 0) {
+		errno = EAGAIN;
+		return false;
+	}
+
+	alen = sizeof(addr);
+	if (!getpeername(fd, (struct sockaddr *)&addr, &alen)) {
+		__atomic_store_n(&lo->connected, true, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	if (getsockopt_fn(fd, SOL_SOCKET, SO_ERROR, &err, &slen) || !err)
+		err = ENOTCONN;
+	errno = err;
+	return false;
+}
+
+/* Whether the connection of fd is up and over rings. On the client, the
+ * rings are used once the server took the offer: it rings a doorbell
+ * after. A send waits up to LKOS_LO_WAIT_MS for it, a receive as long
+ * as for data, then the client withdraws the offer and the kernel
+ * carries the data. Returns 1 over rings, 0 to use the kernel, else -1
+ * with errno.
+ */
+static int lkos_lo_ready(int fd, struct lkos_lo *lo, int flags, bool tx)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint32_t state = LKOS_LO_OFFERED;
+	struct timeval tv = {0};
+	socklen_t slen = sizeof(tv);
+	int timeout, ret;
+
+	if (!lkos_lo_connected(fd, lo, flags))
+		return -1;
+	if (__atomic_load_n(&lo->accepted, __ATOMIC_ACQUIRE))
+		return 1;
+
+	if (__atomic_load_n(&lo->shm->state, __ATOMIC_ACQUIRE) == LKOS_LO_OFFERED) {
+		if (lkos_lo_nonblock(fd, flags))
+			timeout = 0;
+		else if (tx)
+			timeout = LKOS_LO_WAIT_MS;
+		else if (!getsockopt_fn(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &slen) &&
+			 (tv.tv_sec || tv.tv_usec))
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		else
+			timeout = -1;
+
+		/* a receive waits as the kernel would, for data or the doorbell */
+		ret = poll_fn(&pfd, 1, timeout);
+		if (ret <= 0 && !tx) {
+			if (!ret)
+				errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	if (__atomic_compare_exchange_n(&lo->shm->state, &state,
+					LKOS_LO_WITHDRAWN, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		shm_unlink(lo->name);
+		state = LKOS_LO_WITHDRAWN;
+	}
+	if (state != LKOS_LO_ACCEPTED) {
+		__atomic_store_n(&lo->kernel, true, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	__atomic_store_n(&lo->accepted, true, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Copy len bytes between the ring at pos and the iovecs of msg from byte
+ * off: into the ring if to_ring.
+ */
+static void lkos_lo_copy(char *data, uint64_t pos, const struct msghdr *msg,
+			 size_t off, size_t len, bool to_ring)
+{
+	size_t i, n, ring_off, first;
+	char *buf;
+
+	for (i = 0; i < msg->msg_iovlen && len; i++) {
+		if (off >= msg->msg_iov[i].iov_len) {
+			off -= msg->msg_iov[i].iov_len;
+			continue;
+		}
+
+		buf = (char *)msg->msg_iov[i].iov_base + off;
+		n = msg->msg_iov[i].iov_len - off;
+		if (n > len)
+			n = len;
+		off = 0;
+
+		ring_off = pos & (LKOS_LO_RING_SIZE - 1);
+		first = LKOS_LO_RING_SIZE - ring_off < n ?
+			LKOS_LO_RING_SIZE - ring_off : n;
+		if (to_ring) {
+			memcpy(data + ring_off, buf, first);
+			memcpy(data, buf + first, n - first);
+		} else {
+			memcpy(buf, data + ring_off, first);
+			memcpy(buf + first, data, n - first);
+		}
+
+		pos += n;
+		len -= n;
+	}
+}
+
+/* Read the end of stream or an error from the kernel socket. Returns 0
+ * at end of stream, else -1 with errno: EAGAIN if none.
+ */
+static int lkos_lo_kernel(int fd, struct lkos_lo *lo)
+{
+	char c;
+	ssize_t ret;
+
+	lkos_lo_drain(fd, lo);
+	lo->check_ns = lkos_clock_ns(CLOCK_MONOTONIC_COARSE);
+
+	ret = recv_fn(fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+	if (ret > 0) {
+		errno = EAGAIN;	/* a doorbell since */
+		return -1;
+	}
+
+	return ret;
+}
+
+/* Whether to read the kernel socket before reporting an empty ring */
+static bool lkos_lo_check(const struct lkos_lo *lo)
+{
+	return __atomic_load_n(&lo->rx->bells, __ATOMIC_ACQUIRE) !=
+	       __atomic_load_n(&lo->rx->bells_read, __ATOMIC_RELAXED) ||
+	       lkos_clock_ns(CLOCK_MONOTONIC_COARSE) - lo->check_ns >=
+	       LKOS_LO_CHECK_NS;
+}
+
+static ssize_t lkos_lo_recvmsg(int fd, struct lkos_lo *lo, struct msghdr *msg,
+			       int flags)
+{
+	struct lkos_lo_ring *r = lo->rx;
+	size_t len = lkos_iov_len(msg), done = 0, n;
+	uint64_t head, tail, deadline, end = 0;
+	bool armed = false, spun = false;
+	uint32_t seq = 0;
+	ssize_t ret = 0;
+
+	if (len && !lo->rd_shut) {
+		ret = lkos_lo_ready(fd, lo, flags, false);
+		if (ret <= 0)
+			return ret ? ret : recvmsg_fn(fd, msg, flags);
+		ret = 0;
+	}
+
+	if (flags & MSG_OOB) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	msg->msg_namelen = 0;
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+	if (!len || lo->rd_shut)
+		return 0;
+
+	deadline = lkos_spin_deadline_fd(fd, 0, LKOS_SPIN_TCP_RECV, flags);
+
+	pthread_mutex_lock(&lo->rx_lock);
+	for (;;) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+		if (head != tail) {
+			n = head - tail < len - done ? head - tail : len - done;
+			if (!(flags & MSG_TRUNC))
+				lkos_lo_copy(lo->rx_data, tail, msg, done, n, false);
+			done += n;
+			if (flags & MSG_PEEK)
+				break;
+
+			__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+			lkos_lo_wake_tx(r);
+			if (done == len || !(flags & MSG_WAITALL))
+				break;
+			continue;
+		}
+
+		/* empty: the end of stream is after the data written before */
+		if (__atomic_load_n(&r->shut, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != head)
+				continue;
+			break;
+		}
+		if (lkos_lo_check(lo)) {
+			ret = lkos_lo_kernel(fd, lo);
+			if (ret == 0 || errno != EAGAIN) {
+				if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != head)
+					continue;
+				break;
+			}
+			ret = 0;
+		}
+
+		if (lkos_lo_nonblock(fd, flags)) {
+			errno = EAGAIN;
+			ret = -1;
+			break;
+		}
+		if (deadline) {
+			spun = true;
+			if (lkos_spin_continue(deadline))
+				continue;
+			deadline = 0;
+		}
+
+		/* announce the sleep, then look at the ring once more */
+		if (!armed) {
+			seq = __atomic_load_n(&r->rd_seq, __ATOMIC_ACQUIRE);
+			__atomic_or_fetch(&r->rd_wait, LKOS_LO_WAIT_FUTEX,
+					  __ATOMIC_SEQ_CST);
+			armed = true;
+			continue;
+		}
+		armed = false;
+		ret = lkos_lo_sleep(fd, SO_RCVTIMEO, &r->rd_seq, seq, &end);
+		if (ret)
+			break;
+		lo->check_ns = 0;
+	}
+	if (done && !(flags & MSG_PEEK) &&
+	    __atomic_load_n(&r->bells, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&r->bells_read, __ATOMIC_RELAXED))
+		lkos_lo_drain(fd, lo);
+	pthread_mutex_unlock(&lo->rx_lock);
+
+	if (done)
+		ret = done;
+	if (spun && deadline && ret >= 0)
+		lkos_spin_hit();
+
+	return ret;
+}
+
+/* Whether the peer is gone without closing the ring: it exited */
+static bool lkos_lo_peer_gone(int fd, const struct lkos_lo *lo)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+
+	return !__atomic_load_n(&lo->rx->shut, __ATOMIC_ACQUIRE) &&
+	       poll_fn(&pfd, 1, 0) == 1 &&
+	       (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+/* After shutdown, or with the peer gone, the kernel socket reports the
+ * error, and raises SIGPIPE.
+ */
+static ssize_t lkos_lo_sendmsg(int fd, struct lkos_lo *lo,
+			       const struct msghdr *msg, int flags)
+{
+	struct lkos_lo_ring *r = lo->tx;
+	size_t len = lkos_iov_len(msg), done = 0, n;
+	uint64_t head, tail, deadline, end = 0;
+	bool armed = false, spun = false;
+	uint32_t seq = 0;
+	ssize_t ret = 0;
+
+	ret = lkos_lo_ready(fd, lo, flags, true);
+	if (ret <= 0)
+		return ret ? ret : sendmsg_fn(fd, msg, flags);
+	ret = 0;
+	if (flags & MSG_OOB) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (__atomic_load_n(&r->shut, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+		return sendmsg_fn(fd, msg, flags);
+
+	deadline = lkos_spin_deadline_fd(fd, 0, LKOS_SPIN_TCP_SEND, flags);
+
+	pthread_mutex_lock(&lo->tx_lock);
+	for (;;) {
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		head = r->head;
+		n = LKOS_LO_RING_SIZE - (head - tail);
+		if (n > len - done)
+			n = len - done;
+		if (n) {
+			lkos_lo_copy(lo->tx_data, head, msg, done, n, true);
+			__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+			lkos_lo_wake_rx(fd, r);
+			done += n;
+		}
+		if (done == len)
+			break;
+
+		if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+			break;
+		if (lkos_lo_nonblock(fd, flags)) {
+			errno = EAGAIN;
+			ret = -1;
+			break;
+		}
+		if (deadline) {
+			spun = true;
+			if (lkos_spin_continue(deadline))
+				continue;
+			deadline = 0;
+		}
+
+		if (!armed) {
+			seq = __atomic_load_n(&r->wr_seq, __ATOMIC_ACQUIRE);
+			__atomic_or_fetch(&r->wr_wait, LKOS_LO_WAIT_FUTEX,
+					  __ATOMIC_SEQ_CST);
+			armed = true;
+			continue;
+		}
+		armed = false;
+		ret = lkos_lo_sleep(fd, SO_SNDTIMEO, &r->wr_seq, seq, &end);
+		if (ret)
+			break;
+		if (lkos_lo_peer_gone(fd, lo)) {
+			__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lo->tx_lock);
+
+	if (spun && deadline && done)
+		lkos_spin_hit();
+	if (done)
+		return done;
+	if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+		return sendmsg_fn(fd, msg, flags);
+
+	return ret;
+}
+
+static ssize_t lkos_lo_recv(int fd, struct lkos_lo *lo, void *buf, size_t len,
+			    int flags)
+{
+	struct iovec iov = { buf, len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	return lkos_lo_recvmsg(fd, lo, &msg, flags);
+}
+
+static ssize_t lkos_lo_send(int fd, struct lkos_lo *lo, const void *buf,
+			    size_t len, int flags)
+{
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	return lkos_lo_sendmsg(fd, lo, &msg, flags);
+}
+
+/* As Linux TCP recvmmsg: a loop over recvmsg. timeout is not checked */
+static int lkos_lo_recvmmsg(int fd, struct lkos_lo *lo, struct mmsghdr *msgvec,
+			    unsigned int vlen, int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < vlen; i++) {
+		ret = lkos_lo_recvmsg(fd, lo, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+
+		msgvec[i].msg_len = ret;
+		if (!ret)
+			return i + 1;
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+
+	return i;
+}
+
+static int lkos_lo_sendmmsg(int fd, struct lkos_lo *lo, struct mmsghdr *msgvec,
+			    unsigned int vlen, int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < vlen; i++) {
+		ret = lkos_lo_sendmsg(fd, lo, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		msgvec[i].msg_len = ret;
+	}
+
+	return i;
+}
+
+/* Calls of the extension APIs that reach the kernel directly: over the
+ * rings if fd has them.
+ */
+static ssize_t lkos_lo_sendmsg_fd(int fd, const struct msghdr *msg, int flags)
+{
+	struct lkos_lo *lo = lkos_lo_get(fd);
+
+	return lo ? lkos_lo_sendmsg(fd, lo, msg, flags) :
+		    sendmsg_fn(fd, msg, flags);
+}
+
+static ssize_t lkos_lo_send_fd(int fd, const void *buf, size_t len, int flags)
+{
+	struct lkos_lo *lo = lkos_lo_get(fd);
+
+	return lo ? lkos_lo_send(fd, lo, buf, len, flags) :
+		    send_fn(fd, buf, len, flags);
+}
+
+static ssize_t lkos_lo_recvmsg_fd(int fd, struct msghdr *msg, int flags)
+{
+	struct lkos_lo *lo = lkos_lo_get(fd);
+
+	return lo ? lkos_lo_recvmsg(fd, lo, msg, flags) :
+		    recvmsg_fn(fd, msg, flags);
+}
+
+static ssize_t lkos_lo_recv_fd(int fd, void *buf, size_t len, int flags)
+{
+	struct lkos_lo *lo = lkos_lo_get(fd);
+
+	return lo ? lkos_lo_recv(fd, lo, buf, len, flags) :
+		    recv_fn(fd, buf, len, flags);
+}
+
+static struct lkos_lo *lkos_lo_alloc(void)
+{
+	struct lkos_lo *lo;
+
+	lo = calloc(1, sizeof(*lo));
+	if (!lo)
+		return NULL;
+
+	lo->refs = 1;
+	lo->gen = __atomic_load_n(&lkos_fd_gen, __ATOMIC_RELAXED);
+	lo->marker_fd = -1;
+	pthread_mutex_init(&lo->rx_lock, NULL);
+	pthread_mutex_init(&lo->tx_lock, NULL);
+	return lo;
+}
+
+/* Map the segment shm_fd, for the client or the server side */
+static int lkos_lo_map(struct lkos_lo *lo, int shm_fd, bool server)
+{
+	struct lkos_lo_shm *shm;
+
+	shm = mmap(NULL, LKOS_LO_MAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   shm_fd, 0);
+	if (shm == MAP_FAILED)
+		return -1;
+
+	lo->shm = shm;
+	lo->server = server;
+	lo->tx = &shm->ring[server];
+	lo->rx = &shm->ring[!server];
+	lo->tx_data = (char *)shm + LKOS_LO_HDR_SIZE + server * LKOS_LO_RING_SIZE;
+	lo->rx_data = (char *)shm + LKOS_LO_HDR_SIZE + !server * LKOS_LO_RING_SIZE;
+
+	__atomic_add_fetch(&lkos_lo_conns, 1, __ATOMIC_RELAXED);
+	/* readiness comes from the ring, see lkos_zc_pending */
+	__atomic_add_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* A connection is over rings, or a listener has a marker, from now */
+static void lkos_lo_install(int fd, struct lkos_lo *lo)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	__atomic_store_n(&lfd->lo, lo, __ATOMIC_RELEASE);
+}
+
+/* Drop a reference of fd. The rings are not marked closed: the socket
+ * may still be open in another process, passed with SCM_RIGHTS or
+ * inherited. The peer sees the kernel FIN, see lkos_lo_kernel and
+ * lkos_lo_peer_gone.
+ */
+static void lkos_lo_put(struct lkos_lo *lo)
+{
+	if (__atomic_sub_fetch(&lo->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (lo->marker_fd >= 0) {
+		/* The last listener on the port removes the marker. The lock
+		 * is shared with children: the close in a child keeps it.
+		 */
+		if (lo->gen == __atomic_load_n(&lkos_fd_gen, __ATOMIC_RELAXED) &&
+		    !flock(lo->marker_fd, LOCK_EX | LOCK_NB))
+			shm_unlink(lo->name);
+		close_fn(lo->marker_fd);
+	}
+
+	if (lo->shm) {
+		if (!lo->server &&
+		    __atomic_load_n(&lo->shm->state, __ATOMIC_ACQUIRE) ==
+		    LKOS_LO_OFFERED)
+			shm_unlink(lo->name);
+		munmap(lo->shm, LKOS_LO_MAP_LEN);
+
+		__atomic_sub_fetch(&lkos_lo_conns, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_destroy(&lo->rx_lock);
+	pthread_mutex_destroy(&lo->tx_lock);
+	free(lo);
+}
+
+/* fd is closed or replaced, or was closed behind our back */
+static void lkos_lo_close(int fd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_lo *lo;
+
+	if (!lfd || !__atomic_load_n(&lfd->lo, __ATOMIC_RELAXED))
+		return;
+
+	lo = __atomic_exchange_n(&lfd->lo, NULL, __ATOMIC_ACQ_REL);
+	if (lo)
+		lkos_lo_put(lo);
+}
+
+/* newfd now refers to the same socket as oldfd */
+static void lkos_lo_dup(int oldfd, int newfd)
+{
+	const struct lkos_fd *old = lkos_fd_get(oldfd);
+	struct lkos_fd *new = lkos_fd_get(newfd);
+	struct lkos_lo *lo;
+
+	if (!old || !new)
+		return;
+
+	lkos_lo_close(newfd);
+
+	lo = __atomic_load_n(&old->lo, __ATOMIC_ACQUIRE);
+	if (!lo)
+		return;
+
+	__atomic_add_fetch(&lo->refs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&new->lo, lo, __ATOMIC_RELEASE);
+}
+
+static void lkos_lo_shutdown(int fd, int how)
+{
+	struct lkos_lo *lo = lkos_lo_get(fd);
+
+	if (!lo)
+		return;
+
+	if (how == SHUT_RD || how == SHUT_RDWR)
+		lo->rd_shut = true;
+	if (how == SHUT_WR || how == SHUT_RDWR) {
+		__atomic_store_n(&lo->tx->shut, 1, __ATOMIC_RELEASE);
+		lkos_lo_wake_rx(fd, lo->tx);
+	}
+}
+
+/* The network namespace: ports are per namespace, /dev/shm is not */
+static unsigned long lkos_lo_netns(void)
+{
+	struct stat st;
+
+	return stat("/proc/self/ns/net", &st) ? 0 : st.st_ino;
+}
+
+static bool lkos_lo_addr(const struct sockaddr_in *sin)
+{
+	return sin->sin_family == AF_INET &&
+	       (ntohl(sin->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+}
+
+/* Whether fd is a TCP socket of the library, with option opt set */
+static bool lkos_lo_enabled(int fd, int opt)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd && lkos_opts_get()->val[opt].i &&
+	       (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET) &&
+	       __atomic_load_n(&lfd->domain, __ATOMIC_RELAXED) == AF_INET &&
+	       __atomic_load_n(&lfd->type, __ATOMIC_RELAXED) == SOCK_STREAM &&
+	       __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) != LKOS_STACK_NONACCEL &&
+	       !__atomic_load_n(&lfd->lo, __ATOMIC_RELAXED);
+}
+
+/* fd listens: mark its port, for clients in the mode */
+static void lkos_lo_listen(int fd)
+{
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	struct lkos_lo *lo;
+	int mfd;
+
+	if (!lkos_lo_enabled(fd, LKOS_OPT_TCP_SERVER_LOOPBACK) ||
+	    getsockname(fd, (struct sockaddr *)&addr, &alen) ||
+	    (addr.sin_addr.s_addr != htonl(INADDR_ANY) && !lkos_lo_addr(&addr)))
+		return;
+
+	lo = lkos_lo_alloc();
+	if (!lo)
+		return;
+	snprintf(lo->name, sizeof(lo->name), "/lkos_lo.%lx.%08x.%u",
+		 lkos_lo_netns(), ntohl(addr.sin_addr.s_addr),
+		 ntohs(addr.sin_port));
+
+	mfd = shm_open(lo->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (mfd == -1 || flock(mfd, LOCK_SH)) {
+		lkos_warn("loopback: %s: %s\n", lo->name, strerror(errno));
+		if (mfd != -1)
+			close_fn(mfd);
+		lkos_lo_put(lo);
+		return;
+	}
+
+	lo->marker_fd = mfd;
+	lkos_lo_install(fd, lo);
+}
+
+/* Whether a listener in the mode holds the marker of addr and port */
+static bool lkos_lo_marker_live(unsigned long netns, in_addr_t addr,
+				in_port_t port)
+{
+	char marker[LKOS_LO_NAME_LEN];
+	bool live;
+	int mfd;
+
+	snprintf(marker, sizeof(marker), "/lkos_lo.%lx.%08x.%u", netns,
+		 ntohl(addr), ntohs(port));
+	mfd = shm_open(marker, O_RDONLY | O_CLOEXEC, 0);
+	if (mfd == -1)
+		return false;
+	live = flock(mfd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK;
+	close_fn(mfd);
+	return live;
+}
+
+/* Before fd connects to addr: offer a segment if a listener in the mode
+ * has the address and port. Returns the connection, or NULL to use the
+ * kernel.
+ */
+static struct lkos_lo *lkos_lo_connect(int fd, const struct sockaddr *addr,
+				       socklen_t addrlen)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	struct sockaddr_in local = {0};
+	socklen_t alen = sizeof(local);
+	struct lkos_lo_shm *shm;
+	struct lkos_lo *lo;
+	unsigned long netns;
+	int sfd, ret;
+
+	if (!addr || addrlen < sizeof(*sin) || !lkos_lo_addr(sin) ||
+	    !lkos_lo_enabled(fd, LKOS_OPT_TCP_CLIENT_LOOPBACK))
+		return NULL;
+
+	/* a listener holds a shared lock on the marker */
+	netns = lkos_lo_netns();
+	if (!lkos_lo_marker_live(netns, sin->sin_addr.s_addr, sin->sin_port) &&
+	    !lkos_lo_marker_live(netns, htonl(INADDR_ANY), sin->sin_port))
+		return NULL;
+
+	/* the segment is named by the client port: bind to learn it */
+	if (getsockname(fd, (struct sockaddr *)&local, &alen))
+		return NULL;
+	if (!local.sin_port) {
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		alen = sizeof(local);
+		if (bind_fn(fd, (struct sockaddr *)&local, sizeof(local)) ||
+		    getsockname(fd, (struct sockaddr *)&local, &alen))
+			return NULL;
+	}
+
+	lo = lkos_lo_alloc();
+	if (!lo)
+		return NULL;
+	snprintf(lo->name, sizeof(lo->name), "/lkos_lo.%lx.%08x.%u.%u", netns,
+		 ntohl(sin->sin_addr.s_addr), ntohs(sin->sin_port),
+		 ntohs(local.sin_port));
+
+	/* a segment left by a process that exited before the accept */
+	sfd = shm_open(lo->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (sfd == -1 && errno == EEXIST) {
+		shm_unlink(lo->name);
+		sfd = shm_open(lo->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+			       0600);
+	}
+	if (sfd == -1) {
+		lkos_warn("loopback: %s: %s\n", lo->name, strerror(errno));
+		lkos_lo_put(lo);
+		return NULL;
+	}
+
+	ret = ftruncate(sfd, LKOS_LO_MAP_LEN);
+	if (!ret)
+		ret = lkos_lo_map(lo, sfd, false);
+	close_fn(sfd);
+	if (ret) {
+		lkos_warn("loopback: %s: %s\n", lo->name, strerror(errno));
+		shm_unlink(lo->name);
+		lkos_lo_put(lo);
+		return NULL;
+	}
+
+	shm = lo->shm;
+	shm->magic = LKOS_LO_MAGIC;
+	shm->pid = getpid();
+	shm->size = LKOS_LO_RING_SIZE;
+	__atomic_store_n(&shm->state, LKOS_LO_OFFERED, __ATOMIC_RELEASE);
+
+	return lo;
+}
+
+/* After the connect of fd with result ret: keep the offer unless the
+ * connect failed. Preserves errno.
+ */
+static void lkos_lo_connect_done(int fd, struct lkos_lo *lo, int ret)
+{
+	int err = errno;
+
+	if (ret && err != EINPROGRESS && err != EINTR) {
+		lkos_lo_put(lo);	/* and withdraw the offer */
+		errno = err;
+		return;
+	}
+
+	lo->connected = !ret;
+	lkos_lo_install(fd, lo);
+	errno = err;
+}
+
+/* fd was accepted on listenfd: take the offer of a client in the mode */
+static void lkos_lo_accept(int listenfd, int fd)
+{
+	const struct lkos_fd *llfd = lkos_fd_get(listenfd);
+	struct sockaddr_in local, peer;
+	socklen_t alen = sizeof(local);
+	const struct lkos_lo *l;
+	char name[LKOS_LO_NAME_LEN];
+	uint32_t state = LKOS_LO_OFFERED;
+	struct lkos_lo_shm *shm;
+	struct lkos_lo *lo;
+	struct stat st;
+	int sfd, ret;
+
+	lkos_lo_close(fd);
+
+	l = llfd ? __atomic_load_n(&llfd->lo, __ATOMIC_ACQUIRE) : NULL;
+	if (!l || l->marker_fd < 0)
+		return;
+
+	if (getpeername(fd, (struct sockaddr *)&peer, &alen) ||
+	    !lkos_lo_addr(&peer))
+		return;
+	alen = sizeof(local);
+	if (getsockname(fd, (struct sockaddr *)&local, &alen))
+		return;
+
+	snprintf(name, sizeof(name), "/lkos_lo.%lx.%08x.%u.%u", lkos_lo_netns(),
+		 ntohl(local.sin_addr.s_addr), ntohs(local.sin_port),
+		 ntohs(peer.sin_port));
+	sfd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (sfd == -1)
+		return;
+
+	lo = lkos_lo_alloc();
+	ret = !lo || fstat(sfd, &st) || st.st_size != LKOS_LO_MAP_LEN ||
+	      lkos_lo_map(lo, sfd, true);
+	close_fn(sfd);
+	if (ret) {
+		if (lo)
+			lkos_lo_put(lo);
+		return;
+	}
+
+	shm = lo->shm;
+	if (shm->magic != LKOS_LO_MAGIC || shm->size != LKOS_LO_RING_SIZE ||
+	    (kill(shm->pid, 0) && errno == ESRCH) ||
+	    !__atomic_compare_exchange_n(&shm->state, &state, LKOS_LO_ACCEPTED,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		/* left by a client that exited: use the kernel */
+		if (shm->magic == LKOS_LO_MAGIC && state == LKOS_LO_OFFERED)
+			shm_unlink(name);
+		lkos_lo_put(lo);
+		return;
+	}
+	shm_unlink(name);
+
+	strcpy(lo->name, name);
+	lo->connected = true;
+	lo->accepted = true;
+	lkos_lo_install(fd, lo);
+
+	/* the client waits for it before it uses the rings */
+	send_fn(fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	__atomic_add_fetch(&lo->tx->bells, 1, __ATOMIC_RELEASE);
+}
+
+/* multicast fan-out over shared memory
+ *
+ * With LKOS_MCAST_RING set to a number of slots, IPv4 UDP sockets that
+ * join a group with IP_ADD_MEMBERSHIP share one copy of its traffic per
+ * host, instead of one per socket. The group, the port and the interface
+ * name a segment in /dev/shm: a broadcast ring of datagrams, with their
+ * source address, IP_PKTINFO and rx timestamps. In each process, a
+ * thread per segment waits for an OFD lock on it. The process that
+ * holds the lock publishes, through a private socket that joins the
+ * group, and another takes over when it leaves the group or exits. The
+ * sockets of the application do not join: receive calls read the ring,
+ * each socket from its own cursor, then the kernel socket for other
+ * traffic.
+ *
+ * The ring does not wait for slow readers. A socket lapped by the
+ * publisher skips ahead and counts the datagrams that it lost. With
+ * SO_RXQ_OVFL set, the count is reported, added to the drops of the
+ * publisher socket since the join. SO_TIMESTAMP, SO_TIMESTAMPNS,
+ * SO_TIMESTAMPING and IP_PKTINFO are reported as set on the socket, and
+ * hardware timestamps are converted as on the kernel path.
+ *
+ * A reader that finds the ring empty before it waits arms a flag in the
+ * reader table of the segment, and the publisher sends one datagram to
+ * the doorbell socket of the process, on 127.0.0.1. Blocking calls spin
+ * on the ring as for LKOS_SPIN_UDP_RECV, then wait on both sockets, with
+ * SO_RCVTIMEO. epoll_wait, poll and select report sockets with datagrams
+ * in the ring readable, and wait on the doorbell socket as on the
+ * AF_XDP socket of XDP sockets: it joins the epoll sets that a socket is
+ * added to after the join.
+ *
+ * Only the first group joined by a socket bound to a port, on the
+ * wildcard or the group address, uses the ring. Other joins,
+ * MCAST_JOIN_GROUP and source filters go to the kernel. Datagrams are
+ * cut to LKOS_MC_DATA_MAX bytes, as with a short buffer. Datagrams that
+ * arrive while the publisher changes are lost, and not counted. A
+ * thread may take the wakeup for another's datagrams: serve a segment
+ * from one thread per process. After fork the child reads the rings of
+ * inherited sockets, through the doorbell of the parent, but does not
+ * publish.
+ */
+
+#define LKOS_MC_MAGIC		0x6c6b6d63
+#define LKOS_MC_SLOTS_MIN	256
+#define LKOS_MC_SLOTS_MAX	(1 << 20)
+#define LKOS_MC_SLOT_SIZE	2048
+#define LKOS_MC_HDR_SIZE	4096		/* the slots follow */
+#define LKOS_MC_READERS		256		/* processes per segment */
+#define LKOS_MC_BATCH		32		/* datagrams per publisher recvmmsg */
+#define LKOS_MC_CTRL_LEN	256
+#define LKOS_MC_RCVBUF		(8 << 20)
+#define LKOS_MC_JOIN_MS		100		/* for a publisher, at most */
+#define LKOS_MC_NAME_LEN	64
+
+#define LKOS_MC_CMSG_TIMESTAMP	 0x1
+#define LKOS_MC_CMSG_TIMESTAMPNS 0x2
+#define LKOS_MC_CMSG_PKTINFO	 0x4
+#define LKOS_MC_CMSG_RXQ_OVFL	 0x8
+
+/* A datagram. seq is 2 * n + 1 while datagram n is written, 2 * n + 2
+ * once it is complete: readers check it before and after the copy.
+ */
+struct lkos_mc_slot {
+	uint64_t seq;
+	uint32_t len;			/* of the datagram, may exceed the data */
+	uint32_t pad;
+	struct sockaddr_in from;
+	struct in_pktinfo pktinfo;
+	struct timespec ts[3];		/* as SCM_TIMESTAMPING: sw, -, hw */
+	char data[];
+};
+
+#define LKOS_MC_DATA_MAX	(LKOS_MC_SLOT_SIZE - \
+				 offsetof(struct lkos_mc_slot, data))
+
+struct lkos_mc_reader {
+	pid_t pid;			/* 0 if free */
+	in_port_t port;			/* of the doorbell socket */
+	uint32_t wait;			/* armed: send a doorbell */
+};
+
+struct lkos_mc_hdr {
+	uint32_t magic;
+	uint32_t slots;			/* a power of 2 */
+	uint32_t readers;		/* entries in use, at most */
+	pid_t publisher;
+
+	uint64_t head __attribute__((aligned(64)));	/* datagrams published */
+	uint64_t kernel_drops;		/* by the publisher sockets */
+
+	struct lkos_mc_reader reader[LKOS_MC_READERS]
+		__attribute__((aligned(64)));
+};
+
+/* A segment, in a process. Stays on the list once set up: epoll events
+ * of the doorbell socket carry it, see lkos_mc_epoll_ctx.
+ */
+struct lkos_mc {
+	struct lkos_mc *next;		/* list of all segments */
+	int refs;			/* sockets that read the ring, 0 if closed */
+	bool forked;			/* set up by the parent process */
+	char name[LKOS_MC_NAME_LEN];
+	struct ip_mreqn mreq;
+	in_port_t port;			/* network byte order */
+	int fd;				/* the segment, and the election lock */
+	int pub_fd;			/* bound to the group, joins if elected */
+	int wake_fd;			/* doorbells from the publisher */
+	int reader;			/* entry in the reader table */
+	struct lkos_mc_hdr *hdr;
+	size_t map_len;
+	uint32_t slots;
+	pthread_t thread;		/* lkos_mc_publish */
+};
+
+/* A socket that reads the ring */
+struct lkos_mc_sock {
+	struct lkos_mc *mc;
+	int refs;			/* fds that refer to it, see lkos_mc_dup */
+	pthread_mutex_t lock;		/* the cursor */
+	uint64_t cursor;		/* next datagram to read */
+	uint64_t drops;			/* lapped by the publisher */
+	uint64_t kernel_drops;		/* of the publishers, at the join */
+	unsigned int cmsgs;		/* LKOS_MC_CMSG_* */
+	int tsflags;			/* SO_TIMESTAMPING of the socket */
+};
+
+static int lkos_mc_slots;		/* LKOS_MCAST_RING, 0 if off */
+static struct lkos_mc *lkos_mc_list;
+static pthread_mutex_t lkos_mc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int lkos_mc_socks;		/* sockets reading rings */
+
+/* Returns the ring reader of fd, else NULL */
+static struct lkos_mc_sock *lkos_mc_get(int fd)
+{
+	const struct lkos_fd *lfd;
+
+	if (!__atomic_load_n(&lkos_mc_socks, __ATOMIC_RELAXED))
+		return NULL;
+
+	lfd = lkos_fd_get(fd);
+	return lfd ? __atomic_load_n(&lfd->mc, __ATOMIC_ACQUIRE) : NULL;
+}
+
+static struct lkos_mc_slot *lkos_mc_slot(const struct lkos_mc *mc,
+					 uint64_t n)
+{
+	return (void *)((char *)mc->hdr + LKOS_MC_HDR_SIZE +
+			(n & (mc->slots - 1)) * LKOS_MC_SLOT_SIZE);
+}
+
+static bool lkos_mc_readable(const struct lkos_mc_sock *s)
+{
+	return __atomic_load_n(&s->mc->hdr->head, __ATOMIC_ACQUIRE) !=
+	       __atomic_load_n(&s->cursor, __ATOMIC_RELAXED);
+}
+
+/* Ask for a doorbell, then look again. Returns whether s is readable */
+static bool lkos_mc_arm(const struct lkos_mc_sock *s)
+{
+	const struct lkos_mc *mc = s->mc;
+
+	__atomic_store_n(&mc->hdr->reader[mc->reader].wait, 1, __ATOMIC_SEQ_CST);
+	return lkos_mc_readable(s);
+}
+
+/* Discard the doorbells of mc */
+static void lkos_mc_drain(const struct lkos_mc *mc)
+{
+	char buf[64];
+
+	if (__atomic_load_n(&mc->refs, __ATOMIC_RELAXED))
+		while (recv_fn(mc->wake_fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+			;
+}
+
+static bool lkos_mc_pending(int fd)
+{
+	const struct lkos_mc_sock *s = lkos_mc_get(fd);
+
+	return s && (lkos_mc_readable(s) || lkos_mc_arm(s));
+}
+
+/* Skip ahead of the publisher that lapped s, to half a ring behind */
+static void lkos_mc_skip(struct lkos_mc_sock *s, uint64_t head)
+{
+	uint64_t next;
+
+	next = head - (head < s->mc->slots / 2 ? head : s->mc->slots / 2);
+	if (next <= s->cursor)
+		next = head;
+
+	s->drops += next - s->cursor;
+	__atomic_store_n(&s->cursor, next, __ATOMIC_RELAXED);
+}
+
+/* Append a control message, as put_cmsg */
+static void lkos_mc_cmsg(struct msghdr *msg, size_t *used, int level,
+			 int type, const void *data, size_t len)
+{
+	struct cmsghdr *cm = (void *)((char *)msg->msg_control + *used);
+
+	if (*used + CMSG_LEN(len) > msg->msg_controllen) {
+		msg->msg_flags |= MSG_CTRUNC;
+		return;
+	}
+
+	cm->cmsg_level = level;
+	cm->cmsg_type = type;
+	cm->cmsg_len = CMSG_LEN(len);
+	memcpy(CMSG_DATA(cm), data, len);
+
+	*used += CMSG_SPACE(len);
+	if (*used > msg->msg_controllen)
+		*used = msg->msg_controllen;
+}
+
+/* The control messages of slot for s, as the kernel would pass them */
+static void lkos_mc_cmsgs(const struct lkos_mc_sock *s,
+			  const struct lkos_mc_slot *slot, struct msghdr *msg)
+{
+	struct scm_timestamping tss = {0};
+	struct timeval tv;
+	size_t used = 0;
+	uint32_t drops;
+
+	if (!msg->msg_control) {
+		msg->msg_controllen = 0;
+		return;
+	}
+
+	if ((s->cmsgs & LKOS_MC_CMSG_TIMESTAMPNS) && slot->ts[0].tv_sec) {
+		lkos_mc_cmsg(msg, &used, SOL_SOCKET, SCM_TIMESTAMPNS,
+			     &slot->ts[0], sizeof(slot->ts[0]));
+	} else if ((s->cmsgs & LKOS_MC_CMSG_TIMESTAMP) && slot->ts[0].tv_sec) {
+		tv.tv_sec = slot->ts[0].tv_sec;
+		tv.tv_usec = slot->ts[0].tv_nsec / 1000;
+		lkos_mc_cmsg(msg, &used, SOL_SOCKET, SCM_TIMESTAMP,
+			     &tv, sizeof(tv));
+	}
+
+	if (s->tsflags & SOF_TIMESTAMPING_SOFTWARE)
+		tss.ts[0] = slot->ts[0];
+	if (s->tsflags & SOF_TIMESTAMPING_RAW_HARDWARE)
+		tss.ts[2] = slot->ts[2];
+	if (tss.ts[0].tv_sec || tss.ts[2].tv_sec)
+		lkos_mc_cmsg(msg, &used, SOL_SOCKET, SCM_TIMESTAMPING,
+			     &tss, sizeof(tss));
+
+	drops = s->drops + __atomic_load_n(&s->mc->hdr->kernel_drops,
+					   __ATOMIC_RELAXED) - s->kernel_drops;
+	if ((s->cmsgs & LKOS_MC_CMSG_RXQ_OVFL) && drops)
+		lkos_mc_cmsg(msg, &used, SOL_SOCKET, SO_RXQ_OVFL,
+			     &drops, sizeof(drops));
+
+	if (s->cmsgs & LKOS_MC_CMSG_PKTINFO)
+		lkos_mc_cmsg(msg, &used, IPPROTO_IP, IP_PKTINFO,
+			     &slot->pktinfo, sizeof(slot->pktinfo));
+
+	msg->msg_controllen = used;
+}
+
+/* Copy the datagram at the cursor of s to msg, and consume it unless
+ * MSG_PEEK. Returns its length, as recvmsg, or -1 with EAGAIN if the
+ * ring is empty. Called with s->lock held.
+ */
+static ssize_t lkos_mc_copy(struct lkos_mc_sock *s, struct msghdr *msg,
+			    int flags)
+{
+	const struct lkos_mc_slot *slot;
+	uint64_t head, seq;
+	int plen, dlen, len, n;
+	size_t i;
+
+	for (;;) {
+		head = __atomic_load_n(&s->mc->hdr->head, __ATOMIC_ACQUIRE);
+		if (s->cursor == head) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		slot = lkos_mc_slot(s->mc, s->cursor);
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (head - s->cursor > s->mc->slots ||
+		    seq != 2 * s->cursor + 2) {
+			lkos_mc_skip(s, head);
+			continue;
+		}
+
+		plen = slot->len;
+		dlen = plen < LKOS_MC_DATA_MAX ? plen : LKOS_MC_DATA_MAX;
+		for (i = 0, len = 0; i < msg->msg_iovlen && len < dlen; i++) {
+			n = dlen - len;
+			if (msg->msg_iov[i].iov_len < n)
+				n = msg->msg_iov[i].iov_len;
+			memcpy(msg->msg_iov[i].iov_base, slot->data + len, n);
+			len += n;
+		}
+
+		msg->msg_flags = len < plen ? MSG_TRUNC : 0;
+		if (msg->msg_name) {
+			memcpy(msg->msg_name, &slot->from,
+			       msg->msg_namelen < sizeof(slot->from) ?
+			       msg->msg_namelen : sizeof(slot->from));
+			msg->msg_namelen = sizeof(slot->from);
+		}
+		lkos_mc_cmsgs(s, slot, msg);
+
+		/* the publisher may have written the slot during the copy */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+			lkos_mc_skip(s, head);
+			continue;
+		}
+
+		if (!(flags & MSG_PEEK))
+			__atomic_store_n(&s->cursor, s->cursor + 1,
+					 __ATOMIC_RELAXED);
+		return flags & MSG_TRUNC ? plen : len;
+	}
+}
+
+/* Wait for a doorbell or for traffic on fd, as lkos_xdp_wait */
+static int lkos_mc_wait(int fd, struct lkos_mc_sock *s, uint64_t *end)
+{
+	lkos_mc_drain(s->mc);
+	if (lkos_mc_arm(s))
+		return 0;
+
+	return lkos_xdp_wait(fd, s->mc->wake_fd, end);
+}
+
+/* recvmsg from the ring of s, else from the kernel socket */
+static ssize_t lkos_mc_recvmsg(int fd, struct lkos_mc_sock *s,
+			       struct msghdr *msg, int flags)
+{
+	uint64_t deadline, end = 0;
+	ssize_t ret;
+
+	deadline = lkos_spin_deadline_fd(fd, LKOS_SPIN_UDP_RECV, 0, flags);
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		ret = lkos_mc_copy(s, msg, flags);
+		pthread_mutex_unlock(&s->lock);
+		if (ret >= 0)
+			break;
+
+		ret = recvmsg_fn(fd, msg, flags | MSG_DONTWAIT);
+		if (ret >= 0 || errno != EAGAIN || lkos_xdp_nonblock(fd, flags))
+			break;
+
+		if (deadline) {
+			if (lkos_spin_continue(deadline))
+				continue;
+			deadline = 0;
+		}
+
+		ret = lkos_mc_wait(fd, s, &end);
+		if (ret)
+			break;
+	}
+
+	if (deadline && ret >= 0)
+		lkos_spin_hit();
+
+	return ret;
+}
+
+static ssize_t lkos_mc_recvfrom(int fd, struct lkos_mc_sock *s, void *buf,
+				size_t len, int flags,
+				struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {0};
+	ssize_t ret;
+
+	msg.msg_name = src_addr;
+	msg.msg_namelen = src_addr && addrlen ? *addrlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ret = lkos_mc_recvmsg(fd, s, &msg, flags);
+	if (ret >= 0 && src_addr && addrlen)
+		*addrlen = msg.msg_namelen;
+
+	return ret;
+}
+
+/* As lkos_gro_recvmmsg */
+static int lkos_mc_recvmmsg(int fd, struct lkos_mc_sock *s,
+			    struct mmsghdr *msgvec, unsigned int vlen,
+			    int flags, struct timespec *timeout)
+{
+	uint64_t end = 0;
+	unsigned int i;
+	ssize_t ret;
+
+	if (timeout)
+		end = lkos_clock_ns(CLOCK_MONOTONIC) +
+		      timeout->tv_sec * 1000ULL * 1000 * 1000 + timeout->tv_nsec;
+
+	for (i = 0; i < vlen; i++) {
+		ret = lkos_mc_recvmsg(fd, s, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		msgvec[i].msg_len = ret;
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+		if (timeout && lkos_clock_ns(CLOCK_MONOTONIC) >= end)
+			return i + 1;
+	}
+
+	return i;
+}
+
+/* The length and rx timestamp of datagram i after the cursor of fd, for
+ * onload_ordered_epoll_wait. Returns -1 if the ring has no such datagram.
+ */
+static ssize_t lkos_mc_peek_ts(int fd, unsigned int i, struct timespec *ts)
+{
+	struct lkos_mc_sock *s = lkos_mc_get(fd);
+	const struct lkos_mc_slot *slot;
+	uint64_t head, seq, n;
+	ssize_t ret = -1;
+
+	if (!s)
+		return -1;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		head = __atomic_load_n(&s->mc->hdr->head, __ATOMIC_ACQUIRE);
+		n = s->cursor + i;
+		if (head - s->cursor <= i)
+			break;
+
+		slot = lkos_mc_slot(s->mc, n);
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (head - s->cursor > s->mc->slots || seq != 2 * n + 2) {
+			lkos_mc_skip(s, head);
+			continue;
+		}
+
+		*ts = slot->ts[2].tv_sec ? slot->ts[2] : slot->ts[0];
+		ret = slot->len;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			break;
+		lkos_mc_skip(s, head);
+		ret = -1;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+/* Store a datagram received by the publisher in slot */
+static void lkos_mc_fill(struct lkos_mc_slot *slot, struct mmsghdr *mm,
+			 uint32_t *ovfl)
+{
+	struct msghdr *msg = &mm->msg_hdr;
+	struct scm_timestamping *tss;
+	struct cmsghdr *cm;
+
+	slot->len = mm->msg_len;
+	memset(slot->ts, 0, sizeof(slot->ts));
+	memset(&slot->pktinfo, 0, sizeof(slot->pktinfo));
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_TIMESTAMPING) {
+			tss = (void *)CMSG_DATA(cm);
+			memcpy(slot->ts, tss->ts, sizeof(slot->ts));
+		} else if (cm->cmsg_level == SOL_SOCKET &&
+			   cm->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(ovfl, CMSG_DATA(cm), sizeof(*ovfl));
+		} else if (cm->cmsg_level == IPPROTO_IP &&
+			   cm->cmsg_type == IP_PKTINFO) {
+			memcpy(&slot->pktinfo, CMSG_DATA(cm),
+			       sizeof(slot->pktinfo));
+		}
+	}
+}
+
+/* Ring the doorbells of the readers that wait */
+static void lkos_mc_wake(const struct lkos_mc *mc)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct lkos_mc_reader *r;
+	uint32_t i, n;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	n = __atomic_load_n(&mc->hdr->readers, __ATOMIC_RELAXED);
+	for (i = 0; i < n && i < LKOS_MC_READERS; i++) {
+		r = &mc->hdr->reader[i];
+		if (!__atomic_load_n(&r->wait, __ATOMIC_RELAXED) ||
+		    !__atomic_exchange_n(&r->wait, 0, __ATOMIC_ACQ_REL))
+			continue;
+
+		sin.sin_port = __atomic_load_n(&r->port, __ATOMIC_RELAXED);
+		sendto_fn(mc->wake_fd, "", 1, MSG_DONTWAIT,
+			  (struct sockaddr *)&sin, sizeof(sin));
+	}
+}
+
+/* Cancellation is enabled only for the blocking calls of the publisher */
+static void lkos_mc_cancellable(bool on)
+{
+	pthread_setcancelstate(on ? PTHREAD_CANCEL_ENABLE :
+			       PTHREAD_CANCEL_DISABLE, NULL);
+}
+
+/* Copy a datagram from the staging area of the publisher to slot n */
+static void lkos_mc_store(struct lkos_mc *mc, uint64_t n,
+			  const struct lkos_mc_slot *st)
+{
+	struct lkos_mc_slot *slot = lkos_mc_slot(mc, n);
+	size_t len = st->len < LKOS_MC_DATA_MAX ? st->len : LKOS_MC_DATA_MAX;
+
+	__atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&slot->len, &st->len,
+	       offsetof(struct lkos_mc_slot, data) -
+	       offsetof(struct lkos_mc_slot, len) + len);
+
+	__atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+}
+
+/* The publisher thread: wins the election, joins the group, then
+ * receives batches of datagrams until cancelled. A batch is received
+ * into a staging area and copied to the ring: only the slots of the
+ * datagrams received are taken from readers that lag behind.
+ */
+static void *lkos_mc_publish(void *arg)
+{
+	char stage[LKOS_MC_BATCH][LKOS_MC_SLOT_SIZE] __attribute__((aligned(64)));
+	char ctrl[LKOS_MC_BATCH][LKOS_MC_CTRL_LEN] __attribute__((aligned(8)));
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_len = 1 };
+	struct lkos_mc *mc = arg;
+	struct lkos_mc_hdr *hdr = mc->hdr;
+	struct pollfd pfd = { .fd = mc->pub_fd, .events = POLLIN };
+	struct mmsghdr msgs[LKOS_MC_BATCH];
+	struct iovec iov[LKOS_MC_BATCH];
+	struct lkos_mc_slot *st;
+	uint64_t head, base;
+	uint32_t ovfl = 0;
+	int i, n, ret;
+
+	lkos_mc_cancellable(false);
+
+	/* held until the process leaves the group or exits */
+	do {
+		lkos_mc_cancellable(true);
+		ret = fcntl_fn(mc->fd, F_OFD_SETLKW, &fl);
+		lkos_mc_cancellable(false);
+	} while (ret && errno == EINTR);
+	if (ret) {
+		lkos_warn("mcast: %s: lock: %s\n", mc->name, strerror(errno));
+		return NULL;
+	}
+
+	if (setsockopt_fn(mc->pub_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			  &mc->mreq, sizeof(mc->mreq))) {
+		lkos_warn("mcast: %s: join: %s\n", mc->name, strerror(errno));
+		fl.l_type = F_UNLCK;
+		fcntl_fn(mc->fd, F_OFD_SETLK, &fl);
+		return NULL;
+	}
+	__atomic_store_n(&hdr->publisher, getpid(), __ATOMIC_RELEASE);
+	base = __atomic_load_n(&hdr->kernel_drops, __ATOMIC_RELAXED);
+
+	for (;;) {
+		lkos_mc_cancellable(true);
+		ret = poll_fn(&pfd, 1, -1);
+		lkos_mc_cancellable(false);
+		if (ret <= 0)
+			continue;
+
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < LKOS_MC_BATCH; i++) {
+			st = (void *)stage[i];
+			iov[i].iov_base = st->data;
+			iov[i].iov_len = LKOS_MC_DATA_MAX;
+			msgs[i].msg_hdr.msg_name = &st->from;
+			msgs[i].msg_hdr.msg_namelen = sizeof(st->from);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+
+		n = recvmmsg_fn(mc->pub_fd, msgs, LKOS_MC_BATCH,
+				MSG_DONTWAIT | MSG_TRUNC, NULL);
+		if (n <= 0)
+			continue;
+
+		head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+		for (i = 0; i < n; i++) {
+			st = (void *)stage[i];
+			lkos_mc_fill(st, &msgs[i], &ovfl);
+			lkos_mc_store(mc, head + i, st);
+		}
+		__atomic_store_n(&hdr->head, head + n, __ATOMIC_RELEASE);
+		__atomic_store_n(&hdr->kernel_drops, base + ovfl,
+				 __ATOMIC_RELAXED);
+
+		lkos_mc_wake(mc);
+	}
+
+	return NULL;
+}
+
+/* The private sockets of mc: the doorbell socket, on 127.0.0.1, and the
+ * publisher socket, bound to the group now so that a conflict with the
+ * socket of the application shows at the join.
+ */
+static int lkos_mc_sockets(struct lkos_mc *mc)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	socklen_t alen = sizeof(sin);
+	int one = 1, zero = 0;
+	int tsflags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		      SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	int rcvbuf = LKOS_MC_RCVBUF;
+
+	mc->wake_fd = socket_fn(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (mc->wake_fd == -1)
+		return -1;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind_fn(mc->wake_fd, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    getsockname(mc->wake_fd, (struct sockaddr *)&sin, &alen))
+		return -1;
+
+	mc->pub_fd = socket_fn(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (mc->pub_fd == -1)
+		return -1;
+	sin.sin_addr = mc->mreq.imr_multiaddr;
+	sin.sin_port = mc->port;
+	if (setsockopt_fn(mc->pub_fd, SOL_SOCKET, SO_REUSEADDR,
+			  &one, sizeof(one)) ||
+	    setsockopt_fn(mc->pub_fd, IPPROTO_IP, IP_MULTICAST_ALL,
+			  &zero, sizeof(zero)) ||
+	    bind_fn(mc->pub_fd, (struct sockaddr *)&sin, sizeof(sin)))
+		return -1;
+
+	/* best effort */
+	setsockopt_fn(mc->pub_fd, SOL_SOCKET, SO_TIMESTAMPING,
+		      &tsflags, sizeof(tsflags));
+	setsockopt_fn(mc->pub_fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+	setsockopt_fn(mc->pub_fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+	if (setsockopt_fn(mc->pub_fd, SOL_SOCKET, SO_RCVBUFFORCE,
+			  &rcvbuf, sizeof(rcvbuf)))
+		setsockopt_fn(mc->pub_fd, SOL_SOCKET, SO_RCVBUF,
+			      &rcvbuf, sizeof(rcvbuf));
+
+	return 0;
+}
+
+/* Open, and set up if new, the segment of mc, and take an entry in its
+ * reader table. Called with the segment locked.
+ */
+static int lkos_mc_map(struct lkos_mc *mc)
+{
+	struct sockaddr_in sin;
+	socklen_t alen = sizeof(sin);
+	struct lkos_mc_hdr *hdr;
+	struct stat st;
+	uint32_t slots;
+	bool init;
+	pid_t pid;
+	int i;
+
+	if (fstat(mc->fd, &st))
+		return -1;
+
+	init = !st.st_size;
+	if (init) {
+		slots = lkos_mc_slots;
+		if (ftruncate(mc->fd, LKOS_MC_HDR_SIZE +
+			      (off_t)slots * LKOS_MC_SLOT_SIZE))
+			return -1;
+	} else {
+		slots = (st.st_size - LKOS_MC_HDR_SIZE) / LKOS_MC_SLOT_SIZE;
+		if (st.st_size <= LKOS_MC_HDR_SIZE || (slots & (slots - 1))) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	mc->map_len = LKOS_MC_HDR_SIZE + (size_t)slots * LKOS_MC_SLOT_SIZE;
+	hdr = mmap(NULL, mc->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   mc->fd, 0);
+	if (hdr == MAP_FAILED)
+		return -1;
+	mc->hdr = hdr;
+	mc->slots = slots;
+
+	if (init) {
+		hdr->magic = LKOS_MC_MAGIC;
+		hdr->slots = slots;
+	} else if (hdr->magic != LKOS_MC_MAGIC || hdr->slots != slots) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* entries of processes that exited are free */
+	for (i = 0; i < LKOS_MC_READERS; i++) {
+		pid = hdr->reader[i].pid;
+		if (!pid || (kill(pid, 0) && errno == ESRCH))
+			break;
+	}
+	if (i == LKOS_MC_READERS) {
+		errno = EUSERS;
+		return -1;
+	}
+
+	if (getsockname(mc->wake_fd, (struct sockaddr *)&sin, &alen))
+		return -1;
+	hdr->reader[i].port = sin.sin_port;
+	hdr->reader[i].wait = 0;
+	hdr->reader[i].pid = getpid();
+	if (i >= hdr->readers)
+		__atomic_store_n(&hdr->readers, i + 1, __ATOMIC_RELAXED);
+	mc->reader = i;
+
+	return 0;
+}
+
+/* Release the resources of mc. Called with the segment unlocked, or
+ * not open.
+ */
+static void lkos_mc_free(struct lkos_mc *mc)
+{
+	if (mc->hdr)
+		munmap(mc->hdr, mc->map_len);
+	if (mc->fd >= 0)
+		close_fn(mc->fd);
+	if (mc->pub_fd >= 0)
+		close_fn(mc->pub_fd);
+	if (mc->wake_fd >= 0)
+		close_fn(mc->wake_fd);
+
+	mc->hdr = NULL;
+	mc->fd = mc->pub_fd = mc->wake_fd = -1;
+}
+
+/* Open the segment of mc, and start its publisher thread */
+static int lkos_mc_open(struct lkos_mc *mc)
+{
+	sigset_t all, old;
+	struct stat st;
+	int ret;
+
+	mc->hdr = NULL;
+	mc->fd = mc->pub_fd = mc->wake_fd = -1;
+	mc->reader = -1;
+	mc->forked = false;
+
+	if (lkos_mc_sockets(mc))
+		goto fail;
+
+	/* the last process to leave unlinks the segment: retry if it was
+	 * unlinked between the open and the lock
+	 */
+	for (;;) {
+		mc->fd = shm_open(mc->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (mc->fd == -1 || flock(mc->fd, LOCK_EX))
+			goto fail;
+		if (fstat(mc->fd, &st))
+			goto fail;
+		if (st.st_nlink)
+			break;
+		close_fn(mc->fd);
+	}
+
+	ret = lkos_mc_map(mc);
+	flock(mc->fd, LOCK_UN);
+	if (ret)
+		goto fail;
+
+	/* the thread takes no signals of the application */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&mc->thread, NULL, lkos_mc_publish, mc);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	lkos_warn("mcast: %s: %s\n", mc->name, strerror(errno));
+	if (mc->hdr && mc->reader >= 0)
+		__atomic_store_n(&mc->hdr->reader[mc->reader].pid, 0,
+				 __ATOMIC_RELAXED);
+	lkos_mc_free(mc);
+	return -1;
+}
+
+/* The segment of the group in mreq on port, open, with a reference */
+static struct lkos_mc *lkos_mc_ctx(const struct ip_mreqn *mreq,
+				   in_port_t port)
+{
+	char name[LKOS_MC_NAME_LEN];
+	struct lkos_mc *mc, *free_mc = NULL;
+
+	snprintf(name, sizeof(name), "/lkos_mc.%lx.%08x.%u.%08x.%d",
+		 lkos_lo_netns(), ntohl(mreq->imr_multiaddr.s_addr),
+		 ntohs(port), ntohl(mreq->imr_address.s_addr),
+		 mreq->imr_ifindex);
+
+	pthread_mutex_lock(&lkos_mc_lock);
+	for (mc = lkos_mc_list; mc; mc = mc->next) {
+		if (strcmp(mc->name, name) || (mc->refs && mc->forked))
+			continue;
+		if (mc->refs)
+			goto out;
+		free_mc = mc;
+	}
+
+	mc = free_mc;
+	if (!mc) {
+		mc = calloc(1, sizeof(*mc));
+		if (!mc)
+			goto out;
+		strcpy(mc->name, name);
+		mc->mreq = *mreq;
+		mc->port = port;
+		if (lkos_mc_open(mc)) {
+			free(mc);
+			mc = NULL;
+			goto out;
+		}
+		mc->next = lkos_mc_list;
+		__atomic_store_n(&lkos_mc_list, mc, __ATOMIC_RELEASE);
+	} else if (lkos_mc_open(mc)) {
+		mc = NULL;
+		goto out;
+	}
+
+out:
+	if (mc)
+		__atomic_add_fetch(&mc->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lkos_mc_lock);
+	return mc;
+}
+
+/* Drop a reference. The last one stops the publisher, which hands the
+ * group over to another process, and the last process unlinks the
+ * segment.
+ */
+static void lkos_mc_ctx_put(struct lkos_mc *mc)
+{
+	struct lkos_mc_hdr *hdr = mc->hdr;
+	pid_t pid;
+	int i, live = 0;
+
+	pthread_mutex_lock(&lkos_mc_lock);
+	if (__atomic_sub_fetch(&mc->refs, 1, __ATOMIC_RELAXED)) {
+		pthread_mutex_unlock(&lkos_mc_lock);
+		return;
+	}
+
+	if (!mc->forked) {
+		pthread_cancel(mc->thread);
+		pthread_join(mc->thread, NULL);
+		pid = getpid();
+		__atomic_compare_exchange_n(&hdr->publisher, &pid, 0, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	if (mc->fd >= 0 && !flock(mc->fd, LOCK_EX)) {
+		__atomic_store_n(&hdr->reader[mc->reader].wait, 0,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&hdr->reader[mc->reader].pid, 0,
+				 __ATOMIC_RELAXED);
+		for (i = 0; i < LKOS_MC_READERS; i++) {
+			pid = hdr->reader[i].pid;
+			if (pid && !(kill(pid, 0) && errno == ESRCH))
+				live++;
+		}
+		if (!live)
+			shm_unlink(mc->name);
+		flock(mc->fd, LOCK_UN);
+	}
+
+	lkos_mc_free(mc);
+	pthread_mutex_unlock(&lkos_mc_lock);
+}
+
+/* Wait for a publisher, so that traffic after the join is seen, as
+ * after a join in the kernel
+ */
+static void lkos_mc_publisher_wait(const struct lkos_mc *mc)
+{
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < LKOS_MC_JOIN_MS; i++) {
+		pid = __atomic_load_n(&mc->hdr->publisher, __ATOMIC_ACQUIRE);
+		if (pid && !(kill(pid, 0) && errno == ESRCH))
+			return;
+		usleep(1000);
+	}
+}
+
+/* Which control messages the socket asked for */
+static void lkos_mc_sockopts(int fd)
+{
+	struct lkos_mc_sock *s = lkos_mc_get(fd);
+	unsigned int cmsgs = 0;
+
+	if (!s)
+		return;
+
+	if (lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMPNS))
+		cmsgs |= LKOS_MC_CMSG_TIMESTAMPNS;
+	else if (lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMP))
+		cmsgs |= LKOS_MC_CMSG_TIMESTAMP;
+	if (lkos_getsockopt_int(fd, IPPROTO_IP, IP_PKTINFO))
+		cmsgs |= LKOS_MC_CMSG_PKTINFO;
+	if (lkos_getsockopt_int(fd, SOL_SOCKET, SO_RXQ_OVFL))
+		cmsgs |= LKOS_MC_CMSG_RXQ_OVFL;
+
+	__atomic_store_n(&s->cmsgs, cmsgs, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->tsflags,
+			 lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMPING),
+			 __ATOMIC_RELAXED);
+}
+
+/* The group of IP_ADD_MEMBERSHIP or IP_DROP_MEMBERSHIP, as ip_mreqn */
+static int lkos_mc_mreq(const void *optval, socklen_t optlen,
+			struct ip_mreqn *mreq)
+{
+	memset(mreq, 0, sizeof(*mreq));
+
+	if (!optval || optlen < sizeof(struct ip_mreq))
+		return -1;
+	/* struct ip_mreq is the first two fields of struct ip_mreqn */
+	memcpy(mreq, optval, optlen < sizeof(*mreq) ? sizeof(struct ip_mreq) :
+						    sizeof(*mreq));
+
+	return IN_MULTICAST(ntohl(mreq->imr_multiaddr.s_addr)) ? 0 : -1;
+}
+
+/* IP_ADD_MEMBERSHIP on fd: read the group from the ring if fd may.
+ * Returns 0 if it does, -1 to join in the kernel.
+ */
+static int lkos_mc_join(int fd, const void *optval, socklen_t optlen)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	struct lkos_mc_sock *s;
+	struct ip_mreqn mreq;
+	struct lkos_mc *mc;
+	int zero = 0;
+
+	if (!lkos_mc_slots || !lfd ||
+	    !(__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET) ||
+	    __atomic_load_n(&lfd->domain, __ATOMIC_RELAXED) != AF_INET ||
+	    __atomic_load_n(&lfd->type, __ATOMIC_RELAXED) != SOCK_DGRAM ||
+	    __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) == LKOS_STACK_NONACCEL ||
+	    __atomic_load_n(&lfd->mc, __ATOMIC_RELAXED) || lkos_xdp_get(fd) ||
+	    lkos_mc_mreq(optval, optlen, &mreq))
+		return -1;
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &alen) ||
+	    addr.sin_family != AF_INET || !addr.sin_port ||
+	    (addr.sin_addr.s_addr != htonl(INADDR_ANY) &&
+	     addr.sin_addr.s_addr != mreq.imr_multiaddr.s_addr))
+		return -1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+
+	mc = lkos_mc_ctx(&mreq, addr.sin_port);
+	if (!mc) {
+		free(s);
+		return -1;
+	}
+
+	/* the socket must not see the traffic of the publisher socket */
+	if (setsockopt_fn(fd, IPPROTO_IP, IP_MULTICAST_ALL, &zero, sizeof(zero))) {
+		lkos_mc_ctx_put(mc);
+		free(s);
+		return -1;
+	}
+
+	s->mc = mc;
+	s->refs = 1;
+	pthread_mutex_init(&s->lock, NULL);
+	s->cursor = __atomic_load_n(&mc->hdr->head, __ATOMIC_ACQUIRE);
+	s->kernel_drops = __atomic_load_n(&mc->hdr->kernel_drops,
+					  __ATOMIC_RELAXED);
+	__atomic_store_n(&lfd->mc, s, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&lkos_mc_socks, 1, __ATOMIC_RELAXED);
+	/* readiness comes from the ring, see lkos_zc_pending */
+	__atomic_add_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+
+	lkos_mc_sockopts(fd);
+	lkos_mc_publisher_wait(mc);
+	return 0;
+}
+
+static void lkos_mc_sock_put(struct lkos_mc_sock *s)
+{
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	__atomic_sub_fetch(&lkos_mc_socks, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&lkos_zc_stashed, 1, __ATOMIC_RELAXED);
+
+	lkos_mc_ctx_put(s->mc);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+/* fd is closed or replaced, or was closed behind our back */
+static void lkos_mc_close(int fd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_mc_sock *s;
+
+	if (!lfd || !__atomic_load_n(&lfd->mc, __ATOMIC_RELAXED))
+		return;
+
+	s = __atomic_exchange_n(&lfd->mc, NULL, __ATOMIC_ACQ_REL);
+	if (s)
+		lkos_mc_sock_put(s);
+}
+
+/* IP_DROP_MEMBERSHIP on fd. Returns 0 if it left the group of its ring,
+ * -1 to leave in the kernel.
+ */
+static int lkos_mc_leave(int fd, const void *optval, socklen_t optlen)
+{
+	const struct lkos_mc_sock *s = lkos_mc_get(fd);
+	struct ip_mreqn mreq;
+
+	if (!s || lkos_mc_mreq(optval, optlen, &mreq) ||
+	    mreq.imr_multiaddr.s_addr != s->mc->mreq.imr_multiaddr.s_addr ||
+	    mreq.imr_address.s_addr != s->mc->mreq.imr_address.s_addr ||
+	    mreq.imr_ifindex != s->mc->mreq.imr_ifindex)
+		return -1;
+
+	lkos_mc_close(fd);
+	return 0;
+}
+
+/* newfd now refers to the same socket as oldfd */
+static void lkos_mc_dup(int oldfd, int newfd)
+{
+	const struct lkos_fd *old = lkos_fd_get(oldfd);
+	struct lkos_fd *new = lkos_fd_get(newfd);
+	struct lkos_mc_sock *s;
+
+	if (!old || !new)
+		return;
+
+	lkos_mc_close(newfd);
+
+	s = __atomic_load_n(&old->mc, __ATOMIC_ACQUIRE);
+	if (!s)
+		return;
+
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&new->mc, s, __ATOMIC_RELEASE);
+}
+
+/* fd joins epoll set epfd: so does its doorbell socket, to wake the wait.
+ * Its events carry the segment, see lkos_mc_epoll_ctx.
+ */
+static void lkos_mc_epoll_add(int epfd, int fd)
+{
+	const struct lkos_mc_sock *s = lkos_mc_get(fd);
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	if (!s)
+		return;
+
+	ev.data.ptr = s->mc;
+	epoll_ctl_fn(epfd, EPOLL_CTL_ADD, s->mc->wake_fd, &ev);
+}
+
+static struct lkos_mc *lkos_mc_epoll_ctx(const struct epoll_event *ev)
+{
+	struct lkos_mc *mc;
+
+	for (mc = __atomic_load_n(&lkos_mc_list, __ATOMIC_ACQUIRE); mc;
+	     mc = mc->next) {
+		if (ev->data.ptr == mc)
+			return mc;
+	}
+
+	return NULL;
+}
+
+/* The publisher threads are not forked: the parent publishes. The child
+ * keeps reading the rings of inherited sockets.
+ */
+static void lkos_mc_atfork_child(void)
+{
+	struct lkos_mc *mc;
+
+	pthread_mutex_init(&lkos_mc_lock, NULL);
+	for (mc = lkos_mc_list; mc; mc = mc->next) {
+		if (!mc->refs || mc->forked)
+			continue;
+		mc->forked = true;
+		close_fn(mc->fd);
+		close_fn(mc->pub_fd);
+		mc->fd = mc->pub_fd = -1;
+	}
+}
+
+static void lkos_init_mc(void)
+{
+	long slots = lkos_getenv_long("LKOS_MCAST_RING", 0);
+
+	if (slots <= 0)
+		return;
+
+	lkos_mc_slots = LKOS_MC_SLOTS_MIN;
+	while (lkos_mc_slots < slots && lkos_mc_slots < LKOS_MC_SLOTS_MAX)
+		lkos_mc_slots <<= 1;
+
+	pthread_atfork(NULL, NULL, lkos_mc_atfork_child);
+}
+
+/* wake sources
+ *
+ * Data that the kernel does not see wakes waits through another fd: the
+ * AF_XDP socket of an interface queue, or the doorbell socket of a
+ * multicast ring. epoll_wait, poll and select wait on it too, move or
+ * discard what woke them, then wait again, for events or stashed data.
+ */
+
+#define LKOS_WAKE_MAX		8	/* wake fds per poll or select */
+
+struct lkos_wake {
+	int fd;
+	struct lkos_xdp *x;		/* an interface queue, or */
+	struct lkos_mc *mc;		/* a multicast ring */
+};
+
+static bool lkos_wake_any(void)
+{
+	return __atomic_load_n(&lkos_xdp_sockets, __ATOMIC_RELAXED) ||
+	       __atomic_load_n(&lkos_mc_socks, __ATOMIC_RELAXED);
+}
+
+/* The wake fd of fd, if any */
+static bool lkos_wake_get(int fd, struct lkos_wake *w)
+{
+	const struct lkos_xdp_sock *xs;
+	const struct lkos_mc_sock *ms;
+
+	memset(w, 0, sizeof(*w));
+
+	xs = lkos_xdp_get(fd);
+	if (xs) {
+		w->x = xs->x;
+		w->fd = xs->x->xsk_fd;
+		return true;
+	}
+
+	ms = lkos_mc_get(fd);
+	if (ms) {
+		w->mc = ms->mc;
+		w->fd = ms->mc->wake_fd;
+		return true;
+	}
+
+	return false;
+}
+
+static void lkos_wake_drain(const struct lkos_wake *w)
+{
+	if (w->x)
+		lkos_xdp_drain_locked(w->x);
+	else
+		lkos_mc_drain(w->mc);
+}
+
+/* Drain the interface queues of AF_XDP socket events, and the doorbells
+ * of doorbell socket events, and remove them. Returns the number of
+ * events left.
+ */
+static int lkos_wake_epoll_filter(struct epoll_event *events, int n)
+{
+	struct lkos_xdp *x;
+	struct lkos_mc *mc;
+	int i, j;
+
+	for (i = 0, j = 0; i < n; i++) {
+		x = lkos_xdp_epoll_ctx(&events[i]);
+		mc = x ? NULL : lkos_mc_epoll_ctx(&events[i]);
+		if (x)
+			lkos_xdp_drain_locked(x);
+		else if (mc)
+			lkos_mc_drain(mc);
+		else
+			events[j++] = events[i];
+	}
+
+	return j;
+}
+
+static int lkos_wake_add(struct lkos_wake *ws, int n, const struct lkos_wake *w)
+{
+	int i;
+
+	for (i = 0; i < n && ws[i].fd != w->fd; i++)
+		;
+	if (i == n)
+		ws[n++] = *w;
+
+	return n;
+}
+
+/* The wake fds of fds in fds, up to LKOS_WAKE_MAX */
+static int lkos_wake_poll_ctx(const struct pollfd *fds, nfds_t nfds,
+			      struct lkos_wake *ws)
+{
+	struct lkos_wake w;
+	int n = 0;
+	nfds_t j;
+
+	for (j = 0; j < nfds && n < LKOS_WAKE_MAX; j++) {
+		if ((fds[j].events & POLLIN) && lkos_wake_get(fds[j].fd, &w))
+			n = lkos_wake_add(ws, n, &w);
+	}
+
+	return n;
+}
+
+/* poll that also waits on ws, the wake fds of fds in fds. What wakes it
+ * is moved or discarded, then the ring or queue data is reported as
+ * stashed data.
+ */
+static int lkos_wake_poll(struct pollfd *fds, nfds_t nfds, int timeout,
+			  const struct lkos_wake *ws, int nw)
+{
+	bool woken, drained = false;
+	struct pollfd *all;
+	uint64_t start;
+	int i, ret;
+	nfds_t j;
+
+	all = malloc((nfds + nw) * sizeof(*all));
+	if (!all)
+		return poll_fn(fds, nfds, timeout);
+
+	start = lkos_tsc();
+	for (;;) {
+		for (i = 0; i < nw; i++)
+			lkos_wake_drain(&ws[i]);
+
+		if (lkos_zc_poll_pending(fds, nfds)) {
+			ret = poll_fn(fds, nfds, 0);
+			if (ret >= 0)
+				ret = lkos_zc_poll_merge(fds, nfds, ret);
+			break;
+		}
+
+		memcpy(all, fds, nfds * sizeof(*all));
+		for (i = 0; i < nw; i++) {
+			all[nfds + i].fd = ws[i].fd;
+			all[nfds + i].events = POLLIN;
+			all[nfds + i].revents = 0;
+		}
+
+		ret = poll_fn(all, nfds + nw, timeout);
+		if (ret == -1)
+			break;
+
+		woken = false;
+		for (i = 0; i < nw; i++) {
+			if (all[nfds + i].revents) {
+				woken = true;
+				ret--;
+			}
+		}
+		for (j = 0; j < nfds; j++)
+			fds[j].revents = all[j].revents;
+
+		if (!woken || (drained && !timeout))
+			break;
+		drained = true;
+		timeout = lkos_spin_timeout(start, timeout);
+	}
+
+	free(all);
+	return ret;
+}
+
+/* As lkos_wake_poll_ctx, for readfds of select */
+static int lkos_wake_select_ctx(int nfds, const fd_set *readfds,
+				struct lkos_wake *ws)
+{
+	struct lkos_wake w;
+	int n = 0, fd;
+
+	for (fd = 0; readfds && fd < nfds && n < LKOS_WAKE_MAX; fd++) {
+		if (FD_ISSET(fd, readfds) && lkos_wake_get(fd, &w) &&
+		    w.fd < FD_SETSIZE)
+			n = lkos_wake_add(ws, n, &w);
+	}
+
+	return n;
+}
+
+/* As lkos_wake_poll, for select. Linux updates the timeout */
+static int lkos_wake_select(int nfds, fd_set *readfds, fd_set *writefds,
+			    fd_set *exceptfds, struct timeval *timeout,
+			    const struct lkos_wake *ws, int nw)
+{
+	fd_set rfds, wfds, efds, pending;
+	bool woken, drained = false;
+	struct timeval tv_zero;
+	int maxfd = nfds, fd, i, ret;
+
+	for (i = 0; i < nw; i++) {
+		if (ws[i].fd >= maxfd)
+			maxfd = ws[i].fd + 1;
+	}
+
+	rfds = *readfds;
+	if (writefds)
+		wfds = *writefds;
+	if (exceptfds)
+		efds = *exceptfds;
+	for (fd = nfds; fd < maxfd; fd++) {
+		FD_CLR(fd, &rfds);
+		if (writefds)
+			FD_CLR(fd, &wfds);
+		if (exceptfds)
+			FD_CLR(fd, &efds);
+	}
+
+	for (;;) {
+		for (i = 0; i < nw; i++)
+			lkos_wake_drain(&ws[i]);
+
+		*readfds = rfds;
+		if (writefds)
+			*writefds = wfds;
+		if (exceptfds)
+			*exceptfds = efds;
+
+		if (lkos_zc_select_pending(nfds, readfds, &pending)) {
+			tv_zero.tv_sec = 0;
+			tv_zero.tv_usec = 0;
+			ret = select_fn(nfds, readfds, writefds, exceptfds,
+					&tv_zero);
+			if (ret >= 0)
+				ret = lkos_zc_select_merge(nfds, readfds,
+							   &pending, ret);
+			break;
+		}
+
+		for (i = 0; i < nw; i++)
+			FD_SET(ws[i].fd, readfds);
+
+		ret = select_fn(maxfd, readfds, writefds, exceptfds, timeout);
+		if (ret == -1)
+			break;
+
+		woken = false;
+		for (i = 0; i < nw; i++) {
+			if (FD_ISSET(ws[i].fd, readfds)) {
+				FD_CLR(ws[i].fd, readfds);
+				woken = true;
+				ret--;
+			}
+		}
+
+		if (!woken || (drained && timeout && !timeout->tv_sec &&
+				 !timeout->tv_usec))
+			break;
+		drained = true;
+	}
+
+	return ret;
+}
+
+/* clustering
+ *
+ * As in Onload, with EF_CLUSTER_NAME set, TCP and UDP sockets that bind
+ * to a port join the cluster of that name on the port, of up to
+ * EF_CLUSTER_SIZE members across processes. The library sets
+ * SO_REUSEPORT before the bind, so that the members share the port, and
+ * attaches a reuseport program to the group, which steers each
+ * connection or datagram to the member on the CPU that received it.
+ * CPUs without a member, or a program that cannot be loaded, leave the
+ * choice to the kernel hash. UDP sockets are steered from the bind, TCP
+ * sockets from listen.
+ *
+ * The CPUs of a member are its SO_INCOMING_CPU if set, as by a named
+ * stack with a CPU set, else the CPUs that the binding thread is pinned
+ * to, else the CPU that it runs on. The last member to bind takes a CPU
+ * from members before it.
+ *
+ * A segment in /dev/shm per address, port and protocol, as a reuseport
+ * group, keeps the name and size of the cluster, the pids of the
+ * members and the id of the BPF socket array by CPU that the program
+ * reads, under flock. Sockets of another
+ * name, or past the size, get EADDRINUSE. Members of processes that
+ * exited without closing are orphans: with EF_CLUSTER_RESTART set, a new
+ * member takes their place, or restarts a cluster of orphans only, else
+ * it gets EBUSY where they are in the way.
+ *
+ * The program needs CAP_BPF and CAP_NET_ADMIN, and finding the array of
+ * another process CAP_SYS_ADMIN. Options are those of the binding thread.
+ * After fork, membership stays with the parent.
+ */
+
+#define LKOS_CL_MAGIC		0x6c6b636c
+#define LKOS_CL_MEMBERS		64		/* the largest cluster size */
+#define LKOS_CL_NAME_LEN	96
+
+struct lkos_cl_hdr {
+	uint32_t magic;
+	uint32_t size;			/* EF_CLUSTER_SIZE of the cluster */
+	uint32_t map_id;		/* socket array by CPU, 0 if none */
+	uint32_t pad;
+	char name[LKOS_OPT_STR_LEN];	/* EF_CLUSTER_NAME of the cluster */
+	pid_t member[LKOS_CL_MEMBERS];	/* 0 if free */
+};
+
+struct lkos_cl {
+	int refs;			/* fds that refer to it, see lkos_cl_dup */
+	pid_t pid;			/* of the member */
+	int member;			/* index in the segment */
+	int fd;				/* of the segment, for flock */
+	struct lkos_cl_hdr *hdr;
+	char name[LKOS_CL_NAME_LEN];	/* of the segment */
+};
+
+static struct lkos_cl *lkos_cl_get(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	return lfd ? __atomic_load_n(&lfd->cl, __ATOMIC_ACQUIRE) : NULL;
+}
+
+static bool lkos_cl_orphan(pid_t pid)
+{
+	return kill(pid, 0) && errno == ESRCH;
+}
+
+/* Take a place in the cluster of hdr, with the segment locked. Returns
+ * the index, or -1 with errno set.
+ */
+static int lkos_cl_take(struct lkos_cl_hdr *hdr, const struct lkos_opts *opts)
+{
+	const char *cname = opts->val[LKOS_OPT_CLUSTER_NAME].s;
+	bool restart = opts->val[LKOS_OPT_CLUSTER_RESTART].i;
+	bool orphan[LKOS_CL_MEMBERS];
+	int64_t size = opts->val[LKOS_OPT_CLUSTER_SIZE].i;
+	int live = 0, orphans = 0, i;
+
+	for (i = 0; i < LKOS_CL_MEMBERS; i++) {
+		orphan[i] = hdr->member[i] && lkos_cl_orphan(hdr->member[i]);
+		if (orphan[i])
+			orphans++;
+		else if (hdr->member[i])
+			live++;
+	}
+
+	if (hdr->magic != LKOS_CL_MAGIC || (!live && (!orphans || restart))) {
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = LKOS_CL_MAGIC;
+		hdr->size = size < 1 ? 1 : size > LKOS_CL_MEMBERS ?
+			    LKOS_CL_MEMBERS : size;
+		strcpy(hdr->name, cname);
+		memset(orphan, 0, sizeof(orphan));
+		orphans = 0;
+	} else if (strcmp(hdr->name, cname)) {
+		errno = live ? EADDRINUSE : EBUSY;
+		return -1;
+	}
+
+	if (live + (restart ? 0 : orphans) >= hdr->size) {
+		errno = live < hdr->size ? EBUSY : EADDRINUSE;
+		return -1;
+	}
+
+	for (i = 0; hdr->member[i] && !(restart && orphan[i]); i++)
+		;
+	hdr->member[i] = getpid();
+	return i;
+}
+
+/* Open and map the segment in cl->name, locked. Returns 0 or -1 */
+static int lkos_cl_open(struct lkos_cl *cl)
+{
+	struct stat st;
+	void *map;
+
+	/* the last member to leave unlinks the segment: retry if it was
+	 * unlinked between the open and the lock
+	 */
+	for (;;) {
+		cl->fd = shm_open(cl->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (cl->fd == -1)
+			return -1;
+		if (flock(cl->fd, LOCK_EX) || fstat(cl->fd, &st))
+			goto fail;
+		if (st.st_nlink)
+			break;
+		close_fn(cl->fd);
+	}
+
+	if (st.st_size < sizeof(*cl->hdr) &&
+	    ftruncate(cl->fd, sizeof(*cl->hdr)))
+		goto fail;
+
+	map = mmap(NULL, sizeof(*cl->hdr), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, cl->fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	cl->hdr = map;
+	return 0;
+
+fail:
+	close_fn(cl->fd);
+	return -1;
+}
+
+/* Drop a reference. The last one leaves the cluster, and the last member
+ * unlinks the segment.
+ */
+static void lkos_cl_put(struct lkos_cl *cl)
+{
+	int i;
+
+	if (__atomic_sub_fetch(&cl->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (cl->pid == getpid() && !flock(cl->fd, LOCK_EX)) {
+		cl->hdr->member[cl->member] = 0;
+		for (i = 0; i < LKOS_CL_MEMBERS && !cl->hdr->member[i]; i++)
+			;
+		if (i == LKOS_CL_MEMBERS)
+			shm_unlink(cl->name);
+		flock(cl->fd, LOCK_UN);
+	}
+
+	munmap(cl->hdr, sizeof(*cl->hdr));
+	close_fn(cl->fd);
+	free(cl);
+}
+
+/* fd binds to addr: join the cluster on its port. Returns 0, or -1 with
+ * errno set if the cluster refuses fd.
+ */
+static int lkos_cl_bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	const struct lkos_opts *opts = lkos_opts_get();
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	char host[2 * sizeof(struct in6_addr) + 1];
+	const uint8_t *a;
+	struct lkos_cl *cl;
+	in_port_t port;
+	int one = 1, type, err, i;
+
+	if (!lfd || !opts->val[LKOS_OPT_CLUSTER_NAME].s[0] ||
+	    !(__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET) ||
+	    __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) == LKOS_STACK_NONACCEL ||
+	    __atomic_load_n(&lfd->cl, __ATOMIC_RELAXED))
+		return 0;
+
+	type = __atomic_load_n(&lfd->type, __ATOMIC_RELAXED);
+	if (type != SOCK_STREAM && type != SOCK_DGRAM)
+		return 0;
+
+	if (addr->sa_family == AF_INET &&
+	    addrlen >= sizeof(struct sockaddr_in)) {
+		port = ((const struct sockaddr_in *)addr)->sin_port;
+		snprintf(host, sizeof(host), "%08x",
+			 ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr));
+	} else if (addr->sa_family == AF_INET6 &&
+		   addrlen >= sizeof(struct sockaddr_in6)) {
+		port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+		a = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+		for (i = 0; i < sizeof(struct in6_addr); i++)
+			snprintf(host + 2 * i, 3, "%02x", a[i]);
+	} else {
+		return 0;
+	}
+	if (!port)
+		return 0;
+
+	if (setsockopt_fn(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+		return -1;
+
+	cl = calloc(1, sizeof(*cl));
+	if (!cl)
+		return -1;
+	snprintf(cl->name, sizeof(cl->name), "/lkos_cl.%lx.%s.%d.%s.%u",
+		 lkos_lo_netns(), type == SOCK_STREAM ? "tcp" : "udp",
+		 addr->sa_family == AF_INET ? 4 : 6, host, ntohs(port));
+	if (lkos_cl_open(cl)) {
+		lkos_warn("cluster: %s: %s\n", cl->name, strerror(errno));
+		free(cl);
+		return 0;
+	}
+
+	cl->member = lkos_cl_take(cl->hdr, opts);
+	flock(cl->fd, LOCK_UN);
+	if (cl->member < 0) {
+		err = errno;
+		cl->refs = 1;
+		lkos_cl_put(cl);
+		errno = err;
+		return -1;
+	}
+
+	cl->pid = getpid();
+	cl->refs = 1;
+	__atomic_store_n(&lfd->cl, cl, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Load the reuseport program:
+ *
+ *	key = bpf_get_smp_processor_id();
+ *	bpf_sk_select_reuseport(ctx, &cpus, &key, 0);
+ *	return SK_PASS;
+ *
+ * Without a socket selected, the kernel hashes.
+ */
+static int lkos_cl_prog_load(int map_fd)
+{
+	struct bpf_insn insns[] = {
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+			      BPF_FUNC_get_smp_processor_id),
+		LKOS_BPF_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -4, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		LKOS_BPF_LD_MAP(BPF_REG_2, map_fd),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -4),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		LKOS_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+			      BPF_FUNC_sk_select_reuseport),
+		LKOS_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		LKOS_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	union bpf_attr attr = {0};
+
+	attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+	attr.expected_attach_type = BPF_SK_REUSEPORT_SELECT;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uintptr_t)"GPL";
+	snprintf(attr.prog_name, sizeof(attr.prog_name), "lkos_cluster");
+	return lkos_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* The socket array of the cluster, created by the first member. Called
+ * with the segment locked.
+ */
+static int lkos_cl_map(struct lkos_cl_hdr *hdr)
+{
+	struct bpf_map_info info = {0};
+	union bpf_attr attr = {0};
+	int map_fd;
+
+	if (hdr->map_id) {
+		attr.map_id = hdr->map_id;
+		map_fd = lkos_bpf(BPF_MAP_GET_FD_BY_ID, &attr);
+		if (map_fd >= 0 || errno != ENOENT)
+			return map_fd;
+	}
+
+	map_fd = lkos_bpf_map_create(BPF_MAP_TYPE_REUSEPORT_SOCKARRAY,
+				     "lkos_cluster", CPU_SETSIZE);
+	if (map_fd == -1)
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.info.bpf_fd = map_fd;
+	attr.info.info_len = sizeof(info);
+	attr.info.info = (uintptr_t)&info;
+	if (lkos_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr)) {
+		close_fn(map_fd);
+		return -1;
+	}
+
+	hdr->map_id = info.id;
+	return map_fd;
+}
+
+/* The CPUs of the member fd, see above */
+static void lkos_cl_cpus(int fd, cpu_set_t *cpus)
+{
+	socklen_t slen = sizeof(int);
+	int cpu = -1;
+
+	if (!getsockopt_fn(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &slen) &&
+	    cpu >= 0 && cpu < CPU_SETSIZE) {
+		CPU_ZERO(cpus);
+		CPU_SET(cpu, cpus);
+		return;
+	}
+
+	if (!sched_getaffinity(0, sizeof(*cpus), cpus) &&
+	    CPU_COUNT(cpus) < sysconf(_SC_NPROCESSORS_ONLN))
+		return;
+
+	CPU_ZERO(cpus);
+	cpu = sched_getcpu();
+	if (cpu >= 0 && cpu < CPU_SETSIZE)
+		CPU_SET(cpu, cpus);
+}
+
+/* fd is bound, or listens: steer its CPUs to it if a socket of type,
+ * SOCK_DGRAM at bind or SOCK_STREAM at listen
+ */
+static void lkos_cl_attach(int fd, int type)
+{
+	struct lkos_cl *cl = lkos_cl_get(fd);
+	int map_fd, prog_fd = -1, cpu;
+	const char *step = NULL;
+	cpu_set_t cpus;
+
+	if (!cl || lkos_fd_get(fd)->type != type || flock(cl->fd, LOCK_EX))
+		return;
+
+	map_fd = lkos_cl_map(cl->hdr);
+	if (map_fd == -1) {
+		step = "map";
+		goto out;
+	}
+
+	lkos_cl_cpus(fd, &cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cpus) &&
+		    lkos_bpf_map_update(map_fd, cpu, fd)) {
+			step = "map update";
+			goto out;
+		}
+	}
+
+	/* the group keeps the program, and the program the array */
+	prog_fd = lkos_cl_prog_load(map_fd);
+	if (prog_fd == -1)
+		step = "prog load";
+	else if (setsockopt_fn(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+			       &prog_fd, sizeof(prog_fd)))
+		step = "SO_ATTACH_REUSEPORT_EBPF";
+
+out:
+	flock(cl->fd, LOCK_UN);
+	if (step)
+		lkos_warn("cluster: %s: %s: %s\n", cl->name, step,
+			  strerror(errno));
+	if (prog_fd != -1)
+		close_fn(prog_fd);
+	if (map_fd != -1)
+		close_fn(map_fd);
+}
+
+/* fd is closed or replaced, or was closed behind our back */
+static void lkos_cl_close(int fd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_cl *cl;
+
+	if (!lfd || !__atomic_load_n(&lfd->cl, __ATOMIC_RELAXED))
+		return;
+
+	cl = __atomic_exchange_n(&lfd->cl, NULL, __ATOMIC_ACQ_REL);
+	if (cl)
+		lkos_cl_put(cl);
+}
+
+/* newfd now refers to the same socket as oldfd */
+static void lkos_cl_dup(int oldfd, int newfd)
+{
+	const struct lkos_fd *old = lkos_fd_get(oldfd);
+	struct lkos_fd *new = lkos_fd_get(newfd);
+	struct lkos_cl *cl;
+
+	if (!old || !new)
+		return;
+
+	lkos_cl_close(newfd);
+
+	cl = __atomic_load_n(&old->cl, __ATOMIC_ACQUIRE);
+	if (!cl)
+		return;
+
+	__atomic_add_fetch(&cl->refs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&new->cl, cl, __ATOMIC_RELEASE);
+}
+
+/* zero-copy send
+ *
+ * onload_zc_alloc_buffers hands out buffers from a second pool, locked
+ * in memory, and onload_zc_send sends them with MSG_ZEROCOPY. The
+ * kernel pins the pages until the data is transmitted, then queues a
+ * notification for a range of send ids on the error queue. Sends wait
+ * in a per-fd queue until then: the intercepted recvmsg(MSG_ERRQUEUE)
+ * returns the buffers of completed sends to the pool, as does
+ * onload_zc_alloc_buffers when the pool runs out. The notifications
+ * are still passed to the application.
+ *
+ * MSG_ZEROCOPY costs a page pinning and a notification per send, more
+ * than a copy of a small message: sends shorter than LKOS_ZC_SEND_MIN
+ * (default 10240) bytes are copied, and their buffers released at once.
+ * So are sends on sockets shared by dup or fork, whose ids cannot be
+ * tracked per fd.
+ *
+ * LKOS_ZC_TX_BUFS (default 1024) buffers of LKOS_ZC_TX_BUF_SIZE
+ * (default 16384) bytes.
+ */
+
+#define LKOS_ZC_TX_PENDING	256
+
+struct lkos_zc_tx_send {
+	uint32_t id;			/* MSG_ZEROCOPY notification id */
+	uint32_t bufs;			/* chain of buffers: index + 1, or 0 */
+};
+
+struct lkos_zc_txq {
+	pthread_mutex_t lock;
+	uint32_t next_id;		/* id of the next zerocopy send */
+	unsigned int head, tail;	/* free running indices into sends */
+	struct lkos_zc_tx_send sends[LKOS_ZC_TX_PENDING];
+};
+
+static long lkos_zc_send_min;
+
+static void lkos_zc_init_tx(void)
+{
+	long nbufs, buf_size;
+
+	nbufs = lkos_getenv_long("LKOS_ZC_TX_BUFS", 1024);
+	if (nbufs <= 0 || nbufs >= UINT32_MAX)
+		nbufs = 1024;
+	buf_size = lkos_getenv_long("LKOS_ZC_TX_BUF_SIZE", 16384);
+	if (buf_size <= 0 || buf_size > 1 << 20)
+		buf_size = 16384;
+	lkos_zc_send_min = lkos_getenv_long("LKOS_ZC_SEND_MIN", 10240);
+
+	lkos_zc_pool_init(&lkos_zc_tx, "zc tx", nbufs, buf_size, false);
+
+	/* pinned: no page faults on first touch, or after swap */
+	if (lkos_zc_tx.bufs &&
+	    mlock(lkos_zc_tx.mem, (size_t)lkos_zc_tx.nbufs * lkos_zc_tx.buf_size))
+		lkos_warn("zc tx: mlock: %s\n", strerror(errno));
+}
+
+static struct lkos_zc_txq *lkos_zc_txq_get(int fd, bool create)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_zc_txq *q, *old = NULL;
+
+	if (!lfd)
+		return NULL;
+
+	q = __atomic_load_n(&lfd->zc_tx, __ATOMIC_ACQUIRE);
+	if (q || !create)
+		return q;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+	pthread_mutex_init(&q->lock, NULL);
+
+	if (!__atomic_compare_exchange_n(&lfd->zc_tx, &old, q, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(q);
+		q = old;
+	}
+
+	return q;
+}
+
+static void lkos_zc_chain_put(uint32_t chain)
+{
+	struct oo_zc_buf *buf;
+
+	while (chain) {
+		buf = &lkos_zc_tx.bufs[chain - 1];
+		chain = buf->next;
+		lkos_zc_buf_put(&lkos_zc_tx, buf);
+	}
+}
+
+/* Release the buffers of sends with ids lo to hi, inclusive */
+static void lkos_zc_tx_complete(struct lkos_zc_txq *q, uint32_t lo, uint32_t hi)
+{
+	struct lkos_zc_tx_send *s;
+	unsigned int i;
+
+	for (i = q->head; i != q->tail; i++) {
+		s = &q->sends[i % LKOS_ZC_TX_PENDING];
+		if (s->bufs && s->id - lo <= hi - lo) {
+			lkos_zc_chain_put(s->bufs);
+			s->bufs = 0;
+		}
+	}
+
+	while (q->head != q->tail && !q->sends[q->head % LKOS_ZC_TX_PENDING].bufs)
+		q->head++;
+}
+
+/* Process the zerocopy notifications in msg, from the error queue */
+static void lkos_zc_tx_notify(struct lkos_zc_txq *q, struct msghdr *msg)
+{
+	const struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+		    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+			continue;
+
+		serr = (void *)CMSG_DATA(cmsg);
+		if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY && !serr->ee_errno)
+			lkos_zc_tx_complete(q, serr->ee_info, serr->ee_data);
+	}
+}
+
+/* Whether the error queue of fd holds only zerocopy notifications. The
+ * kernel has no peek on the error queue: with TX timestamps or IP_RECVERR
+ * enabled, reading it here would discard messages that the application
+ * waits for. Then notifications are only taken from its own
+ * recvmsg(MSG_ERRQUEUE).
+ */
+static bool lkos_zc_tx_reapable(int fd)
+{
+	const int tx = SOF_TIMESTAMPING_TX_HARDWARE |
+		       SOF_TIMESTAMPING_TX_SOFTWARE |
+		       SOF_TIMESTAMPING_TX_SCHED |
+		       SOF_TIMESTAMPING_TX_ACK;
+
+	return !(lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMPING) & tx) &&
+	       !lkos_getsockopt_int(fd, SOL_IP, IP_RECVERR) &&
+	       !lkos_getsockopt_int(fd, SOL_IPV6, IPV6_RECVERR);
+}
+
+/* Read the error queue of fd until empty, if it has only zerocopy
+ * notifications. Called with q locked
+ */
+static void lkos_zc_tx_reap(int fd, struct lkos_zc_txq *q)
+{
+	char ctrl[LKOS_ZC_CTRL_LEN];
+	struct msghdr msg = { .msg_control = ctrl };
+
+	if (q->head == q->tail || !lkos_zc_tx_reapable(fd))
+		return;
+
+	while (q->head != q->tail) {
+		msg.msg_controllen = sizeof(ctrl);
+		if (recvmsg_fn(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		lkos_zc_tx_notify(q, &msg);
+	}
+}
+
+/* Called from recvmsg(MSG_ERRQUEUE) on fd */
+static void lkos_zc_tx_errqueue(int fd, struct msghdr *msg)
+{
+	struct lkos_zc_txq *q = lkos_zc_txq_get(fd, false);
+
+	if (!q || !msg->msg_control)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	lkos_zc_tx_notify(q, msg);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void lkos_zc_tx_reap_fd(int fd)
+{
+	struct lkos_zc_txq *q = lkos_zc_txq_get(fd, false);
+
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	lkos_zc_tx_reap(fd, q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* fd is closed: later sockets with this fd number start at id 0.
+ * Buffers of sends still in flight return to the pool.
+ */
+static void lkos_zc_tx_close(int fd)
+{
+	struct lkos_zc_txq *q = lkos_zc_txq_get(fd, false);
+
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	lkos_zc_tx_reap(fd, q);
+	for (; q->head != q->tail; q->head++)
+		lkos_zc_chain_put(q->sends[q->head % LKOS_ZC_TX_PENDING].bufs);
+	q->head = q->tail = 0;
+	q->next_id = 0;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Enable SO_ZEROCOPY on fd, if not yet. Returns whether enabled */
+static bool lkos_zc_tx_enable(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	unsigned int state;
+	int one = 1;
+
+	if (lfd) {
+		state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+		if (lkos_fd_shared(lfd, state))
+			return false;
+		if (state & LKOS_FD_ZEROCOPY)
+			return true;
+	}
+
+	if (setsockopt_fn(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		return false;
+
+	lkos_fd_set_flag(fd, LKOS_FD_ZEROCOPY, true);
+	return true;
+}
+
+/* Check that iovecs are within buffers from onload_zc_alloc_buffers, and
+ * chain the buffers, each once. Returns the message length or -EINVAL
+ */
+static ssize_t lkos_zc_tx_iov(const struct onload_zc_iovec *zc_iov,
+			      struct iovec *iov, size_t iovlen, uint32_t *chain)
+{
+	struct oo_zc_buf *buf;
+	const char *data;
+	ssize_t len = 0;
+	size_t i, j;
+
+	*chain = 0;
+	for (i = 0; i < iovlen; i++) {
+		buf = zc_iov[i].buf;
+		if (lkos_zc_handle_pool(buf) != &lkos_zc_tx)
+			return -EINVAL;
+
+		data = lkos_zc_buf_data(&lkos_zc_tx, buf);
+		if ((const char *)zc_iov[i].iov_base < data ||
+		    zc_iov[i].iov_len > lkos_zc_tx.buf_size ||
+		    (const char *)zc_iov[i].iov_base + zc_iov[i].iov_len >
+		    data + lkos_zc_tx.buf_size)
+			return -EINVAL;
+
+		iov[i].iov_base = zc_iov[i].iov_base;
+		iov[i].iov_len = zc_iov[i].iov_len;
+		len += zc_iov[i].iov_len;
+
+		for (j = 0; j < i && zc_iov[j].buf != buf; j++)
+			;
+		if (j == i) {
+			buf->next = *chain;
+			*chain = buf->idx + 1;
+		}
+	}
+
+	return len;
+}
+
+/* Send one message. Returns the bytes sent or -errno */
+static int lkos_zc_send_one(struct onload_zc_mmsg *m, int flags)
+{
+	size_t iovlen = m->msg.msghdr.msg_iovlen;
+	struct msghdr mh = m->msg.msghdr;
+	struct lkos_zc_tx_send *s;
+	struct lkos_zc_txq *q;
+	uint32_t chain;
+	ssize_t len, ret;
+
+	if (!iovlen || iovlen > IOV_MAX || !m->msg.iov)
+		return -EINVAL;
+
+	struct iovec iov[iovlen];
+
+	len = lkos_zc_tx_iov(m->msg.iov, iov, iovlen, &chain);
+	if (len < 0)
+		return len;
+
+	mh.msg_iov = iov;
+	mh.msg_iovlen = iovlen;
+
+	/* over loopback rings, MSG_ZEROCOPY would only add a copy */
+	if (!len || len < lkos_zc_send_min || lkos_lo_get(m->fd) ||
+	    !lkos_zc_tx_enable(m->fd) || !(q = lkos_zc_txq_get(m->fd, true))) {
+		ret = lkos_lo_sendmsg_fd(m->fd, &mh, flags);
+		if (ret < 0)
+			return -errno;
+
+		lkos_zc_chain_put(chain);
+		return ret;
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->tail - q->head == LKOS_ZC_TX_PENDING)
+		lkos_zc_tx_reap(m->fd, q);
+	if (q->tail - q->head == LKOS_ZC_TX_PENDING) {
+		pthread_mutex_unlock(&q->lock);
+		return -ENOBUFS;
+	}
+
+	ret = sendmsg_fn(m->fd, &mh, flags | MSG_ZEROCOPY);
+	/* notifications not yet read count against optmem */
+	if (ret < 0 && errno == ENOBUFS) {
+		lkos_zc_tx_reap(m->fd, q);
+		ret = sendmsg_fn(m->fd, &mh, flags | MSG_ZEROCOPY);
+	}
+	if (ret < 0) {
+		ret = -errno;
+		pthread_mutex_unlock(&q->lock);
+		return ret;
+	}
+
+	/* after a partial send, the kernel may still reference any buffer */
+	s = &q->sends[q->tail++ % LKOS_ZC_TX_PENDING];
+	s->id = q->next_id++;
+	s->bufs = chain;
+
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+/* high-level zero-copy receive
+ *
+ * onload_zc_hlrx_recv_zc maps received TCP payload into a per-socket
+ * window with TCP_ZEROCOPY_RECEIVE. The kernel maps only whole pages
+ * that are page aligned in the receive queue: the bytes before them
+ * (recv_skip_hint) are read with recv, and a tail shorter than a page is
+ * copied by the kernel into a copy buffer in the same call.
+ *
+ * The window is LKOS_HLRX_SLOTS slots of LKOS_HLRX_SLOT_SIZE bytes, and
+ * each mapping fills one slot. Copies go to LKOS_HLRX_COPY_BUFS buffers.
+ * Each slot or buffer is a handle for onload_zc_hlrx_buffer_release.
+ * Pages of a released slot stay mapped until the next mapping into it
+ * replaces them.
+ */
+
+#define LKOS_HLRX_SLOTS		16
+#define LKOS_HLRX_SLOT_SIZE	(1 << 18)
+#define LKOS_HLRX_COPY_BUFS	16
+#define LKOS_HLRX_COPY_SIZE	(1 << 16)
+#define LKOS_HLRX_BUFS		(LKOS_HLRX_SLOTS + LKOS_HLRX_COPY_BUFS)
+
+/* struct tcp_zerocopy_receive of linux/tcp.h: glibc declares only the
+ * first three fields, and linux/tcp.h conflicts with netinet/tcp.h
+ */
+struct lkos_tcp_zc {
+	uint64_t address;
+	uint32_t length;
+	uint32_t recv_skip_hint;
+	uint32_t inq;
+	int32_t err;
+	uint64_t copybuf_address;
+	int32_t copybuf_len;
+	uint32_t flags;
+	uint64_t msg_control;
+	uint64_t msg_controllen;
+	uint32_t msg_flags;
+	uint32_t reserved;
+};
+
+struct onload_zc_hlrx {
+	pthread_mutex_t lock;
+	int fd;
+	size_t page_size;
+	char *map;			/* the window, mapped from fd */
+	char *copy;			/* the copy buffers */
+	bool map_failed;		/* TCP_ZEROCOPY_RECEIVE unsupported */
+	uint32_t map_free;		/* freelist of slots: index + 1, or 0 */
+	uint32_t copy_free;		/* freelist of copy buffers */
+	unsigned int used;		/* buffers held by the application */
+	struct oo_zc_buf bufs[LKOS_HLRX_BUFS];	/* slots, then copy buffers */
+};
+
+static void *lkos_hlrx_buf_data(const struct onload_zc_hlrx *hlrx,
+				const struct oo_zc_buf *buf)
+{
+	if (buf->idx < LKOS_HLRX_SLOTS)
+		return hlrx->map + (size_t)buf->idx * LKOS_HLRX_SLOT_SIZE;
+
+	return hlrx->copy + (size_t)(buf->idx - LKOS_HLRX_SLOTS) *
+	       LKOS_HLRX_COPY_SIZE;
+}
+
+static struct oo_zc_buf *lkos_hlrx_buf_get(struct onload_zc_hlrx *hlrx,
+					   uint32_t *list)
+{
+	struct oo_zc_buf *buf;
+
+	if (!*list)
+		return NULL;
+
+	buf = &hlrx->bufs[*list - 1];
+	*list = buf->next;
+	buf->next = UINT32_MAX;		/* held, for buffer_release */
+	hlrx->used++;
+	return buf;
+}
+
+static void lkos_hlrx_buf_put(struct onload_zc_hlrx *hlrx,
+			      struct oo_zc_buf *buf)
+{
+	uint32_t *list = buf->idx < LKOS_HLRX_SLOTS ? &hlrx->map_free :
+						      &hlrx->copy_free;
+
+	buf->next = *list;
+	*list = buf->idx + 1;
+	hlrx->used--;
+}
+
+static void lkos_hlrx_iov(struct onload_zc_hlrx *hlrx,
+			  struct onload_zc_iovec *iov, struct oo_zc_buf *buf,
+			  size_t len)
+{
+	iov->iov_base = lkos_hlrx_buf_data(hlrx, buf);
+	iov->iov_len = len;
+	iov->buf = buf;
+	iov->iov_flags = 0;
+}
+
+/* Read up to max bytes into a copy buffer. Returns iovecs filled, 0 at
+ * end of stream, or -errno: -EAGAIN if no data
+ */
+static int lkos_hlrx_copy(struct onload_zc_hlrx *hlrx,
+			  struct onload_zc_iovec *iov, size_t max)
+{
+	struct oo_zc_buf *buf;
+	ssize_t ret;
+
+	buf = lkos_hlrx_buf_get(hlrx, &hlrx->copy_free);
+	if (!buf)
+		return -ENOBUFS;
+
+	ret = lkos_lo_recv_fd(hlrx->fd, lkos_hlrx_buf_data(hlrx, buf),
+		      max < LKOS_HLRX_COPY_SIZE ? max : LKOS_HLRX_COPY_SIZE,
+		      MSG_DONTWAIT);
+	if (ret <= 0) {
+		lkos_hlrx_buf_put(hlrx, buf);
+		return ret < 0 ? -errno : 0;
+	}
+
+	lkos_hlrx_iov(hlrx, iov, buf, ret);
+	return 1;
+}
+
+/* Receive without blocking into up to two iovecs: a mapped slot and a
+ * copy buffer. Returns the iovecs filled, 0 at end of stream, or
+ * -errno: -EAGAIN if no data
+ */
+static int lkos_hlrx_fill(struct onload_zc_hlrx *hlrx,
+			  struct onload_zc_iovec *iov, size_t niov, size_t max)
+{
+	struct oo_zc_buf *slot, *copy;
+	struct lkos_tcp_zc zc = { 0 };
+	socklen_t len = sizeof(zc);
+	size_t map_len;
+	int n = 0;
+
+	map_len = max < LKOS_HLRX_SLOT_SIZE ? max : LKOS_HLRX_SLOT_SIZE;
+	map_len &= ~(hlrx->page_size - 1);
+	if (hlrx->map_failed || niov < 2 || !map_len || !hlrx->map_free ||
+	    !hlrx->copy_free || lkos_lo_get(hlrx->fd))
+		return lkos_hlrx_copy(hlrx, iov, max);
+
+	slot = lkos_hlrx_buf_get(hlrx, &hlrx->map_free);
+	copy = lkos_hlrx_buf_get(hlrx, &hlrx->copy_free);
+
+	zc.address = (uintptr_t)lkos_hlrx_buf_data(hlrx, slot);
+	zc.length = map_len;
+	zc.copybuf_address = (uintptr_t)lkos_hlrx_buf_data(hlrx, copy);
+	zc.copybuf_len = max - map_len < LKOS_HLRX_COPY_SIZE ?
+			 max - map_len : LKOS_HLRX_COPY_SIZE;
+
+	if (getsockopt_fn(hlrx->fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc,
+			  &len)) {
+		lkos_warn("%s: %s, copying\n", __func__, strerror(errno));
+		hlrx->map_failed = true;
+		lkos_hlrx_buf_put(hlrx, copy);
+		lkos_hlrx_buf_put(hlrx, slot);
+		return lkos_hlrx_copy(hlrx, iov, max);
+	}
+
+	if (zc.length)
+		lkos_hlrx_iov(hlrx, &iov[n++], slot, zc.length);
+	else
+		lkos_hlrx_buf_put(hlrx, slot);
+
+	if (zc.copybuf_len > 0)
+		lkos_hlrx_iov(hlrx, &iov[n++], copy, zc.copybuf_len);
+	else
+		lkos_hlrx_buf_put(hlrx, copy);
+
+	/* unaligned bytes at the head of the queue */
+	if (!n && zc.recv_skip_hint)
+		return lkos_hlrx_copy(hlrx, iov, zc.recv_skip_hint < max ?
+						 zc.recv_skip_hint : max);
+
+	if (!n && zc.err)
+		return -zc.err;
+
+	/* nothing mapped or copied: no data, or end of stream, which
+	 * only recv tells apart
+	 */
+	if (!n)
+		return lkos_hlrx_copy(hlrx, iov, max);
+
+	return n;
+}
+
+/* Delegated sends
+ *
+ * The kernel owns the connection, so the application cannot transmit
+ * delegated data itself: onload_delegated_send_complete sends it with
+ * sendmsg. prepare reports the windows the kernel would apply. The
+ * usable send window is the peer's window less the bytes in flight
+ * (SIOCOUTQ less tcpi_notsent_bytes), the congestion window is
+ * tcpi_snd_cwnd segments less those in flight.
+ *
+ * The headers are built once per connection, from its addresses, with
+ * zero MAC addresses and checksums. The kernel does not expose the
+ * initial sequence number: sequence numbers are relative, counting
+ * the bytes written to the socket.
+ */
+
+#define LKOS_DS_HDR_MAX		128
+
+/* struct tcp_info of linux/tcp.h up to tcpi_snd_wnd: glibc declares
+ * only the fields up to tcpi_total_retrans
+ */
+struct lkos_tcp_info {
+	struct tcp_info info;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+	uint32_t segs_out;
+	uint32_t segs_in;
+	uint32_t notsent_bytes;
+	uint32_t min_rtt;
+	uint32_t data_segs_in;
+	uint32_t data_segs_out;
+	uint64_t delivery_rate;
+	uint64_t busy_time;
+	uint64_t rwnd_limited;
+	uint64_t sndbuf_limited;
+	uint32_t delivered;
+	uint32_t delivered_ce;
+	uint64_t bytes_sent;
+	uint64_t bytes_retrans;
+	uint32_t dsack_dups;
+	uint32_t reord_seen;
+	uint32_t rcv_ooopack;
+	uint32_t snd_wnd;
+};
+
+struct lkos_ds {
+	pthread_mutex_t lock;
+	bool built;			/* headers built for this connection */
+	bool active;			/* between prepare and complete/cancel */
+	int remaining;			/* bytes prepared, not yet completed */
+	char headers[LKOS_DS_HDR_MAX];
+	int headers_len;
+	int tcp_seq_offset;
+	int ip_len_offset;
+	int ip_tcp_hdr_len;
+};
+
+static struct lkos_ds *lkos_ds_get(int fd, bool create)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct lkos_ds *ds, *old = NULL;
+
+	if (!lfd)
+		return NULL;
+
+	ds = __atomic_load_n(&lfd->ds, __ATOMIC_ACQUIRE);
+	if (ds || !create)
+		return ds;
+
+	ds = calloc(1, sizeof(*ds));
+	if (!ds)
+		return NULL;
+	pthread_mutex_init(&ds->lock, NULL);
+
+	if (!__atomic_compare_exchange_n(&lfd->ds, &old, ds, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(ds);
+		ds = old;
+	}
+
+	return ds;
+}
+
+/* fd is closed: a later connection with this fd number needs headers */
+static void lkos_ds_close(int fd)
+{
+	struct lkos_ds *ds = lkos_ds_get(fd, false);
+
+	if (!ds)
+		return;
+
+	pthread_mutex_lock(&ds->lock);
+	ds->built = false;
+	ds->active = false;
+	pthread_mutex_unlock(&ds->lock);
+}
+
+/* Build Ethernet, IP and TCP headers for the connection of fd */
+static int lkos_ds_build(int fd, struct lkos_ds *ds, bool tcp_ts)
+{
+	struct sockaddr_storage local, peer;
+	struct sockaddr_in6 *l6 = (void *)&local, *p6 = (void *)&peer;
+	struct sockaddr_in *l4 = (void *)&local, *p4 = (void *)&peer;
+	socklen_t llen = sizeof(local), plen = sizeof(peer);
+	struct ether_header *eth = (void *)ds->headers;
+	struct tcphdr *th;
+	struct ip6_hdr *ip6;
+	struct iphdr *ip;
+	uint8_t *opt;
+	bool v4;
+
+	if (getsockname(fd, (void *)&local, &llen) ||
+	    getpeername(fd, (void *)&peer, &plen))
+		return -1;
+
+	memset(ds->headers, 0, sizeof(ds->headers));
+
+	v4 = local.ss_family == AF_INET ||
+	     IN6_IS_ADDR_V4MAPPED(&l6->sin6_addr);
+	if (v4) {
+		eth->ether_type = htons(ETHERTYPE_IP);
+		ip = (void *)(eth + 1);
+		ip->version = 4;
+		ip->ihl = sizeof(*ip) / 4;
+		ip->frag_off = htons(IP_DF);
+		ip->ttl = IPDEFTTL;
+		ip->protocol = IPPROTO_TCP;
+		if (local.ss_family == AF_INET) {
+			ip->saddr = l4->sin_addr.s_addr;
+			ip->daddr = p4->sin_addr.s_addr;
+		} else {
+			memcpy(&ip->saddr, &l6->sin6_addr.s6_addr[12], 4);
+			memcpy(&ip->daddr, &p6->sin6_addr.s6_addr[12], 4);
+		}
+		ds->ip_len_offset = (char *)&ip->tot_len - ds->headers;
+		th = (void *)(ip + 1);
+	} else {
+		eth->ether_type = htons(ETHERTYPE_IPV6);
+		ip6 = (void *)(eth + 1);
+		ip6->ip6_flow = htonl(6 << 28);
+		ip6->ip6_nxt = IPPROTO_TCP;
+		ip6->ip6_hlim = IPDEFTTL;
+		ip6->ip6_src = l6->sin6_addr;
+		ip6->ip6_dst = p6->sin6_addr;
+		ds->ip_len_offset = (char *)&ip6->ip6_plen - ds->headers;
+		th = (void *)(ip6 + 1);
+	}
+
+	/* ports are at the same offset in sockaddr_in and sockaddr_in6 */
+	th->source = l4->sin_port;
+	th->dest = p4->sin_port;
+	th->doff = (sizeof(*th) + (tcp_ts ? TCPOLEN_TSTAMP_APPA : 0)) / 4;
+	th->ack = 1;
+	if (tcp_ts) {
+		opt = (void *)(th + 1);
+		opt[0] = TCPOPT_NOP;
+		opt[1] = TCPOPT_NOP;
+		opt[2] = TCPOPT_TIMESTAMP;
+		opt[3] = TCPOLEN_TIMESTAMP;
+	}
+
+	ds->tcp_seq_offset = (char *)&th->seq - ds->headers;
+	ds->headers_len = (char *)th + th->doff * 4 - ds->headers;
+	ds->ip_tcp_hdr_len = ds->headers_len - sizeof(*eth);
+	if (!v4)
+		ds->ip_tcp_hdr_len -= sizeof(*ip6);	/* payload length */
+	ds->built = true;
+	return 0;
+}
+
+static void __attribute__((constructor)) lkos_init(void)
+{
+	lkos_init_log();
+
+	lkos_init_fds();
+	lkos_init_opts();
+	lkos_init_spin();
+
+	lkos_udp_gro = lkos_getenv_long("LKOS_UDP_GRO", 0);
+	lkos_init_gso();
+	lkos_init_uring();
+	lkos_init_xdp();
+	lkos_init_mc();
+
+	accept_fn = lkos_dlsym("accept");
+	accept4_fn = lkos_dlsym("accept4");
+	bind_fn = lkos_dlsym("bind");
+	close_fn = lkos_dlsym("close");
+	close_range_fn = lkos_dlsym("close_range");
+	connect_fn = lkos_dlsym("connect");
+	dup_fn = lkos_dlsym("dup");
+	dup2_fn = lkos_dlsym("dup2");
+	dup3_fn = lkos_dlsym("dup3");
+	epoll_create_fn = lkos_dlsym("epoll_create");
+	epoll_create1_fn = lkos_dlsym("epoll_create1");
+	epoll_ctl_fn = lkos_dlsym("epoll_ctl");
+	epoll_wait_fn = lkos_dlsym("epoll_wait");
+	fcntl_fn = lkos_dlsym("fcntl");
+	fcntl64_fn = lkos_dlsym("fcntl64");
+	getsockopt_fn = lkos_dlsym("getsockopt");
+	ioctl_fn = lkos_dlsym("ioctl");
+	listen_fn = lkos_dlsym("listen");
+	poll_fn = lkos_dlsym("poll");
+	read_fn = lkos_dlsym("read");
+	readv_fn = lkos_dlsym("readv");
+	recv_fn = lkos_dlsym("recv");
+	recvfrom_fn = lkos_dlsym("recvfrom");
+	recvmmsg_fn = lkos_dlsym("recvmmsg");
+	recvmsg_fn = lkos_dlsym("recvmsg");
+	select_fn = lkos_dlsym("select");
+	send_fn = lkos_dlsym("send");
+	sendmmsg_fn = lkos_dlsym("sendmmsg");
+	sendmsg_fn = lkos_dlsym("sendmsg");
+	sendto_fn = lkos_dlsym("sendto");
+	setsockopt_fn = lkos_dlsym("setsockopt");
+	shutdown_fn = lkos_dlsym("shutdown");
+	socket_fn = lkos_dlsym("socket");
+	socketpair_fn = lkos_dlsym("socketpair");
+	write_fn = lkos_dlsym("write");
+	writev_fn = lkos_dlsym("writev");
+
+	lkos_init_stats();
+	lkos_init_log_thread();
+}
+
+
+/* intercepted functions */
+
+/* Spin until a connection is ready, then let the blocking call take it */
+static void lkos_accept_spin(int sockfd)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	uint64_t deadline;
+
+	deadline = lkos_spin_deadline_fd(sockfd, 0, LKOS_SPIN_TCP_ACCEPT, 0);
+	if (!deadline)
+		return;
+
+	do {
+		if (poll_fn(&pfd, 1, 0)) {
+			lkos_spin_hit();
+			return;
+		}
+	} while (lkos_spin_continue(deadline));
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	int ret;
+
+	lkos_accept_spin(sockfd);
+
+	ret = accept_fn(sockfd, addr, addrlen);
+	if (ret >= 0) {
+		lkos_fd_accept(sockfd, ret, 0);
+		lkos_busy_poll_accept(sockfd, ret);
+		lkos_stack_fd_napi(ret);
+		lkos_uring_accept(sockfd, ret);
+		lkos_lo_accept(sockfd, ret);
+	}
+
+	return ret;
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+	int ret;
+
+	lkos_accept_spin(sockfd);
+
+	ret = accept4_fn(sockfd, addr, addrlen, flags);
+	if (ret >= 0) {
+		lkos_fd_accept(sockfd, ret, flags);
+		lkos_busy_poll_accept(sockfd, ret);
+		lkos_stack_fd_napi(ret);
+		lkos_uring_accept(sockfd, ret);
+		lkos_lo_accept(sockfd, ret);
+	}
+
+	return ret;
+}
+
+int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	int ret, err;
+
+	if (lkos_cl_bind(sockfd, addr, addrlen))
+		return -1;
+
+	ret = bind_fn(sockfd, addr, addrlen);
+	if (ret) {
+		err = errno;
+		lkos_cl_close(sockfd);
+		errno = err;
+		return ret;
+	}
+
+	lkos_xdp_bind(sockfd);
+	lkos_cl_attach(sockfd, SOCK_DGRAM);
+
+	return ret;
+}
+
+/* fd is about to be closed */
+static void lkos_close_fd(int fd)
+{
+	/* reset before close: after close, another thread may reuse fd */
+	lkos_fd_reset(fd);
+	lkos_zc_close(fd);
+	lkos_zc_tx_close(fd);
+	lkos_ds_close(fd);
+	lkos_gro_close(fd);
+	lkos_gso_close(fd);
+	lkos_uring_close(fd);
+	lkos_xdp_close(fd);
+	lkos_lo_close(fd);
+	lkos_mc_close(fd);
+	lkos_cl_close(fd);
+}
+
+int close(int fd)
+{
+	lkos_close_fd(fd);
+
+	return close_fn(fd);
+}
+
+int close_range(unsigned int first, unsigned int last, int flags)
+{
+	unsigned int fd;
+
+	/* fds beyond the table have no state */
+	if (!(flags & CLOSE_RANGE_CLOEXEC)) {
+		for (fd = first; fd <= last && fd < (unsigned int)lkos_fd_max; fd++)
+			lkos_close_fd(fd);
+	}
+
+	return close_range_fn(first, last, flags);
+}
+
+/* A blocking TCP connect with spinning: connect non-blocking, spin for
+ * completion, then block in poll for the remainder of SO_SNDTIMEO.
+ */
+static int lkos_connect_spin(int sockfd, const struct sockaddr *addr,
+			     socklen_t addrlen, uint64_t deadline)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+	struct timeval tv = { 0 };
+	socklen_t slen;
+	int flags, ret, err, timeout;
+
+	flags = fcntl_fn(sockfd, F_GETFL);
+	if (flags == -1 || fcntl_fn(sockfd, F_SETFL, flags | O_NONBLOCK))
+		return connect_fn(sockfd, addr, addrlen);
+
+	ret = connect_fn(sockfd, addr, addrlen);
+	if (ret == 0 || errno != EINPROGRESS) {
+		err = errno;
+		fcntl_fn(sockfd, F_SETFL, flags);
+		errno = err;
+		return ret;
+	}
+
+	do {
+		ret = poll_fn(&pfd, 1, 0);
+		if (ret) {
+			lkos_spin_hit();
+			break;
+		}
+	} while (lkos_spin_continue(deadline));
+
+	if (!ret) {
+		slen = sizeof(tv);
+		getsockopt_fn(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, &slen);
+		timeout = tv.tv_sec || tv.tv_usec ?
+			  tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000 : -1;
+		ret = poll_fn(&pfd, 1, timeout);
+	}
+
+	err = errno;
+	fcntl_fn(sockfd, F_SETFL, flags);
+
+	if (ret == -1) {
+		errno = err;
+		return -1;
+	}
+	if (ret == 0) {
+		errno = EINPROGRESS;	/* as the kernel on SO_SNDTIMEO */
+		return -1;
+	}
+
+	slen = sizeof(err);
+	if (getsockopt_fn(sockfd, SOL_SOCKET, SO_ERROR, &err, &slen))
+		return -1;
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct lkos_lo *lo;
+	uint64_t deadline;
+	int ret;
+
+	lkos_gso_flush_fd(sockfd);
+	lo = lkos_lo_connect(sockfd, addr, addrlen);
+
+	deadline = lkos_spin_deadline_fd(sockfd, 0, LKOS_SPIN_TCP_CONNECT, 0);
+	if (deadline)
+		ret = lkos_connect_spin(sockfd, addr, addrlen, deadline);
+	else
+		ret = connect_fn(sockfd, addr, addrlen);
+
+	if (lo)
+		lkos_lo_connect_done(sockfd, lo, ret);
+
+	return ret;
+}
+
+int dup(int oldfd)
+{
+	int ret;
+
+	lkos_gro_dup(oldfd);
+	lkos_gso_dup(oldfd);
+
+	ret = dup_fn(oldfd);
+	if (ret >= 0) {
+		lkos_fd_dup(oldfd, ret);
+		lkos_lo_dup(oldfd, ret);
+		lkos_mc_dup(oldfd, ret);
+		lkos_cl_dup(oldfd, ret);
+	}
+
+	return ret;
+}
+
+int dup2(int oldfd, int newfd)
+{
+	int ret;
+
+	/* newfd is closed first, as by close */
+	if (oldfd != newfd) {
+		lkos_gso_close(newfd);
+		lkos_gro_close(newfd);
+		lkos_gro_dup(oldfd);
+		lkos_gso_dup(oldfd);
+	}
+
+	ret = dup2_fn(oldfd, newfd);
+	if (ret >= 0 && oldfd != newfd) {
+		lkos_uring_close(ret);
+		lkos_xdp_close(ret);
+		lkos_fd_dup(oldfd, ret);
+		lkos_lo_dup(oldfd, ret);
+		lkos_mc_dup(oldfd, ret);
+		lkos_cl_dup(oldfd, ret);
+	}
+
+	return ret;
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+	int ret;
+
+	if (oldfd != newfd) {
+		lkos_gso_close(newfd);
+		lkos_gro_close(newfd);
+		lkos_gro_dup(oldfd);
+		lkos_gso_dup(oldfd);
+	}
+
+	ret = dup3_fn(oldfd, newfd, flags);
+	if (ret >= 0) {
+		lkos_uring_close(ret);
+		lkos_xdp_close(ret);
+		lkos_fd_dup(oldfd, ret);
+		lkos_lo_dup(oldfd, ret);
+		lkos_mc_dup(oldfd, ret);
+		lkos_cl_dup(oldfd, ret);
+	}
+
+	return ret;
+}
+
+int epoll_create(int size)
+{
+	int ret;
+
+	ret = epoll_create_fn(size);
+	if (ret >= 0) {
+		lkos_fd_reset(ret);
+		lkos_epoll_create(ret);
+		lkos_stack_epoll(ret);
+	}
+
+	return ret;
+}
+
+int epoll_create1(int flags)
+{
+	int ret;
+
+	ret = epoll_create1_fn(flags);
+	if (ret >= 0) {
+		lkos_fd_reset(ret);
+		lkos_epoll_create(ret);
+		lkos_stack_epoll(ret);
+	}
+
+	return ret;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int ret;
+
+	ret = epoll_ctl_fn(epfd, op, fd, event);
+	if (!ret) {
+		lkos_epoll_ctl(epfd, op, fd, event);
+		if (op == EPOLL_CTL_ADD) {
+			lkos_stack_fd_napi(fd);
+			lkos_xdp_epoll_add(epfd, fd);
+			lkos_mc_epoll_add(epfd, fd);
+		}
+	}
+
+	return ret;
+}
+
+static int __lkos_epoll_wait(int epfd, struct epoll_event *events,
+			     int maxevents, int timeout)
+{
+	uint64_t deadline, start;
+	int ret, n;
+
+	if (__atomic_load_n(&lkos_zc_stashed, __ATOMIC_RELAXED)) {
+		n = lkos_zc_epoll(epfd, events, maxevents);
+		if (n) {
+			ret = epoll_wait_fn(epfd, events + n, maxevents - n, 0);
+			return lkos_zc_epoll_merge(events, n, ret > 0 ? ret : 0);
+		}
+	}
+
+	deadline = timeout ? lkos_spin_deadline(LKOS_SPIN_EPOLL) : 0;
+	if (deadline) {
+		start = lkos_tsc();
+		do {
+			ret = epoll_wait_fn(epfd, events, maxevents, 0);
+			if (ret) {
+				lkos_spin_hit();
+				return ret;
+			}
+		} while (lkos_spin_continue(deadline));
+
+		timeout = lkos_spin_timeout(start, timeout);
+	}
+
+	return epoll_wait_fn(epfd, events, maxevents, timeout);
+}
+
+/* Wake fds in the set wake the wait: move or discard what woke it,
+ * then wait again, for events or stashed data.
+ */
+static int lkos_epoll_wait(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout)
+{
+	bool drained = false;
+	uint64_t start;
+	int ret;
+
+	if (!lkos_wake_any())
+		return __lkos_epoll_wait(epfd, events, maxevents, timeout);
+
+	start = lkos_tsc();
+	for (;;) {
+		ret = __lkos_epoll_wait(epfd, events, maxevents, timeout);
+		if (ret <= 0)
+			return ret;
+
+		ret = lkos_wake_epoll_filter(events, ret);
+		if (ret || (drained && !timeout))
+			return ret;
+		drained = true;
+		timeout = lkos_spin_timeout(start, timeout);
+	}
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int ret;
+
+	lkos_stats_wait();
+	ret = lkos_epoll_wait(epfd, events, maxevents, timeout);
+	lkos_stats_call = NULL;
+	return ret;
+}
+
+static void lkos_fcntl(int fd, int cmd, void *arg, int ret)
+{
+	if (ret == -1)
+		return;
+
+	switch (cmd) {
+	case F_SETFL:
+		lkos_fd_set_flag(fd, LKOS_FD_NONBLOCK, (long)arg & O_NONBLOCK);
+		break;
+	case F_DUPFD:
+	case F_DUPFD_CLOEXEC:
+		lkos_gro_dup(fd);
+		lkos_gso_dup(fd);
+		lkos_fd_dup(fd, ret);
+		break;
+	}
+}
+
+/* The optional third argument is an int or a pointer: pass as is */
+int fcntl(int fd, int cmd, ...)
+{
+	va_list args;
+	void *arg;
+	int ret;
+
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	ret = fcntl_fn(fd, cmd, arg);
+	lkos_fcntl(fd, cmd, arg, ret);
+
+	return ret;
+}
+
+int fcntl64(int fd, int cmd, ...)
+{
+	va_list args;
+	void *arg;
+	int ret;
+
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	ret = fcntl64_fn(fd, cmd, arg);
+	lkos_fcntl(fd, cmd, arg, ret);
+
+	return ret;
+}
+
+static int __getsockopt_timestamping(int sockfd, void *optval, socklen_t *optlen)
+{
+	struct so_timestamping *ts = (struct so_timestamping *)optval;
+	struct lkos_fd *lfd = lkos_fd_get(sockfd);
+	unsigned int state = 0;
+	uint64_t val = 0;
+	int ret;
+
+	if (lfd) {
+		state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+		val = __atomic_load_n(&lfd->ts, __ATOMIC_RELAXED);
+	}
+
+	/* Return the flags as recorded by __setsockopt_timestamping */
+	if ((state & LKOS_FD_TS_VALID) && !lkos_fd_shared(lfd, state) &&
+	    (*optlen == sizeof(*ts) || *optlen == sizeof(ts->flags))) {
+		memcpy(optval, &val, *optlen);
+		return 0;
+	}
+
+	ret = getsockopt_fn(sockfd, SOL_SOCKET, SO_TIMESTAMPING, optval, optlen);
+	if (ret)
+		return ret;
+
+	if (*optlen != sizeof(*ts) && *optlen != sizeof(ts->flags))
+		return lkos_error(EINVAL, NULL);
+
+	/* The socket is shared with another fd or process: the record is
+	 * valid if no one changed the kernel state since.
+	 */
+	if ((state & LKOS_FD_TS_VALID) &&
+	    ts->flags == __atomic_load_n(&lfd->ts_kernel, __ATOMIC_RELAXED)) {
+		memcpy(optval, &val, *optlen);
+		return 0;
+	}
+
+	/* No record for this socket, e.g., inherited across exec.
+	 * See __setsockopt_timestamping for matching code
+	 *
+	 * If hardware timestamp reporting is enabled, but no recording,
+	 * then it is likely a conversion by that function. Invert when
+	 * returning the current flags in getsockopt.
+	 */
+	if (ts->flags & SOF_TIMESTAMPING_RAW_HARDWARE &&
+	    !(ts->flags & SOF_TIMESTAMPING_TX_HARDWARE) &&
+	    !(ts->flags & SOF_TIMESTAMPING_RX_HARDWARE)) {
+		if (ts->flags & SOF_TIMESTAMPING_RX_SOFTWARE) {
+			ts->flags |= SOF_TIMESTAMPING_RX_HARDWARE;
+			ts->flags &= ~(SOF_TIMESTAMPING_RX_SOFTWARE |
+				       SOF_TIMESTAMPING_SOFTWARE);
+		} if (ts->flags & SOF_TIMESTAMPING_TX_SOFTWARE) {
+			ts->flags |= SOF_TIMESTAMPING_TX_HARDWARE;
+			ts->flags &= ~(SOF_TIMESTAMPING_TX_SOFTWARE |
+				       SOF_TIMESTAMPING_SOFTWARE);
+		}
+	}
+
+	return 0;
+}
+
+int getsockopt(int sockfd, int level, int optname,
+	       void *optval, socklen_t *optlen)
+{
+	lkos_gso_flush_fd(sockfd);
+
+	if (level == SOL_SOCKET &&
+	    optname == SO_TIMESTAMPING)
+		return __getsockopt_timestamping(sockfd, optval, optlen);
+
+	if (((level == SOL_SOCKET && optname == SO_TIMESTAMPNS &&
+	      lkos_fd_onepkt_ts(sockfd)) ||
+	     (level == SOL_UDP && optname == UDP_GRO && lkos_fd_gro_split(sockfd))) &&
+	    optval && *optlen >= sizeof(int)) {
+		*(int *)optval = 0;
+		*optlen = sizeof(int);
+		return 0;
+	}
+
+	return getsockopt_fn(sockfd, level, optname, optval, optlen);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+	int ret;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	lkos_gso_flush_fd(fd);
+
+	if ((request == SIOCINQ || request == SIOCOUTQ) && arg) {
+		ret = lkos_lo_queued(fd, request == SIOCOUTQ);
+		if (ret >= 0) {
+			*(int *)arg = ret;
+			return 0;
+		}
+	}
+
+	ret = ioctl_fn(fd, request, arg);
+	if (!ret && request == FIONBIO)
+		lkos_fd_set_flag(fd, LKOS_FD_NONBLOCK, *(int *)arg);
+
+	return ret;
+}
+
+int listen(int sockfd, int backlog)
+{
+	int ret;
+
+	ret = listen_fn(sockfd, backlog);
+	if (!ret) {
+		lkos_lo_listen(sockfd);
+		lkos_cl_attach(sockfd, SOCK_STREAM);
+	}
+
+	return ret;
+}
+
+static int lkos_getsockopt_int(int fd, int level, int optname)
+{
+	socklen_t slen;
+	int val = 0;
+
+	slen = sizeof(val);
+	if (getsockopt_fn(fd, level, optname, &val, &slen))
+		return 0;
+
+	return val;
+}
+
+/* SOCK_STREAM, SOCK_DGRAM, ...: cached for sockets, else SO_TYPE.
+ * Returns 0 if fd is not a socket.
+ */
+static int lkos_fd_type(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (lfd && (__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET))
+		return __atomic_load_n(&lfd->type, __ATOMIC_RELAXED);
+
+	return lkos_getsockopt_int(fd, SOL_SOCKET, SO_TYPE);
+}
+
+/* Features from the per-fd table. Another fd may have changed a shared
+ * socket: then ask the kernel.
+ */
+static uint32_t lkos_fd_features(int fd, const struct lkos_fd *lfd,
+				 unsigned int state)
+{
+	uint32_t features = 0;
+
+	if ((state & LKOS_FD_URING) &&
+	    __atomic_load_n(&lkos_uring_on, __ATOMIC_RELAXED))
+		features |= LKOS_FD_FEATURE_IO_URING;
+	if (lkos_xdp_get(fd))
+		features |= LKOS_FD_FEATURE_XDP;
+	if (lkos_lo_get(fd))
+		features |= LKOS_FD_FEATURE_LOOPBACK;
+	if (lkos_mc_get(fd))
+		features |= LKOS_FD_FEATURE_MCAST;
+	if (lkos_cl_get(fd))
+		features |= LKOS_FD_FEATURE_CLUSTER;
+
+	if (lkos_fd_shared(lfd, state)) {
+		if (lkos_getsockopt_int(fd, SOL_SOCKET, SO_BUSY_POLL) > 0)
+			features |= LKOS_FD_FEATURE_BUSY_POLL;
+		if (lfd->type == SOCK_DGRAM &&
+		    lkos_getsockopt_int(fd, SOL_UDP, UDP_GRO))
+			features |= LKOS_FD_FEATURE_UDP_GRO;
+		if (lkos_getsockopt_int(fd, SOL_SOCKET, SO_ZEROCOPY))
+			features |= LKOS_FD_FEATURE_ZEROCOPY;
+		if (lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMPING) &
+		    SOF_TIMESTAMPING_RAW_HARDWARE)
+			features |= LKOS_FD_FEATURE_TS_CONVERT;
+		return features;
+	}
+
+	if (state & LKOS_FD_BUSY_POLL)
+		features |= LKOS_FD_FEATURE_BUSY_POLL;
+	if (state & LKOS_FD_UDP_GRO)
+		features |= LKOS_FD_FEATURE_UDP_GRO;
+	if (state & LKOS_FD_ZEROCOPY)
+		features |= LKOS_FD_FEATURE_ZEROCOPY;
+	if (state & LKOS_FD_TS_CONVERT)
+		features |= LKOS_FD_FEATURE_TS_CONVERT;
+	return features;
+}
+
+/* Returns the entry of fd if a socket managed by the library, else NULL */
+static const struct lkos_fd *lkos_fd_managed(int fd, unsigned int *state)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+
+	if (!lfd)
+		return NULL;
+
+	*state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+	if (!(*state & LKOS_FD_SOCKET) ||
+	    __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED) == LKOS_STACK_NONACCEL)
+		return NULL;
+
+	return lfd;
+}
+
+int lkos_fd_stat(int fd, struct lkos_fd_stat *stat)
+{
+	const struct lkos_fd *lfd;
+	unsigned int state;
+
+	lfd = lkos_fd_managed(fd, &state);
+	if (!lfd)
+		return 0;
+	if (!stat)
+		return 1;
+
+	stat->features = lkos_fd_features(fd, lfd, state);
+	stat->busy_poll_usec = lkos_getsockopt_int(fd, SOL_SOCKET, SO_BUSY_POLL);
+	stat->napi_id = lkos_getsockopt_int(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID);
+	return 1;
+}
+
+enum onload_delegated_send_rc
+onload_delegated_send_prepare(int fd, int size, unsigned flags,
+			      struct onload_delegated_send *out)
+{
+	struct lkos_tcp_info ti;
+	socklen_t len = sizeof(ti);
+	int outq, inflight;
+	struct lkos_ds *ds;
+	uint32_t seq;
+
+	/* TCP_INFO fails on other sockets */
+	if (!out || size < 0 ||
+	    getsockopt_fn(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) ||
+	    ti.info.tcpi_state != TCP_ESTABLISHED ||
+	    ioctl_fn(fd, SIOCOUTQ, &outq))
+		return ONLOAD_DELEGATED_SEND_RC_BAD_SOCKET;
+
+	/* before 6.2, no notsent_bytes or snd_wnd */
+	if (len < offsetof(struct lkos_tcp_info, snd_wnd) + sizeof(ti.snd_wnd)) {
+		ti.notsent_bytes = 0;
+		ti.snd_wnd = INT_MAX;
+	}
+	if (ti.notsent_bytes)
+		return ONLOAD_DELEGATED_SEND_RC_SENDQ_BUSY;
+
+	ds = lkos_ds_get(fd, true);
+	if (!ds)
+		return ONLOAD_DELEGATED_SEND_RC_BAD_SOCKET;
+
+	pthread_mutex_lock(&ds->lock);
+	if (!ds->built &&
+	    lkos_ds_build(fd, ds, ti.info.tcpi_options & TCPI_OPT_TIMESTAMPS)) {
+		pthread_mutex_unlock(&ds->lock);
+		return ONLOAD_DELEGATED_SEND_RC_BAD_SOCKET;
+	}
+	if (out->headers_len < ds->headers_len) {
+		pthread_mutex_unlock(&ds->lock);
+		return ONLOAD_DELEGATED_SEND_RC_SMALL_HEADER;
+	}
+
+	memcpy(out->headers, ds->headers, ds->headers_len);
+	seq = htonl(ti.bytes_acked + outq);
+	memcpy((char *)out->headers + ds->tcp_seq_offset, &seq, sizeof(seq));
+	out->headers_len = ds->headers_len;
+	out->tcp_seq_offset = ds->tcp_seq_offset;
+	out->ip_len_offset = ds->ip_len_offset;
+	out->ip_tcp_hdr_len = ds->ip_tcp_hdr_len;
+
+	inflight = outq - ti.notsent_bytes;
+	out->mss = ti.info.tcpi_snd_mss;
+	out->send_wnd = (int64_t)ti.snd_wnd - inflight > INT_MAX ? INT_MAX :
+			ti.snd_wnd - inflight;
+	out->cong_wnd = (int)(ti.info.tcpi_snd_cwnd * ti.info.tcpi_snd_mss) -
+			inflight;
+	out->user_size = size;
+
+	ds->active = true;
+	ds->remaining = size;
+	pthread_mutex_unlock(&ds->lock);
+
+	if (out->send_wnd <= 0)
+		return ONLOAD_DELEGATED_SEND_RC_NOWIN;
+	if (out->cong_wnd <= 0)
+		return ONLOAD_DELEGATED_SEND_RC_NOCWIN;
+
+	return ONLOAD_DELEGATED_SEND_RC_OK;
+}
+
+/* Send the delegated data. Returns the bytes sent, or -1 with errno */
+int onload_delegated_send_complete(int fd, const struct iovec *iov, int iovlen,
+				   int flags)
+{
+	struct msghdr msg = { .msg_iov = (struct iovec *)iov,
+			      .msg_iovlen = iovlen };
+	struct lkos_ds *ds = lkos_ds_get(fd, false);
+	ssize_t ret;
+
+	if (!ds || !__atomic_load_n(&ds->active, __ATOMIC_ACQUIRE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = lkos_lo_sendmsg_fd(fd, &msg, MSG_NOSIGNAL | (flags & MSG_DONTWAIT));
+	if (ret < 0)
+		return -1;
+
+	pthread_mutex_lock(&ds->lock);
+	ds->remaining -= ret;
+	if (ds->remaining <= 0)
+		ds->active = false;
+	pthread_mutex_unlock(&ds->lock);
+
+	return ret;
+}
+
+/* Nothing reached the kernel before complete: just end the delegation */
+int onload_delegated_send_cancel(int fd)
+{
+	struct lkos_ds *ds = lkos_ds_get(fd, false);
+
+	if (!ds)
+		return 0;
+
+	pthread_mutex_lock(&ds->lock);
+	ds->active = false;
+	ds->remaining = 0;
+	pthread_mutex_unlock(&ds->lock);
+	return 0;
+}
+
+/* Returns 1 if supported, 0 if not, -EOPNOTSUPP for unknown features */
+int onload_fd_check_feature(int fd, enum onload_fd_feat feature)
+{
+	unsigned int state;
+
+	switch (feature) {
+	case ONLOAD_FD_FEAT_MSG_WARM:
+		return lkos_fd_managed(fd, &state) ? 1 : 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* Returns 1 for sockets managed by the library, in a stack. The
+ * endpoint id is the fd, the endpoint state the kernel TCP state for
+ * TCP sockets, else 0.
+ */
+int onload_fd_stat(int fd, struct onload_stat *stat)
+{
+	const struct lkos_stack *st;
+	const struct lkos_fd *lfd;
+	struct tcp_info info;
+	unsigned int state;
+	socklen_t slen;
+	int stack;
+
+	lfd = lkos_fd_managed(fd, &state);
+	if (!lfd)
+		return 0;
+	if (!stat)
+		return 1;
+
+	stack = __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED);
+	st = lkos_stack_get(stack);
+
+	stat->stack_name = strdup(st ? st->name : "");
+	if (!stat->stack_name)
+		return -ENOMEM;
+
+	stat->stack_id = stack;
+	stat->endpoint_id = fd;
+	stat->endpoint_state = 0;
+
+	slen = sizeof(info);
+	if (__atomic_load_n(&lfd->type, __ATOMIC_RELAXED) == SOCK_STREAM &&
+	    !getsockopt_fn(fd, SOL_TCP, TCP_INFO, &info, &slen))
+		stat->endpoint_state = info.tcpi_state;
+
+	return 1;
+}
+
+int onload_is_present(void)
+{
+	return 0;
+}
+
+/* Move fd to the stack selected for the calling thread */
+int onload_move_fd(int fd)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	int stack = lkos_stack_cur();
+
+	if (!lfd || !(__atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE) & LKOS_FD_SOCKET))
+		return -EINVAL;
+	if (stack == LKOS_STACK_NONACCEL)
+		return -EINVAL;
+
+	lkos_stack_apply(fd, __atomic_load_n(&lfd->domain, __ATOMIC_RELAXED),
+			 __atomic_load_n(&lfd->type, __ATOMIC_RELAXED), stack);
+	lkos_stack_fd_napi(fd);
+	return 0;
+}
+
+/* Templated sends
+ *
+ * A template is a copy of the message in its own mapping, prefaulted
+ * and locked, with the iovec and msghdr to send it built at alloc.
+ * Updates patch the copy in place, and SEND_NOW sends it with a single
+ * sendmsg: no allocation, copy to a staging buffer or header building
+ * on the send path. Onload restricts templates to TCP; here any
+ * connected socket works.
+ *
+ * Mappings of a page are reused, so that a template allocated ahead of
+ * a send is already in cache and the TLB.
+ */
+
+#define LKOS_TMPL_CACHE		64
+
+struct oo_msg_template {
+	struct oo_msg_template *next;	/* in lkos_tmpl_cache */
+	int fd;
+	size_t map_len;
+	struct iovec iov;
+	struct msghdr msg;
+	char data[];
+};
+
+static pthread_mutex_t lkos_tmpl_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct oo_msg_template *lkos_tmpl_cache;
+static int lkos_tmpl_cached;
+
+static struct oo_msg_template *lkos_msg_template_get(size_t map_len)
+{
+	struct oo_msg_template *tmpl = NULL;
+
+	if (map_len <= getpagesize()) {
+		map_len = getpagesize();
+		pthread_mutex_lock(&lkos_tmpl_lock);
+		tmpl = lkos_tmpl_cache;
+		if (tmpl) {
+			lkos_tmpl_cache = tmpl->next;
+			lkos_tmpl_cached--;
+		}
+		pthread_mutex_unlock(&lkos_tmpl_lock);
+		if (tmpl)
+			return tmpl;
+	}
+
+	tmpl = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (tmpl == MAP_FAILED)
+		return NULL;
+	if (mlock(tmpl, map_len))
+		lkos_warn("%s: mlock: %s\n", __func__, strerror(errno));
+
+	tmpl->map_len = map_len;
+	return tmpl;
+}
+
+static void lkos_msg_template_put(struct oo_msg_template *tmpl)
+{
+	if (tmpl->map_len == getpagesize()) {
+		pthread_mutex_lock(&lkos_tmpl_lock);
+		if (lkos_tmpl_cached < LKOS_TMPL_CACHE) {
+			tmpl->next = lkos_tmpl_cache;
+			lkos_tmpl_cache = tmpl;
+			lkos_tmpl_cached++;
+			tmpl = NULL;
+		}
+		pthread_mutex_unlock(&lkos_tmpl_lock);
+	}
+
+	if (tmpl)
+		munmap(tmpl, tmpl->map_len);
+}
+
+int onload_msg_template_alloc(int fd, const struct iovec *initial_msg,
+			      int mlen, onload_template_handle *handle,
+			      unsigned flags)
+{
+	struct oo_msg_template *tmpl;
+	size_t len = 0, off = 0;
+	int i;
+
+	if (mlen <= 0 || !initial_msg || !handle)
+		return -EINVAL;
+
+	for (i = 0; i < mlen; i++)
+		len += initial_msg[i].iov_len;
+
+	tmpl = lkos_msg_template_get(sizeof(*tmpl) + len);
+	if (!tmpl)
+		return -errno;
+
+	for (i = 0; i < mlen; i++) {
+		memcpy(tmpl->data + off, initial_msg[i].iov_base,
+		       initial_msg[i].iov_len);
+		off += initial_msg[i].iov_len;
+	}
+
+	tmpl->fd = fd;
+	tmpl->iov.iov_base = tmpl->data;
+	tmpl->iov.iov_len = len;
+	memset(&tmpl->msg, 0, sizeof(tmpl->msg));
+	tmpl->msg.msg_iov = &tmpl->iov;
+	tmpl->msg.msg_iovlen = 1;
+
+	*handle = tmpl;
+	return 0;
+}
+
+int onload_msg_template_abort(int fd, onload_template_handle handle)
+{
+	if (!handle || handle->fd != fd)
+		return -EINVAL;
+
+	lkos_msg_template_put(handle);
+	return 0;
+}
+
+/* Send the template. Once any of it is sent, send the rest blocking:
+ * the peer must not see a partial message. The template is consumed
+ * once any of it is sent, also if the rest then fails: it cannot be
+ * sent again.
+ */
+static int lkos_msg_template_send(struct oo_msg_template *tmpl, int flags)
+{
+	ssize_t ret;
+	size_t off;
+	int err = 0;
+
+	ret = lkos_lo_sendmsg_fd(tmpl->fd, &tmpl->msg, MSG_NOSIGNAL | flags);
+	if (ret < 0)
+		return -errno;
+
+	for (off = ret; off < tmpl->iov.iov_len; off += ret) {
+		ret = lkos_lo_send_fd(tmpl->fd, tmpl->data + off,
+				      tmpl->iov.iov_len - off, MSG_NOSIGNAL);
+		if (ret < 0) {
+			err = -errno;
+			break;
+		}
+	}
+
+	lkos_msg_template_put(tmpl);
+	return err;
+}
+
+/* Apply updates in order. With ONLOAD_TEMPLATE_FLAGS_SEND_NOW, then
+ * send the template, which is consumed unless nothing could be sent.
+ */
+int onload_msg_template_update(int fd, onload_template_handle handle,
+			       const struct onload_template_msg_update_iovec *updates,
+			       int ulen, unsigned flags)
+{
+	int i;
+
+	if (!handle || handle->fd != fd || ulen < 0 || (ulen && !updates))
+		return -EINVAL;
+
+	for (i = 0; i < ulen; i++) {
+		if (updates[i].otmu_offset < 0 ||
+		    updates[i].otmu_len > handle->iov.iov_len ||
+		    updates[i].otmu_offset > handle->iov.iov_len -
+					     updates[i].otmu_len)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < ulen; i++)
+		memcpy(handle->data + updates[i].otmu_offset,
+		       updates[i].otmu_base, updates[i].otmu_len);
+
+	if (!(flags & ONLOAD_TEMPLATE_FLAGS_SEND_NOW))
+		return 0;
+
+	return lkos_msg_template_send(handle, flags & ONLOAD_TEMPLATE_FLAGS_DONTWAIT);
+}
+
+/* WODA: wire order delivery
+ *
+ * For each readable socket, peek at the head of the receive queue to
+ * learn the receive timestamp of the first packet, the length of the
+ * data that shares that timestamp (one datagram, or for TCP the bytes
+ * of the head skb) and the timestamp of the data queued behind it.
+ *
+ * Data queued behind the head of any socket may be older than the head
+ * of another. So the earliest of these second timestamps is the
+ * ordering limit: all heads before the limit can be consumed in
+ * timestamp order. Sockets whose head lies beyond the limit are
+ * returned after these, with bytes 0: they must not be read yet.
+ *
+ * Timestamps are the receive timestamps requested by the application
+ * with SO_TIMESTAMPING. Raw hardware timestamps are preferred over
+ * software. Sockets without timestamps are returned first with ts 0,
+ * as in Onload.
+ */
+
+#define LKOS_WODA_PEEK_MAX	(64 << 10)
+
+enum lkos_woda_class {
+	LKOS_WODA_UNORDERED,
+	LKOS_WODA_ORDERED,
+	LKOS_WODA_BEYOND_LIMIT,
+};
+
+struct lkos_woda {
+	struct epoll_event ev;
+	struct timespec ts;
+	struct timespec next;		/* tv_sec 0: no data queued behind */
+	int bytes;
+	int class;
+	int idx;
+};
+
+static __thread struct lkos_woda *lkos_woda_buf;
+static __thread int lkos_woda_len;
+static __thread char *lkos_peek_buf;
+
+static int lkos_ts_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Peek len bytes from the head of the receive queue.
+ *
+ * Returns the number of bytes peeked (with MSG_TRUNC: the datagram
+ * length) and in ts the rx timestamp of the last skb peeked, or zero.
+ * SO_TIMESTAMPING is preferred over SO_TIMESTAMPNS and SO_TIMESTAMP.
+ */
+static ssize_t lkos_peek_ts(int fd, size_t len, int flags, struct timespec *ts)
+{
+	char ctrl[256] __attribute__((aligned(8)));
+	struct scm_timestamping *tss;
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	struct timeval tv;
+	struct iovec iov;
+	ssize_t ret;
+
+	if (len && !lkos_peek_buf) {
+		lkos_peek_buf = malloc(LKOS_WODA_PEEK_MAX + 1);
+		if (!lkos_peek_buf)
+			return -1;
+	}
+
+	iov.iov_base = lkos_peek_buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	ts->tv_sec = 0;
+	ts->tv_nsec = 0;
+
+	ret = lkos_lo_recvmsg_fd(fd, &msg, flags | MSG_PEEK | MSG_DONTWAIT);
+	if (ret < 0)
+		return ret;
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cm->cmsg_type == SCM_TIMESTAMPING) {
+			tss = (void *) CMSG_DATA(cm);
+			*ts = tss->ts[2].tv_sec ? tss->ts[2] : tss->ts[0];
+		} else if (cm->cmsg_type == SCM_TIMESTAMPNS && !ts->tv_sec) {
+			memcpy(ts, CMSG_DATA(cm), sizeof(*ts));
+		} else if (cm->cmsg_type == SCM_TIMESTAMP && !ts->tv_sec) {
+			memcpy(&tv, CMSG_DATA(cm), sizeof(tv));
+			ts->tv_sec = tv.tv_sec;
+			ts->tv_nsec = tv.tv_usec * 1000;
+		}
+	}
+
+	return ret;
+}
+
+/* Peeks start at the peek offset of the application, if it set one.
+ * Clear it, and return it in prev for lkos_peek_off_restore.
+ */
+static bool lkos_peek_off_clear(int fd, int *prev)
+{
+	socklen_t len = sizeof(*prev);
+	int off = -1;
+
+	if (getsockopt_fn(fd, SOL_SOCKET, SO_PEEK_OFF, prev, &len))
+		*prev = -1;
+
+	return *prev < 0 ||
+	       !setsockopt_fn(fd, SOL_SOCKET, SO_PEEK_OFF, &off, sizeof(off));
+}
+
+static void lkos_peek_off_restore(int fd, int prev)
+{
+	if (prev >= 0)
+		setsockopt_fn(fd, SOL_SOCKET, SO_PEEK_OFF, &prev, sizeof(prev));
+}
+
+static void lkos_woda_dgram(int fd, struct lkos_woda *w)
+{
+	int off, prev, ret;
+
+	/* a multicast ring is read first */
+	ret = lkos_mc_peek_ts(fd, 0, &w->ts);
+	if (ret >= 0) {
+		w->bytes = ret;
+		if (lkos_mc_peek_ts(fd, 1, &w->next) < 0)
+			w->next.tv_sec = 0;
+		return;
+	}
+
+	if (!lkos_peek_off_clear(fd, &prev))
+		return;
+
+	ret = lkos_peek_ts(fd, 0, MSG_TRUNC, &w->ts);
+	if (ret < 0)
+		goto out;
+	w->bytes = ret;
+	if (!w->ts.tv_sec)
+		goto out;
+
+	/* Peek at the second datagram: skip the first with a peek offset */
+	off = ret;
+	if (setsockopt_fn(fd, SOL_SOCKET, SO_PEEK_OFF, &off, sizeof(off)))
+		goto out;
+	if (lkos_peek_ts(fd, 0, MSG_TRUNC, &w->next) < 0)
+		w->next.tv_sec = 0;
+	off = -1;
+	if (prev < 0)
+		setsockopt_fn(fd, SOL_SOCKET, SO_PEEK_OFF, &off, sizeof(off));
+
+out:
+	lkos_peek_off_restore(fd, prev);
+}
+
+/* Learn the length of the head skb, up to max bytes */
+static void __lkos_woda_stream(int fd, struct lkos_woda *w, int max)
+{
+	struct timespec ts;
+	int inq, lo, hi, mid;
+
+	inq = lkos_lo_queued(fd, false);
+	if ((inq < 0 && ioctl_fn(fd, SIOCINQ, &inq)) || inq <= 0)
+		return;
+	if (lkos_peek_ts(fd, 1, 0, &w->ts) != 1 || !w->ts.tv_sec)
+		return;
+
+	/* Find the end of the head skb: the longest peek that ends on data
+	 * with the same timestamp. Peek reports the timestamp of the last
+	 * skb that it touched.
+	 */
+	lo = 1;
+	hi = inq < max ? inq : max;
+	if (lkos_peek_ts(fd, hi, 0, &ts) == hi && !lkos_ts_cmp(&ts, &w->ts)) {
+		lo = hi;
+	} else {
+		while (lo < hi - 1) {
+			mid = lo + (hi - lo) / 2;
+			if (lkos_peek_ts(fd, mid, 0, &ts) == mid &&
+			    !lkos_ts_cmp(&ts, &w->ts))
+				lo = mid;
+			else
+				hi = mid;
+		}
+	}
+	w->bytes = lo;
+
+	if (lo < inq && lo < max &&
+	    lkos_peek_ts(fd, lo + 1, 0, &ts) == lo + 1)
+		w->next = ts;
+}
+
+static void lkos_woda_stream(int fd, struct lkos_woda *w, int max)
+{
+	int prev;
+
+	if (!lkos_peek_off_clear(fd, &prev))
+		return;
+	__lkos_woda_stream(fd, w, max);
+	lkos_peek_off_restore(fd, prev);
+}
+
+static int lkos_woda_cmp(const void *_a, const void *_b)
+{
+	const struct lkos_woda *a = _a, *b = _b;
+	int ret;
+
+	if (a->class != b->class)
+		return a->class - b->class;
+	if (a->class != LKOS_WODA_UNORDERED) {
+		ret = lkos_ts_cmp(&a->ts, &b->ts);
+		if (ret)
+			return ret;
+	}
+	return a->idx - b->idx;
+}
+
+static void lkos_woda_probe(struct lkos_epoll *ep, struct lkos_woda *w)
+{
+	int fd, type;
+
+	if (!(w->ev.events & EPOLLIN))
+		return;
+
+	if (ep) {
+		pthread_mutex_lock(&ep->lock);
+		fd = lkos_epoll_key_lookup(ep, w->ev.data.u64);
+		pthread_mutex_unlock(&ep->lock);
+	} else {
+		fd = w->ev.data.fd;
+	}
+	if (fd < 0)
+		return;
+
+	type = lkos_fd_type(fd);
+	if (!type)
+		return;
+
+	if (type == SOCK_STREAM)
+		lkos_woda_stream(fd, w, LKOS_WODA_PEEK_MAX);
+	else
+		lkos_woda_dgram(fd, w);
+}
+
+int onload_ordered_epoll_wait(int epfd, struct epoll_event *events,
+			      struct onload_ordered_epoll_event *oo_events,
+			      int maxevents, int timeout)
+{
+	struct timespec limit = {0};
+	struct lkos_epoll *ep;
+	struct lkos_woda *w;
+	int i, ret;
+
+	ret = lkos_epoll_wait(epfd, events, maxevents, timeout);
+	if (ret <= 0)
+		return ret;
+
+	if (ret > lkos_woda_len) {
+		w = realloc(lkos_woda_buf, ret * sizeof(*w));
+		if (!w) {
+			/* tv_sec == 0 disables wire-order, defined in onload_extensions.h */
+			for (i = 0; i < ret; i++)
+				oo_events[i].ts.tv_sec = 0;
+			return ret;
+		}
+		lkos_woda_buf = w;
+		lkos_woda_len = ret;
+	}
+	w = lkos_woda_buf;
+
+	ep = lkos_epoll_get(epfd);
+
+	for (i = 0; i < ret; i++) {
+		memset(&w[i], 0, sizeof(w[i]));
+		w[i].ev = events[i];
+		w[i].idx = i;
+		lkos_woda_probe(ep, &w[i]);
+
+		if (w[i].next.tv_sec &&
+		    (!limit.tv_sec || lkos_ts_cmp(&w[i].next, &limit) < 0))
+			limit = w[i].next;
+	}
+
+	for (i = 0; i < ret; i++) {
+		if (!w[i].ts.tv_sec) {
+			w[i].class = LKOS_WODA_UNORDERED;
+		} else if (!limit.tv_sec || lkos_ts_cmp(&w[i].ts, &limit) <= 0) {
+			w[i].class = LKOS_WODA_ORDERED;
+		} else {
+			w[i].class = LKOS_WODA_BEYOND_LIMIT;
+			w[i].bytes = 0;
+		}
+	}
+
+	qsort(w, ret, sizeof(*w), lkos_woda_cmp);
+
+	for (i = 0; i < ret; i++) {
+		events[i] = w[i].ev;
+		oo_events[i].ts = w[i].ts;
+		oo_events[i].bytes = w[i].bytes;
+	}
+
+	return ret;
+}
+
+int onload_set_stackname(int who, int scope, const char* stackname)
+{
+	struct lkos_stack *st;
+	uint64_t sel;
+	int stack;
+
+	if (who != ONLOAD_THIS_THREAD && who != ONLOAD_ALL_THREADS)
+		return -EINVAL;
+	if (scope < ONLOAD_SCOPE_NOCHANGE || scope > ONLOAD_SCOPE_GLOBAL)
+		return -EINVAL;
+
+	/* keep the scope of the current stack */
+	if (scope == ONLOAD_SCOPE_NOCHANGE) {
+		st = lkos_stack_get(lkos_stack_cur());
+		scope = st && st->tid ? ONLOAD_SCOPE_THREAD : ONLOAD_SCOPE_PROCESS;
+	}
+
+	if (stackname == ONLOAD_DONT_ACCELERATE) {
+		stack = LKOS_STACK_NONACCEL;
+	} else if (!*stackname) {
+		stack = LKOS_STACK_DEFAULT;
+	} else {
+		if (strlen(stackname) >= LKOS_STACK_NAME_LEN)
+			return -EINVAL;
+
+		stack = lkos_stack_find(stackname,
+					scope == ONLOAD_SCOPE_THREAD ? gettid() : 0);
+		if (stack < 0)
+			return stack;
+	}
+
+	sel = lkos_stack_sel(stack);
+	if (who == ONLOAD_ALL_THREADS)
+		__atomic_store_n(&lkos_stack_all, sel, __ATOMIC_RELAXED);
+	else
+		lkos_stack_thread = sel;
+
+	return 0;
+}
+
+int onload_socket_nonaccel(int domain, int type, int protocol)
+{
+	int ret;
+
+	ret = socket_fn(domain, type, protocol);
+	if (ret >= 0) {
+		lkos_debug("socket: fd %d: domain %d type 0x%x\n", ret, domain,
+			   type);
+		lkos_lo_close(ret);	/* if closed behind our back */
+		lkos_mc_close(ret);
+		lkos_cl_close(ret);
+		lkos_uring_close(ret);
+		lkos_fd_socket(ret, domain, type);
+		lkos_stack_apply(ret, domain, type, LKOS_STACK_NONACCEL);
+	}
+
+	return ret;
+}
+
+int onload_stackname_restore(void)
+{
+	if (!lkos_stack_nsaved)
+		return -EINVAL;
+
+	lkos_stack_nsaved--;
+	lkos_stack_thread = lkos_stack_sel((int8_t)lkos_stack_saved[lkos_stack_nsaved]);
+	return 0;
+}
+
+int onload_stackname_save(void)
+{
+	if (lkos_stack_nsaved == LKOS_STACK_SAVE_MAX)
+		return -ENOMEM;
+
+	lkos_stack_saved[lkos_stack_nsaved++] = lkos_stack_sel_cur();
+	return 0;
+}
+
+int onload_stack_opt_get_int(const char* opt, int64_t *val)
+{
+	int i = lkos_opt_find(opt);
+
+	if (i < 0 || lkos_opt_defs[i].is_str || !val)
+		return -EINVAL;
+
+	*val = lkos_opts_get()->val[i].i;
+	return 0;
+}
+
+/* On -ENOSPC, *val_out_len is set to the required length */
+int onload_stack_opt_get_str(const char* opt, char* val_out, size_t* val_out_len)
+{
+	int i = lkos_opt_find(opt);
+	size_t len;
+
+	if (i < 0 || !lkos_opt_defs[i].is_str || !val_out || !val_out_len)
+		return -EINVAL;
+
+	len = strlen(lkos_opts_get()->val[i].s) + 1;
+	if (len > *val_out_len) {
+		*val_out_len = len;
+		return -ENOSPC;
+	}
+
+	memcpy(val_out, lkos_opts_get()->val[i].s, len);
+	*val_out_len = len;
+	return 0;
+}
+
+int onload_stack_opt_reset(void)
+{
+	lkos_opts_thread_valid = false;
+	return 0;
+}
+
+int onload_stack_opt_set_int(const char* opt, int64_t val)
+{
+	int i = lkos_opt_find(opt);
+	struct lkos_opts *opts;
+
+	if (i < 0 || lkos_opt_defs[i].is_str)
+		return -EINVAL;
+
+	opts = lkos_opts_get_thread();
+	opts->val[i].i = val;
+	opts->val[i].set = true;
+	lkos_opts_update(opts);
+	return 0;
+}
+
+int onload_stack_opt_set_str(const char* opt, const char* val)
+{
+	int i = lkos_opt_find(opt);
+	struct lkos_opts *opts;
+
+	if (i < 0 || !lkos_opt_defs[i].is_str || !val ||
+	    strlen(val) >= LKOS_OPT_STR_LEN)
+		return -EINVAL;
+
+	opts = lkos_opts_get_thread();
+	strcpy(opts->val[i].s, val);
+	opts->val[i].set = true;
+	return 0;
+}
+
+/* onload_zc_recv through the zero-copy receive pool: call the callback
+ * for each message until it returns ONLOAD_ZC_TERMINATE or no more data
+ * is available. Blocks for the first message, unless MSG_DONTWAIT.
+ */
+static int lkos_zc_recv(int fd, struct onload_zc_recv_args *args, int flags)
+{
+	struct lkos_zc_stash *st;
+	enum onload_zc_callback_rc rc;
+	size_t controllen;
+	socklen_t namelen;
+	bool was_stashed, delivered = false;
+	int ret = 0;
+
+	pthread_once(&lkos_zc_rx.once, lkos_zc_init_rx);
+	if (!lkos_zc_rx.bufs)
+		return -ENOMEM;
+
+	st = lkos_zc_stash_get(fd, true);
+	if (!st)
+		return -ENOMEM;
+
+	namelen = args->msg.msghdr.msg_name ? args->msg.msghdr.msg_namelen : 0;
+	controllen = args->msg.msghdr.msg_control ?
+		     args->msg.msghdr.msg_controllen : 0;
+
+	pthread_mutex_lock(&st->lock);
+	was_stashed = st->count;
+
+	for (;;) {
+		if (!st->count) {
+			ret = lkos_zc_fill(fd, st, delivered ? MSG_DONTWAIT :
+					   flags | MSG_WAITFORONE, controllen);
+			if (ret <= 0) {
+				/* after delivering, no more data is success */
+				if (delivered)
+					ret = 0;
+				break;
+			}
+		}
+
+		rc = lkos_zc_deliver(st, args, namelen, controllen);
+		delivered = true;
+		ret = 0;
+
+		if (rc & ONLOAD_ZC_TERMINATE)
+			break;
+	}
+
+	lkos_zc_stash_update(st, was_stashed);
+	pthread_mutex_unlock(&st->lock);
+
+	return ret;
+}
+
+int onload_zc_recv(int fd, struct onload_zc_recv_args *args)
+{
+	struct lkos_xdp_sock *s;
+
+	if (!args || !args->cb)
+		return -EINVAL;
+
+	s = lkos_xdp_get(fd);
+	if (s)
+		return lkos_xdp_zc_recv(fd, s, args);
+
+	return lkos_zc_recv(fd, args, args->flags & MSG_DONTWAIT);
+}
+
+int onload_zc_alloc_buffers(int fd, struct onload_zc_iovec *iovecs,
+			    int iovecs_len,
+			    enum onload_zc_buffer_type_flags flags)
+{
+	struct oo_zc_buf *buf;
+	bool reaped = false;
+	int i;
+
+	pthread_once(&lkos_zc_tx.once, lkos_zc_init_tx);
+	if (!lkos_zc_tx.bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < iovecs_len; i++) {
+		buf = lkos_zc_buf_get(&lkos_zc_tx);
+		if (!buf && !reaped) {
+			lkos_zc_tx_reap_fd(fd);
+			reaped = true;
+			buf = lkos_zc_buf_get(&lkos_zc_tx);
+		}
+		if (!buf) {
+			while (i--)
+				lkos_zc_buf_put(&lkos_zc_tx, iovecs[i].buf);
+			return -ENOMEM;
+		}
+
+		iovecs[i].iov_base = lkos_zc_buf_data(&lkos_zc_tx, buf);
+		iovecs[i].iov_len = lkos_zc_tx.buf_size;
+		iovecs[i].buf = buf;
+		iovecs[i].iov_flags = 0;
+	}
+
+	return 0;
+}
+
+int onload_zc_release_buffers(int fd, onload_zc_handle *bufs, int bufs_len)
+{
+	struct lkos_zc_pool *pool;
+	struct lkos_xdp *x;
+	int i;
+
+	for (i = 0; i < bufs_len; i++) {
+		pool = lkos_zc_handle_pool(bufs[i]);
+		if (pool) {
+			lkos_zc_buf_put(pool, bufs[i]);
+			continue;
+		}
+
+		x = lkos_xdp_handle(bufs[i]);
+		if (!x)
+			return -EINVAL;
+		lkos_xdp_release(x, bufs[i]);
+	}
+
+	return 0;
+}
+
+/* Send each message, until one fails. Returns the number of messages
+ * processed, with the bytes sent or -errno in their rc. Buffers of sent
+ * messages belong to the library, those of a failed one to the caller.
+ */
+int onload_zc_send(struct onload_zc_mmsg *msgs, int mlen, int flags)
+{
+	int i;
+
+	for (i = 0; i < mlen; i++) {
+		msgs[i].rc = lkos_zc_send_one(&msgs[i], flags);
+		if (msgs[i].rc < 0)
+			return i + 1;
+	}
+
+	return mlen;
+}
+
+int onload_zc_hlrx_alloc(int fd, int flags, struct onload_zc_hlrx **hlrx_out)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct onload_zc_hlrx *hlrx;
+	socklen_t slen = sizeof(int);
+	int proto, err, i;
+
+	if (getsockopt_fn(fd, SOL_SOCKET, SO_PROTOCOL, &proto, &slen))
+		return -errno;
+	if (proto != IPPROTO_TCP)
+		return -EINVAL;
+
+	hlrx = calloc(1, sizeof(*hlrx));
+	if (!hlrx)
+		return -ENOMEM;
+
+	pthread_mutex_init(&hlrx->lock, NULL);
+	hlrx->fd = fd;
+	hlrx->page_size = sysconf(_SC_PAGESIZE);
+
+	hlrx->copy = mmap(NULL, LKOS_HLRX_COPY_BUFS * LKOS_HLRX_COPY_SIZE,
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+	if (hlrx->copy == MAP_FAILED) {
+		err = errno;
+		free(hlrx);
+		return -err;
+	}
+
+	/* without the window, all data is copied */
+	hlrx->map = lkos_lo_get(fd) ? MAP_FAILED :
+		    mmap(NULL, LKOS_HLRX_SLOTS * LKOS_HLRX_SLOT_SIZE, PROT_READ,
+			 MAP_SHARED, fd, 0);
+	if (hlrx->map == MAP_FAILED) {
+		lkos_warn("%s: mmap: %s, copying\n", __func__, strerror(errno));
+		hlrx->map = NULL;
+		hlrx->map_failed = true;
+	}
+
+	for (i = 0; i < LKOS_HLRX_BUFS; i++) {
+		hlrx->bufs[i].idx = i;
+		hlrx->bufs[i].next = i + 2;
+	}
+	hlrx->bufs[LKOS_HLRX_SLOTS - 1].next = 0;
+	hlrx->bufs[LKOS_HLRX_BUFS - 1].next = 0;
+	hlrx->map_free = 1;
+	hlrx->copy_free = LKOS_HLRX_SLOTS + 1;
+
+	if (lfd)
+		__atomic_store_n(&lfd->hlrx, hlrx, __ATOMIC_RELEASE);
+
+	*hlrx_out = hlrx;
+	return 0;
+}
+
+/* All buffers must have been released */
+int onload_zc_hlrx_free(struct onload_zc_hlrx *hlrx)
+{
+	struct lkos_fd *lfd = lkos_fd_get(hlrx->fd);
+	struct onload_zc_hlrx *old = hlrx;
+
+	if (hlrx->used)
+		return -EBUSY;
+
+	/* fd may have been closed and reused with another hlrx */
+	if (lfd)
+		__atomic_compare_exchange_n(&lfd->hlrx, &old, NULL, false,
+					    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+	if (hlrx->map)
+		munmap(hlrx->map, LKOS_HLRX_SLOTS * LKOS_HLRX_SLOT_SIZE);
+	munmap(hlrx->copy, LKOS_HLRX_COPY_BUFS * LKOS_HLRX_COPY_SIZE);
+	pthread_mutex_destroy(&hlrx->lock);
+	free(hlrx);
+	return 0;
+}
+
+int onload_zc_hlrx_buffer_release(int fd, onload_zc_handle buf)
+{
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	struct onload_zc_hlrx *hlrx;
+
+	hlrx = lfd ? __atomic_load_n(&lfd->hlrx, __ATOMIC_ACQUIRE) : NULL;
+	if (!hlrx || buf < hlrx->bufs || buf >= hlrx->bufs + LKOS_HLRX_BUFS)
+		return -EINVAL;
+
+	pthread_mutex_lock(&hlrx->lock);
+	if (buf->next != UINT32_MAX) {
+		pthread_mutex_unlock(&hlrx->lock);
+		return -EINVAL;
+	}
+	lkos_hlrx_buf_put(hlrx, buf);
+	pthread_mutex_unlock(&hlrx->lock);
+	return 0;
+}
+
+ssize_t onload_zc_hlrx_recv_copy(struct onload_zc_hlrx *hlrx,
+				 struct msghdr *msg, int flags)
+{
+	ssize_t ret;
+
+	ret = lkos_lo_recvmsg_fd(hlrx->fd, msg, flags);
+	return ret < 0 ? -errno : ret;
+}
+
+/* Receive up to max_bytes into at most msg_iovlen iovecs of msg->iov,
+ * blocking for the first byte unless MSG_DONTWAIT. Returns the bytes
+ * received, with msg_iovlen set to the iovecs filled, 0 at end of
+ * stream, or -errno.
+ */
+ssize_t onload_zc_hlrx_recv_zc(struct onload_zc_hlrx *hlrx,
+			       struct onload_zc_msg *msg, size_t max_bytes,
+			       int flags)
+{
+	size_t niov = msg->msghdr.msg_iovlen, n = 0, i;
+	ssize_t total = 0;
+	char c;
+	int ret;
+
+	if (!niov || !msg->iov || !max_bytes)
+		return -EINVAL;
+
+	/* honours SO_RCVTIMEO, and returns 0 at end of stream */
+	if (!(flags & MSG_DONTWAIT)) {
+		ret = lkos_lo_recv_fd(hlrx->fd, &c, 1, MSG_PEEK);
+		if (ret <= 0)
+			return ret < 0 ? -errno : 0;
+	}
+
+	pthread_mutex_lock(&hlrx->lock);
+	while (n < niov && total < max_bytes) {
+		ret = lkos_hlrx_fill(hlrx, &msg->iov[n], niov - n,
+				     max_bytes - total);
+		if (ret <= 0) {
+			if (!total)
+				total = ret;
+			break;
+		}
+
+		for (i = n; i < n + ret; i++)
+			total += msg->iov[i].iov_len;
+		n += ret;
+	}
+	pthread_mutex_unlock(&hlrx->lock);
+
+	msg->msghdr.msg_iovlen = n;
+	msg->msghdr.msg_flags = 0;
+	return total;
+}
+
+static int __poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct lkos_wake ws[LKOS_WAKE_MAX];
+	uint64_t deadline, start;
+	int ret, nw;
+
+	if (lkos_wake_any()) {
+		nw = lkos_wake_poll_ctx(fds, nfds, ws);
+		if (nw)
+			return lkos_wake_poll(fds, nfds, timeout, ws, nw);
+	}
+
+	if (__atomic_load_n(&lkos_zc_stashed, __ATOMIC_RELAXED) &&
+	    lkos_zc_poll_pending(fds, nfds)) {
+		ret = poll_fn(fds, nfds, 0);
+		return ret < 0 ? ret : lkos_zc_poll_merge(fds, nfds, ret);
+	}
+
+	deadline = timeout ? lkos_spin_deadline(LKOS_SPIN_POLL) : 0;
+	if (deadline) {
+		start = lkos_tsc();
+		do {
+			ret = poll_fn(fds, nfds, 0);
+			if (ret) {
+				lkos_spin_hit();
+				return ret;
+			}
+		} while (lkos_spin_continue(deadline));
+
+		timeout = lkos_spin_timeout(start, timeout);
+	}
+
+	return poll_fn(fds, nfds, timeout);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	int ret;
+
+	lkos_stats_wait();
+	ret = __poll(fds, nfds, timeout);
+	lkos_stats_call = NULL;
+	return ret;
+}
+
+static void __recvmsg_timestamping(struct msghdr *msg)
+{
+	struct scm_timestamping *tss;
+	struct cmsghdr *cm;
+
+	/* Unconditionally copy the sw timestamp from ts[0]
+	 * to the raw hw timestamp field ts[2]
+	 *
+	 * The fields are undefined if the relevant SOF_.. option was not set,
+	 * so it is safe to fill in both fields if only one at a time is set.
+	 */
+	for (cm = CMSG_FIRSTHDR(msg);
+	     cm && cm->cmsg_len;
+	     cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_TIMESTAMPING) {
+			tss = (void *) CMSG_DATA(cm);
+			tss->ts[2] = tss->ts[0];
+			lkos_stat_call(LKOS_STAT_TS_CONVERT);
+		}
+	}
+}
+
+static ssize_t lkos_recv(int sockfd, void *buf, size_t len, int flags)
+{
+	uint64_t deadline;
+	bool spun = false;
+	ssize_t ret;
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_RECV,
+					 LKOS_SPIN_TCP_RECV, flags);
+	if (deadline) {
+		do {
+			ret = lkos_uring_recv(sockfd, buf, len,
+					      flags | MSG_DONTWAIT);
+			if (lkos_spin_done(ret, &spun))
+				return ret;
+		} while (lkos_spin_continue(deadline));
+	}
+
+	return lkos_uring_recv(sockfd, buf, len, flags);
+}
+
+/* ONLOAD_MSG_ONEPKT: read no further than the end of the first packet
+ *
+ * Datagram sockets return one packet per call. For TCP, the segment
+ * boundaries are the boundaries between skbs in the receive queue,
+ * found by peeking at their rx timestamps (see __lkos_woda_stream).
+ * Segments that the kernel coalesced into one skb, by GRO or when
+ * queueing, are read as one packet.
+ *
+ * The flag aliases MSG_SENDPAGE_NOTLAST and is never passed to Linux.
+ */
+
+/* Enable rx timestamps, if the application did not: SO_TIMESTAMPNS,
+ * hidden from the application. Only timestamped data has boundaries.
+ *
+ * Returns whether fd is a TCP socket with rx timestamps.
+ */
+static bool lkos_onepkt_enable(int fd)
+{
+	struct lkos_fd *lfd = lkos_fd_get(fd);
+	unsigned int state = 0, flag = LKOS_FD_ONEPKT;
+	int ts, one = 1;
+
+	if (lfd)
+		state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
+	if (state & LKOS_FD_ONEPKT)
+		return true;
+
+	if (lkos_fd_type(fd) != SOCK_STREAM)
+		return false;
+
+	/* SO_TIMESTAMPING must both generate and report rx timestamps */
+	ts = lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMPING);
+	if (!lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMP) &&
+	    !lkos_getsockopt_int(fd, SOL_SOCKET, SO_TIMESTAMPNS) &&
+	    !((ts & SOF_TIMESTAMPING_RX_SOFTWARE) &&
+	      (ts & SOF_TIMESTAMPING_SOFTWARE)) &&
+	    !((ts & SOF_TIMESTAMPING_RX_HARDWARE) &&
+	      (ts & SOF_TIMESTAMPING_RAW_HARDWARE))) {
+		if (setsockopt_fn(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)))
+			return false;
+		flag |= LKOS_FD_ONEPKT_TS;
+	}
+
+	lkos_fd_set_flag(fd, flag, true);
+	return true;
+}
+
+/* Returns len, or less to end the read at the first segment boundary */
+static size_t lkos_onepkt_len(int fd, size_t len, int flags)
+{
+	struct lkos_woda w = {0};
+	int prev;
+	char c;
+
+	if (!len || !lkos_onepkt_enable(fd) || !lkos_peek_off_clear(fd, &prev))
+		return len;
+
+	/* Wait for data as the read would, then find the head skb */
+	if (lkos_recv(fd, &c, 1, MSG_PEEK | (flags & MSG_DONTWAIT)) == 1)
+		__lkos_woda_stream(fd, &w, len < LKOS_WODA_PEEK_MAX ?
+					   len : LKOS_WODA_PEEK_MAX);
+	lkos_peek_off_restore(fd, prev);
+
+	if (w.bytes > 0 && w.bytes < len)
+		return w.bytes;
+
+	return len;
+}
+
+/* The SO_TIMESTAMPNS control messages enabled by lkos_onepkt_enable
+ * are received into a buffer of the library, with room for them on top
+ * of the application's msg_controllen: so that they neither take its
+ * space nor set MSG_CTRUNC. The other messages are copied back.
+ * Applications with more control space than the buffer receive into
+ * their own: that leaves room for all that TCP may return.
+ */
+
+#define LKOS_ONEPKT_CTRL_LEN	512
+
+struct lkos_onepkt_ctl {
+	void *control;			/* the application's */
+	size_t controllen;
+	char buf[LKOS_ONEPKT_CTRL_LEN] __attribute__((aligned(8)));
+};
+
+/* Returns whether msg now points to c->buf */
+static bool lkos_onepkt_ctl_begin(int fd, struct msghdr *msg, int flags,
+				  struct lkos_onepkt_ctl *c)
+{
+	const size_t ts_space = CMSG_SPACE(sizeof(struct timespec));
+
+	if (!lkos_fd_onepkt_ts(fd) || (flags & MSG_ERRQUEUE))
+		return false;
+
+	c->control = msg->msg_control;
+	c->controllen = msg->msg_control ? msg->msg_controllen : 0;
+	if (c->controllen > sizeof(c->buf) - ts_space)
+		return false;
+
+	msg->msg_control = c->buf;
+	msg->msg_controllen = c->controllen + ts_space;
+	return true;
+}
+
+static void lkos_onepkt_ctl_end(struct msghdr *msg, struct lkos_onepkt_ctl *c,
+				ssize_t ret)
+{
+	struct cmsghdr *cm;
+	size_t len = 0, space;
+
+	if (ret >= 0) {
+		lkos_cmsg_remove(msg, SOL_SOCKET, SCM_TIMESTAMPNS);
+		for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+			space = CMSG_SPACE(cm->cmsg_len - CMSG_LEN(0));
+			if (len + space > c->controllen) {
+				msg->msg_flags |= MSG_CTRUNC;
+				break;
+			}
+			len += space;
+		}
+		if (len)
+			memcpy(c->control, c->buf, len);
+	}
+
+	msg->msg_control = c->control;
+	msg->msg_controllen = ret >= 0 ? len : c->controllen;
+}
+
+/* Remove the SO_TIMESTAMPNS control messages of an application buffer
+ * too large for lkos_onepkt_ctl_begin
+ */
+static void lkos_onepkt_strip(int fd, struct msghdr *msg)
+{
+	if (lkos_fd_onepkt_ts(fd))
+		lkos_cmsg_remove(msg, SOL_SOCKET, SCM_TIMESTAMPNS);
+}
+
+static ssize_t __read(int fd, void *buf, size_t count)
+{
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+
+	lkos_gso_flush_fd(fd);
+
+	lo = lkos_lo_get(fd);
+	if (lo)
+		return lkos_lo_recv(fd, lo, buf, count, 0);
+
+	ms = lkos_mc_get(fd);
+	if (ms)
+		return lkos_mc_recvfrom(fd, ms, buf, count, 0, NULL, NULL);
+
+	return read_fn(fd, buf, count);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(fd);
+	ssize_t ret = __read(fd, buf, count);
+
+	return lkos_stats_end(row, fd, false, ret, NULL);
+}
+
+static ssize_t __readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = { .msg_iov = (struct iovec *)iov,
+			      .msg_iovlen = iovcnt };
+	struct lkos_lo *lo;
+
+	lkos_gso_flush_fd(fd);
+
+	lo = lkos_lo_get(fd);
+	if (lo && iovcnt >= 0 && iovcnt <= IOV_MAX)
+		return lkos_lo_recvmsg(fd, lo, &msg, 0);
+
+	return readv_fn(fd, iov, iovcnt);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(fd);
+	ssize_t ret = __readv(fd, iov, iovcnt);
+
+	return lkos_stats_end(row, fd, false, ret, NULL);
+}
+
+static ssize_t __recv(int sockfd, void *buf, size_t len, int flags)
+{
+	struct lkos_xdp_sock *s;
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+
+	lkos_gso_flush_fd(sockfd);
+
+	lo = lkos_lo_get(sockfd);
+	if (lo && !(flags & MSG_ERRQUEUE))
+		return lkos_lo_recv(sockfd, lo, buf, len, flags & ~ONLOAD_MSG_ONEPKT);
+
+	if (flags & ONLOAD_MSG_ONEPKT) {
+		flags &= ~ONLOAD_MSG_ONEPKT;
+		len = lkos_onepkt_len(sockfd, len, flags);
+	}
+
+	s = lkos_xdp_get(sockfd);
+	if (s && !(flags & MSG_ERRQUEUE))
+		return lkos_xdp_recvfrom(sockfd, s, buf, len, flags, NULL, NULL);
+
+	ms = lkos_mc_get(sockfd);
+	if (ms && !(flags & MSG_ERRQUEUE))
+		return lkos_mc_recvfrom(sockfd, ms, buf, len, flags, NULL, NULL);
+
+	if (lkos_gro_active(sockfd) && !(flags & MSG_ERRQUEUE))
+		return lkos_gro_recvfrom(sockfd, buf, len, flags, NULL, NULL);
+
+	return lkos_recv(sockfd, buf, len, flags);
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	ssize_t ret = __recv(sockfd, buf, len, flags);
+
+	return lkos_stats_end(row, sockfd, false, ret, NULL);
+}
+
+static ssize_t __recvfrom(int sockfd, void *buf, size_t len, int flags,
+			  struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct lkos_xdp_sock *s;
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+	uint64_t deadline;
+	bool spun = false;
+	ssize_t ret;
+
+	lkos_gso_flush_fd(sockfd);
+
+	lo = lkos_lo_get(sockfd);
+	if (lo && !(flags & MSG_ERRQUEUE)) {
+		if (src_addr && addrlen)
+			*addrlen = 0;
+		return lkos_lo_recv(sockfd, lo, buf, len, flags & ~ONLOAD_MSG_ONEPKT);
+	}
+
+	if (flags & ONLOAD_MSG_ONEPKT) {
+		flags &= ~ONLOAD_MSG_ONEPKT;
+		len = lkos_onepkt_len(sockfd, len, flags);
+	}
+
+	s = lkos_xdp_get(sockfd);
+	if (s && !(flags & MSG_ERRQUEUE))
+		return lkos_xdp_recvfrom(sockfd, s, buf, len, flags,
+					 src_addr, addrlen);
+
+	ms = lkos_mc_get(sockfd);
+	if (ms && !(flags & MSG_ERRQUEUE))
+		return lkos_mc_recvfrom(sockfd, ms, buf, len, flags,
+					src_addr, addrlen);
+
+	if (lkos_gro_active(sockfd) && !(flags & MSG_ERRQUEUE))
+		return lkos_gro_recvfrom(sockfd, buf, len, flags,
+					 src_addr, addrlen);
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_RECV,
+					 LKOS_SPIN_TCP_RECV, flags);
+	if (deadline) {
+		do {
+			ret = lkos_uring_recvfrom(sockfd, buf, len,
+						  flags | MSG_DONTWAIT,
+						  src_addr, addrlen);
+			if (lkos_spin_done(ret, &spun))
+				return ret;
+		} while (lkos_spin_continue(deadline));
+	}
+
+	return lkos_uring_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
+		 struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	ssize_t ret = __recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+
+	return lkos_stats_end(row, sockfd, false, ret, NULL);
+}
+
+static ssize_t lkos_recvmsg_spin(int sockfd, struct msghdr *msg, int flags)
+{
+	uint64_t deadline;
+	bool spun = false;
+	ssize_t ret;
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_RECV,
+					 LKOS_SPIN_TCP_RECV, flags);
+	if (deadline) {
+		do {
+			ret = lkos_uring_recvmsg(sockfd, msg, flags | MSG_DONTWAIT);
+			if (lkos_spin_done(ret, &spun))
+				return ret;
+		} while (lkos_spin_continue(deadline));
+	}
+
+	return lkos_uring_recvmsg(sockfd, msg, flags);
+}
+
+static ssize_t lkos_recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	struct lkos_onepkt_ctl ctl;
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+	ssize_t ret;
+
+	lo = lkos_lo_get(sockfd);
+	if (lo && !(flags & MSG_ERRQUEUE))
+		return lkos_lo_recvmsg(sockfd, lo, msg, flags);
+
+	ms = lkos_mc_get(sockfd);
+	if (ms && !(flags & MSG_ERRQUEUE))
+		return lkos_mc_recvmsg(sockfd, ms, msg, flags);
+
+	if (!lkos_onepkt_ctl_begin(sockfd, msg, flags, &ctl))
+		return lkos_recvmsg_spin(sockfd, msg, flags);
+
+	ret = lkos_recvmsg_spin(sockfd, msg, flags);
+	lkos_onepkt_ctl_end(msg, &ctl, ret);
+	return ret;
+}
+
+/* recvmsg, with the iovec shortened to len bytes for the call */
+static ssize_t lkos_recvmsg_len(int sockfd, struct msghdr *msg, int flags,
+				size_t len)
+{
+	size_t iovlen = msg->msg_iovlen, iov_len = 0, i;
+	ssize_t ret;
+
+	for (i = 0; i < iovlen; i++) {
+		if (msg->msg_iov[i].iov_len >= len)
+			break;
+		len -= msg->msg_iov[i].iov_len;
+	}
+	if (i < iovlen) {
+		iov_len = msg->msg_iov[i].iov_len;
+		msg->msg_iov[i].iov_len = len;
+		msg->msg_iovlen = i + 1;
+	}
+
+	ret = lkos_recvmsg(sockfd, msg, flags);
+
+	if (i < iovlen) {
+		msg->msg_iov[i].iov_len = iov_len;
+		msg->msg_iovlen = iovlen;
+	}
+
+	return ret;
+}
+
+static size_t lkos_iov_len(const struct msghdr *msg)
+{
+	size_t len = 0, i;
+
+	for (i = 0; i < msg->msg_iovlen; i++)
+		len += msg->msg_iov[i].iov_len;
+
+	return len;
+}
+
+static ssize_t __recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	struct lkos_xdp_sock *s;
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+	ssize_t ret;
+
+	lkos_gso_flush_fd(sockfd);
+
+	lo = lkos_lo_get(sockfd);
+	if (lo && !(flags & MSG_ERRQUEUE))
+		return lkos_lo_recvmsg(sockfd, lo, msg, flags & ~ONLOAD_MSG_ONEPKT);
+
+	/* datagrams: one packet per call */
+	s = lkos_xdp_get(sockfd);
+	if (s && !(flags & MSG_ERRQUEUE))
+		return lkos_xdp_recvmsg(sockfd, s, msg, flags & ~ONLOAD_MSG_ONEPKT);
+
+	ms = lkos_mc_get(sockfd);
+	if (ms && !(flags & MSG_ERRQUEUE)) {
+		flags &= ~ONLOAD_MSG_ONEPKT;
+		ret = lkos_mc_recvmsg(sockfd, ms, msg, flags);
+	} else if (flags & ONLOAD_MSG_ONEPKT) {
+		flags &= ~ONLOAD_MSG_ONEPKT;
+		ret = lkos_recvmsg_len(sockfd, msg, flags,
+				       lkos_onepkt_len(sockfd, lkos_iov_len(msg), flags));
+	} else if (lkos_gro_active(sockfd) && !(flags & MSG_ERRQUEUE)) {
+		ret = lkos_gro_recvmsg(sockfd, msg, flags);
+	} else {
+		ret = lkos_recvmsg(sockfd, msg, flags);
+	}
+
+	if (ret >= 0)
+		lkos_onepkt_strip(sockfd, msg);
+
+	if (ret >= 0 && (flags & MSG_ERRQUEUE))
+		lkos_zc_tx_errqueue(sockfd, msg);
+
+	if (ret >= 0 && msg->msg_control && msg->msg_controllen &&
+	    lkos_fd_ts_convert(sockfd))
+		__recvmsg_timestamping(msg);
+
+	return ret;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	ssize_t ret = __recvmsg(sockfd, msg, flags);
+
+	if (ret >= 0)
+		lkos_stats_drops(row, sockfd, msg);
+	return lkos_stats_end(row, sockfd, false, ret, NULL);
+}
+
+/* Without MSG_WAITFORONE, a blocking recvmmsg waits for vlen messages:
+ * after a partial batch while spinning, block for the remainder.
+ */
+static int lkos_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+			 int flags, struct timespec *timeout)
+{
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+	uint64_t deadline;
+	bool spun = false;
+	int ret, more;
+
+	lo = lkos_lo_get(sockfd);
+	if (lo && !(flags & MSG_ERRQUEUE))
+		return lkos_lo_recvmmsg(sockfd, lo, msgvec, vlen, flags);
+
+	ms = lkos_mc_get(sockfd);
+	if (ms && !(flags & MSG_ERRQUEUE))
+		return lkos_mc_recvmmsg(sockfd, ms, msgvec, vlen, flags, timeout);
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_RECV,
+					 LKOS_SPIN_TCP_RECV, flags);
+	if (deadline) {
+		do {
+			ret = recvmmsg_fn(sockfd, msgvec, vlen,
+					  flags | MSG_DONTWAIT, NULL);
+			if (lkos_spin_done(ret, &spun)) {
+				if (ret <= 0 || ret == vlen ||
+				    (flags & MSG_WAITFORONE))
+					return ret;
+
+				more = recvmmsg_fn(sockfd, msgvec + ret,
+						   vlen - ret, flags, timeout);
+				return more > 0 ? ret + more : ret;
+			}
+		} while (lkos_spin_continue(deadline));
+	}
+
+	return recvmmsg_fn(sockfd, msgvec, vlen, flags, timeout);
+}
+
+/* Linux TCP recvmmsg is a loop over recvmsg. With onepkt, end each
+ * message at the first segment boundary. Either way, each message goes
+ * through lkos_recvmsg, which hides the timestamps of onepkt. As in
+ * Linux, timeout is only checked between messages: here it is not
+ * checked at all.
+ */
+static int lkos_recvmmsg_loop(int sockfd, struct mmsghdr *msgvec,
+			      unsigned int vlen, int flags, bool onepkt)
+{
+	struct msghdr *mh;
+	unsigned int i;
+	size_t len;
+	ssize_t ret;
+
+	for (i = 0; i < vlen; i++) {
+		mh = &msgvec[i].msg_hdr;
+		len = lkos_iov_len(mh);
+		if (onepkt)
+			len = lkos_onepkt_len(sockfd, len, flags);
+		ret = lkos_recvmsg_len(sockfd, mh, flags, len);
+		if (ret < 0)
+			return i ? i : -1;
+
+		msgvec[i].msg_len = ret;
+		if (!ret)
+			return i + 1;
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+
+	return i;
+}
+
+static int __recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		      int flags, struct timespec *timeout)
+{
+	struct lkos_xdp_sock *s;
+	struct lkos_mc_sock *ms;
+	struct lkos_lo *lo;
+	bool convert;
+	int ret, i;
+
+	lkos_gso_flush_fd(sockfd);
 
-/* library support functions */
+	lo = lkos_lo_get(sockfd);
+	if (lo && !(flags & MSG_ERRQUEUE))
+		return lkos_lo_recvmmsg(sockfd, lo, msgvec, vlen,
+					flags & ~ONLOAD_MSG_ONEPKT);
 
-static void lkos_log(const char *fmt, ...)
-{
-	if (lkos_log_fd) {
-		va_list args;
+	s = lkos_xdp_get(sockfd);
+	if (s && !(flags & MSG_ERRQUEUE))
+		return lkos_xdp_recvmmsg(sockfd, s, msgvec, vlen,
+					 flags & ~ONLOAD_MSG_ONEPKT, timeout);
 
-		va_start(args, fmt);
-		vdprintf(lkos_log_fd, fmt, args);
-		va_end(args);
+	ms = lkos_mc_get(sockfd);
+	if (ms && !(flags & MSG_ERRQUEUE)) {
+		flags &= ~ONLOAD_MSG_ONEPKT;
+		ret = lkos_mc_recvmmsg(sockfd, ms, msgvec, vlen, flags, timeout);
+	} else if (flags & ONLOAD_MSG_ONEPKT) {
+		flags &= ~ONLOAD_MSG_ONEPKT;
+		if (lkos_onepkt_enable(sockfd))
+			ret = lkos_recvmmsg_loop(sockfd, msgvec, vlen, flags, true);
+		else if (lkos_gro_active(sockfd))
+			ret = lkos_gro_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+		else
+			ret = lkos_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+	} else if (lkos_gro_active(sockfd) && !(flags & MSG_ERRQUEUE)) {
+		ret = lkos_gro_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+	} else if (lkos_fd_onepkt_ts(sockfd) && !(flags & MSG_ERRQUEUE)) {
+		ret = lkos_recvmmsg_loop(sockfd, msgvec, vlen, flags, false);
+	} else {
+		ret = lkos_recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+	}
+
+	if (ret <= 0)
+		return ret;
+
+	convert = lkos_fd_ts_convert(sockfd);
+	for (i = 0; i < ret; i++) {
+		struct msghdr *mh = &msgvec[i].msg_hdr;
+
+		lkos_onepkt_strip(sockfd, mh);
+		if (convert && mh->msg_controllen)
+			__recvmsg_timestamping(mh);
 	}
+
+	return ret;
 }
 
-static int __attribute__((unused)) __lkos_error(int err, const char *msg, const char *fn, int lineno)
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
 {
-	if (msg)
-		lkos_log("%s.%d: %s\n", fn, lineno, msg);
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	int i, ret = __recvmmsg(sockfd, msgvec, vlen, flags, timeout);
 
-	errno = err;
-	return 1;
+	for (i = 0; i < ret; i++)
+		lkos_stats_drops(row, sockfd, &msgvec[i].msg_hdr);
+	return lkos_stats_end(row, sockfd, false, ret, msgvec);
 }
-#define lkos_error(err, msg) __lkos_error(err, msg, __func__, __LINE__)
 
-static void * __attribute__((used)) lkos_dlsym(const char *symbol_str)
+/* select modifies the sets: spin on copies, restored for each attempt */
+static int __select(int nfds, fd_set *readfds, fd_set *writefds,
+		    fd_set *exceptfds, struct timeval *timeout)
 {
-	void *fn;
+	struct lkos_wake ws[LKOS_WAKE_MAX];
+	fd_set rfds, wfds, efds, pending;
+	struct timeval tv_zero;
+	uint64_t deadline, start;
+	int64_t timeout_us;
+	int ret, nw;
 
-	fn = dlsym(RTLD_NEXT, symbol_str);
-	if (!fn) {
-		lkos_log("%s: %s: %s\n", __func__, symbol_str, dlerror());
-		exit(1);
+	if (lkos_wake_any() && nfds >= 0 && nfds <= FD_SETSIZE) {
+		nw = lkos_wake_select_ctx(nfds, readfds, ws);
+		if (nw)
+			return lkos_wake_select(nfds, readfds, writefds,
+						exceptfds, timeout, ws, nw);
 	}
 
-	return fn;
-};
+	if (__atomic_load_n(&lkos_zc_stashed, __ATOMIC_RELAXED) &&
+	    nfds >= 0 && nfds <= FD_SETSIZE &&
+	    lkos_zc_select_pending(nfds, readfds, &pending)) {
+		tv_zero.tv_sec = 0;
+		tv_zero.tv_usec = 0;
+		ret = select_fn(nfds, readfds, writefds, exceptfds, &tv_zero);
+		return ret < 0 ? ret : lkos_zc_select_merge(nfds, readfds,
+							     &pending, ret);
+	}
 
-static void lkos_init_log(void)
-{
-	unsigned long fd_val;
-	const char *fd_str;
+	if (timeout && !timeout->tv_sec && !timeout->tv_usec)
+		deadline = 0;
+	else if (nfds < 0 || nfds > FD_SETSIZE)
+		deadline = 0;
+	else
+		deadline = lkos_spin_deadline(LKOS_SPIN_SELECT);
 
-	fd_str = getenv("LKOS_LOG_FD");
-	if (!fd_str)
-		return;
+	if (deadline) {
+		if (readfds)
+			rfds = *readfds;
+		if (writefds)
+			wfds = *writefds;
+		if (exceptfds)
+			efds = *exceptfds;
 
-	fd_val = strtoul(fd_str, NULL, 0);
-	if (fd_val > INT_MAX)
-		return;
+		start = lkos_tsc();
+		do {
+			tv_zero.tv_sec = 0;
+			tv_zero.tv_usec = 0;
+			ret = select_fn(nfds, readfds, writefds, exceptfds,
+					&tv_zero);
+			if (ret) {
+				lkos_spin_hit();
+				return ret;
+			}
 
-	lkos_log_fd = (int) fd_val;
+			if (readfds)
+				*readfds = rfds;
+			if (writefds)
+				*writefds = wfds;
+			if (exceptfds)
+				*exceptfds = efds;
+		} while (lkos_spin_continue(deadline));
 
-	lkos_log("lk_onload_stub loaded\n");
+		if (timeout) {
+			timeout_us = timeout->tv_sec * 1000000LL +
+				     timeout->tv_usec -
+				     (lkos_tsc() - start) / lkos_tsc_per_usec;
+			if (timeout_us < 0)
+				timeout_us = 0;
+			timeout->tv_sec = timeout_us / 1000000;
+			timeout->tv_usec = timeout_us % 1000000;
+		}
+	}
+
+	return select_fn(nfds, readfds, writefds, exceptfds, timeout);
 }
 
-static void __attribute__((constructor)) lkos_init(void)
+int select(int nfds, fd_set *readfds, fd_set *writefds,
+	   fd_set *exceptfds, struct timeval *timeout)
 {
-	lkos_init_log();
+	int ret;
 
-	getsockopt_fn = lkos_dlsym("getsockopt");
-	recvmmsg_fn = lkos_dlsym("recvmmsg");
-	recvmsg_fn = lkos_dlsym("recvmsg");
-	setsockopt_fn = lkos_dlsym("setsockopt");
+	lkos_stats_wait();
+	ret = __select(nfds, readfds, writefds, exceptfds, timeout);
+	lkos_stats_call = NULL;
+	return ret;
 }
 
+/* ONLOAD_MSG_WARM: run the send path up to the syscall, so that its
+ * code and data stay in cache, without sending. Touch each cache line
+ * of the payload, the per-fd state with the delegated send headers,
+ * and build the msghdr in a per-thread scratch copy.
+ */
+#define LKOS_WARM_IOV	16
 
-/* intercepted functions */
+static __thread struct msghdr lkos_warm_msg;
+static __thread struct iovec lkos_warm_iov[LKOS_WARM_IOV];
 
-static int __getsockopt_timestamping(int sockfd, void *optval, socklen_t *optlen)
+static ssize_t lkos_send_warm(int fd, const struct msghdr *msg, int flags)
 {
-	struct so_timestamping *ts = (struct so_timestamping *)optval;
-	int ret;
+	const struct lkos_fd *lfd = lkos_fd_get(fd);
+	unsigned int state = 0;
+	const struct lkos_ds *ds;
+	size_t i, off, len = 0;
+	uint64_t deadline;
+	char sink = 0;
 
-	ret = getsockopt_fn(sockfd, SOL_SOCKET, SO_TIMESTAMPING, optval, optlen);
-	if (ret)
-		return ret;
+	if (lfd)
+		state = __atomic_load_n(&lfd->state, __ATOMIC_ACQUIRE);
 
-	if (*optlen != sizeof(*ts) && *optlen != sizeof(ts->flags))
-		return lkos_error(EINVAL, NULL);
+	/* Nothing is sent: fail as a send would for what is not a socket */
+	if (!(state & LKOS_FD_SOCKET) &&
+	    lkos_getsockopt_int(fd, SOL_SOCKET, SO_TYPE) <= 0)
+		return -1;
 
-	/* See __setsockopt_timestamping for matching code
-	 *
-	 * If hardware timestamp reporting is enabled, but no recording,
-	 * then it is likely a conversion by that function. Invert when
-	 * returning the current flags in getsockopt.
-	 */
-	if (ts->flags & SOF_TIMESTAMPING_RAW_HARDWARE &&
-	    !(ts->flags & SOF_TIMESTAMPING_TX_HARDWARE) &&
-	    !(ts->flags & SOF_TIMESTAMPING_RX_HARDWARE)) {
-		if (ts->flags & SOF_TIMESTAMPING_RX_SOFTWARE) {
-			ts->flags |= SOF_TIMESTAMPING_RX_HARDWARE;
-			ts->flags &= ~(SOF_TIMESTAMPING_RX_SOFTWARE |
-				       SOF_TIMESTAMPING_SOFTWARE);
-		} if (ts->flags & SOF_TIMESTAMPING_TX_SOFTWARE) {
-			ts->flags |= SOF_TIMESTAMPING_TX_HARDWARE;
-			ts->flags &= ~(SOF_TIMESTAMPING_TX_SOFTWARE |
-				       SOF_TIMESTAMPING_SOFTWARE);
-		}
+	if (lfd) {
+		sink ^= state;
+		sink ^= __atomic_load_n(&lfd->stack, __ATOMIC_RELAXED);
+		ds = __atomic_load_n(&lfd->ds, __ATOMIC_ACQUIRE);
+		if (ds)
+			for (off = 0; off < ds->headers_len; off += 64)
+				sink ^= ((const volatile char *)ds->headers)[off];
 	}
 
-	return 0;
-}
+	deadline = lkos_spin_deadline_fd(fd, LKOS_SPIN_UDP_SEND,
+					 LKOS_SPIN_TCP_SEND, flags);
+	sink ^= deadline;
 
-int getsockopt(int sockfd, int level, int optname,
-	       void *optval, socklen_t *optlen)
-{
-	if (level == SOL_SOCKET &&
-	    optname == SO_TIMESTAMPING)
-		return __getsockopt_timestamping(sockfd, optval, optlen);
+	lkos_warm_msg = *msg;
+	lkos_warm_msg.msg_iov = lkos_warm_iov;
+	lkos_warm_msg.msg_iovlen = msg->msg_iovlen < LKOS_WARM_IOV ?
+				   msg->msg_iovlen : LKOS_WARM_IOV;
 
-	return getsockopt_fn(sockfd, level, optname, optval, optlen);
-}
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		if (i < LKOS_WARM_IOV)
+			lkos_warm_iov[i] = msg->msg_iov[i];
+		for (off = 0; off < msg->msg_iov[i].iov_len; off += 64)
+			sink ^= ((const volatile char *)msg->msg_iov[i].iov_base)[off];
+		len += msg->msg_iov[i].iov_len;
+	}
 
-int onload_fd_stat(int fd, void *unused)
-{
-	return 0;
+	__asm__ volatile("" : : "r"(sink));
+	return len;
 }
 
-int onload_is_present(void)
+static ssize_t lkos_send_warm_buf(int fd, const void *buf, size_t len,
+				  int flags)
 {
-	return 0;
-}
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
 
-int onload_move_fd(int fd)
-{
-	return 0;
+	return lkos_send_warm(fd, &msg, flags);
 }
 
-int onload_ordered_epoll_wait(int epfd, struct epoll_event *events,
-			      struct onload_ordered_epoll_event *oo_events,
-			      int maxevents, int timeout)
+/* A send that spins. A non-blocking attempt on a stream socket may
+ * send part of the data: the caller blocks for the remainder.
+ */
+static ssize_t lkos_send_spin(int sockfd, const void *buf, size_t len,
+			      int flags)
 {
-	int i, ret;
+	uint64_t deadline;
+	bool spun = false;
+	ssize_t ret, more;
 
-	ret = epoll_wait(epfd, events, maxevents, timeout);
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_SEND,
+					 LKOS_SPIN_TCP_SEND, flags);
+	if (deadline) {
+		do {
+			ret = lkos_uring_send(sockfd, buf, len,
+					      flags | MSG_DONTWAIT);
+			if (lkos_spin_done(ret, &spun)) {
+				if (ret <= 0 || ret == len)
+					return ret;
 
-	/* tv_sec == 0 disables wire-order, defined in onload_extensions.h */
-	for (i = 0; i < ret; i++)
-		oo_events[i].ts.tv_sec = 0;
+				more = lkos_uring_send(sockfd, buf + ret, len - ret,
+						       flags);
+				return more > 0 ? ret + more : ret;
+			}
+		} while (lkos_spin_continue(deadline));
+	}
 
-	return ret;
+	return lkos_uring_send(sockfd, buf, len, flags);
 }
 
-int onload_set_stackname(int who, int scope, const char* stackname)
+static ssize_t __send(int sockfd, const void *buf, size_t len, int flags)
 {
-	return 0;
-}
+	struct lkos_lo *lo;
+	ssize_t ret;
 
-int onload_socket_nonaccel(int domain, int type, int protocol)
-{
-	return socket(domain, type, protocol);
-}
+	if (flags & ONLOAD_MSG_WARM)
+		return lkos_send_warm_buf(sockfd, buf, len, flags);
 
-int onload_stackname_restore(void)
-{
-	return 0;
-}
+	lo = lkos_lo_get(sockfd);
+	if (lo)
+		return lkos_lo_send(sockfd, lo, buf, len, flags);
 
-int onload_stackname_save(void)
-{
-	return 0;
+	if (lkos_gso_enabled(sockfd) &&
+	    lkos_gso_sendto(sockfd, buf, len, flags, NULL, 0, &ret))
+		return ret;
+
+	return lkos_send_spin(sockfd, buf, len, flags);
 }
 
-int onload_stack_opt_get_int(const char* opt, int64_t *val)
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
 {
-	return -1;
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	ssize_t ret = __send(sockfd, buf, len, flags);
+
+	return lkos_stats_end(row, sockfd, true, ret, NULL);
 }
 
-int onload_stack_opt_get_str(const char* opt, char* val_out, size_t* val_out_len)
+/* Send the remainder of msg after a partial send of sent bytes */
+static ssize_t lkos_sendmsg_rest(int sockfd, const struct msghdr *msg,
+				 int flags, size_t sent)
 {
-	return -1;
+	struct iovec iov[msg->msg_iovlen];
+	struct msghdr rest = *msg;
+	size_t i;
+
+	for (i = 0; i < msg->msg_iovlen && sent >= msg->msg_iov[i].iov_len; i++)
+		sent -= msg->msg_iov[i].iov_len;
+
+	if (i == msg->msg_iovlen)
+		return 0;
+
+	memcpy(iov, msg->msg_iov + i, (msg->msg_iovlen - i) * sizeof(iov[0]));
+	iov[0].iov_base += sent;
+	iov[0].iov_len -= sent;
+
+	rest.msg_iov = iov;
+	rest.msg_iovlen = msg->msg_iovlen - i;
+	rest.msg_control = NULL;	/* already sent with the first part */
+	rest.msg_controllen = 0;
+
+	return sendmsg_fn(sockfd, &rest, flags);
 }
 
-int onload_stack_opt_reset(void)
+/* Batch each message, or send it if it does not batch */
+static int lkos_gso_sendmmsg(int sockfd, struct mmsghdr *msgvec,
+			     unsigned int vlen, int flags)
 {
-	return 0;
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < vlen; i++) {
+		if (!lkos_gso_send(sockfd, &msgvec[i].msg_hdr, flags, &ret))
+			ret = sendmsg_fn(sockfd, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? i : -1;
+		msgvec[i].msg_len = ret;
+	}
+
+	return i;
 }
 
-int onload_stack_opt_set_int(const char* opt, int64_t val)
+static int __sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
 {
-	return 0;
+	struct lkos_lo *lo;
+	uint64_t deadline;
+	bool spun = false;
+	unsigned int i;
+	int ret, more;
+
+	if (flags & ONLOAD_MSG_WARM) {
+		for (i = 0; i < vlen; i++) {
+			ret = lkos_send_warm(sockfd, &msgvec[i].msg_hdr, flags);
+			if (ret < 0)
+				return i ? i : -1;
+			msgvec[i].msg_len = ret;
+		}
+		return vlen;
+	}
+
+	lo = lkos_lo_get(sockfd);
+	if (lo)
+		return lkos_lo_sendmmsg(sockfd, lo, msgvec, vlen, flags);
+
+	if (lkos_gso_enabled(sockfd))
+		return lkos_gso_sendmmsg(sockfd, msgvec, vlen, flags);
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_SEND,
+					 LKOS_SPIN_TCP_SEND, flags);
+	if (deadline) {
+		do {
+			ret = sendmmsg_fn(sockfd, msgvec, vlen, flags | MSG_DONTWAIT);
+			if (lkos_spin_done(ret, &spun)) {
+				if (ret <= 0 || ret == vlen)
+					return ret;
+
+				more = sendmmsg_fn(sockfd, msgvec + ret, vlen - ret,
+						   flags);
+				return more > 0 ? ret + more : ret;
+			}
+		} while (lkos_spin_continue(deadline));
+	}
+
+	return sendmmsg_fn(sockfd, msgvec, vlen, flags);
 }
 
-int onload_stack_opt_set_str(const char* opt, const char* val)
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
 {
-	return 0;
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	int ret = __sendmmsg(sockfd, msgvec, vlen, flags);
+
+	return lkos_stats_end(row, sockfd, true, ret, msgvec);
 }
 
-static void __recvmsg_timestamping(struct msghdr *msg)
+static ssize_t __sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
-	struct scm_timestamping *tss;
-	struct cmsghdr *cm;
+	struct lkos_lo *lo;
+	uint64_t deadline;
+	bool spun = false;
+	ssize_t ret, more;
+	size_t len, i;
 
-	/* Unconditionally copy the sw timestamp from ts[0]
-	 * to the raw hw timestamp field ts[2]
-	 *
-	 * The fields are undefined if the relevant SOF_.. option was not set,
-	 * so it is safe to fill in both fields if only one at a time is set.
-	 */
-	for (cm = CMSG_FIRSTHDR(msg);
-	     cm && cm->cmsg_len;
-	     cm = CMSG_NXTHDR(msg, cm)) {
-		if (cm->cmsg_level == SOL_SOCKET &&
-		    cm->cmsg_type == SCM_TIMESTAMPING) {
-			tss = (void *) CMSG_DATA(cm);
-			tss->ts[2] = tss->ts[0];
-		}
+	if (flags & ONLOAD_MSG_WARM)
+		return lkos_send_warm(sockfd, msg, flags);
+
+	lo = lkos_lo_get(sockfd);
+	if (lo)
+		return lkos_lo_sendmsg(sockfd, lo, msg, flags);
+
+	if (lkos_gso_enabled(sockfd) && lkos_gso_send(sockfd, msg, flags, &ret))
+		return ret;
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_SEND,
+					 LKOS_SPIN_TCP_SEND, flags);
+	if (deadline) {
+		do {
+			ret = lkos_uring_sendmsg(sockfd, msg, flags | MSG_DONTWAIT);
+			if (lkos_spin_done(ret, &spun)) {
+				if (ret <= 0)
+					return ret;
+
+				for (len = 0, i = 0; i < msg->msg_iovlen; i++)
+					len += msg->msg_iov[i].iov_len;
+				if (ret == len)
+					return ret;
+
+				more = lkos_sendmsg_rest(sockfd, msg, flags, ret);
+				return more > 0 ? ret + more : ret;
+			}
+		} while (lkos_spin_continue(deadline));
 	}
+
+	return lkos_uring_sendmsg(sockfd, msg, flags);
 }
 
-ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
-	ssize_t ret;
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	ssize_t ret = __sendmsg(sockfd, msg, flags);
 
-	ret = recvmsg_fn(sockfd, msg, flags);
-
-	if (ret >= 0 && msg->msg_control && msg->msg_controllen)
-		__recvmsg_timestamping(msg);
-
-	return ret;
+	return lkos_stats_end(row, sockfd, true, ret, NULL);
 }
 
-int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
-	     int flags, struct timespec *timeout)
+static ssize_t __sendto(int sockfd, const void *buf, size_t len, int flags,
+			const struct sockaddr *dest_addr, socklen_t addrlen)
 {
-	int ret, i;
+	struct lkos_lo *lo;
+	uint64_t deadline;
+	bool spun = false;
+	ssize_t ret, more;
 
-	ret = recvmmsg_fn(sockfd, msgvec, vlen, flags, timeout);
+	if (flags & ONLOAD_MSG_WARM)
+		return lkos_send_warm_buf(sockfd, buf, len, flags);
 
-	for (i = 0; i < ret; i++) {
-		struct msghdr *mh = &msgvec[i].msg_hdr;
+	/* as TCP, ignores the address of a connected socket */
+	lo = lkos_lo_get(sockfd);
+	if (lo)
+		return lkos_lo_send(sockfd, lo, buf, len, flags);
 
-		if (mh->msg_control && mh->msg_controllen)
-			__recvmsg_timestamping(mh);
+	if (lkos_gso_enabled(sockfd) &&
+	    lkos_gso_sendto(sockfd, buf, len, flags, dest_addr, addrlen, &ret))
+		return ret;
+
+	deadline = lkos_spin_deadline_fd(sockfd, LKOS_SPIN_UDP_SEND,
+					 LKOS_SPIN_TCP_SEND, flags);
+	if (deadline) {
+		do {
+			ret = lkos_uring_sendto(sockfd, buf, len,
+						flags | MSG_DONTWAIT,
+						dest_addr, addrlen);
+			if (lkos_spin_done(ret, &spun)) {
+				if (ret <= 0 || ret == len)
+					return ret;
+
+				more = lkos_uring_sendto(sockfd, buf + ret,
+							 len - ret, flags,
+							 dest_addr, addrlen);
+				return more > 0 ? ret + more : ret;
+			}
+		} while (lkos_spin_continue(deadline));
 	}
 
-	return ret;
+	return lkos_uring_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
+	       const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(sockfd);
+	ssize_t ret = __sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+
+	return lkos_stats_end(row, sockfd, true, ret, NULL);
 }
 
 /* optval is defined as const, but not here, as it may be modified. */
@@ -303,6 +11897,7 @@ static int __setsockopt_timestamping(int sockfd, void *optval, socklen_t optlen)
 			  SOF_TIMESTAMPING_SOFTWARE;
 
 	struct so_timestamping ts = *(struct so_timestamping *)optval;
+	int ret;
 
 	if (optlen != sizeof(ts) && optlen != sizeof(ts.flags))
 		return lkos_error(EINVAL, NULL);
@@ -319,13 +11914,14 @@ static int __setsockopt_timestamping(int sockfd, void *optval, socklen_t optlen)
 	 * - enable the software report flag.
 	 * to start receiving software timestamps.
 	 *
-	 * Keep the hardware report flag. We will use that in getsockopt
-	 * as a hint that hardware timestamping was originally requested
-	 * and we converted it here. This is a hopefully decent heuristic,
-	 * because requesting a report without matching record is a noop,
-	 * and thus not something normal applications would do. That said,
-	 * the approach *is* a heuristic, so not foolproof: getsockopt
-	 * might convert incorrectly in some cases.
+	 * The original flags are recorded in the per-fd state, for
+	 * getsockopt to return exactly.
+	 *
+	 * Keep the hardware report flag. getsockopt uses that as a hint
+	 * that hardware timestamping was originally requested, for sockets
+	 * without a record, such as those inherited across exec. This is a
+	 * heuristic, because requesting a report without matching record
+	 * is a noop, and thus not something normal applications would do.
 	 */
 	if ((ts.flags & (sw_tx | sw_rx)) == 0) {
 		if ((ts.flags & hw_tx) == hw_tx) {
@@ -339,15 +11935,145 @@ static int __setsockopt_timestamping(int sockfd, void *optval, socklen_t optlen)
 		}
 	}
 
-	return setsockopt_fn(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &ts, optlen);
+	ret = setsockopt_fn(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &ts, optlen);
+	if (ret)
+		return ret;
+
+	lkos_fd_set_timestamping(sockfd, optval, optlen, ts.flags);
+	return 0;
 }
 
 int setsockopt(int sockfd, int level, int optname,
 	       const void *optval, socklen_t optlen)
 {
+	int ret;
+
+	lkos_gso_flush_fd(sockfd);
+
 	if (level == SOL_SOCKET &&
-	    optname == SO_TIMESTAMPING)
-		return __setsockopt_timestamping(sockfd, (void *)optval, optlen);
+	    optname == SO_TIMESTAMPING) {
+		ret = __setsockopt_timestamping(sockfd, (void *)optval, optlen);
+		lkos_mc_sockopts(sockfd);
+		return ret;
+	}
+
+	/* join and leave groups of a multicast ring here */
+	if (level == IPPROTO_IP && optname == IP_ADD_MEMBERSHIP &&
+	    !lkos_mc_join(sockfd, optval, optlen))
+		return 0;
+	if (level == IPPROTO_IP && optname == IP_DROP_MEMBERSHIP &&
+	    !lkos_mc_leave(sockfd, optval, optlen))
+		return 0;
+
+	ret = setsockopt_fn(sockfd, level, optname, optval, optlen);
+	if (ret || !optval || optlen < sizeof(int))
+		return ret;
+
+	lkos_mc_sockopts(sockfd);
+
+	/* record features for lkos_fd_stat */
+	if (level == SOL_UDP && optname == UDP_GRO) {
+		lkos_fd_set_flag(sockfd, LKOS_FD_GRO_SPLIT, false);
+		lkos_fd_set_flag(sockfd, LKOS_FD_UDP_GRO, *(const int *)optval);
+	}
+	else if (level == SOL_SOCKET && optname == SO_ZEROCOPY)
+		lkos_fd_set_flag(sockfd, LKOS_FD_ZEROCOPY, *(const int *)optval);
+	else if (level == SOL_SOCKET && optname == SO_BUSY_POLL)
+		lkos_fd_set_flag(sockfd, LKOS_FD_BUSY_POLL, *(const int *)optval > 0);
+	else if (level == SOL_SOCKET &&
+		 (optname == SO_TIMESTAMP || optname == SO_TIMESTAMPNS))
+		lkos_fd_set_flag(sockfd, LKOS_FD_ONEPKT | LKOS_FD_ONEPKT_TS, false);
+
+	return ret;
+}
+
+int shutdown(int sockfd, int how)
+{
+	int ret;
+
+	ret = shutdown_fn(sockfd, how);
+	if (!ret)
+		lkos_lo_shutdown(sockfd, how);
+
+	return ret;
+}
+
+int socket(int domain, int type, int protocol)
+{
+	int ret;
+
+	ret = socket_fn(domain, type, protocol);
+	if (ret >= 0) {
+		lkos_debug("socket: fd %d: domain %d type 0x%x\n", ret, domain,
+			   type);
+		lkos_lo_close(ret);	/* if closed behind our back */
+		lkos_mc_close(ret);
+		lkos_cl_close(ret);
+		lkos_uring_close(ret);
+		lkos_fd_socket(ret, domain, type);
+		lkos_stack_socket(ret, domain, type);
+		lkos_gro_socket(ret, domain, type);
+		lkos_gso_socket(ret, domain, type);
+		lkos_uring_socket(ret, domain, type);
+	}
+
+	return ret;
+}
+
+int socketpair(int domain, int type, int protocol, int sv[2])
+{
+	int ret;
+
+	ret = socketpair_fn(domain, type, protocol, sv);
+	if (!ret) {
+		lkos_fd_socket(sv[0], domain, type);
+		lkos_fd_socket(sv[1], domain, type);
+	}
+
+	return ret;
+}
+
+static ssize_t __write(int fd, const void *buf, size_t count)
+{
+	struct lkos_lo *lo;
+
+	/* after the datagrams batched by send */
+	lkos_gso_flush_fd(fd);
+
+	lo = lkos_lo_get(fd);
+	if (lo)
+		return lkos_lo_send(fd, lo, buf, count, 0);
+
+	return write_fn(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(fd);
+	ssize_t ret = __write(fd, buf, count);
+
+	return lkos_stats_end(row, fd, true, ret, NULL);
+}
+
+static ssize_t __writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg = { .msg_iov = (struct iovec *)iov,
+			      .msg_iovlen = iovcnt };
+	struct lkos_lo *lo;
+
+	lkos_gso_flush_fd(fd);
+
+	lo = lkos_lo_get(fd);
+	if (lo && iovcnt >= 0 && iovcnt <= IOV_MAX)
+		return lkos_lo_sendmsg(fd, lo, &msg, 0);
+
+	return writev_fn(fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct lkos_stats_row *row = lkos_stats_begin(fd);
+	ssize_t ret = __writev(fd, iov, iovcnt);
 
-	return setsockopt_fn(sockfd, level, optname, optval, optlen);
+	return lkos_stats_end(row, fd, true, ret, NULL);
 }
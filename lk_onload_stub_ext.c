@@ -26,7 +26,30 @@
 
 #include "lk_onload_stub_ext.h"
 
-int onload_fd_stat(int fd, void *unused)
+int onload_delegated_send_cancel(int fd)
+{
+	return -1;
+}
+
+int onload_delegated_send_complete(int fd, const struct iovec *iov, int iovlen,
+				   int flags)
+{
+	return -1;
+}
+
+enum onload_delegated_send_rc
+onload_delegated_send_prepare(int fd, int size, unsigned flags,
+			      struct onload_delegated_send *out)
+{
+	return ONLOAD_DELEGATED_SEND_RC_BAD_SOCKET;
+}
+
+int onload_fd_check_feature(int fd, enum onload_fd_feat feature)
+{
+	return -1;
+}
+
+int onload_fd_stat(int fd, struct onload_stat *stat)
 {
 	return -1;
 }
@@ -41,6 +64,25 @@ int onload_move_fd(int fd)
 	return -1;
 }
 
+int onload_msg_template_abort(int fd, onload_template_handle handle)
+{
+	return -1;
+}
+
+int onload_msg_template_alloc(int fd, const struct iovec *initial_msg,
+			      int mlen, onload_template_handle *handle,
+			      unsigned flags)
+{
+	return -1;
+}
+
+int onload_msg_template_update(int fd, onload_template_handle handle,
+			       const struct onload_template_msg_update_iovec *updates,
+			       int ulen, unsigned flags)
+{
+	return -1;
+}
+
 int onload_ordered_epoll_wait(int epfd, struct epoll_event *events,
 			      struct onload_ordered_epoll_event *oo_events,
 			      int maxevents, int timeout)
@@ -92,3 +134,88 @@ int onload_stack_opt_set_str(const char* opt, const char* val)
 {
 	return -1;
 }
+
+int onload_thread_get_spin(unsigned *state)
+{
+	return -1;
+}
+
+int onload_thread_set_spin(enum onload_spin_type type, int spin)
+{
+	return -1;
+}
+
+int onload_zc_alloc_buffers(int fd, struct onload_zc_iovec *iovecs,
+			    int iovecs_len,
+			    enum onload_zc_buffer_type_flags flags)
+{
+	return -1;
+}
+
+int onload_zc_hlrx_alloc(int fd, int flags, struct onload_zc_hlrx **hlrx)
+{
+	return -1;
+}
+
+int onload_zc_hlrx_buffer_release(int fd, onload_zc_handle buf)
+{
+	return -1;
+}
+
+int onload_zc_hlrx_free(struct onload_zc_hlrx *hlrx)
+{
+	return -1;
+}
+
+ssize_t onload_zc_hlrx_recv_copy(struct onload_zc_hlrx *hlrx,
+				 struct msghdr *msg, int flags)
+{
+	return -1;
+}
+
+ssize_t onload_zc_hlrx_recv_zc(struct onload_zc_hlrx *hlrx,
+			       struct onload_zc_msg *msg, size_t max_bytes,
+			       int flags)
+{
+	return -1;
+}
+
+int onload_zc_recv(int fd, struct onload_zc_recv_args *args)
+{
+	return -1;
+}
+
+int onload_zc_release_buffers(int fd, onload_zc_handle *bufs, int bufs_len)
+{
+	return -1;
+}
+
+int onload_zc_send(struct onload_zc_mmsg *msgs, int mlen, int flags)
+{
+	return -1;
+}
+
+int lkos_fd_stat(int fd, struct lkos_fd_stat *stat)
+{
+	return -1;
+}
+
+int lkos_get_spin_stats(struct lkos_spin_stats *stats)
+{
+	return -1;
+}
+
+int lkos_get_gso_stats(struct lkos_gso_stats *stats)
+{
+	return -1;
+}
+
+int lkos_get_log_stats(struct lkos_log_stats *stats)
+{
+	return -1;
+}
+
+int lkos_log_flush(void)
+{
+	return -1;
+}
@@ -22,13 +22,16 @@
  * Therefore all functions here return with error.
  */
 
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include <time.h>
 
 #ifdef HAVE_ONLOAD
 #include <onload/extensions.h>
 #else
-/* Linux TCP ignores flags it does not expect.
- * It is safe to pass this flag to a tcp socket recv call.
+/* Receive flag: read at most one packet.
+ * The library removes it before calling Linux.
  *
  * This flag does alias a flag in Linux: MSG_SENDPAGE_NOTLAST.
  * Introduced in v3.4 in commit 35f9c09fe9c7
@@ -37,6 +40,11 @@
  */
 #define ONLOAD_MSG_ONEPKT 0x20000
 
+/* Send flag: exercise the send path without sending.
+ * Aliases MSG_WAITFORONE, which only applies to recvmmsg.
+ */
+#define ONLOAD_MSG_WARM 0x10000
+
 struct onload_ordered_epoll_event {
 	struct timespec ts;
 	int bytes;
@@ -46,7 +54,45 @@ int onload_ordered_epoll_wait(int epfd, struct epoll_event *events,
 			      struct onload_ordered_epoll_event *oo_events,
 			      int maxevents, int timeout);
 
+/* Spin API */
+
+enum onload_spin_type {
+	ONLOAD_SPIN_ALL,	/* enable or disable all spin types */
+	ONLOAD_SPIN_UDP_RECV,
+	ONLOAD_SPIN_UDP_SEND,
+	ONLOAD_SPIN_TCP_RECV,
+	ONLOAD_SPIN_TCP_SEND,
+	ONLOAD_SPIN_TCP_ACCEPT,
+	ONLOAD_SPIN_PIPE_RECV,
+	ONLOAD_SPIN_PIPE_SEND,
+	ONLOAD_SPIN_SELECT,
+	ONLOAD_SPIN_POLL,
+	ONLOAD_SPIN_PKT_WAIT,
+	ONLOAD_SPIN_EPOLL_WAIT,
+	ONLOAD_SPIN_STACK_LOCK,
+	ONLOAD_SPIN_SOCK_LOCK,
+	ONLOAD_SPIN_SO_BUSY_POLL,
+	ONLOAD_SPIN_TCP_CONNECT,
+	ONLOAD_SPIN_MIMIC_EF_POLL,
+	ONLOAD_SPIN_MAX		/* special value to mark largest valid input */
+};
+
+int onload_thread_set_spin(enum onload_spin_type type, int spin);
+int onload_thread_get_spin(unsigned *state);
+
 /* Stacks API */
+
+#define ONLOAD_THIS_THREAD	0
+#define ONLOAD_ALL_THREADS	1
+
+#define ONLOAD_SCOPE_NOCHANGE	0
+#define ONLOAD_SCOPE_THREAD	1
+#define ONLOAD_SCOPE_PROCESS	2
+#define ONLOAD_SCOPE_USER	3
+#define ONLOAD_SCOPE_GLOBAL	4
+
+#define ONLOAD_DONT_ACCELERATE	NULL
+
 int onload_move_fd(int fd);
 int onload_set_stackname(int who, int scope, const char* stackname);
 int onload_stackname_restore(void);
@@ -57,11 +103,294 @@ int onload_stack_opt_reset(void);
 int onload_stack_opt_set_int(const char* opt, int64_t val);
 int onload_stack_opt_set_str(const char* opt, const char* val);
 
+/* Delegated sends API */
+
+enum onload_delegated_send_rc {
+	ONLOAD_DELEGATED_SEND_RC_OK = 0,
+	ONLOAD_DELEGATED_SEND_RC_BAD_SOCKET,
+	ONLOAD_DELEGATED_SEND_RC_SMALL_HEADER,
+	ONLOAD_DELEGATED_SEND_RC_SENDQ_BUSY,
+	ONLOAD_DELEGATED_SEND_RC_NOWIN,
+	ONLOAD_DELEGATED_SEND_RC_NOARP,
+	ONLOAD_DELEGATED_SEND_RC_NOCWIN,
+};
+
+struct onload_delegated_send {
+	void *headers;
+	int headers_len;		/* buffer len on input, headers len on output */
+
+	int mss;			/* one packet payload may not exceed this */
+	int send_wnd;			/* send window */
+	int cong_wnd;			/* congestion window */
+	int user_size;			/* the size passed to prepare */
+
+	/* private */
+	int tcp_seq_offset;
+	int ip_len_offset;
+	int ip_tcp_hdr_len;
+	int reserved[5];
+};
+
+#define ONLOAD_DELEGATED_SEND_FLAG_IGNORE_ARP	0x1
+
+/* Set the IP length and the TCP PSH flag for a packet of bytes payload */
+static inline void
+onload_delegated_send_tcp_update(struct onload_delegated_send *ds, int bytes,
+				 int push)
+{
+	uint16_t *ip_len_p = (uint16_t *)((char *)ds->headers + ds->ip_len_offset);
+	uint8_t *flags_p = (uint8_t *)ds->headers + ds->tcp_seq_offset + 9;
+
+	*ip_len_p = htons(bytes + ds->ip_tcp_hdr_len);
+	if (push)
+		*flags_p |= 0x8;
+	else
+		*flags_p &= ~0x8;
+}
+
+/* Advance the TCP sequence number and windows past bytes sent */
+static inline void
+onload_delegated_send_tcp_advance(struct onload_delegated_send *ds, int bytes)
+{
+	uint32_t *seq_p = (uint32_t *)((char *)ds->headers + ds->tcp_seq_offset);
+
+	*seq_p = htonl(ntohl(*seq_p) + bytes);
+	ds->send_wnd -= bytes;
+	ds->cong_wnd -= bytes;
+	ds->user_size -= bytes;
+}
+
+enum onload_delegated_send_rc
+onload_delegated_send_prepare(int fd, int size, unsigned flags,
+			      struct onload_delegated_send *out);
+int onload_delegated_send_complete(int fd, const struct iovec *iov, int iovlen,
+				   int flags);
+int onload_delegated_send_cancel(int fd);
+
+/* Templated sends API */
+
+enum onload_template_flags {
+	ONLOAD_TEMPLATE_FLAGS_SEND_NOW = 0x1,
+	ONLOAD_TEMPLATE_FLAGS_PIO_RETRY = 0x2,
+	ONLOAD_TEMPLATE_FLAGS_DONTWAIT = MSG_DONTWAIT,
+};
+
+struct onload_template_msg_update_iovec {
+	void *otmu_base;
+	size_t otmu_len;
+	off_t otmu_offset;
+	unsigned otmu_flags;
+};
+
+typedef struct oo_msg_template *onload_template_handle;
+
+int onload_msg_template_abort(int fd, onload_template_handle handle);
+int onload_msg_template_alloc(int fd, const struct iovec *initial_msg,
+			      int mlen, onload_template_handle *handle,
+			      unsigned flags);
+int onload_msg_template_update(int fd, onload_template_handle handle,
+			       const struct onload_template_msg_update_iovec *updates,
+			       int ulen, unsigned flags);
+
+/* Zero-copy API */
+
+typedef struct oo_zc_buf *onload_zc_handle;
+
+struct onload_zc_iovec {
+	void *iov_base;
+	size_t iov_len;
+	onload_zc_handle buf;
+	unsigned iov_flags;
+};
+
+struct onload_zc_msg {
+	struct onload_zc_iovec *iov;
+	struct msghdr msghdr;
+};
+
+enum onload_zc_callback_rc {
+	ONLOAD_ZC_CONTINUE = 0x0,
+	ONLOAD_ZC_TERMINATE = 0x1,
+	ONLOAD_ZC_KEEP = 0x2,		/* flag, may be OR-ed with the above */
+};
+
+/* callback flags */
+#define ONLOAD_ZC_END_OF_BURST	0x1
+#define ONLOAD_ZC_MSG_SHARED	0x2
+
+struct onload_zc_recv_args;
+
+typedef enum onload_zc_callback_rc
+(*onload_zc_recv_callback)(struct onload_zc_recv_args *args, int flags);
+
+struct onload_zc_recv_args {
+	struct onload_zc_msg msg;
+	onload_zc_recv_callback cb;
+	void *user_ptr;
+	int flags;
+};
+
+int onload_zc_recv(int fd, struct onload_zc_recv_args *args);
+int onload_zc_release_buffers(int fd, onload_zc_handle *bufs, int bufs_len);
+
+enum onload_zc_buffer_type_flags {
+	ONLOAD_ZC_BUFFER_HDR_NONE = 0x0,
+	ONLOAD_ZC_BUFFER_HDR_UDP = 0x1,
+	ONLOAD_ZC_BUFFER_HDR_TCP = 0x2,
+};
+
+struct onload_zc_mmsg {
+	struct onload_zc_msg msg;
+	int rc;
+	int fd;
+};
+
+int onload_zc_alloc_buffers(int fd, struct onload_zc_iovec *iovecs,
+			    int iovecs_len,
+			    enum onload_zc_buffer_type_flags flags);
+int onload_zc_send(struct onload_zc_mmsg *msgs, int mlen, int flags);
+
+struct onload_zc_hlrx;
+
+int onload_zc_hlrx_alloc(int fd, int flags, struct onload_zc_hlrx **hlrx);
+int onload_zc_hlrx_free(struct onload_zc_hlrx *hlrx);
+int onload_zc_hlrx_buffer_release(int fd, onload_zc_handle buf);
+ssize_t onload_zc_hlrx_recv_copy(struct onload_zc_hlrx *hlrx,
+				 struct msghdr *msg, int flags);
+ssize_t onload_zc_hlrx_recv_zc(struct onload_zc_hlrx *hlrx,
+			       struct onload_zc_msg *msg, size_t max_bytes,
+			       int flags);
+
 /* non-accel API */
 
-int onload_fd_stat(int fd, void *unused);
+struct onload_stat {
+	int32_t stack_id;
+	char *stack_name;		/* allocated, caller must free */
+	int32_t endpoint_id;
+	int32_t endpoint_state;
+};
+
+enum onload_fd_feat {
+	ONLOAD_FD_FEAT_MSG_WARM = 0,
+	ONLOAD_FD_FEAT_UDP_TX_TS_HDR,
+	ONLOAD_FD_FEAT_TX_TIMESTAMPING,
+};
+
+int onload_fd_check_feature(int fd, enum onload_fd_feat feature);
+int onload_fd_stat(int fd, struct onload_stat *stat);
 int onload_is_present(void);
 int onload_socket_nonaccel(int domain, int type, int protocol);
 
 #endif
 
+/* lk_onload_stub extensions, not part of Onload */
+
+struct lkos_spin_stats {
+	uint64_t hits;		/* calls that completed while spinning */
+	uint64_t misses;	/* calls that blocked after spinning */
+};
+
+int lkos_get_spin_stats(struct lkos_spin_stats *stats);
+
+struct lkos_gso_stats {
+	uint64_t datagrams;	/* datagrams batched, see LKOS_UDP_GSO */
+	uint64_t sends;		/* batches sent */
+};
+
+int lkos_get_gso_stats(struct lkos_gso_stats *stats);
+
+struct lkos_log_stats {
+	uint64_t written;	/* records written, see LKOS_LOG_FD */
+	uint64_t dropped;	/* records lost to full rings */
+	uint64_t suppressed;	/* records over LKOS_LOG_RATE */
+};
+
+int lkos_get_log_stats(struct lkos_log_stats *stats);
+
+/* Write the records logged so far. Returns the number written */
+int lkos_log_flush(void);
+
+/* performance features active on an fd. struct onload_stat is part of
+ * the Onload ABI and cannot be extended.
+ */
+#define LKOS_FD_FEATURE_BUSY_POLL	0x1	/* SO_BUSY_POLL */
+#define LKOS_FD_FEATURE_UDP_GRO		0x2	/* UDP_GRO */
+#define LKOS_FD_FEATURE_ZEROCOPY	0x4	/* SO_ZEROCOPY, for MSG_ZEROCOPY */
+#define LKOS_FD_FEATURE_TS_CONVERT	0x8	/* hw timestamps converted */
+#define LKOS_FD_FEATURE_IO_URING	0x10	/* I/O through io_uring */
+#define LKOS_FD_FEATURE_XDP		0x20	/* UDP receive through AF_XDP */
+#define LKOS_FD_FEATURE_LOOPBACK	0x40	/* TCP loopback over shared memory */
+#define LKOS_FD_FEATURE_MCAST		0x80	/* multicast through a shared ring */
+#define LKOS_FD_FEATURE_CLUSTER		0x100	/* member of a cluster */
+
+struct lkos_fd_stat {
+	uint32_t features;		/* LKOS_FD_FEATURE_* */
+	int32_t busy_poll_usec;
+	uint32_t napi_id;		/* SO_INCOMING_NAPI_ID, 0 if unknown */
+};
+
+/* As onload_fd_stat: returns 1 for sockets managed by the library */
+int lkos_fd_stat(int fd, struct lkos_fd_stat *stat);
+
+/* statistics in shared memory, with LKOS_STATS set: the segment
+ * /dev/shm/lkos_stats.<pid> holds a struct lkos_stats, for lkos_stackdump
+ */
+#define LKOS_STATS_MAGIC	0x6c6b7374
+#define LKOS_STATS_VERSION	1
+#define LKOS_STATS_THREADS	64	/* the last is shared by later threads */
+#define LKOS_STATS_STACKS	65	/* the default stack, then by stack id */
+#define LKOS_STATS_FDS		65536
+#define LKOS_STATS_NAME_LEN	32
+#define LKOS_STATS_BATCHES	8	/* recvmmsg batches of 0, 1, 2-3, .. 64+ */
+
+enum lkos_stat {
+	LKOS_STAT_RX_CALLS,		/* recv calls, read and readv on sockets */
+	LKOS_STAT_RX_BYTES,
+	LKOS_STAT_TX_CALLS,		/* send calls, write and writev */
+	LKOS_STAT_TX_BYTES,
+	LKOS_STAT_EAGAIN,		/* calls of either that returned EAGAIN */
+	LKOS_STAT_ERRORS,		/* other errors */
+	LKOS_STAT_MMSG_CALLS,		/* recvmmsg calls, also in RX_CALLS */
+	LKOS_STAT_MMSG_MSGS,
+	LKOS_STAT_MMSG_BATCH,		/* LKOS_STATS_BATCHES counters */
+	LKOS_STAT_TS_CONVERT = LKOS_STAT_MMSG_BATCH + LKOS_STATS_BATCHES,
+	LKOS_STAT_SPIN_HITS,
+	LKOS_STAT_SPIN_MISSES,
+	LKOS_STAT_RXQ_DROPS,		/* increments of SO_RXQ_OVFL */
+	LKOS_STAT_WAIT_CALLS,		/* epoll_wait, poll and select */
+	LKOS_STAT_MAX
+};
+
+/* one row per thread and stack, in a cache line of its own */
+struct lkos_stats_row {
+	uint64_t val[LKOS_STAT_MAX];
+} __attribute__((aligned(64)));
+
+struct lkos_stats_thread {
+	struct lkos_stats_row stack[LKOS_STATS_STACKS];
+};
+
+/* one per fd number, reset when a socket takes the number */
+struct lkos_stats_fd {
+	int16_t domain;			/* 0 if not a socket of the library */
+	int16_t type;
+	int32_t stack;			/* 0 default, or the stack id */
+	uint64_t rx_calls;
+	uint64_t rx_bytes;
+	uint64_t tx_calls;
+	uint64_t tx_bytes;
+	uint64_t eagain;
+	uint64_t drops;			/* last SO_RXQ_OVFL */
+} __attribute__((aligned(64)));
+
+struct lkos_stats {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t threads;		/* thread rows taken */
+	uint32_t fds;			/* fd numbers used, up to LKOS_STATS_FDS */
+	char stack_name[LKOS_STATS_STACKS][LKOS_STATS_NAME_LEN];
+	struct lkos_stats_thread thread[LKOS_STATS_THREADS]
+		__attribute__((aligned(64)));
+	struct lkos_stats_fd fd[LKOS_STATS_FDS];
+};
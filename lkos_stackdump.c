@@ -0,0 +1,264 @@
+/*
+ * Copyright 2023 Google LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/* Print the statistics of a process running with lk_onload_stub and
+ * LKOS_STATS set, as onload_stackdump does for Onload stacks.
+ *
+ *   lkos_stackdump                       list processes with statistics
+ *   lkos_stackdump <pid> [lots|stacks|fds]
+ *
+ * Counters are read while the process updates them, so a view is not
+ * a snapshot of a single point in time.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lk_onload_stub_ext.h"
+
+static const char *stat_names[LKOS_STAT_MAX] = {
+	[LKOS_STAT_RX_CALLS]	= "rx_calls",
+	[LKOS_STAT_RX_BYTES]	= "rx_bytes",
+	[LKOS_STAT_TX_CALLS]	= "tx_calls",
+	[LKOS_STAT_TX_BYTES]	= "tx_bytes",
+	[LKOS_STAT_EAGAIN]	= "eagain",
+	[LKOS_STAT_ERRORS]	= "errors",
+	[LKOS_STAT_MMSG_CALLS]	= "recvmmsg_calls",
+	[LKOS_STAT_MMSG_MSGS]	= "recvmmsg_msgs",
+	[LKOS_STAT_TS_CONVERT]	= "ts_convert",
+	[LKOS_STAT_SPIN_HITS]	= "spin_hits",
+	[LKOS_STAT_SPIN_MISSES]	= "spin_misses",
+	[LKOS_STAT_RXQ_DROPS]	= "rxq_drops",
+	[LKOS_STAT_WAIT_CALLS]	= "wait_calls",
+};
+
+static const char *batch_names[LKOS_STATS_BATCHES] = {
+	"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"
+};
+
+static void comm_get(int pid, char *comm, size_t len)
+{
+	char path[64];
+	ssize_t ret;
+	int fd;
+
+	snprintf(comm, len, "-");
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	ret = read(fd, comm, len - 1);
+	if (ret > 0) {
+		comm[ret] = '\0';
+		comm[strcspn(comm, "\n")] = '\0';
+	}
+	close(fd);
+}
+
+static bool pid_alive(int pid)
+{
+	return !kill(pid, 0) || errno == EPERM;
+}
+
+static int do_list(void)
+{
+	struct dirent *de;
+	char comm[32];
+	DIR *dir;
+	int pid;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		error(1, errno, "opendir /dev/shm");
+
+	printf("%8s %-16s %s\n", "pid", "comm", "state");
+	while ((de = readdir(dir))) {
+		if (sscanf(de->d_name, "lkos_stats.%d", &pid) != 1)
+			continue;
+
+		comm_get(pid, comm, sizeof(comm));
+		printf("%8d %-16s %s\n", pid, comm,
+		       pid_alive(pid) ? "running" : "exited");
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static const struct lkos_stats *stats_map(int pid)
+{
+	const struct lkos_stats *stats;
+	char name[LKOS_STATS_NAME_LEN];
+	struct stat st;
+	int fd;
+
+	snprintf(name, sizeof(name), "/lkos_stats.%d", pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		error(1, errno, "%s: is LKOS_STATS set?", name);
+
+	if (fstat(fd, &st))
+		error(1, errno, "fstat %s", name);
+	if (st.st_size != sizeof(*stats))
+		error(1, 0, "%s: size %lld, expected %zu", name,
+		      (long long)st.st_size, sizeof(*stats));
+
+	stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED)
+		error(1, errno, "mmap %s", name);
+	close(fd);
+
+	if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != LKOS_STATS_MAGIC ||
+	    stats->version != LKOS_STATS_VERSION)
+		error(1, 0, "%s: bad magic or version %u, expected %u", name,
+		      stats->version, LKOS_STATS_VERSION);
+
+	return stats;
+}
+
+/* The rows of all threads summed, for stack id */
+static void stack_sum(const struct lkos_stats *stats, int id,
+		      uint64_t sum[LKOS_STAT_MAX])
+{
+	uint32_t threads, t;
+	int i;
+
+	threads = __atomic_load_n(&stats->threads, __ATOMIC_RELAXED);
+	if (threads > LKOS_STATS_THREADS)
+		threads = LKOS_STATS_THREADS;
+
+	memset(sum, 0, LKOS_STAT_MAX * sizeof(sum[0]));
+	for (t = 0; t < threads; t++) {
+		for (i = 0; i < LKOS_STAT_MAX; i++)
+			sum[i] += __atomic_load_n(&stats->thread[t].stack[id].val[i],
+						  __ATOMIC_RELAXED);
+	}
+}
+
+static void print_stacks(const struct lkos_stats *stats)
+{
+	uint64_t sum[LKOS_STAT_MAX];
+	bool used;
+	int id, i;
+
+	for (id = 0; id < LKOS_STATS_STACKS; id++) {
+		stack_sum(stats, id, sum);
+		for (used = false, i = 0; i < LKOS_STAT_MAX; i++)
+			used |= !!sum[i];
+		if (!used && !stats->stack_name[id][0])
+			continue;
+
+		printf("stack %d %.*s\n", id, LKOS_STATS_NAME_LEN,
+		       stats->stack_name[id][0] ? stats->stack_name[id] : "-");
+		for (i = 0; i < LKOS_STAT_MAX; i++) {
+			if (stat_names[i])
+				printf("  %-16s %llu\n", stat_names[i],
+				       (unsigned long long)sum[i]);
+		}
+		printf("  %-16s", "recvmmsg_batch");
+		for (i = 0; i < LKOS_STATS_BATCHES; i++)
+			printf(" %s:%llu", batch_names[i],
+			       (unsigned long long)sum[LKOS_STAT_MMSG_BATCH + i]);
+		printf("\n");
+	}
+}
+
+static const char *type_name(int domain, int type)
+{
+	switch (type) {
+	case SOCK_STREAM:
+		return domain == AF_UNIX ? "unix_stream" : "tcp";
+	case SOCK_DGRAM:
+		return domain == AF_UNIX ? "unix_dgram" : "udp";
+	case SOCK_RAW:
+		return "raw";
+	default:
+		return "other";
+	}
+}
+
+static void print_fds(const struct lkos_stats *stats)
+{
+	const struct lkos_stats_fd *sfd;
+	uint32_t fds, fd;
+
+	fds = __atomic_load_n(&stats->fds, __ATOMIC_RELAXED);
+	if (fds > LKOS_STATS_FDS)
+		fds = LKOS_STATS_FDS;
+
+	printf("%6s %-11s %5s %12s %14s %12s %14s %10s %10s\n", "fd", "type",
+	       "stack", "rx_calls", "rx_bytes", "tx_calls", "tx_bytes",
+	       "eagain", "rxq_ovfl");
+	for (fd = 0; fd < fds; fd++) {
+		sfd = &stats->fd[fd];
+		if (!__atomic_load_n(&sfd->domain, __ATOMIC_RELAXED))
+			continue;
+
+		printf("%6u %-11s %5d %12llu %14llu %12llu %14llu %10llu %10llu\n",
+		       fd, type_name(sfd->domain, sfd->type), sfd->stack,
+		       (unsigned long long)sfd->rx_calls,
+		       (unsigned long long)sfd->rx_bytes,
+		       (unsigned long long)sfd->tx_calls,
+		       (unsigned long long)sfd->tx_bytes,
+		       (unsigned long long)sfd->eagain,
+		       (unsigned long long)sfd->drops);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const struct lkos_stats *stats;
+	const char *view = "lots";
+	char comm[32];
+	int pid;
+
+	if (argc < 2)
+		return do_list();
+
+	pid = atoi(argv[1]);
+	if (pid <= 0 || argc > 3)
+		error(1, 0, "usage: %s [<pid> [lots|stacks|fds]]", argv[0]);
+	if (argc == 3)
+		view = argv[2];
+	if (strcmp(view, "lots") && strcmp(view, "stacks") && strcmp(view, "fds"))
+		error(1, 0, "unknown view: %s", view);
+
+	stats = stats_map(pid);
+
+	comm_get(pid, comm, sizeof(comm));
+	printf("pid %d %s%s threads %u\n", pid, comm,
+	       pid_alive(pid) ? "" : " (exited)",
+	       __atomic_load_n(&stats->threads, __ATOMIC_RELAXED));
+
+	if (strcmp(view, "fds"))
+		print_stacks(stats);
+	if (strcmp(view, "stacks"))
+		print_fds(stats);
+
+	return 0;
+}
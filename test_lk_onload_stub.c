@@ -13,16 +13,25 @@
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <dlfcn.h>
 #include <error.h>
 #include <errno.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/errqueue.h>
+#include <linux/if_ether.h>
 #include <linux/net_tstamp.h>
+#include <net/if.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <netpacket/packet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -30,10 +39,13 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "lk_onload_stub_ext.h"
@@ -56,6 +68,41 @@ static int __fail_str(const char *fn, int line, const char *str)
 }
 #define fail_str(s) __fail_str(__func__, __LINE__, s)
 
+/* exit status of a test that cannot run here, see run_in_child */
+#define TEST_SKIP	77
+
+static int __skip_str(const char *fn, int line, const char *str)
+{
+	fprintf(stderr, "%s.%d: skipped: %s\n", fn, line, str);
+	return TEST_SKIP;
+}
+#define skip_str(s) __skip_str(__func__, __LINE__, s)
+
+/* Run fn in a child process, for tests that change its namespaces */
+static int run_in_child(int (*fn)(int domain, int type), int domain, int type,
+			const char *what)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid)
+		exit(fn(domain, type));
+
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+	if (WIFEXITED(status) && WEXITSTATUS(status) == TEST_SKIP)
+		return 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s: child failed\n", what);
+		return 1;
+	}
+
+	return 0;
+}
+
 
 /* test functions */
 
@@ -82,10 +129,195 @@ static int test_dlsym(void)
 	return 0;
 }
 
+/* Run path preloaded, logging at level into buf, with env (or NULL)
+ * added to the environment
+ */
+static int log_spawn_prog(const char *path, char *argv[], const char *level,
+			  const char *env, char *buf, size_t len)
+{
+	char preload[256], libpath[256], log_fd[32], log_level[32], extra[256];
+	char *envp[] = { preload, libpath, log_fd, log_level, extra, NULL };
+	int fds[2], status;
+	ssize_t ret;
+	size_t off = 0;
+	pid_t pid;
+
+	if (pipe(fds))
+		return fail_errno();
+
+	snprintf(preload, sizeof(preload), "LD_PRELOAD=%s", getenv("LD_PRELOAD"));
+	snprintf(libpath, sizeof(libpath), "LD_LIBRARY_PATH=%s",
+		 getenv("LD_LIBRARY_PATH") ? : "");
+	snprintf(log_fd, sizeof(log_fd), "LKOS_LOG_FD=%d", fds[1]);
+	snprintf(log_level, sizeof(log_level), "LKOS_LOG_LEVEL=%s", level);
+	snprintf(extra, sizeof(extra), "%s", env ? : "LKOS_UNUSED=");
+	errno = posix_spawn(&pid, path, NULL, NULL, argv, envp);
+	if (errno)
+		return fail_errno();
+	if (close(fds[1]))
+		return fail_errno();
+
+	while ((ret = read(fds[0], buf + off, len - 1 - off)) > 0)
+		off += ret;
+	buf[off] = '\0';
+
+	if (close(fds[0]))
+		return fail_errno();
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return fail_str("log: child failed");
+
+	return 0;
+}
+
+/* Run /bin/true preloaded, logging at level into buf */
+static int log_spawn(const char *level, char *buf, size_t len)
+{
+	char *argv[] = { "true", NULL };
+
+	return log_spawn_prog("/bin/true", argv, level, NULL, buf, len);
+}
+
+/* In a child of test_log_limits: open and close n sockets. Expect
+ * records over the rate suppressed if rate_limited
+ */
+static int log_sockets(int n, bool rate_limited)
+{
+	struct lkos_log_stats stats;
+	int i, fd;
+
+	for (i = 0; i < n; i++) {
+		fd = socket(PF_INET, SOCK_DGRAM, 0);
+		if (fd == -1)
+			return fail_errno();
+		if (close(fd))
+			return fail_errno();
+	}
+
+	if (lkos_get_log_stats(&stats))
+		return fail_str("lkos_get_log_stats");
+	if (rate_limited && !stats.suppressed)
+		return fail_str("log: expected records suppressed");
+
+	return 0;
+}
+
+static int count_str(const char *buf, const char *str)
+{
+	int n = 0;
+
+	while ((buf = strstr(buf, str))) {
+		buf += strlen(str);
+		n++;
+	}
+
+	return n;
+}
+
+/* A call site logs at most LKOS_LOG_RATE records per second, and a full
+ * ring drops records, then reports their count
+ */
+static int test_log_limits(void)
+{
+	char *argv[] = { "test_lk_onload_stub", "--log-sockets", "200", "1",
+			 NULL };
+	static char buf[16384];
+	int ret;
+
+	if (!has_preload || !getenv("LKOS_LOG_FD"))
+		return 0;
+
+	ret = log_spawn_prog("/proc/self/exe", argv, "debug", "LKOS_LOG_RATE=10",
+			     buf, sizeof(buf));
+	if (ret)
+		return ret;
+	if (count_str(buf, " socket: fd ") != 10)
+		return fail_str("log: expected LKOS_LOG_RATE records");
+
+	/* no flush before exit: the ring of 16 records fills */
+	argv[2] = "1000";
+	argv[3] = "0";
+	ret = log_spawn_prog("/proc/self/exe", argv, "debug",
+			     "LKOS_LOG_RING=16", buf, sizeof(buf));
+	if (ret)
+		return ret;
+	if (!strstr(buf, " records dropped\n"))
+		return fail_str("log: expected dropped records reported");
+
+	return 0;
+}
+
+/* Records wait in the rings of their threads, and a process writes them
+ * by its exit, with timestamps. Levels filter them.
+ */
+static int test_log(void)
+{
+	struct lkos_log_stats stats;
+	unsigned long sec, usec;
+	char buf[1024], msg[64];
+	int ret;
+
+	if (!has_preload || !getenv("LKOS_LOG_FD"))
+		return 0;
+
+	if (lkos_log_flush() < 0)
+		return fail_str("lkos_log_flush");
+	if (lkos_get_log_stats(&stats))
+		return fail_str("lkos_get_log_stats");
+	if (!stats.written || stats.dropped)
+		return fail_str("log: expected records, without drops");
+
+	ret = log_spawn("info", buf, sizeof(buf));
+	if (ret)
+		return ret;
+	if (sscanf(buf, "%lu.%06lu %63[^\n]", &sec, &usec, msg) != 3 ||
+	    strcmp(msg, "lk_onload_stub loaded"))
+		return fail_str("log: expected a timestamped record");
+
+	ret = log_spawn("err", buf, sizeof(buf));
+	if (ret)
+		return ret;
+	if (buf[0])
+		return fail_str("log: expected no records at level err");
+
+	return 0;
+}
+
+/* With EF_POLL_USEC in the environment, sockets are created with
+ * kernel busy polling enabled
+ */
+static int test_busy_poll(int domain, int type)
+{
+	const char *poll_usec;
+	socklen_t slen;
+	int fd, val;
+
+	poll_usec = getenv("EF_POLL_USEC");
+	if (!has_preload || !poll_usec)
+		return 0;
+
+	fd = socket(domain, type, 0);
+	if (fd == -1)
+		return fail_errno();
+
+	slen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, &slen))
+		return fail_errno();
+	if (val != strtol(poll_usec, NULL, 0))
+		return fail_str("SO_BUSY_POLL: unexpected value");
+
+	if (close(fd))
+		return fail_errno();
+
+	return 0;
+}
+
 static int test_getsockopt_timestamping_val(int domain, int type, int val)
 {
+	int fd, dupfd, get, status;
 	socklen_t slen;
-	int fd, get;
+	pid_t pid;
 
 	fd = socket(domain, type, 0);
 	if (fd == -1)
@@ -103,6 +335,42 @@ static int test_getsockopt_timestamping_val(int domain, int type, int val)
 	if (get != val)
 		return fail_str("getsockopt: unexpected value");
 
+	/* a child shares the socket: expect the flags it sets */
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid) {
+		get = 0;
+		exit(!!setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &get,
+				  sizeof(get)));
+	}
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return fail_str("timestamping: child failed");
+
+	slen = sizeof(get);
+	if (getsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &get, &slen))
+		return fail_errno();
+	if (get != 0)
+		return fail_str("getsockopt: unexpected value after fork");
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)))
+		return fail_errno();
+
+	/* a dup refers to the same socket: expect the same flags */
+	dupfd = dup(fd);
+	if (dupfd == -1)
+		return fail_errno();
+
+	slen = sizeof(get);
+	if (getsockopt(dupfd, SOL_SOCKET, SO_TIMESTAMPING, &get, &slen))
+		return fail_errno();
+	if (get != val)
+		return fail_str("getsockopt: unexpected value on dup");
+
+	if (close(dupfd))
+		return fail_errno();
 	if (close(fd))
 		return fail_errno();
 
@@ -133,12 +401,18 @@ static int test_getsockopt_timestamping(int domain, int type)
 	ret |= test_getsockopt_timestamping_val(domain, type, rx);
 	ret |= test_getsockopt_timestamping_val(domain, type, all);
 
+	/* report without record: must not be mistaken for a conversion */
+	ret |= test_getsockopt_timestamping_val(domain, type,
+						SOF_TIMESTAMPING_RAW_HARDWARE | sw_rx);
+
 	return ret;
 }
 
 static int test_onload_nonaccel(int domain, int type)
 {
-	int fd;
+	struct lkos_fd_stat lstat;
+	struct onload_stat stat;
+	int fd, one = 1;
 
 	/* Without the LD_PRELOAD, these calls will fall back to the
 	 * lk_onload_stub_ext.c functions, all of which return failure
@@ -155,8 +429,34 @@ static int test_onload_nonaccel(int domain, int type)
 	if (fd == -1)
 		return fail_errno();
 
-	if (onload_fd_stat(fd, NULL))
-		return fail_str("onload_fd_stat: returns non-zero for non-accelerated socket");
+	if (onload_fd_stat(fd, NULL) != 1)
+		return fail_str("onload_fd_stat: returns 0 for managed socket");
+
+	if (onload_fd_stat(fd, &stat) != 1)
+		return fail_str("onload_fd_stat");
+	if (stat.stack_id != 0 || strcmp(stat.stack_name, "") ||
+	    stat.endpoint_id != fd)
+		return fail_str("onload_fd_stat: unexpected stat");
+	if (type == SOCK_STREAM && stat.endpoint_state != TCP_CLOSE)
+		return fail_str("onload_fd_stat: unexpected endpoint state");
+	free(stat.stack_name);
+
+	/* test lkos_fd_stat */
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		return fail_errno();
+	if (type == SOCK_DGRAM &&
+	    setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)))
+		return fail_errno();
+
+	if (lkos_fd_stat(fd, &lstat) != 1)
+		return fail_str("lkos_fd_stat");
+	if (!(lstat.features & LKOS_FD_FEATURE_ZEROCOPY) ||
+	    (type == SOCK_DGRAM) != !!(lstat.features & LKOS_FD_FEATURE_UDP_GRO) ||
+	    (lstat.features & LKOS_FD_FEATURE_TS_CONVERT))
+		return fail_str("lkos_fd_stat: unexpected features");
+	if (getenv("EF_POLL_USEC") &&
+	    !(lstat.features & LKOS_FD_FEATURE_BUSY_POLL))
+		return fail_str("lkos_fd_stat: expected busy poll");
 
 	if (close(fd))
 		return fail_errno();
@@ -166,6 +466,11 @@ static int test_onload_nonaccel(int domain, int type)
 	if (fd == -1)
 		return fail_errno();
 
+	if (onload_fd_stat(fd, NULL))
+		return fail_str("onload_fd_stat: returns non-zero for non-accelerated socket");
+	if (lkos_fd_stat(fd, &lstat))
+		return fail_str("lkos_fd_stat: returns non-zero for non-accelerated socket");
+
 	if (close(fd))
 		return fail_errno();
 
@@ -251,12 +556,16 @@ static int test_onload_stacks_api(int domain, int type)
 	if (onload_stack_opt_set_str("EF_SCALABLE_FILTERS", "eth0"))
 		return fail_str("onload_stack_opt_set_str");
 
-	if (onload_stack_opt_get_int("EF_SPIN_USEC", &data_get_int) != -1)
-		return fail_str("onload_stack_opt_get_int: not failing as expected");
+	if (onload_stack_opt_get_int("EF_SPIN_USEC", &data_get_int))
+		return fail_str("onload_stack_opt_get_int");
+	if (data_get_int != 10)
+		return fail_str("onload_stack_opt_get_int: unexpected value");
 
 	len_get_str = sizeof(data_get_str);
-	if (onload_stack_opt_get_str("EF_SCALABLE_FILTERS", data_get_str, &len_get_str) != -1)
-		return fail_str("onload_stack_opt_get_str: not failing as expected");
+	if (onload_stack_opt_get_str("EF_SCALABLE_FILTERS", data_get_str, &len_get_str))
+		return fail_str("onload_stack_opt_get_str");
+	if (strcmp(data_get_str, "eth0") || len_get_str != sizeof("eth0"))
+		return fail_str("onload_stack_opt_get_str: unexpected value");
 
 	fd = socket(domain, type, 0);
 	if (fd == -1)
@@ -274,6 +583,199 @@ static int test_onload_stacks_api(int domain, int type)
 	if (close(fd))
 		return fail_errno();
 
+	/* stacks are real: return to the default stack for other tests */
+	if (onload_set_stackname(0, 0, ""))
+		return fail_str("onload_set_stackname");
+
+	return 0;
+}
+
+static int get_rcvbuf(int domain, int type, int *val)
+{
+	socklen_t slen = sizeof(*val);
+	int fd;
+
+	fd = socket(domain, type, 0);
+	if (fd == -1)
+		return fail_errno();
+
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, val, &slen))
+		return fail_errno();
+
+	if (close(fd))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Options are applied to sockets created after the set, until reset */
+static int test_onload_stack_opt(int domain, int type)
+{
+	int64_t val, poll_usec;
+	int rcvbuf_def, rcvbuf;
+	size_t len;
+	char str[2];
+	int ret;
+
+	if (!has_preload)
+		return 0;
+
+	/* seeded from the environment */
+	if (onload_stack_opt_get_int("EF_POLL_USEC", &poll_usec))
+		return fail_str("onload_stack_opt_get_int");
+	if (poll_usec != strtol(getenv("EF_POLL_USEC") ? : "0", NULL, 0))
+		return fail_str("onload_stack_opt_get_int: unexpected value");
+
+	/* unknown options and mismatched types */
+	if (onload_stack_opt_set_int("EF_DOES_NOT_EXIST", 1) != -EINVAL)
+		return fail_str("onload_stack_opt_set_int: expected -EINVAL");
+	if (onload_stack_opt_get_int("EF_NAME", &val) != -EINVAL)
+		return fail_str("onload_stack_opt_get_int: expected -EINVAL");
+
+	if (onload_stack_opt_set_str("EF_NAME", "stack"))
+		return fail_str("onload_stack_opt_set_str");
+	len = sizeof(str);
+	if (onload_stack_opt_get_str("EF_NAME", str, &len) != -ENOSPC ||
+	    len != sizeof("stack"))
+		return fail_str("onload_stack_opt_get_str: expected -ENOSPC");
+
+	ret = get_rcvbuf(domain, type, &rcvbuf_def);
+	if (ret)
+		return ret;
+
+	/* SO_RCVBUF from EF_RXQ_SIZE packets; the kernel doubles it */
+	if (onload_stack_opt_set_int("EF_RXQ_SIZE", 16))
+		return fail_str("onload_stack_opt_set_int");
+
+	ret = get_rcvbuf(domain, type, &rcvbuf);
+	if (ret)
+		return ret;
+	if (rcvbuf != 2 * 16 * 2048)
+		return fail_str("EF_RXQ_SIZE: unexpected SO_RCVBUF");
+
+	if (onload_stack_opt_reset())
+		return fail_str("onload_stack_opt_reset");
+
+	ret = get_rcvbuf(domain, type, &rcvbuf);
+	if (ret)
+		return ret;
+	if (rcvbuf != rcvbuf_def)
+		return fail_str("onload_stack_opt_reset: unexpected SO_RCVBUF");
+
+	if (onload_stack_opt_get_int("EF_POLL_USEC", &val) || val != poll_usec)
+		return fail_str("onload_stack_opt_reset: unexpected value");
+
+	return 0;
+}
+
+/* Open a socket in the current stack, return SO_BUSY_POLL and
+ * SO_INCOMING_CPU. Leaves the socket open in *fd_p, if not NULL.
+ */
+static int stack_socket(int domain, int type, int *fd_p, int *busy_poll,
+			int *cpu)
+{
+	socklen_t slen;
+	int fd;
+
+	fd = socket(domain, type, 0);
+	if (fd == -1)
+		return fail_errno();
+
+	slen = sizeof(*busy_poll);
+	if (getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll, &slen))
+		return fail_errno();
+	slen = sizeof(*cpu);
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, cpu, &slen))
+		return fail_errno();
+
+	if (fd_p)
+		*fd_p = fd;
+	else if (close(fd))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Sockets created under a stack name get the stack's settings, from
+ * LKOS_STACKS="lkos_test:cpus=0x1,poll_usec=20"
+ */
+static int test_onload_stacks_named(int domain, int type)
+{
+	int fd, busy_poll, cpu, poll_usec, ret;
+
+	if (!has_preload || !getenv("LKOS_STACKS") || !getenv("EF_POLL_USEC"))
+		return 0;
+
+	poll_usec = strtol(getenv("EF_POLL_USEC"), NULL, 0);
+
+	if (onload_stackname_save())
+		return fail_str("onload_stackname_save");
+
+	if (onload_set_stackname(ONLOAD_THIS_THREAD, ONLOAD_SCOPE_THREAD,
+				 "lkos_test"))
+		return fail_str("onload_set_stackname");
+	ret = stack_socket(domain, type, NULL, &busy_poll, &cpu);
+	if (ret)
+		return ret;
+	if (busy_poll != 20 || cpu != 0)
+		return fail_str("stack lkos_test: unexpected settings");
+
+	if (onload_stackname_save())
+		return fail_str("onload_stackname_save");
+
+	/* not accelerated: no settings, and cannot move fds */
+	if (onload_set_stackname(ONLOAD_THIS_THREAD, ONLOAD_SCOPE_NOCHANGE,
+				 ONLOAD_DONT_ACCELERATE))
+		return fail_str("onload_set_stackname");
+	ret = stack_socket(domain, type, &fd, &busy_poll, &cpu);
+	if (ret)
+		return ret;
+	if (busy_poll != 0 || cpu != -1)
+		return fail_str("stack nonaccel: unexpected settings");
+	if (onload_move_fd(fd) != -EINVAL)
+		return fail_str("onload_move_fd: expected -EINVAL");
+
+	/* back in lkos_test: move fd there */
+	if (onload_stackname_restore())
+		return fail_str("onload_stackname_restore");
+	if (onload_move_fd(fd))
+		return fail_str("onload_move_fd");
+	if (close(fd))
+		return fail_errno();
+
+	/* back in the default stack */
+	if (onload_stackname_restore())
+		return fail_str("onload_stackname_restore");
+	ret = stack_socket(domain, type, NULL, &busy_poll, &cpu);
+	if (ret)
+		return ret;
+	if (busy_poll != poll_usec || cpu != -1)
+		return fail_str("stack default: unexpected settings");
+
+	/* the most recent of this thread's and all threads' names wins */
+	if (onload_set_stackname(ONLOAD_ALL_THREADS, ONLOAD_SCOPE_PROCESS,
+				 "lkos_test"))
+		return fail_str("onload_set_stackname");
+	ret = stack_socket(domain, type, NULL, &busy_poll, &cpu);
+	if (ret)
+		return ret;
+	if (busy_poll != 20)
+		return fail_str("stack all threads: unexpected settings");
+
+	if (onload_set_stackname(ONLOAD_THIS_THREAD, ONLOAD_SCOPE_PROCESS, ""))
+		return fail_str("onload_set_stackname");
+	ret = stack_socket(domain, type, NULL, &busy_poll, &cpu);
+	if (ret)
+		return ret;
+	if (busy_poll != poll_usec)
+		return fail_str("stack this thread: unexpected settings");
+
+	if (onload_set_stackname(ONLOAD_ALL_THREADS, ONLOAD_SCOPE_PROCESS, ""))
+		return fail_str("onload_set_stackname");
+
+	if (onload_stackname_restore() != -EINVAL)
+		return fail_str("onload_stackname_restore: expected -EINVAL");
+
 	return 0;
 }
 
@@ -334,8 +836,12 @@ static int socketpair_open(int domain, int type, int *fdt_p, int *fdr_p)
 
 static int test_recv_msg_onepkt(int domain, int type)
 {
+	char ctrl[CMSG_SPACE(sizeof(int))] __attribute__((aligned(8)));
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	struct iovec iov;
+	int fdt, fdr, one = 1, ret;
 	char rxbuf[2];
-	int fdt, fdr, ret;
 
 	ret = socketpair_open(domain, type, &fdt, &fdr);
 	if (ret)
@@ -351,6 +857,34 @@ static int test_recv_msg_onepkt(int domain, int type)
 	if (recv(fdr, rxbuf, sizeof(rxbuf), ONLOAD_MSG_ONEPKT) != 1)
 		return fail_errno();
 
+	/* the timestamps that onepkt enables take no control space */
+	if (has_preload && type == SOCK_STREAM) {
+		iov.iov_base = rxbuf;
+		iov.iov_len = sizeof(rxbuf);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (write(fdt, "a", 1) != 1)
+			return fail_errno();
+		if (recvmsg(fdr, &msg, ONLOAD_MSG_ONEPKT) != 1)
+			return fail_errno();
+		if (msg.msg_controllen || (msg.msg_flags & MSG_CTRUNC))
+			return fail_str("recvmsg: unexpected MSG_CTRUNC");
+
+		if (setsockopt(fdr, IPPROTO_TCP, TCP_INQ, &one, sizeof(one)))
+			return fail_errno();
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		if (write(fdt, "a", 1) != 1)
+			return fail_errno();
+		if (recvmsg(fdr, &msg, ONLOAD_MSG_ONEPKT) != 1)
+			return fail_errno();
+		cm = CMSG_FIRSTHDR(&msg);
+		if ((msg.msg_flags & MSG_CTRUNC) || !cm ||
+		    cm->cmsg_level != IPPROTO_TCP || cm->cmsg_type != TCP_CM_INQ ||
+		    CMSG_NXTHDR(&msg, cm))
+			return fail_str("recvmsg: expected inq only");
+	}
+
 	if (close(fdr))
 		return fail_errno();
 	if (close(fdt))
@@ -359,11 +893,322 @@ static int test_recv_msg_onepkt(int domain, int type)
 	return 0;
 }
 
-static int test_setsockopt_timestamping_ctrl(int domain, int type)
+/* Each ONLOAD_MSG_ONEPKT read ends at or before a packet boundary
+ *
+ * Loopback TCP coalesces small segments in the receive queue, but keeps
+ * segments of this size apart.
+ */
+static int test_recv_msg_onepkt_burst(int domain, int type)
 {
-	int fd, val;
+	const int len = 40000, num = 3;
+	char ctrl[CMSG_SPACE(sizeof(struct timespec))];
+	struct msghdr msg = {0};
+	struct iovec iov;
+	int fdt, fdr, one = 1, off, ret, i;
+	static char buf[2 * 40000];
 
-	fd = socket(domain, type, 0);
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	/* Arm segment boundaries before data arrives */
+	if (recv(fdr, buf, sizeof(buf), ONLOAD_MSG_ONEPKT | MSG_DONTWAIT) != -1 ||
+	    errno != EAGAIN)
+		return fail_str("recv: expected EAGAIN");
+
+	if (type == SOCK_STREAM &&
+	    setsockopt(fdt, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		return fail_errno();
+
+	for (i = 0; i < num; i++) {
+		if (write(fdt, buf, len) != len)
+			return fail_errno();
+		usleep(1000);
+	}
+	usleep(10000);
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	for (off = 0, i = 0; off < len * num; off += ret, i++) {
+		if (i & 1) {
+			msg.msg_control = ctrl;
+			msg.msg_controllen = sizeof(ctrl);
+			ret = recvmsg(fdr, &msg, ONLOAD_MSG_ONEPKT | MSG_DONTWAIT);
+			if (msg.msg_controllen)
+				return fail_str("recvmsg: unexpected cmsg");
+		} else {
+			ret = recv(fdr, buf, sizeof(buf), ONLOAD_MSG_ONEPKT | MSG_DONTWAIT);
+		}
+		if (ret <= 0)
+			return fail_errno();
+		if (off / len != (off + ret - 1) / len)
+			return fail_str("recv: read across packets");
+	}
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Verify that events are returned in the order that data arrived
+ *
+ * Send to b, then to a. Register both with epoll data that is not the
+ * fd, to exercise the mapping from event to socket. A datagram queued
+ * behind the head of a does not count. A peek offset set by the
+ * application is kept: TCP supports it since Linux 6.9.
+ */
+static int test_onload_ordered_epoll_wait_data(int domain, int type)
+{
+	const int val = SOF_TIMESTAMPING_SOFTWARE |
+			SOF_TIMESTAMPING_RX_SOFTWARE;
+	struct onload_ordered_epoll_event oo_rev[NUM_REVENTS];
+	struct epoll_event ev = { .events = EPOLLIN }, rev[NUM_REVENTS];
+	int fdt[2], fdr[2], epoll_fd, ret, i, off = 0;
+	const char *payload[2] = { "aaa", "bbbbb" };
+	socklen_t len = sizeof(off);
+	char rxbuf[8];
+	bool peek_off;
+
+	if (!has_preload)
+		return 0;
+
+	for (i = 0; i < 2; i++) {
+		ret = socketpair_open(domain, type, &fdt[i], &fdr[i]);
+		if (ret)
+			return ret;
+		if (setsockopt(fdr[i], SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)))
+			return fail_errno();
+	}
+	peek_off = !setsockopt(fdr[0], SOL_SOCKET, SO_PEEK_OFF, &off, sizeof(off));
+	if (!peek_off && type == SOCK_DGRAM)
+		return fail_errno();
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1)
+		return fail_errno();
+
+	for (i = 0; i < 2; i++) {
+		ev.data.ptr = &fdr[i];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fdr[i], &ev))
+			return fail_errno();
+	}
+
+	/* wait for static_branch netstamp_needed_key to be enabled */
+	usleep(10 * 1000);
+
+	if (write(fdt[1], payload[1], strlen(payload[1])) != strlen(payload[1]))
+		return fail_errno();
+	usleep(1000);
+	if (write(fdt[0], payload[0], strlen(payload[0])) != strlen(payload[0]))
+		return fail_errno();
+	usleep(1000);
+	if (type == SOCK_DGRAM && write(fdt[0], "cc", 2) != 2)
+		return fail_errno();
+	usleep(1000);
+
+	ret = onload_ordered_epoll_wait(epoll_fd, rev, oo_rev, NUM_REVENTS, 100);
+	if (ret == -1)
+		return fail_errno();
+	if (ret != 2)
+		return fail_str("onload_ordered_epoll_wait: count");
+
+	if (rev[0].data.ptr != &fdr[1] || rev[1].data.ptr != &fdr[0])
+		return fail_str("onload_ordered_epoll_wait: not in wire order");
+	for (i = 0; i < 2; i++) {
+		if (!oo_rev[i].ts.tv_sec)
+			return fail_str("onload_ordered_epoll_wait: zero ts");
+		if (oo_rev[i].bytes != strlen(payload[1 - i]))
+			return fail_str("onload_ordered_epoll_wait: bytes");
+	}
+	if (oo_rev[0].ts.tv_sec > oo_rev[1].ts.tv_sec ||
+	    (oo_rev[0].ts.tv_sec == oo_rev[1].ts.tv_sec &&
+	     oo_rev[0].ts.tv_nsec >= oo_rev[1].ts.tv_nsec))
+		return fail_str("onload_ordered_epoll_wait: ts not ascending");
+
+	if (peek_off &&
+	    (getsockopt(fdr[0], SOL_SOCKET, SO_PEEK_OFF, &off, &len) || off))
+		return fail_str("getsockopt SO_PEEK_OFF: expected 0");
+	if (recv(fdr[0], rxbuf, sizeof(rxbuf), MSG_PEEK | MSG_DONTWAIT) <
+	    (int)strlen(payload[0]) || memcmp(rxbuf, payload[0], strlen(payload[0])))
+		return fail_str("recv MSG_PEEK: expected head");
+
+	if (close(epoll_fd))
+		return fail_errno();
+	for (i = 0; i < 2; i++) {
+		if (close(fdr[i]))
+			return fail_errno();
+		if (close(fdt[i]))
+			return fail_errno();
+	}
+
+	return 0;
+}
+
+/* With LKOS_USER_SPIN, a blocking recv first spins: count a miss if the
+ * call has to block (and times out). Data that is ready at once takes
+ * no spinning: that is not a hit.
+ */
+static int test_user_spin(int domain, int type)
+{
+	struct timeval tv = { .tv_usec = 10 * 1000 };
+	struct lkos_spin_stats before, after;
+	int fdt, fdr, ret;
+	char rxbuf[2];
+
+	if (!has_preload || !getenv("LKOS_USER_SPIN"))
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (setsockopt(fdr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		return fail_errno();
+
+	if (lkos_get_spin_stats(&before))
+		return fail_str("lkos_get_spin_stats");
+
+	if (write(fdt, "a", 1) != 1)
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1)
+		return fail_errno();
+
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != -1 || errno != EAGAIN)
+		return fail_str("recv: expected timeout");
+
+	if (lkos_get_spin_stats(&after))
+		return fail_str("lkos_get_spin_stats");
+	if (after.hits != before.hits)
+		return fail_str("user spin: unexpected hit");
+	if (after.misses != before.misses + 1)
+		return fail_str("user spin: expected a miss");
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+static void *thread_get_spin(void *arg)
+{
+	if (onload_thread_get_spin(arg))
+		return arg;
+
+	return NULL;
+}
+
+/* Spin a recv on a connection without data, until it times out:
+ * returns spin misses
+ */
+static int thread_spin_recv(int fdr, uint64_t *misses)
+{
+	struct timeval tv = { .tv_usec = 1000 };
+	struct lkos_spin_stats before, after;
+	char rxbuf[2];
+
+	if (setsockopt(fdr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		return fail_errno();
+
+	if (lkos_get_spin_stats(&before))
+		return fail_str("lkos_get_spin_stats");
+
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != -1 || errno != EAGAIN)
+		return fail_str("recv: expected timeout");
+
+	if (lkos_get_spin_stats(&after))
+		return fail_str("lkos_get_spin_stats");
+
+	*misses = after.misses - before.misses;
+	return 0;
+}
+
+/* Spin state is per thread, and overrides the process default */
+static int test_thread_spin(int domain, int type)
+{
+	enum onload_spin_type spin_recv;
+	unsigned int orig, state, other;
+	int fdt, fdr, ret, i;
+	pthread_t thread;
+	uint64_t misses;
+
+	if (!has_preload)
+		return 0;
+
+	spin_recv = type == SOCK_STREAM ? ONLOAD_SPIN_TCP_RECV :
+					  ONLOAD_SPIN_UDP_RECV;
+
+	if (onload_thread_get_spin(&orig))
+		return fail_str("onload_thread_get_spin");
+
+	if (onload_thread_set_spin(ONLOAD_SPIN_MAX, 1) != -EINVAL)
+		return fail_str("onload_thread_set_spin: expected -EINVAL");
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	/* disabled: no spinning */
+	if (onload_thread_set_spin(ONLOAD_SPIN_ALL, 0))
+		return fail_str("onload_thread_set_spin");
+	if (onload_thread_get_spin(&state) || state)
+		return fail_str("onload_thread_get_spin: expected 0");
+
+	ret = thread_spin_recv(fdr, &misses);
+	if (ret)
+		return ret;
+	if (misses)
+		return fail_str("thread spin: unexpected spin");
+
+	/* other threads see the process default */
+	if (pthread_create(&thread, NULL, thread_get_spin, &other))
+		return fail_str("pthread_create");
+	if (pthread_join(thread, NULL))
+		return fail_str("pthread_join");
+	if (other != orig)
+		return fail_str("onload_thread_get_spin: other thread changed");
+
+	/* enabled for this socket type only */
+	if (onload_thread_set_spin(spin_recv, 1))
+		return fail_str("onload_thread_set_spin");
+	if (onload_thread_get_spin(&state) || state != 1U << spin_recv)
+		return fail_str("onload_thread_get_spin: unexpected state");
+
+	ret = thread_spin_recv(fdr, &misses);
+	if (ret)
+		return ret;
+	if (misses != 1)
+		return fail_str("thread spin: expected a spin");
+
+	/* restore the process default for this thread */
+	for (i = ONLOAD_SPIN_ALL + 1; i < ONLOAD_SPIN_MAX; i++) {
+		if (onload_thread_set_spin(i, orig & (1U << i)))
+			return fail_str("onload_thread_set_spin");
+	}
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+static int test_setsockopt_timestamping_ctrl(int domain, int type)
+{
+	int fd, val;
+
+	fd = socket(domain, type, 0);
 	if (fd == -1)
 		return fail_errno();
 
@@ -497,25 +1342,2077 @@ static int test_setsockopt_timestamping_data(int domain, int type)
 	return 0;
 }
 
-int main(int argc, char **argv)
+struct zc_recv_state {
+	char data[16];
+	int len;
+	int calls;
+	int terminate_at;		/* return TERMINATE on this call */
+	int keep_at;			/* return KEEP on this call */
+	onload_zc_handle kept;
+	int flags;			/* of the last call */
+	int ret;
+};
+
+static enum onload_zc_callback_rc zc_recv_cb(struct onload_zc_recv_args *args,
+					     int flags)
 {
-	const int domains[] = { PF_INET, PF_INET6, 0 }, *p_domain;
-	const int types[] = { SOCK_STREAM, SOCK_DGRAM, 0 }, *p_type;
-	int ret = 0;
+	struct zc_recv_state *zs = args->user_ptr;
+	struct onload_zc_iovec *iov = &args->msg.iov[0];
+	enum onload_zc_callback_rc rc = ONLOAD_ZC_CONTINUE;
 
-	has_preload = getenv("LD_PRELOAD");
+	zs->calls++;
+	zs->flags = flags;
+
+	if (zs->len + iov->iov_len <= sizeof(zs->data)) {
+		memcpy(zs->data + zs->len, iov->iov_base, iov->iov_len);
+		zs->len += iov->iov_len;
+	}
+
+	if (args->msg.msghdr.msg_control)
+		zs->ret |= recvmsg_tstamp_cmsg(&args->msg.msghdr);
+
+	if (zs->calls == zs->keep_at) {
+		zs->kept = iov->buf;
+		rc |= ONLOAD_ZC_KEEP;
+	}
+	if (zs->calls == zs->terminate_at)
+		rc |= ONLOAD_ZC_TERMINATE;
+
+	return rc;
+}
+
+/* Messages not consumed before ONLOAD_ZC_TERMINATE are delivered on the
+ * next call, and readable meanwhile. Kept buffers are released.
+ */
+static int test_onload_zc_recv(int domain, int type)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct epoll_event ev = { .events = EPOLLIN }, rev;
+	struct onload_zc_recv_args args = {0};
+	struct zc_recv_state zs = {0};
+	struct pollfd pfd;
+	int fdt, fdr, epfd, ret, val;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	val = SOF_TIMESTAMPING_SOFTWARE |
+	      SOF_TIMESTAMPING_RX_SOFTWARE |
+	      SOF_TIMESTAMPING_RAW_HARDWARE;
+	if (setsockopt(fdr, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)))
+		return fail_errno();
+
+	/* wait for static_branch netstamp_needed_key to be enabled */
+	usleep(10 * 1000);
+
+	args.cb = zc_recv_cb;
+	args.user_ptr = &zs;
+	args.flags = MSG_DONTWAIT;
+	args.msg.msghdr.msg_control = ctrl;
+	args.msg.msghdr.msg_controllen = sizeof(ctrl);
+
+	if (onload_zc_recv(fdr, &args) != -EAGAIN)
+		return fail_str("onload_zc_recv: expected -EAGAIN");
+
+	if (write(fdt, "a", 1) != 1 || write(fdt, "bb", 2) != 2 ||
+	    write(fdt, "ccc", 3) != 3)
+		return fail_errno();
+	usleep(10 * 1000);
+
+	/* datagrams: keep the first, stop after the second */
+	if (type == SOCK_DGRAM) {
+		zs.keep_at = 1;
+		zs.terminate_at = 2;
+		if (onload_zc_recv(fdr, &args))
+			return fail_str("onload_zc_recv");
+		if (zs.calls != 2 || zs.len != 3 || !zs.kept)
+			return fail_str("onload_zc_recv: unexpected calls");
+
+		/* the third datagram is stashed: still readable */
+		epfd = epoll_create(1);
+		if (epfd == -1)
+			return fail_errno();
+		ev.data.u64 = 0xabcd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdr, &ev))
+			return fail_errno();
+		if (epoll_wait(epfd, &rev, 1, 0) != 1 || rev.data.u64 != 0xabcd)
+			return fail_str("epoll_wait: stash not readable");
+		if (close(epfd))
+			return fail_errno();
+
+		pfd.fd = fdr;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+			return fail_str("poll: stash not readable");
+	}
+
+	if (onload_zc_recv(fdr, &args))
+		return fail_str("onload_zc_recv");
+	if (zs.len != 6 || memcmp(zs.data, "abbccc", 6))
+		return fail_str("onload_zc_recv: unexpected data");
+	if (!(zs.flags & ONLOAD_ZC_END_OF_BURST))
+		return fail_str("onload_zc_recv: expected end of burst");
+	if (zs.ret)
+		return zs.ret;
+
+	if (zs.kept && onload_zc_release_buffers(fdr, &zs.kept, 1))
+		return fail_str("onload_zc_release_buffers");
+	if (onload_zc_release_buffers(fdr, (onload_zc_handle *)&fdr, 1) != -EINVAL)
+		return fail_str("onload_zc_release_buffers: expected -EINVAL");
+
+	/* an empty datagram does not end the batch */
+	if (type == SOCK_DGRAM) {
+		memset(&zs, 0, sizeof(zs));
+		if (write(fdt, "a", 1) != 1 || write(fdt, "", 0) != 0 ||
+		    write(fdt, "bb", 2) != 2)
+			return fail_errno();
+		usleep(10 * 1000);
+		if (onload_zc_recv(fdr, &args))
+			return fail_str("onload_zc_recv");
+		if (zs.calls != 3 || zs.len != 3 || memcmp(zs.data, "abb", 3))
+			return fail_str("onload_zc_recv: expected an empty datagram");
+	}
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Receive len bytes on fd, as one datagram or from a stream */
+static int recv_all(int fd, char *buf, int len)
+{
+	int ret, off = 0;
+
+	while (off < len) {
+		ret = recv(fd, buf + off, len - off, 0);
+		if (ret <= 0)
+			return fail_errno();
+		off += ret;
+	}
+
+	return 0;
+}
+
+/* A large send goes out with MSG_ZEROCOPY, a small one is copied. Buffers
+ * return to the pool once recvmsg(MSG_ERRQUEUE) reads the notification.
+ */
+static int test_onload_zc_send(int domain, int type)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) +
+			     sizeof(struct sockaddr_in6))];
+	struct msghdr msg = { .msg_control = ctrl };
+	const struct sock_extended_err *serr = NULL;
+	struct onload_zc_iovec iov[2], *all;
+	struct onload_zc_mmsg mmsg[2] = {0};
+	struct pollfd pfd;
+	struct cmsghdr *cmsg;
+	const char *env;
+	char *rxbuf;
+	int fdt, fdr, ret, nbufs, i;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (onload_zc_alloc_buffers(fdt, iov, 2, ONLOAD_ZC_BUFFER_HDR_NONE))
+		return fail_str("onload_zc_alloc_buffers");
+	if (iov[0].iov_len < 12000 || iov[0].buf == iov[1].buf)
+		return fail_str("onload_zc_alloc_buffers: unexpected buffers");
+
+	memset(iov[0].iov_base, 'a', 12000);
+	iov[0].iov_len = 12000;
+	memcpy(iov[1].iov_base, "hello", 5);
+	iov[1].iov_len = 5;
+
+	for (i = 0; i < 2; i++) {
+		mmsg[i].fd = fdt;
+		mmsg[i].msg.iov = &iov[i];
+		mmsg[i].msg.msghdr.msg_iovlen = 1;
+	}
+	if (onload_zc_send(mmsg, 2, 0) != 2)
+		return fail_str("onload_zc_send");
+	if (mmsg[0].rc != 12000 || mmsg[1].rc != 5)
+		return fail_str("onload_zc_send: unexpected rc");
+
+	rxbuf = malloc(12005);
+	if (!rxbuf)
+		return fail_errno();
+	if (type == SOCK_DGRAM) {
+		ret = recv_all(fdr, rxbuf, 12000);
+		ret |= recv_all(fdr, rxbuf + 12000, 5);
+	} else {
+		ret = recv_all(fdr, rxbuf, 12005);
+	}
+	if (ret)
+		return ret;
+	if (rxbuf[0] != 'a' || rxbuf[11999] != 'a' || memcmp(rxbuf + 12000, "hello", 5))
+		return fail_str("onload_zc_send: unexpected data");
+	free(rxbuf);
+
+	/* only the large send is notified */
+	pfd.fd = fdt;
+	pfd.events = 0;
+	if (poll(&pfd, 1, 1000) != 1 || !(pfd.revents & POLLERR))
+		return fail_str("poll: expected a zerocopy notification");
+	msg.msg_controllen = sizeof(ctrl);
+	if (recvmsg(fdt, &msg, MSG_ERRQUEUE) < 0)
+		return fail_errno();
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		serr = (void *)CMSG_DATA(cmsg);
+	if (!serr || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+	    serr->ee_info != 0 || serr->ee_data != 0)
+		return fail_str("recvmsg: expected a zerocopy notification");
+
+	/* both buffers are back: the whole pool can be allocated */
+	env = getenv("LKOS_ZC_TX_BUFS");
+	nbufs = env ? atoi(env) : 1024;
+	all = calloc(nbufs, sizeof(*all));
+	if (!all)
+		return fail_errno();
+	if (onload_zc_alloc_buffers(fdt, all, nbufs, ONLOAD_ZC_BUFFER_HDR_NONE))
+		return fail_str("onload_zc_alloc_buffers: buffers not returned");
+	if (onload_zc_alloc_buffers(fdt, iov, 1, ONLOAD_ZC_BUFFER_HDR_NONE) != -ENOMEM)
+		return fail_str("onload_zc_alloc_buffers: expected -ENOMEM");
+
+	/* buffers not from the pool are refused, and stay with the caller */
+	iov[0].iov_base = ctrl;
+	iov[0].iov_len = 1;
+	iov[0].buf = all[0].buf;
+	if (onload_zc_send(mmsg, 1, 0) != 1 || mmsg[0].rc != -EINVAL)
+		return fail_str("onload_zc_send: expected -EINVAL");
+
+	for (i = 0; i < nbufs; i++) {
+		if (onload_zc_release_buffers(fdt, &all[i].buf, 1))
+			return fail_str("onload_zc_release_buffers");
+	}
+	free(all);
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* With TX timestamps on, running out of buffers does not read the error
+ * queue: the timestamps stay there for the application.
+ */
+static int test_onload_zc_send_tstamp(int domain, int type)
+{
+	const int val = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) +
+			     sizeof(struct sockaddr_in6)) +
+		  CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct msghdr msg = { .msg_control = ctrl };
+	const struct sock_extended_err *serr;
+	struct onload_zc_iovec iov, *all;
+	struct onload_zc_mmsg mmsg = {0};
+	struct cmsghdr *cmsg;
+	bool tstamp = false;
+	const char *env;
+	char *rxbuf;
+	int fdt, fdr, ret, nbufs, i;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+	if (setsockopt(fdt, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)))
+		return fail_errno();
+
+	if (onload_zc_alloc_buffers(fdt, &iov, 1, ONLOAD_ZC_BUFFER_HDR_NONE))
+		return fail_str("onload_zc_alloc_buffers");
+	memset(iov.iov_base, 'a', 12000);
+	iov.iov_len = 12000;
+	mmsg.fd = fdt;
+	mmsg.msg.iov = &iov;
+	mmsg.msg.msghdr.msg_iovlen = 1;
+	if (onload_zc_send(&mmsg, 1, 0) != 1 || mmsg.rc != 12000)
+		return fail_str("onload_zc_send");
+
+	rxbuf = malloc(12000);
+	if (!rxbuf)
+		return fail_errno();
+	ret = recv_all(fdr, rxbuf, 12000);
+	free(rxbuf);
+	if (ret)
+		return ret;
+
+	/* the buffer in flight is not reaped from the error queue */
+	env = getenv("LKOS_ZC_TX_BUFS");
+	nbufs = env ? atoi(env) : 1024;
+	all = calloc(nbufs, sizeof(*all));
+	if (!all)
+		return fail_errno();
+	if (onload_zc_alloc_buffers(fdt, all, nbufs, ONLOAD_ZC_BUFFER_HDR_NONE) != -ENOMEM)
+		return fail_str("onload_zc_alloc_buffers: expected -ENOMEM");
+
+	for (i = 0; i < 100; i++) {
+		msg.msg_controllen = sizeof(ctrl);
+		if (recvmsg(fdt, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno != EAGAIN)
+				return fail_errno();
+			if (tstamp)
+				break;
+			usleep(10 * 1000);
+			continue;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_TIMESTAMPING)
+				continue;
+			serr = (void *)CMSG_DATA(cmsg);
+			tstamp |= serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+		}
+	}
+	if (!tstamp)
+		return fail_str("recvmsg: expected a TX timestamp");
+
+	/* the notification was read along with them: the buffer is back */
+	if (onload_zc_alloc_buffers(fdt, all, nbufs, ONLOAD_ZC_BUFFER_HDR_NONE))
+		return fail_str("onload_zc_alloc_buffers: buffers not returned");
+	for (i = 0; i < nbufs; i++) {
+		if (onload_zc_release_buffers(fdt, &all[i].buf, 1))
+			return fail_str("onload_zc_release_buffers");
+	}
+	free(all);
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Small reads are copied, not mapped: TCP_ZEROCOPY_RECEIVE maps only
+ * whole pages, which loopback delivers only from MSG_ZEROCOPY sends
+ * with a page sized MSS. See bench_lk_onload_stub for that case.
+ */
+static int test_onload_zc_hlrx(int domain, int type)
+{
+	struct onload_zc_iovec iov[4];
+	struct onload_zc_msg msg = { .iov = iov };
+	struct onload_zc_hlrx *hlrx;
+	struct iovec cp_iov;
+	struct msghdr cp = { .msg_iov = &cp_iov, .msg_iovlen = 1 };
+	char rxbuf[16];
+	int fdt, fdr, ret, len, i;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (type != SOCK_STREAM) {
+		if (onload_zc_hlrx_alloc(fdr, 0, &hlrx) != -EINVAL)
+			ret = fail_str("onload_zc_hlrx_alloc: expected -EINVAL");
+		close(fdr);
+		close(fdt);
+		return ret;
+	}
+
+	if (onload_zc_hlrx_alloc(fdr, 0, &hlrx))
+		return fail_str("onload_zc_hlrx_alloc");
+
+	msg.msghdr.msg_iovlen = 4;
+	if (onload_zc_hlrx_recv_zc(hlrx, &msg, 1 << 20, MSG_DONTWAIT) != -EAGAIN)
+		return fail_str("onload_zc_hlrx_recv_zc: expected -EAGAIN");
+
+	if (write(fdt, "hello", 5) != 5)
+		return fail_errno();
+
+	msg.msghdr.msg_iovlen = 4;
+	ret = onload_zc_hlrx_recv_zc(hlrx, &msg, 1 << 20, 0);
+	for (i = 0, len = 0; ret > 0 && i < msg.msghdr.msg_iovlen; i++) {
+		memcpy(rxbuf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	if (ret != 5 || len != 5 || memcmp(rxbuf, "hello", 5))
+		return fail_str("onload_zc_hlrx_recv_zc: unexpected data");
+
+	/* buffers are released once */
+	if (onload_zc_hlrx_free(hlrx) != -EBUSY)
+		return fail_str("onload_zc_hlrx_free: expected -EBUSY");
+	if (onload_zc_hlrx_buffer_release(fdr, iov[0].buf))
+		return fail_str("onload_zc_hlrx_buffer_release");
+	if (onload_zc_hlrx_buffer_release(fdr, iov[0].buf) != -EINVAL)
+		return fail_str("onload_zc_hlrx_buffer_release: expected -EINVAL");
+
+	if (write(fdt, "world", 5) != 5)
+		return fail_errno();
+	cp_iov.iov_base = rxbuf;
+	cp_iov.iov_len = sizeof(rxbuf);
+	if (onload_zc_hlrx_recv_copy(hlrx, &cp, 0) != 5 || memcmp(rxbuf, "world", 5))
+		return fail_str("onload_zc_hlrx_recv_copy");
+
+	if (shutdown(fdt, SHUT_WR))
+		return fail_errno();
+	msg.msghdr.msg_iovlen = 4;
+	if (onload_zc_hlrx_recv_zc(hlrx, &msg, 1 << 20, MSG_DONTWAIT) != 0)
+		return fail_str("onload_zc_hlrx_recv_zc: expected end of stream");
+	msg.msghdr.msg_iovlen = 4;
+	if (onload_zc_hlrx_recv_zc(hlrx, &msg, 1 << 20, 0) != 0)
+		return fail_str("onload_zc_hlrx_recv_zc: expected end of stream");
+
+	if (onload_zc_hlrx_free(hlrx))
+		return fail_str("onload_zc_hlrx_free");
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Updates patch the template in place, SEND_NOW sends and consumes it */
+static int test_onload_msg_template(int domain, int type)
+{
+	struct iovec iov[2] = { { "hello ", 6 }, { "world", 5 } };
+	struct onload_template_msg_update_iovec upd = { "WORLD", 5, 6, 0 };
+	onload_template_handle tmpl;
+	char rxbuf[16];
+	int fdt, fdr, ret;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (onload_msg_template_alloc(fdt, iov, 2, &tmpl, 0))
+		return fail_str("onload_msg_template_alloc");
+	if (onload_msg_template_update(fdt, tmpl, &upd, 1, 0))
+		return fail_str("onload_msg_template_update");
+
+	upd.otmu_offset = 7;
+	if (onload_msg_template_update(fdt, tmpl, &upd, 1, 0) != -EINVAL)
+		return fail_str("onload_msg_template_update: expected -EINVAL");
+	if (onload_msg_template_update(fdr, tmpl, NULL, 0, 0) != -EINVAL)
+		return fail_str("onload_msg_template_update: expected -EINVAL");
+
+	upd.otmu_base = "!";
+	upd.otmu_len = 1;
+	upd.otmu_offset = 10;
+	if (onload_msg_template_update(fdt, tmpl, &upd, 1,
+				       ONLOAD_TEMPLATE_FLAGS_SEND_NOW))
+		return fail_str("onload_msg_template_update: send");
+
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 11 ||
+	    memcmp(rxbuf, "hello WORL!", 11))
+		return fail_str("onload_msg_template_update: unexpected data");
+
+	if (onload_msg_template_alloc(fdt, iov, 1, &tmpl, 0))
+		return fail_str("onload_msg_template_alloc");
+	if (onload_msg_template_abort(fdt, tmpl))
+		return fail_str("onload_msg_template_abort");
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* prepare reports windows and headers, complete sends the data */
+static int test_onload_delegated_send(int domain, int type)
+{
+	struct onload_delegated_send ds = {0};
+	struct iovec iov = { "hello", 5 };
+	uint32_t seq, seq2;
+	char hdr[128], rxbuf[16];
+	int fdt, fdr, ret;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	ds.headers = hdr;
+	ds.headers_len = sizeof(hdr);
+	ret = onload_delegated_send_prepare(fdt, 5, 0, &ds);
+	if (type != SOCK_STREAM) {
+		if (ret != ONLOAD_DELEGATED_SEND_RC_BAD_SOCKET)
+			ret = fail_str("onload_delegated_send_prepare: expected BAD_SOCKET");
+		else
+			ret = 0;
+		close(fdr);
+		close(fdt);
+		return ret;
+	}
+	if (ret != ONLOAD_DELEGATED_SEND_RC_OK)
+		return fail_str("onload_delegated_send_prepare");
+	if (ds.mss <= 0 || ds.send_wnd < 5 || ds.cong_wnd < 5 || ds.user_size != 5)
+		return fail_str("onload_delegated_send_prepare: unexpected windows");
+	if (ds.headers_len < 14 + 20 + 20 ||
+	    hdr[12] != (domain == PF_INET ? 0x08 : (char)0x86))
+		return fail_str("onload_delegated_send_prepare: unexpected headers");
+	memcpy(&seq, hdr + ds.tcp_seq_offset, sizeof(seq));
+
+	onload_delegated_send_tcp_update(&ds, 5, 1);
+	onload_delegated_send_tcp_advance(&ds, 5);
+	if (ds.user_size != 0)
+		return fail_str("onload_delegated_send_tcp_advance");
+
+	if (onload_delegated_send_complete(fdt, &iov, 1, 0) != 5)
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 5 || memcmp(rxbuf, "hello", 5))
+		return fail_str("onload_delegated_send_complete: unexpected data");
+
+	/* the delegation ended with the prepared bytes */
+	if (onload_delegated_send_complete(fdt, &iov, 1, 0) != -1 || errno != EINVAL)
+		return fail_str("onload_delegated_send_complete: expected EINVAL");
+
+	/* sequence numbers count the bytes sent */
+	ds.headers_len = sizeof(hdr);
+	if (onload_delegated_send_prepare(fdt, 5, 0, &ds) != ONLOAD_DELEGATED_SEND_RC_OK)
+		return fail_str("onload_delegated_send_prepare");
+	memcpy(&seq2, hdr + ds.tcp_seq_offset, sizeof(seq2));
+	if (ntohl(seq2) != ntohl(seq) + 5)
+		return fail_str("onload_delegated_send_prepare: unexpected seq");
+	if (onload_delegated_send_cancel(fdt))
+		return fail_str("onload_delegated_send_cancel");
+
+	ds.headers_len = 10;
+	if (onload_delegated_send_prepare(fdt, 5, 0, &ds) !=
+	    ONLOAD_DELEGATED_SEND_RC_SMALL_HEADER)
+		return fail_str("onload_delegated_send_prepare: expected SMALL_HEADER");
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+struct gro_reader {
+	int fd;
+	int ret;
+};
+
+/* Blocking recv of one segment */
+static void *gro_read(void *arg)
+{
+	struct gro_reader *r = arg;
+	char buf[2000];
+
+	r->ret = recv(r->fd, buf, sizeof(buf), 0);
+	return NULL;
+}
+
+/* A GSO send arrives as one run on a socket with UDP_GRO: the library
+ * returns it as the datagrams that were sent, each with a timestamp.
+ */
+static int test_udp_gro(int domain, int type)
+{
+	const int ts_flags = SOF_TIMESTAMPING_SOFTWARE |
+			     SOF_TIMESTAMPING_RX_SOFTWARE;
+	const int seg = 1000, len = 3500, num = 4;
+	char ctrl[num][CMSG_SPACE(sizeof(struct scm_timestamping))];
+	char txctrl[CMSG_SPACE(sizeof(uint16_t))] = {0};
+	static char txbuf[3500], rxbuf[4][2000];
+	struct pollfd pfd = { .events = POLLIN };
+	struct mmsghdr mmsg[4] = {0};
+	struct iovec iov[4];
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	int fdt, fdr, ret, val = 1, i, j;
+
+	if (!has_preload || !getenv("LKOS_UDP_GRO") || type != SOCK_DGRAM)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	socklen_t vlen = sizeof(val);
+	if (getsockopt(fdr, SOL_UDP, UDP_GRO, &val, &vlen) || val)
+		return fail_str("getsockopt UDP_GRO: expected hidden");
+	if (setsockopt(fdr, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)))
+		return fail_errno();
+
+	for (i = 0; i < len; i++)
+		txbuf[i] = i / seg;
+
+	iov[0].iov_base = txbuf;
+	iov[0].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = txctrl;
+	msg.msg_controllen = sizeof(txctrl);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *)CMSG_DATA(cm) = seg;
+	if (sendmsg(fdt, &msg, 0) != len)
+		return fail_errno();
+
+	if (recv(fdr, rxbuf[0], sizeof(rxbuf[0]), 0) != seg || rxbuf[0][seg - 1])
+		return fail_str("recv: expected first segment");
+
+	pfd.fd = fdr;
+	if (poll(&pfd, 1, 0) != 1)
+		return fail_str("poll: expected stashed segments");
+
+	/* close does not wait for a recv blocked in the kernel, while
+	 * another socket has a stash
+	 */
+	struct timeval tv = { .tv_sec = 2 }, start, end;
+	struct gro_reader r;
+	pthread_t thread;
+	int fdt2;
+
+	ret = socketpair_open(domain, type, &fdt2, &r.fd);
+	if (ret)
+		return ret;
+	if (setsockopt(r.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		return fail_errno();
+	if (pthread_create(&thread, NULL, gro_read, &r))
+		return fail_str("pthread_create");
+	usleep(10 * 1000);
+	gettimeofday(&start, NULL);
+	if (close(r.fd))
+		return fail_errno();
+	gettimeofday(&end, NULL);
+	if (end.tv_sec - start.tv_sec > 1)
+		return fail_str("close: waited for a blocked recv");
+	if (sendmsg(fdt2, &msg, 0) != len)
+		return fail_errno();
+	if (pthread_join(thread, NULL) || r.ret != seg)
+		return fail_str("recv: expected a segment after close");
+	if (close(fdt2))
+		return fail_errno();
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = rxbuf[i];
+		iov[i].iov_len = sizeof(rxbuf[i]);
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		mmsg[i].msg_hdr.msg_control = ctrl[i];
+		mmsg[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+	}
+	if (recvmmsg(fdr, mmsg, num, MSG_DONTWAIT, NULL) != num - 1)
+		return fail_str("recvmmsg: expected remaining segments");
+
+	for (i = 0; i < num - 1; i++) {
+		if (mmsg[i].msg_len != (i < num - 2 ? seg : len % seg) ||
+		    rxbuf[i][0] != i + 1)
+			return fail_str("recvmmsg: unexpected segment");
+
+		msg = mmsg[i].msg_hdr;
+		for (j = 0, cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_UDP)
+				return fail_str("recvmmsg: unexpected UDP_GRO cmsg");
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SCM_TIMESTAMPING)
+				j++;
+		}
+		if (j != 1)
+			return fail_str("recvmmsg: expected timestamp");
+	}
+
+	if (recv(fdr, rxbuf[0], sizeof(rxbuf[0]), MSG_DONTWAIT) != -1 ||
+	    errno != EAGAIN)
+		return fail_str("recv: expected EAGAIN");
+
+	/* a dup'ed socket receives datagrams, on either fd */
+	ret = dup(fdr);
+	if (ret == -1)
+		return fail_errno();
+	msg = (struct msghdr){ .msg_iov = iov, .msg_iovlen = 1,
+			       .msg_control = txctrl,
+			       .msg_controllen = sizeof(txctrl) };
+	iov[0].iov_base = txbuf;
+	iov[0].iov_len = len;
+	if (sendmsg(fdt, &msg, 0) != len)
+		return fail_errno();
+	if (recv(ret, rxbuf[0], sizeof(rxbuf[0]), 0) != seg ||
+	    recv(fdr, rxbuf[1], sizeof(rxbuf[1]), 0) != seg || rxbuf[1][0] != 1)
+		return fail_str("recv: expected segments after dup");
+	if (close(ret))
+		return fail_errno();
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Receive a GRO run: returns its length and segment size in seg */
+static int recv_gro(int fd, char *buf, int len, int flags, int *seg)
+{
+	char ctrl[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	int ret;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	ret = recvmsg(fd, &msg, flags);
+	*seg = ret;
+	for (cm = CMSG_FIRSTHDR(&msg); ret > 0 && cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+			memcpy(seg, CMSG_DATA(cm), sizeof(*seg));
+	}
+
+	return ret;
+}
+
+/* Sends of one size to one destination leave as one UDP_SEGMENT send:
+ * a receiver with UDP_GRO sees them as one run.
+ */
+static int test_udp_gso(int domain, int type)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct lkos_gso_stats before, after;
+	char buf[1000] = {0};
+	int fdt, fdr, ret, seg, one = 1, i;
+
+	if (!has_preload || !getenv("LKOS_UDP_GSO") || type != SOCK_DGRAM)
+		return 0;
+
+	if (lkos_get_gso_stats(&before))
+		return fail_str("lkos_get_gso_stats");
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (setsockopt(fdr, SOL_UDP, UDP_GRO, &one, sizeof(one)))
+		return fail_errno();
+
+	/* a run of 3, ended by a shorter datagram, then a run of 1 */
+	for (i = 0; i < 3; i++) {
+		if (send(fdt, buf, 100, 0) != 100)
+			return fail_errno();
+	}
+	if (send(fdt, buf, 50, 0) != 50 || send(fdt, buf, 100, 0) != 100)
+		return fail_errno();
+
+	/* flushed by another operation on the fd */
+	if (getsockopt(fdt, SOL_SOCKET, SO_TYPE, &i, &(socklen_t){ sizeof(i) }))
+		return fail_errno();
+
+	if (recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 350 || seg != 100)
+		return fail_str("recv: expected run of 4");
+	if (recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 100)
+		return fail_str("recv: expected run of 1");
+
+	if (lkos_get_gso_stats(&after))
+		return fail_str("lkos_get_gso_stats");
+	if (after.datagrams - before.datagrams != 5 || after.sends - before.sends != 2)
+		return fail_str("lkos_get_gso_stats: expected 5 datagrams in 2 sends");
+
+	/* a write goes out after the batch */
+	if (send(fdt, buf, 100, 0) != 100 || send(fdt, buf, 100, 0) != 100 ||
+	    write(fdt, buf, 50) != 50)
+		return fail_errno();
+	if (recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 200 || seg != 100)
+		return fail_str("recv: expected run of 2 before the write");
+	if (recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 50)
+		return fail_str("recv: expected the write");
+
+	/* flushed by the thread */
+	if (sendto(fdt, buf, 200, 0, NULL, 0) != 200 ||
+	    sendto(fdt, buf, 200, 0, NULL, 0) != 200)
+		return fail_errno();
+	pfd.fd = fdr;
+	if (poll(&pfd, 1, 1000) != 1)
+		return fail_str("poll: batch not sent");
+	if (recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 400 || seg != 200)
+		return fail_str("recv: expected run of 2");
+
+	/* dup sends the batch, and the socket no longer batches */
+	if (send(fdt, buf, 100, 0) != 100)
+		return fail_errno();
+	ret = dup(fdt);
+	if (ret == -1)
+		return fail_errno();
+	if (send(ret, buf, 50, 0) != 50 || send(fdt, buf, 100, 0) != 100)
+		return fail_errno();
+	if (recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 100 ||
+	    recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 50 ||
+	    recv_gro(fdr, buf, sizeof(buf), MSG_DONTWAIT, &seg) != 100)
+		return fail_str("recv: expected datagrams in order after dup");
+	if (close(ret))
+		return fail_errno();
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	return 0;
+}
+
+/* Sends with ONLOAD_MSG_WARM return as if sent, but send nothing */
+static int test_onload_msg_warm(int domain, int type)
+{
+	struct iovec iov = { "warm", 4 };
+	struct mmsghdr mmsg[2] = { { .msg_hdr = { .msg_iov = &iov, .msg_iovlen = 1 } },
+				   { .msg_hdr = { .msg_iov = &iov, .msg_iovlen = 1 } } };
+	char rxbuf[16];
+	int fdt, fdr, fdn, ret;
+
+	if (!has_preload)
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (onload_fd_check_feature(fdt, ONLOAD_FD_FEAT_MSG_WARM) != 1)
+		return fail_str("onload_fd_check_feature: expected MSG_WARM");
+	if (onload_fd_check_feature(fdt, 99) != -EOPNOTSUPP)
+		return fail_str("onload_fd_check_feature: expected -EOPNOTSUPP");
+
+	if (send(fdt, "warm", 4, ONLOAD_MSG_WARM) != 4 ||
+	    sendto(fdt, "warm", 4, ONLOAD_MSG_WARM, NULL, 0) != 4 ||
+	    sendmsg(fdt, &mmsg[0].msg_hdr, ONLOAD_MSG_WARM) != 4)
+		return fail_str("send: MSG_WARM");
+	if (sendmmsg(fdt, mmsg, 2, ONLOAD_MSG_WARM) != 2 || mmsg[1].msg_len != 4)
+		return fail_str("sendmmsg: MSG_WARM");
+
+	if (recv(fdr, rxbuf, sizeof(rxbuf), MSG_DONTWAIT) != -1 || errno != EAGAIN)
+		return fail_str("recv: MSG_WARM data sent");
+
+	if (sendmmsg(fdt, mmsg, 1, 0) != 1)
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 4 || memcmp(rxbuf, "warm", 4))
+		return fail_str("recv: unexpected data");
+
+	/* what is not a socket fails, as a send would */
+	fdn = open("/dev/null", O_WRONLY);
+	if (fdn == -1)
+		return fail_errno();
+	if (send(fdn, "warm", 4, ONLOAD_MSG_WARM) != -1 || errno != ENOTSOCK)
+		return fail_str("send: MSG_WARM expected ENOTSOCK");
+	if (close(fdn))
+		return fail_errno();
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+
+	if (send(fdt, "warm", 4, ONLOAD_MSG_WARM) != -1 || errno != EBADF)
+		return fail_str("send: MSG_WARM expected EBADF");
+
+	return 0;
+}
+
+/* With LKOS_IO_URING, socket I/O goes through io_uring, with the
+ * results of the syscalls
+ */
+static int test_io_uring(int domain, int type)
+{
+	struct timeval tv = { .tv_usec = 10 * 1000 }, start, end;
+	struct sockaddr_storage addr;
+	struct lkos_fd_stat lstat;
+	char rxbuf[8];
+	int fdt, fdr, ret;
+	socklen_t alen;
+
+	if (!has_preload || !getenv("LKOS_IO_URING"))
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (lkos_fd_stat(fdr, &lstat) != 1 ||
+	    !(lstat.features & LKOS_FD_FEATURE_IO_URING))
+		return fail_str("lkos_fd_stat: expected io_uring");
+
+	if (recv(fdr, rxbuf, sizeof(rxbuf), MSG_DONTWAIT) != -1 || errno != EAGAIN)
+		return fail_str("recv: expected EAGAIN");
+
+	/* a blocking call that would block waits in the syscall */
+	if (setsockopt(fdr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		return fail_errno();
+	gettimeofday(&start, NULL);
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != -1 || errno != EAGAIN)
+		return fail_str("recv: expected timeout");
+	gettimeofday(&end, NULL);
+	if ((end.tv_sec - start.tv_sec) * 1000 * 1000 +
+	    end.tv_usec - start.tv_usec < 5 * 1000)
+		return fail_str("recv: returned before the timeout");
+
+	if (send(fdt, "ab", 2, 0) != 2)
+		return fail_errno();
+	if (type == SOCK_STREAM) {
+		if (recv(fdr, rxbuf, 1, 0) != 1 || rxbuf[0] != 'a')
+			return fail_str("recv: expected partial read");
+		if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'b')
+			return fail_str("recv: expected rest");
+	} else {
+		alen = sizeof(addr);
+		if (recvfrom(fdr, rxbuf, sizeof(rxbuf), 0, (void *)&addr, &alen) != 2)
+			return fail_errno();
+		if (addr.ss_family != domain ||
+		    alen != (domain == PF_INET6 ? sizeof(struct sockaddr_in6) :
+						  sizeof(struct sockaddr_in)))
+			return fail_str("recvfrom: unexpected address");
+	}
+
+	/* close drops the registered file: the peer sees the end of stream */
+	if (close(fdr))
+		return fail_errno();
+	if (type == SOCK_STREAM) {
+		if (setsockopt(fdt, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+			return fail_errno();
+		if (recv(fdt, rxbuf, sizeof(rxbuf), 0) != 0)
+			return fail_str("recv: expected end of stream");
+		send(fdt, "a", 1, MSG_NOSIGNAL);	/* elicits a reset */
+		usleep(1000);
+		if (send(fdt, "a", 1, MSG_NOSIGNAL) != -1 ||
+		    (errno != EPIPE && errno != ECONNRESET))
+			return fail_str("send: expected EPIPE");
+	}
+
+	if (close(fdt))
+		return fail_errno();
+
+	/* as does close_range */
+	if (type == SOCK_STREAM) {
+		ret = socketpair_open(domain, type, &fdt, &fdr);
+		if (ret)
+			return ret;
+		if (recv(fdr, rxbuf, sizeof(rxbuf), MSG_DONTWAIT) != -1 ||
+		    errno != EAGAIN)
+			return fail_str("recv: expected EAGAIN");
+		if (close_range(fdr, fdr, 0))
+			return fail_errno();
+		if (setsockopt(fdt, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+			return fail_errno();
+		if (recv(fdt, rxbuf, sizeof(rxbuf), 0) != 0)
+			return fail_str("close_range: expected end of stream");
+		if (close(fdt))
+			return fail_errno();
+	}
+
+	return 0;
+}
+
+/* The 16 bit one's complement sum of len bytes at p, added to sum */
+static uint32_t csum_add(uint32_t sum, const void *p, int len)
+{
+	const uint8_t *b = p;
+	int i;
+
+	for (i = 0; i < len; i++)
+		sum += i & 1 ? b[i] : b[i] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* An IPv4 UDP frame from 10.99.0.1:1234 to 10.99.0.2:port, sent on the
+ * AF_PACKET socket fdp. With a right UDP checksum, or a wrong one.
+ */
+static int xdp_inject_csum(int fdp, const struct sockaddr_ll *sll,
+			   uint16_t port, const char *payload, int len,
+			   bool good)
+{
+	char frame[ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr) + 64];
+	struct ethhdr *eth = (void *)frame;
+	struct iphdr *iph = (void *)(eth + 1);
+	struct udphdr *uh = (void *)(iph + 1);
+	uint16_t *p16 = (void *)iph, check;
+	uint32_t sum = 0;
+	int i;
+
+	memset(frame, 0, sizeof(frame));
+	memcpy(eth->h_dest, sll->sll_addr, ETH_ALEN);
+	eth->h_source[0] = 0x2;
+	eth->h_proto = htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(sizeof(*iph) + sizeof(*uh) + len);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htonl(0x0a630001);
+	iph->daddr = htonl(0x0a630002);
+	for (i = 0; i < sizeof(*iph) / 2; i++)
+		sum += p16[i];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	iph->check = ~sum;
+
+	uh->source = htons(1234);
+	uh->dest = port;
+	uh->len = htons(sizeof(*uh) + len);
+	memcpy(uh + 1, payload, len);
+
+	/* the pseudo header: addresses, protocol and length */
+	sum = csum_add(IPPROTO_UDP + sizeof(*uh) + len, &iph->saddr, 8);
+	check = ~csum_add(sum, uh, sizeof(*uh) + len);
+	uh->check = check ? htons(check) : 0xffff;
+	if (!good)
+		uh->check ^= 0xbad;
+
+	if (sendto(fdp, frame, (char *)(uh + 1) + len - frame, 0,
+		   (void *)sll, sizeof(*sll)) == -1)
+		return fail_errno();
+
+	return 0;
+}
+
+static int xdp_inject(int fdp, const struct sockaddr_ll *sll, uint16_t port,
+		      const char *payload, int len)
+{
+	return xdp_inject_csum(fdp, sll, port, payload, len, true);
+}
+
+static int test_xdp_netns(int domain, int type)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct epoll_event ev = { .events = EPOLLIN }, rev;
+	struct onload_zc_recv_args args = {0};
+	struct zc_recv_state zs = {0};
+	struct sockaddr_in addr = {0}, src;
+	struct sockaddr_ll sll = {0};
+	struct lkos_fd_stat lstat;
+	struct iovec iov;
+	struct msghdr msg = {0};
+	struct ifreq ifr = {0};
+	socklen_t alen;
+	struct pollfd pfd;
+	fd_set rfds;
+	int fdr, fdk, fdp, epfd;
+	char rxbuf[8];
+
+	if (unshare(CLONE_NEWNET))
+		return skip_str("unshare: no network namespace");
+	if (system("ip link set lo up && "
+		   "ip link add lkos_xdp0 type veth peer name lkos_xdp1 && "
+		   "ip link set lkos_xdp0 up && ip link set lkos_xdp1 up && "
+		   "ip addr add 10.99.0.2/24 dev lkos_xdp1 2>/dev/null"))
+		return skip_str("ip: cannot set up the veth pair");
+
+	/* inject on lkos_xdp0, to the address of lkos_xdp1 */
+	fdp = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fdp == -1)
+		return fail_errno();
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "lkos_xdp1");
+	if (ioctl(fdp, SIOCGIFHWADDR, &ifr))
+		return fail_errno();
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = if_nametoindex("lkos_xdp0");
+	sll.sll_halen = ETH_ALEN;
+	memcpy(sll.sll_addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	if (onload_set_stackname(ONLOAD_THIS_THREAD, ONLOAD_SCOPE_THREAD,
+				 "lkos_xdp"))
+		return fail_str("onload_set_stackname");
+	fdr = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdr == -1)
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	if (bind(fdr, (void *)&addr, sizeof(addr)))
+		return fail_errno();
+	alen = sizeof(addr);
+	if (getsockname(fdr, (void *)&addr, &alen))
+		return fail_errno();
+	if (setsockopt(fdr, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		return fail_errno();
+
+	if (lkos_fd_stat(fdr, &lstat) != 1 ||
+	    !(lstat.features & LKOS_FD_FEATURE_XDP))
+		return fail_str("lkos_fd_stat: expected xdp");
+
+	if (recv(fdr, rxbuf, sizeof(rxbuf), MSG_DONTWAIT) != -1 || errno != EAGAIN)
+		return fail_str("recv: expected EAGAIN");
+
+	/* a wrong UDP checksum: dropped, as by the kernel */
+	if (xdp_inject_csum(fdp, &sll, addr.sin_port, "x", 1, false) ||
+	    xdp_inject(fdp, &sll, addr.sin_port, "a", 1))
+		return 1;
+	alen = sizeof(src);
+	if (recvfrom(fdr, rxbuf, sizeof(rxbuf), 0, (void *)&src, &alen) != 1 ||
+	    rxbuf[0] != 'a')
+		return fail_str("recvfrom: expected frame");
+	if (alen != sizeof(src) || src.sin_port != htons(1234) ||
+	    src.sin_addr.s_addr != htonl(0x0a630001))
+		return fail_str("recvfrom: unexpected address");
+
+	/* traffic from other interfaces takes the kernel path */
+	if (onload_set_stackname(ONLOAD_THIS_THREAD, ONLOAD_SCOPE_THREAD, ""))
+		return fail_str("onload_set_stackname");
+	fdk = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdk == -1)
+		return fail_errno();
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (sendto(fdk, "k", 1, 0, (void *)&addr, sizeof(addr)) != 1)
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'k')
+		return fail_str("recv: expected kernel datagram");
+
+	/* as do ports of sockets outside the stack: fdk is bound by sendto */
+	alen = sizeof(src);
+	if (getsockname(fdk, (void *)&src, &alen))
+		return fail_errno();
+	if (setsockopt(fdk, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		return fail_errno();
+	if (xdp_inject(fdp, &sll, src.sin_port, "o", 1))
+		return 1;
+	if (recv(fdk, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'o')
+		return fail_str("recv: expected datagram on the kernel path");
+
+	/* frames wake epoll_wait, poll and select */
+	epfd = epoll_create(1);
+	if (epfd == -1)
+		return fail_errno();
+	ev.data.u64 = 0xabcd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdr, &ev))
+		return fail_errno();
+	if (epoll_wait(epfd, &rev, 1, 0) != 0)
+		return fail_str("epoll_wait: unexpected event");
+	if (xdp_inject(fdp, &sll, addr.sin_port, "bb", 2))
+		return 1;
+	if (epoll_wait(epfd, &rev, 1, 1000) != 1 || rev.data.u64 != 0xabcd)
+		return fail_str("epoll_wait: expected frame");
+	if (close(epfd))
+		return fail_errno();
+
+	pfd.fd = fdr;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+		return fail_str("poll: expected frame");
+	FD_ZERO(&rfds);
+	FD_SET(fdr, &rfds);
+	tv.tv_sec = 0;
+	if (select(fdr + 1, &rfds, NULL, NULL, &tv) != 1 || !FD_ISSET(fdr, &rfds))
+		return fail_str("select: expected frame");
+
+	/* onload_zc_recv passes frames in place. Keep the first */
+	if (xdp_inject(fdp, &sll, addr.sin_port, "ccc", 3) ||
+	    xdp_inject(fdp, &sll, addr.sin_port, "dddd", 4))
+		return 1;
+	usleep(10 * 1000);
+	args.cb = zc_recv_cb;
+	args.user_ptr = &zs;
+	args.flags = MSG_DONTWAIT;
+	zs.keep_at = 1;
+	if (onload_zc_recv(fdr, &args))
+		return fail_str("onload_zc_recv");
+	if (zs.calls != 3 || zs.len != 9 || memcmp(zs.data, "bbcccdddd", 9))
+		return fail_str("onload_zc_recv: unexpected data");
+	if (!(zs.flags & ONLOAD_ZC_END_OF_BURST))
+		return fail_str("onload_zc_recv: expected end of burst");
+	if (!zs.kept || onload_zc_release_buffers(fdr, &zs.kept, 1))
+		return fail_str("onload_zc_release_buffers");
+	if (onload_zc_recv(fdr, &args) != -EAGAIN)
+		return fail_str("onload_zc_recv: expected -EAGAIN");
+
+	/* truncated, as recvmsg on the kernel socket */
+	if (xdp_inject(fdp, &sll, addr.sin_port, "eeee", 4))
+		return 1;
+	iov.iov_base = rxbuf;
+	iov.iov_len = 2;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (recvmsg(fdr, &msg, 0) != 2 || !(msg.msg_flags & MSG_TRUNC))
+		return fail_str("recvmsg: expected truncation");
+
+	if (close(fdk) || close(fdr) || close(fdp))
+		return fail_errno();
+
+	return 0;
+}
+
+/* A stack with an interface receives UDP through AF_XDP. Run in a child,
+ * in a network namespace with a veth pair: see LKOS_STACKS in make test.
+ */
+static int test_xdp(int domain, int type)
+{
+	const char *stacks = getenv("LKOS_STACKS");
+
+	if (!has_preload || !stacks || !strstr(stacks, "lkos_xdp:") ||
+	    domain != PF_INET || type != SOCK_DGRAM || geteuid())
+		return 0;
+
+	return run_in_child(test_xdp_netns, domain, type, "xdp");
+}
+
+#define LO_BULK_LEN	(4 << 20)	/* larger than the ring */
+
+struct lo_writer {
+	int fd;
+	int delay_us;
+	int len;
+	int ret;
+};
+
+/* Write len bytes of a pattern after delay_us */
+static void *lo_write(void *arg)
+{
+	struct lo_writer *w = arg;
+	char buf[4096];
+	int off, n, i;
+
+	usleep(w->delay_us);
+	for (off = 0; off < w->len; off += n) {
+		n = w->len - off < sizeof(buf) ? w->len - off : sizeof(buf);
+		for (i = 0; i < n; i++)
+			buf[i] = (off + i) * 7;
+		n = send(w->fd, buf, n, 0);
+		if (n <= 0) {
+			w->ret = fail_errno();
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* A TCP connection over 127.0.0.1, accepted by a raw syscall that the
+ * library does not see
+ */
+static int lo_accept_raw(int *fdt_p, int *fdr_p)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t alen = sizeof(addr);
+	int fdl, fdt, fdr;
+
+	fdl = socket(PF_INET, SOCK_STREAM, 0);
+	fdt = socket(PF_INET, SOCK_STREAM, 0);
+	if (fdl == -1 || fdt == -1)
+		return fail_errno();
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fdl, (void *)&addr, alen) ||
+	    getsockname(fdl, (void *)&addr, &alen) || listen(fdl, 1))
+		return fail_errno();
+	if (connect(fdt, (void *)&addr, alen))
+		return fail_errno();
+
+	fdr = syscall(SYS_accept4, fdl, NULL, NULL, 0);
+	if (fdr == -1 || close(fdl))
+		return fail_errno();
+
+	*fdt_p = fdt;
+	*fdr_p = fdr;
+	return 0;
+}
+
+/* With EF_TCP_CLIENT_LOOPBACK and EF_TCP_SERVER_LOOPBACK, data over a
+ * loopback connection bypasses the kernel socket
+ */
+static int test_tcp_loopback(int domain, int type)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct pollfd pfd = { .events = POLLIN };
+	struct lkos_fd_stat lstat;
+	struct lo_writer w = {0};
+	pthread_t thread;
+	char rxbuf[8], *bulk;
+	int fdt, fdr, epfd, ret, i;
+
+	if (!has_preload || domain != PF_INET || type != SOCK_STREAM)
+		return 0;
+
+	if (onload_stack_opt_set_int("EF_TCP_CLIENT_LOOPBACK", 1) ||
+	    onload_stack_opt_set_int("EF_TCP_SERVER_LOOPBACK", 1))
+		return fail_str("onload_stack_opt_set_int");
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	if (lkos_fd_stat(fdt, &lstat) != 1 ||
+	    !(lstat.features & LKOS_FD_FEATURE_LOOPBACK) ||
+	    lkos_fd_stat(fdr, &lstat) != 1 ||
+	    !(lstat.features & LKOS_FD_FEATURE_LOOPBACK))
+		return fail_str("lkos_fd_stat: expected loopback");
+
+	if (send(fdt, "ab", 2, 0) != 2)
+		return fail_errno();
+
+	/* the kernel socket does not see the data */
+	if (syscall(SYS_recvfrom, fdr, rxbuf, sizeof(rxbuf),
+		    MSG_PEEK | MSG_DONTWAIT, NULL, NULL) != -1 || errno != EAGAIN)
+		return fail_str("recvfrom: data in the kernel socket");
+
+	if (ioctl(fdr, FIONREAD, &ret) || ret != 2)
+		return fail_str("ioctl: expected 2 bytes");
+
+	pfd.fd = fdr;
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+		return fail_str("poll: expected POLLIN");
+
+	epfd = epoll_create1(0);
+	if (epfd == -1)
+		return fail_errno();
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdr, &ev))
+		return fail_errno();
+	if (epoll_wait(epfd, &ev, 1, 0) != 1)
+		return fail_str("epoll_wait: expected EPOLLIN");
+
+	if (recv(fdr, rxbuf, 1, 0) != 1 || rxbuf[0] != 'a')
+		return fail_str("recv: expected partial read");
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'b')
+		return fail_str("recv: expected rest");
+	if (recv(fdr, rxbuf, sizeof(rxbuf), MSG_DONTWAIT) != -1 || errno != EAGAIN)
+		return fail_str("recv: expected EAGAIN");
+	if (epoll_wait(epfd, &ev, 1, 0) != 0)
+		return fail_str("epoll_wait: expected no event");
+
+	/* a write wakes a reader asleep in the kernel */
+	w.fd = fdt;
+	w.delay_us = 10 * 1000;
+	w.len = 1;
+	if (pthread_create(&thread, NULL, lo_write, &w))
+		return fail_str("pthread_create");
+	if (epoll_wait(epfd, &ev, 1, 1000) != 1)
+		return fail_str("epoll_wait: expected a wakeup");
+	if (pthread_join(thread, NULL) || w.ret)
+		return fail_str("lo_write");
+	if (read(fdr, rxbuf, sizeof(rxbuf)) != 1 || rxbuf[0] != 0)
+		return fail_str("read: unexpected data");
+
+	/* and the other direction */
+	if (write(fdr, "c", 1) != 1)
+		return fail_errno();
+	if (recv(fdt, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'c')
+		return fail_str("recv: expected reply");
+
+	/* a blocked writer waits for the reader to make room */
+	bulk = malloc(LO_BULK_LEN);
+	if (!bulk)
+		return fail_errno();
+	w.delay_us = 0;
+	w.len = LO_BULK_LEN;
+	if (pthread_create(&thread, NULL, lo_write, &w))
+		return fail_str("pthread_create");
+	ret = recv_all(fdr, bulk, LO_BULK_LEN);
+	if (pthread_join(thread, NULL) || w.ret || ret)
+		return fail_str("bulk transfer");
+	for (i = 0; i < LO_BULK_LEN; i++) {
+		if (bulk[i] != (char)(i * 7))
+			return fail_str("bulk transfer: unexpected data");
+	}
+	free(bulk);
+
+	if (close(fdt))
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 0)
+		return fail_str("recv: expected end of stream");
+	if (close(fdr) || close(epfd))
+		return fail_errno();
+
+	/* accepted without the library: the client withdraws its offer */
+	ret = lo_accept_raw(&fdt, &fdr);
+	if (ret)
+		return ret;
+	if (send(fdt, "a", 1, 0) != 1)
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'a')
+		return fail_str("recv: expected data in the kernel socket");
+	if (lkos_fd_stat(fdt, &lstat) != 1 ||
+	    (lstat.features & LKOS_FD_FEATURE_LOOPBACK))
+		return fail_str("lkos_fd_stat: unexpected loopback");
+	if (close(fdt) || close(fdr))
+		return fail_errno();
+
+	/* a server without the option: the kernel carries the data */
+	if (onload_stack_opt_reset() ||
+	    onload_stack_opt_set_int("EF_TCP_CLIENT_LOOPBACK", 1))
+		return fail_str("onload_stack_opt_set_int");
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+	if (lkos_fd_stat(fdt, &lstat) != 1 ||
+	    (lstat.features & LKOS_FD_FEATURE_LOOPBACK))
+		return fail_str("lkos_fd_stat: unexpected loopback");
+	if (send(fdt, "a", 1, 0) != 1)
+		return fail_errno();
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'a')
+		return fail_str("recv: expected data");
+	if (close(fdt) || close(fdr))
+		return fail_errno();
+
+	if (onload_stack_opt_reset())
+		return fail_str("onload_stack_opt_reset");
+
+	return 0;
+}
+
+#define MC_GROUP	0xef010203	/* 239.1.2.3 */
+#define MC_BURST	300		/* more than a ring of LKOS_MCAST_RING=256 */
+
+/* A UDP socket bound to port (0: any) with SO_REUSEADDR, that reads the
+ * group on lo
+ */
+static int mc_socket(uint16_t *port, bool join)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct sockaddr_in addr = {0};
+	struct ip_mreqn mreq = {0};
+	socklen_t alen = sizeof(addr);
+	int fd, one = 1;
+
+	fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		return -1;
+	addr.sin_family = AF_INET;
+	addr.sin_port = *port;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    bind(fd, (void *)&addr, sizeof(addr)) ||
+	    getsockname(fd, (void *)&addr, &alen))
+		return -1;
+	*port = addr.sin_port;
+
+	mreq.imr_multiaddr.s_addr = htonl(MC_GROUP);
+	mreq.imr_ifindex = if_nametoindex("lo");
+	if (join && setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			       &mreq, sizeof(mreq)))
+		return -1;
+
+	return fd;
+}
+
+static int mc_send(int fd, const void *buf, int len)
+{
+	return send(fd, buf, len, 0) == len ? 0 : fail_errno();
+}
+
+/* recvmsg with control messages: the payload, and in *ovfl the drops
+ * reported with SO_RXQ_OVFL. Checks the timestamp and IP_PKTINFO.
+ */
+static int mc_recv(int fd, char *buf, int len, uint32_t *ovfl)
+{
+	char ctrl[256] __attribute__((aligned(8)));
+	struct scm_timestamping *tss = NULL;
+	struct in_pktinfo *pi = NULL;
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	int ret;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	ret = recvmsg(fd, &msg, 0);
+	if (ret < 0)
+		return fail_errno();
+
+	*ovfl = 0;
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_TIMESTAMPING)
+			tss = (void *)CMSG_DATA(cm);
+		else if (cm->cmsg_level == SOL_SOCKET &&
+			 cm->cmsg_type == SO_RXQ_OVFL)
+			memcpy(ovfl, CMSG_DATA(cm), sizeof(*ovfl));
+		else if (cm->cmsg_level == IPPROTO_IP &&
+			 cm->cmsg_type == IP_PKTINFO)
+			pi = (void *)CMSG_DATA(cm);
+	}
+
+	/* raw hardware timestamps are converted from software */
+	if (!tss || !tss->ts[2].tv_sec)
+		return fail_str("recvmsg: expected a timestamp");
+	if (!pi || pi->ipi_addr.s_addr != htonl(MC_GROUP))
+		return fail_str("recvmsg: expected IP_PKTINFO");
+
+	return ret;
+}
+
+static int test_mcast_netns(int domain, int type)
+{
+	int tsflags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct onload_ordered_epoll_event oev;
+	struct sockaddr_in addr = {0};
+	struct pollfd pfd = { .events = POLLIN };
+	struct ip_mreqn mreq = {0};
+	struct mmsghdr mmsg[2] = {0};
+	struct iovec iov[2];
+	struct lkos_fd_stat lstat;
+	struct lo_writer w = {0};
+	struct timeval tv = {0};
+	char rxbuf[8], rxbuf2[8];
+	int fdr, fdr2, fdt, epfd, one = 1, status, i, n, sync[2];
+	uint32_t ovfl;
+	uint16_t port = 0;
+	pthread_t thread;
+	fd_set rfds;
+	pid_t pid;
+
+	if (unshare(CLONE_NEWNET))
+		return skip_str("unshare: no network namespace");
+	if (system("ip link set lo up && ip link set lo multicast on && "
+		   "ip route add 224.0.0.0/4 dev lo"))
+		return skip_str("ip: cannot set up multicast on lo");
+
+	fdr = mc_socket(&port, false);
+	if (fdr == -1)
+		return fail_errno();
+	if (setsockopt(fdr, SOL_SOCKET, SO_TIMESTAMPING, &tsflags, sizeof(tsflags)) ||
+	    setsockopt(fdr, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) ||
+	    setsockopt(fdr, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)))
+		return fail_errno();
+	mreq.imr_multiaddr.s_addr = htonl(MC_GROUP);
+	mreq.imr_ifindex = if_nametoindex("lo");
+	if (setsockopt(fdr, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+		return fail_errno();
+	if (lkos_fd_stat(fdr, &lstat) != 1 ||
+	    !(lstat.features & LKOS_FD_FEATURE_MCAST))
+		return fail_str("lkos_fd_stat: expected mcast");
+
+	fdr2 = mc_socket(&port, true);
+	if (fdr2 == -1)
+		return fail_errno();
+
+	fdt = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fdt == -1)
+		return fail_errno();
+	addr.sin_family = AF_INET;
+	addr.sin_port = port;
+	addr.sin_addr.s_addr = htonl(MC_GROUP);
+	if (setsockopt(fdt, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) ||
+	    connect(fdt, (void *)&addr, sizeof(addr)))
+		return fail_errno();
+
+	/* each socket reads the datagram, from the ring */
+	if (mc_send(fdt, "a", 1))
+		return 1;
+	if (mc_recv(fdr, rxbuf, sizeof(rxbuf), &ovfl) != 1 || rxbuf[0] != 'a')
+		return fail_str("recvmsg: expected datagram");
+	if (recv(fdr2, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'a')
+		return fail_str("recv: expected datagram");
+	if (syscall(SYS_recvfrom, fdr, rxbuf, sizeof(rxbuf), MSG_DONTWAIT,
+		    NULL, NULL) != -1 || errno != EAGAIN)
+		return fail_str("recvfrom: datagram in the kernel socket");
+
+	/* datagrams wake epoll_wait, and are reported by poll and select */
+	epfd = epoll_create1(0);
+	if (epfd == -1)
+		return fail_errno();
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdr, &ev))
+		return fail_errno();
+	if (epoll_wait(epfd, &ev, 1, 0) != 0)
+		return fail_str("epoll_wait: unexpected event");
+	w.fd = fdt;
+	w.delay_us = 10 * 1000;
+	w.len = 1;
+	if (pthread_create(&thread, NULL, lo_write, &w))
+		return fail_str("pthread_create");
+	if (epoll_wait(epfd, &ev, 1, 1000) != 1)
+		return fail_str("epoll_wait: expected a wakeup");
+	if (pthread_join(thread, NULL) || w.ret)
+		return fail_str("lo_write");
+
+	pfd.fd = fdr;
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+		return fail_str("poll: expected POLLIN");
+	FD_ZERO(&rfds);
+	FD_SET(fdr, &rfds);
+	if (select(fdr + 1, &rfds, NULL, NULL, &tv) != 1)
+		return fail_str("select: expected readable");
+	if (onload_ordered_epoll_wait(epfd, &ev, &oev, 1, 0) != 1 ||
+	    !oev.ts.tv_sec || oev.bytes != 1)
+		return fail_str("onload_ordered_epoll_wait: expected datagram");
+	if (read(fdr, rxbuf, sizeof(rxbuf)) != 1 || rxbuf[0] != 0 ||
+	    read(fdr2, rxbuf, sizeof(rxbuf)) != 1 || rxbuf[0] != 0)
+		return fail_str("read: unexpected data");
+
+	/* recvmmsg, and a blocking recv woken by the publisher */
+	if (mc_send(fdt, "b", 1) || mc_send(fdt, "cc", 2))
+		return 1;
+	for (i = 0; i < 2; i++) {
+		iov[i].iov_base = i ? rxbuf2 : rxbuf;
+		iov[i].iov_len = sizeof(rxbuf);
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+	}
+	if (recvmmsg(fdr2, mmsg, 2, 0, NULL) != 2 ||
+	    mmsg[0].msg_len != 1 || mmsg[1].msg_len != 2 ||
+	    rxbuf[0] != 'b' || rxbuf2[0] != 'c')
+		return fail_str("recvmmsg: expected 2 datagrams");
+	if (pthread_create(&thread, NULL, lo_write, &w))
+		return fail_str("pthread_create");
+	if (recv(fdr2, rxbuf, sizeof(rxbuf), 0) != 1)
+		return fail_str("recv: expected a wakeup");
+	if (pthread_join(thread, NULL) || w.ret)
+		return fail_str("lo_write");
+
+	/* a reader lapped by the publisher counts the datagrams lost */
+	if (mc_recv(fdr, rxbuf, sizeof(rxbuf), &ovfl) != 1 ||
+	    mc_recv(fdr, rxbuf, sizeof(rxbuf), &ovfl) != 2 ||
+	    mc_recv(fdr, rxbuf, sizeof(rxbuf), &ovfl) != 1)
+		return fail_str("recvmsg: expected datagrams");
+	for (i = 0; i < MC_BURST; i++) {
+		if (mc_send(fdt, &i, sizeof(i)))
+			return 1;
+	}
+	usleep(50 * 1000);
+	if (mc_recv(fdr, (char *)&n, sizeof(n), &ovfl) != sizeof(n) ||
+	    !ovfl || n != ovfl)
+		return fail_str("recvmsg: expected drops");
+	for (i = n + 1; i < MC_BURST; i++) {
+		if (recv(fdr, (char *)&n, sizeof(n), MSG_DONTWAIT) != sizeof(n) ||
+		    n != i)
+			return fail_str("recv: expected the rest of the burst");
+	}
+
+	/* another process reads from the same ring */
+	if (pipe(sync))
+		return fail_errno();
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid) {
+		n = mc_socket(&port, true);
+		if (n == -1)
+			exit(fail_errno());
+		if (lkos_fd_stat(n, &lstat) != 1 ||
+		    !(lstat.features & LKOS_FD_FEATURE_MCAST))
+			exit(fail_str("lkos_fd_stat: expected mcast"));
+		if (write(sync[1], "", 1) != 1)
+			exit(fail_errno());
+		if (recv(n, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'x')
+			exit(fail_str("recv: expected datagram in the child"));
+		exit(close(n) ? fail_errno() : 0);
+	}
+	if (read(sync[0], rxbuf, 1) != 1)
+		return fail_errno();
+	if (mc_send(fdt, "x", 1))
+		return 1;
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return fail_str("mcast: child failed");
+	if (recv(fdr, rxbuf, sizeof(rxbuf), 0) != 1 || rxbuf[0] != 'x')
+		return fail_str("recv: expected datagram");
+
+	/* a socket that leaves reads the kernel socket only */
+	if (setsockopt(fdr2, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq)))
+		return fail_errno();
+	if (lkos_fd_stat(fdr2, &lstat) != 1 ||
+	    (lstat.features & LKOS_FD_FEATURE_MCAST))
+		return fail_str("lkos_fd_stat: unexpected mcast");
+
+	if (close(fdr) || close(fdr2) || close(fdt) || close(epfd) ||
+	    close(sync[0]) || close(sync[1]))
+		return fail_errno();
+
+	return 0;
+}
+
+/* With LKOS_MCAST_RING, sockets that join a group read it from a ring
+ * in shared memory. Run in a child, in a network namespace with
+ * multicast on lo.
+ */
+static int test_mcast(int domain, int type)
+{
+	if (!has_preload || !getenv("LKOS_MCAST_RING") ||
+	    domain != PF_INET || type != SOCK_DGRAM || geteuid())
+		return 0;
+
+	return run_in_child(test_mcast_netns, domain, type, "mcast");
+}
+
+#define CL_PORT		9123
+
+/* A socket of domain and type bound to CL_PORT on loopback, on
+ * addr4_host for PF_INET, listening if TCP. Returns the fd, or -1 with
+ * errno set.
+ */
+static int cl_bind_addr(int domain, int type, uint32_t addr4_host)
+{
+	struct sockaddr_in6 addr6 = {0};
+	struct sockaddr_in addr4 = {0};
+	struct sockaddr *addr;
+	socklen_t alen;
+	int fd, err;
+
+	if (domain == PF_INET6) {
+		addr6.sin6_family = domain;
+		addr6.sin6_port = htons(CL_PORT);
+		addr6.sin6_addr = in6addr_loopback;
+		alen = sizeof(addr6);
+		addr = (void *)&addr6;
+	} else {
+		addr4.sin_family = domain;
+		addr4.sin_port = htons(CL_PORT);
+		addr4.sin_addr.s_addr = htonl(addr4_host);
+		alen = sizeof(addr4);
+		addr = (void *)&addr4;
+	}
+
+	fd = socket(domain, type | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		return -1;
+	if (bind(fd, addr, alen) ||
+	    (type == SOCK_STREAM && listen(fd, 16))) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+static int cl_bind(int domain, int type)
+{
+	return cl_bind_addr(domain, type, INADDR_LOOPBACK);
+}
+
+/* Send n datagrams, or make n connections, to CL_PORT on loopback */
+static int cl_send(int domain, int type, int n)
+{
+	struct sockaddr_storage addr;
+	socklen_t alen = sizeof(addr);
+	int fd, i;
+
+	memset(&addr, 0, sizeof(addr));
+	if (domain == PF_INET6) {
+		((struct sockaddr_in6 *)&addr)->sin6_family = domain;
+		((struct sockaddr_in6 *)&addr)->sin6_port = htons(CL_PORT);
+		((struct sockaddr_in6 *)&addr)->sin6_addr = in6addr_loopback;
+		alen = sizeof(struct sockaddr_in6);
+	} else {
+		((struct sockaddr_in *)&addr)->sin_family = domain;
+		((struct sockaddr_in *)&addr)->sin_port = htons(CL_PORT);
+		((struct sockaddr_in *)&addr)->sin_addr.s_addr =
+			htonl(INADDR_LOOPBACK);
+		alen = sizeof(struct sockaddr_in);
+	}
+
+	for (i = 0; i < n; i++) {
+		fd = socket(domain, type, 0);
+		if (fd == -1)
+			return fail_errno();
+		if (connect(fd, (void *)&addr, alen))
+			return fail_errno();
+		if (type == SOCK_DGRAM && send(fd, "x", 1, 0) != 1)
+			return fail_errno();
+		if (close(fd))
+			return fail_errno();
+	}
+
+	return 0;
+}
+
+/* The number of datagrams or connections waiting on fd, taken */
+static int cl_count(int fd, int type)
+{
+	char buf[1];
+	int n = 0, afd;
+
+	for (;;) {
+		if (type == SOCK_STREAM) {
+			afd = accept(fd, NULL, NULL);
+			if (afd == -1)
+				break;
+			close(afd);
+		} else if (recv(fd, buf, sizeof(buf), 0) != 1) {
+			break;
+		}
+		n++;
+	}
+
+	return errno == EAGAIN ? n : -1;
+}
+
+static int test_cluster_netns(int domain, int type)
+{
+	struct lkos_fd_stat lstat;
+	int fda, fdb, fdc, fdd, status;
+	struct dirent *de;
+	pid_t pid;
+	DIR *dir;
+
+	if (unshare(CLONE_NEWNET))
+		return skip_str("unshare: no network namespace");
+	if (system("ip link set lo up"))
+		return skip_str("ip: cannot set up lo");
+
+	if (onload_stack_opt_set_str("EF_CLUSTER_NAME", "lkos_test") ||
+	    onload_stack_opt_set_int("EF_CLUSTER_SIZE", 2))
+		return fail_str("onload_stack_opt_set");
+
+	/* two members share the port, a third is past the size */
+	fda = cl_bind(domain, type);
+	if (fda == -1)
+		return fail_errno();
+	if (lkos_fd_stat(fda, &lstat) != 1 ||
+	    !(lstat.features & LKOS_FD_FEATURE_CLUSTER))
+		return fail_str("lkos_fd_stat: expected cluster");
+	fdb = cl_bind(domain, type);
+	if (fdb == -1)
+		return fail_errno();
+	if (cl_bind(domain, type) != -1 || errno != EADDRINUSE)
+		return fail_str("cluster: expected EADDRINUSE past the size");
+
+	/* the last member to bind takes the CPU of the sender */
+	if (cl_send(domain, type, 8))
+		return 1;
+	if (cl_count(fdb, type) != 8 || cl_count(fda, type) != 0)
+		return fail_str("cluster: expected all on the last member");
+
+	if (close(fdb))
+		return fail_errno();
+	fdc = cl_bind(domain, type);
+	if (fdc == -1)
+		return fail_errno();
+	if (cl_send(domain, type, 4))
+		return 1;
+	if (cl_count(fdc, type) != 4)
+		return fail_str("cluster: expected all on the new member");
+
+	/* another cluster name cannot share the port */
+	if (onload_stack_opt_set_str("EF_CLUSTER_NAME", "lkos_other"))
+		return fail_str("onload_stack_opt_set_str");
+	if (cl_bind(domain, type) != -1 || errno != EADDRINUSE)
+		return fail_str("cluster: expected EADDRINUSE for another name");
+
+	/* but it can have the port on another address */
+	if (domain == PF_INET) {
+		fdd = cl_bind_addr(domain, type, INADDR_LOOPBACK + 1);
+		if (fdd == -1)
+			return fail_str("cluster: expected another address to bind");
+		if (close(fdd))
+			return fail_errno();
+	}
+	if (onload_stack_opt_set_str("EF_CLUSTER_NAME", "lkos_test"))
+		return fail_str("onload_stack_opt_set_str");
+
+	/* a member that exits without closing is in the way, unless
+	 * EF_CLUSTER_RESTART
+	 */
+	if (close(fda))
+		return fail_errno();
+	pid = fork();
+	if (pid == -1)
+		return fail_errno();
+	if (!pid)
+		_exit(cl_bind(domain, type) == -1);
+	if (waitpid(pid, &status, 0) != pid)
+		return fail_errno();
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return fail_str("cluster: child failed");
+
+	if (cl_bind(domain, type) != -1 || errno != EBUSY)
+		return fail_str("cluster: expected EBUSY for an orphan");
+	if (onload_stack_opt_set_int("EF_CLUSTER_RESTART", 1))
+		return fail_str("onload_stack_opt_set_int");
+	fda = cl_bind(domain, type);
+	if (fda == -1)
+		return fail_errno();
+
+	/* the last member to leave removes the segment */
+	if (close(fda) || close(fdc))
+		return fail_errno();
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return fail_errno();
+	while ((de = readdir(dir))) {
+		if (!strncmp(de->d_name, "lkos_cl.", 8))
+			return fail_str("cluster: segment left in /dev/shm");
+	}
+	closedir(dir);
+
+	if (onload_stack_opt_reset())
+		return fail_str("onload_stack_opt_reset");
+
+	return 0;
+}
+
+/* Needs root, for the namespace and the reuseport program */
+static int test_cluster(int domain, int type)
+{
+	if (!has_preload || geteuid())
+		return 0;
+
+	return run_in_child(test_cluster_netns, domain, type, "cluster");
+}
+
+/* With LKOS_STATS, calls on a socket count in its fd record and in the
+ * rows of its stack, and lkos_stackdump reads them
+ */
+static int test_stats(int domain, int type)
+{
+	char *argv[] = { "lkos_stackdump", NULL, NULL }, *envp[] = { NULL };
+	posix_spawn_file_actions_t fa;
+	const struct lkos_stats_fd *sfd;
+	const struct lkos_stats *stats;
+	uint64_t rx_calls = 0, batch = 0;
+	char name[64], pid[16];
+	struct mmsghdr msgs[2];
+	struct iovec iov[2];
+	char rxbuf[2][8];
+	int fdt, fdr, fd, ret, status, i;
+	pid_t child;
+	uint32_t t;
+
+	if (!has_preload || !getenv("LKOS_STATS"))
+		return 0;
+
+	ret = socketpair_open(domain, type, &fdt, &fdr);
+	if (ret)
+		return ret;
+
+	/* the segment exists from the first counted call */
+	if (send(fdt, "ab", 2, 0) != 2 || send(fdt, "cde", 3, 0) != 3)
+		return fail_errno();
+
+	snprintf(name, sizeof(name), "/lkos_stats.%d", getpid());
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		return fail_errno();
+	stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED)
+		return fail_errno();
+	if (close(fd))
+		return fail_errno();
+	if (stats->magic != LKOS_STATS_MAGIC || stats->pid != getpid())
+		return fail_str("stats: bad header");
+
+	if (type == SOCK_STREAM) {
+		if (recv(fdr, rxbuf[0], 5, MSG_WAITALL) != 5)
+			return fail_errno();
+	} else {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < 2; i++) {
+			iov[i].iov_base = rxbuf[i];
+			iov[i].iov_len = sizeof(rxbuf[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		if (recvmmsg(fdr, msgs, 2, MSG_WAITFORONE, NULL) != 2)
+			return fail_errno();
+	}
+	if (recv(fdr, rxbuf[0], sizeof(rxbuf[0]), MSG_DONTWAIT) != -1 ||
+	    errno != EAGAIN)
+		return fail_str("recv: expected EAGAIN");
+
+	sfd = &stats->fd[fdr];
+	if (sfd->domain != domain || sfd->type != type || sfd->stack ||
+	    stats->fds <= fdr)
+		return fail_str("stats: bad fd record");
+	if (sfd->rx_calls != 2 || sfd->rx_bytes != 5 || sfd->eagain != 1 ||
+	    stats->fd[fdt].tx_calls != 2 || stats->fd[fdt].tx_bytes != 5)
+		return fail_str("stats: bad fd counters");
+
+	for (t = 0; t < stats->threads && t < LKOS_STATS_THREADS; t++) {
+		rx_calls += stats->thread[t].stack[0].val[LKOS_STAT_RX_CALLS];
+		batch += stats->thread[t].stack[0].val[LKOS_STAT_MMSG_BATCH + 2];
+	}
+	if (rx_calls < 2 || (type == SOCK_DGRAM && !batch))
+		return fail_str("stats: bad stack counters");
+
+	/* without preload, and without fork handlers, to leave no segment */
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	argv[1] = pid;
+	if (posix_spawn_file_actions_init(&fa) ||
+	    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+					     O_WRONLY, 0))
+		return fail_str("posix_spawn_file_actions");
+	errno = posix_spawn(&child, "./lkos_stackdump", &fa, NULL, argv, envp);
+	posix_spawn_file_actions_destroy(&fa);
+	if (errno)
+		return fail_errno();
+	if (waitpid(child, &status, 0) != child)
+		return fail_errno();
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return fail_str("lkos_stackdump failed");
+
+	if (close(fdr))
+		return fail_errno();
+	if (close(fdt))
+		return fail_errno();
+	if (sfd->domain)
+		return fail_str("stats: fd record not cleared on close");
+
+	if (munmap((void *)stats, sizeof(*stats)))
+		return fail_errno();
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const int domains[] = { PF_INET, PF_INET6, 0 }, *p_domain;
+	const int types[] = { SOCK_STREAM, SOCK_DGRAM, 0 }, *p_type;
+	int ret = 0;
+
+	has_preload = getenv("LD_PRELOAD");
+
+	if (argc == 4 && !strcmp(argv[1], "--log-sockets"))
+		return log_sockets(atoi(argv[2]), atoi(argv[3]));
 
 	ret |= test_dlsym();
+	ret |= test_log();
+	ret |= test_log_limits();
 
 	for (p_domain = domains; *p_domain; p_domain++) {
 		for (p_type = types; *p_type; p_type++) {
+			ret |= test_busy_poll(*p_domain, *p_type);
 			ret |= test_getsockopt_timestamping(*p_domain, *p_type);
 			ret |= test_onload_nonaccel(*p_domain, *p_type);
 			ret |= test_onload_ordered_epoll_wait(*p_domain, *p_type);
+			ret |= test_onload_ordered_epoll_wait_data(*p_domain, *p_type);
 			ret |= test_onload_stacks_api(*p_domain, *p_type);
 			ret |= test_recv_msg_onepkt(*p_domain, *p_type);
+			ret |= test_recv_msg_onepkt_burst(*p_domain, *p_type);
 			ret |= test_setsockopt_timestamping_ctrl(*p_domain, *p_type);
 			ret |= test_setsockopt_timestamping_data(*p_domain, *p_type);
+			ret |= test_user_spin(*p_domain, *p_type);
+			ret |= test_thread_spin(*p_domain, *p_type);
+			ret |= test_onload_stack_opt(*p_domain, *p_type);
+			ret |= test_onload_stacks_named(*p_domain, *p_type);
+			ret |= test_onload_zc_recv(*p_domain, *p_type);
+			ret |= test_onload_zc_send(*p_domain, *p_type);
+			ret |= test_onload_zc_send_tstamp(*p_domain, *p_type);
+			ret |= test_onload_zc_hlrx(*p_domain, *p_type);
+			ret |= test_onload_msg_template(*p_domain, *p_type);
+			ret |= test_onload_delegated_send(*p_domain, *p_type);
+			ret |= test_onload_msg_warm(*p_domain, *p_type);
+			ret |= test_udp_gro(*p_domain, *p_type);
+			ret |= test_udp_gso(*p_domain, *p_type);
+			ret |= test_io_uring(*p_domain, *p_type);
+			ret |= test_xdp(*p_domain, *p_type);
+			ret |= test_tcp_loopback(*p_domain, *p_type);
+			ret |= test_mcast(*p_domain, *p_type);
+			ret |= test_cluster(*p_domain, *p_type);
+			ret |= test_stats(*p_domain, *p_type);
 		}
 	}
 